@@ -0,0 +1,749 @@
+/**
+ * \file analyze.c
+ * \brief Offline analyzer of copycat capture files (copycat-analyze).
+ *
+ *    tun[.run-id][-segment].pcap[.zst] and notun[...] traces are grouped
+ *    by run and side, each trace is mmap'ed and parsed by a pool of worker
+ *    threads into per-flow TCP metrics, and flows are aggregated by client
+ *    port (the unique source port of dest.txt, or the destination of one
+ *    of the public addresses of dest.txt for flows striped over several
+ *    paths) and address family. Tunneled and not-tunneled aggregates of
+ *    the same run, port and family are then written side by side to a
+ *    CSV table:
+ *
+ *    run,port,family,public,private,{tun,notun}_{flows,packets,duration,
+ *        syn_synack,c2s_payload,s2c_payload,goodput,retrans,holes},
+ *        goodput_ratio
+ *
+ *    Times are in ns, goodput in bit/s (c2s+s2c payload over duration)
+ *    and goodput_ratio is tun/notun.
+ *
+ *    With -p and/or -t, the packets of a port and/or time window are
+ *    extracted instead from indexed traces (capture-index) to a pcap file.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <byteswap.h>
+#include <libgen.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "debug.h"
+#include "sysconfig.h"
+#include "flowstat.h"
+#include "pcapw.h"
+#include "pcapidx.h"
+
+#if defined(WITH_ZSTD)
+#  include <zstd.h>
+#endif
+
+/**
+ * \def ANALYZE_SIDES
+ * \brief notun (0) and tun (1).
+ */
+#define ANALYZE_SIDES 2
+
+/**
+ * \struct dest
+ * \brief A dest.txt line.
+ */
+struct dest {
+   uint16_t port;                          /*!< unique source port */
+   char public4[INET6_ADDRSTRLEN];         /*!< first public address (IPv4) */
+   char private4[INET6_ADDRSTRLEN];        /*!< private address (IPv4) */
+   char public6[INET6_ADDRSTRLEN];         /*!< first public address (IPv6) */
+   char private6[INET6_ADDRSTRLEN];        /*!< private address (IPv6) */
+};
+
+/**
+ * \struct side_stat
+ * \brief Flows of one port and family in one trace.
+ */
+struct side_stat {
+   uint32_t key;          /*!< family << 16 | port, hash table key */
+   uint32_t flows;        /*!< number of flows */
+   uint64_t packets;      /*!< packets (both directions) */
+   uint64_t first, last;  /*!< first and last packet times */
+   int64_t  syn_synack;   /*!< first handshake RTT, -1 if none */
+   uint64_t c2s, s2c;     /*!< payload bytes */
+   uint64_t retrans;      /*!< retransmitted segments */
+   uint64_t holes;        /*!< sequence holes */
+};
+
+/**
+ * \struct trace
+ * \brief The segments of one capture point of one run.
+ */
+struct trace {
+   char       *run;       /*!< run id, "" if none */
+   int         tun;       /*!< 1 for tun, 0 for notun */
+   char      **files;     /*!< segments, in order */
+   int         nfiles;    /*!< number of segments */
+   uint64_t    packets;   /*!< parsed packets */
+   GHashTable *stats;     /*!< uint32_t key to struct side_stat */
+};
+
+/**
+ * \struct pair
+ * \brief An output row.
+ */
+struct pair {
+   const char       *run;                  /*!< run id */
+   uint32_t          key;                  /*!< family << 16 | port */
+   struct side_stat *side[ANALYZE_SIDES];  /*!< notun, tun or NULL */
+};
+
+/* program arguments */
+const char *program_version = "copycat-analyze 0.1";
+const char *optstring       = ":d:j:o:p:t:qhV";
+const char *arg_help = "Usage: copycat-analyze [OPTION...] FILE...\n"
+"  or:  copycat-analyze [-p PORT] [-t FROM,TO] -o OUT.pcap FILE...\n\n"
+"compare tunneled and not-tunneled flows of copycat capture files\n\n"
+"  -d, --dest-file FILE         Destination file (dest.txt)\n"
+"  -j, --jobs N                 Number of worker threads (default: cores)\n"
+"  -o, --output FILE            Output CSV file (default: stdout)\n"
+"\n"
+"  -p, --port PORT              Extract the flows of a port (e.g. a dest.txt\n"
+"                               source port) from indexed traces\n"
+"  -t, --time FROM,TO           Extract a time window (s since the epoch)\n"
+"\n"
+"  -q, --quiet                  Don't report progress\n"
+"  -h, --help                   Give this help list\n"
+"  -V, --version                Print program version\n\n"
+"Report bugs to korian.edeline@ulg.ac.be\n";
+
+/**
+ * \var static GHashTable *dests
+ * \brief Port (uint16_t) to struct dest, NULL without dest file.
+ */
+static GHashTable *dests;
+
+/**
+ * \var static GHashTable *dest_addrs
+ * \brief Public address (string) to struct dest, every address of the
+ *        multipath lists included.
+ */
+static GHashTable *dest_addrs;
+
+/**
+ * \var static struct trace *traces
+ * \brief The traces to analyze.
+ */
+static struct trace *traces;
+static int ntraces;
+
+/**
+ * \var static int next_trace
+ * \brief Next trace to pick by workers.
+ */
+static int next_trace;
+
+/**
+ * \var static int silent
+ * \brief Don't report progress.
+ */
+static int silent;
+
+/**
+ * \fn static void parse_dests(const char *filename)
+ * \brief Read dest.txt into dests.
+ */
+static void parse_dests(const char *filename);
+
+/**
+ * \fn static void dest_public(struct dest *d, char *public, char *list)
+ * \brief Split a public address list, keep its first address and map
+ *        all its addresses to the destination.
+ */
+static void dest_public(struct dest *d, char *public, char *list);
+
+/**
+ * \fn static void add_file(char *filename)
+ * \brief Add a segment to its trace.
+ */
+static void add_file(char *filename);
+
+/**
+ * \fn static void *worker(void *arg)
+ * \brief Analyze traces until none is left.
+ */
+static void *worker(void *arg);
+
+/**
+ * \fn static void parse_buf(struct flowstat **fs, const u_char *buf,
+ *                           size_t len, const char *filename)
+ * \brief Feed every record of an in-memory pcap file to the engine.
+ *
+ *    The engine is created on the first segment, with its link-layer type
+ *    and timestamp precision.
+ *
+ * \return The number of records
+ */
+static uint64_t parse_buf(struct flowstat **fs, const u_char *buf,
+                          size_t len, const char *filename);
+
+/**
+ * \fn static void collect(gpointer key, gpointer value, gpointer user_data)
+ * \brief Aggregate a flow (struct flow_rec) into its trace.
+ */
+static void collect(gpointer key, gpointer value, gpointer user_data);
+
+/**
+ * \fn static void write_pairs(FILE *fp)
+ * \brief Pair tun and notun aggregates and write the table.
+ */
+static void write_pairs(FILE *fp);
+
+/* flowstat.c is linked without sock.c */
+void die(char *s) {
+   perror(s);
+   exit(1);
+}
+
+void *xmalloc(size_t size) {
+   void *mem = malloc(size);
+   if (!mem)
+      die("malloc");
+   return mem;
+}
+
+static guint uint_hash(gconstpointer key) {
+   return *(const uint32_t *)key * 2654435761U;
+}
+
+static gboolean uint_equal(gconstpointer a, gconstpointer b) {
+   return *(const uint32_t *)a == *(const uint32_t *)b;
+}
+
+static guint port_hash(gconstpointer key) {
+   return *(const uint16_t *)key;
+}
+
+static gboolean port_equal(gconstpointer a, gconstpointer b) {
+   return *(const uint16_t *)a == *(const uint16_t *)b;
+}
+
+void parse_dests(const char *filename) {
+   FILE *fp = fopen(filename, "r");
+   if (!fp)
+      die("destination file");
+
+   char line[4096], *tok[5], *t, *save;
+   int port, n;
+   dests      = g_hash_table_new(port_hash, port_equal);
+   dest_addrs = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+   while (fgets(line, sizeof(line), fp)) {
+      /* <port> <public> <private> [<public6> <private6>] [<prefix>...],
+         as in state.c, routed prefixes are the only fields with a '/' */
+      n = 0;
+      for (t = strtok_r(line, " \t\r\n", &save); t && n < 5 && 
+           !strchr(t, '/'); t = strtok_r(NULL, " \t\r\n", &save))
+         tok[n++] = t;
+      if ((n != 3 && n != 5) || sscanf(tok[0], "%d", &port) != 1)
+         continue;
+
+      struct dest *d = calloc(1, sizeof(struct dest));
+      if (!d)
+         die("calloc");
+      d->port = port;
+      if (n == 5) {
+         dest_public(d, d->public4, tok[1]);
+         snprintf(d->private4, sizeof(d->private4), "%s", tok[2]);
+         dest_public(d, d->public6, tok[3]);
+         snprintf(d->private6, sizeof(d->private6), "%s", tok[4]);
+      } else if (strchr(tok[1], ':')) {
+         dest_public(d, d->public6, tok[1]);
+         snprintf(d->private6, sizeof(d->private6), "%s", tok[2]);
+      } else {
+         dest_public(d, d->public4, tok[1]);
+         snprintf(d->private4, sizeof(d->private4), "%s", tok[2]);
+      }
+      g_hash_table_insert(dests, &d->port, d);
+   }
+   fclose(fp);
+}
+
+void dest_public(struct dest *d, char *public, char *list) {
+   char *save, *tok;
+
+   /* public,public',... as parsed by mpath_parse, the first one is the
+      destination address */
+   for (tok = strtok_r(list, ",", &save); tok;
+        tok = strtok_r(NULL, ",", &save)) {
+      if (!*public)
+         snprintf(public, INET6_ADDRSTRLEN, "%s", tok);
+      if (!g_hash_table_lookup(dest_addrs, tok))
+         g_hash_table_insert(dest_addrs, strdup(tok), d);
+   }
+}
+
+void add_file(char *filename) {
+   char *copy = strdup(filename);
+   char *base = basename(copy);
+   int tun;
+
+   if (!strncmp(base, "notun", 5)) {
+      tun = 0; base += 5;
+   } else if (!strncmp(base, "tun", 3)) {
+      tun = 1; base += 3;
+   } else {
+      fprintf(stderr, "%s: not a copycat trace, skipped\n", filename);
+      free(copy);
+      return;
+   }
+
+   /* [.run-id][-segment].pcap[.zst] */
+   char *ext = strstr(base, ".pcap");
+   if (!ext) {
+      fprintf(stderr, "%s: not a pcap file, skipped\n", filename);
+      free(copy);
+      return;
+   }
+   *ext = '\0';
+   size_t len = strlen(base);
+   if (len >= 6 && base[len - 6] == '-' &&
+       strspn(base + len - 5, "0123456789") == 5)
+      base[len - 6] = '\0';
+   const char *run = (*base == '.') ? base + 1 : base;
+
+   int i;
+   for (i = 0; i < ntraces; i++)
+      if (traces[i].tun == tun && !strcmp(traces[i].run, run))
+         break;
+   if (i == ntraces) {
+      traces = realloc(traces, ++ntraces * sizeof(struct trace));
+      if (!traces)
+         die("realloc");
+      memset(&traces[i], 0, sizeof(struct trace));
+      traces[i].run = strdup(run);
+      traces[i].tun = tun;
+   }
+
+   struct trace *t = &traces[i];
+   t->files = realloc(t->files, ++t->nfiles * sizeof(char *));
+   if (!t->files)
+      die("realloc");
+   t->files[t->nfiles - 1] = filename;
+   free(copy);
+}
+
+uint64_t parse_buf(struct flowstat **fs, const u_char *buf, size_t len,
+                   const char *filename) {
+   const struct pcapw_file_hdr *fh = (const struct pcapw_file_hdr *)buf;
+   struct pcap_pkthdr h;
+   uint64_t count = 0;
+   int swap = 0, nano;
+   uint32_t linktype;
+
+   if (len < sizeof(struct pcapw_file_hdr)) {
+      fprintf(stderr, "%s: truncated\n", filename);
+      return 0;
+   }
+   switch (fh->magic) {
+      case PCAPW_MAGIC:      nano = 0; break;
+      case PCAPW_MAGIC_NANO: nano = 1; break;
+      case 0xd4c3b2a1:       nano = 0; swap = 1; break;
+      case 0x4d3cb2a1:       nano = 1; swap = 1; break;
+      default:
+         fprintf(stderr, "%s: bad pcap magic, skipped\n", filename);
+         return 0;
+   }
+   linktype = swap ? bswap_32(fh->linktype) : fh->linktype;
+
+   if (!*fs)
+      *fs = flowstat_open(NULL, linktype, nano, 0);
+   (*fs)->linktype = linktype;
+   (*fs)->nano     = nano;
+
+   size_t off = sizeof(struct pcapw_file_hdr);
+   while (off + sizeof(struct pcapw_rec_hdr) <= len) {
+      const struct pcapw_rec_hdr *rh = (const struct pcapw_rec_hdr *)(buf + off);
+      h.ts.tv_sec  = swap ? bswap_32(rh->ts_sec)  : rh->ts_sec;
+      h.ts.tv_usec = swap ? bswap_32(rh->ts_frac) : rh->ts_frac;
+      h.caplen     = swap ? bswap_32(rh->caplen)  : rh->caplen;
+      h.len        = swap ? bswap_32(rh->len)     : rh->len;
+      off += sizeof(struct pcapw_rec_hdr);
+      if (off + h.caplen > len)
+         break;
+      flowstat_packet(*fs, &h, buf + off);
+      off += h.caplen;
+      count++;
+   }
+   return count;
+}
+
+#if defined(WITH_ZSTD)
+/**
+ * \fn static u_char *decompress(const u_char *src, size_t len, size_t *dlen)
+ * \brief Decompress a whole .pcap.zst segment.
+ */
+static u_char *decompress(const u_char *src, size_t len, size_t *dlen) {
+   ZSTD_DCtx *dctx = ZSTD_createDCtx();
+   size_t cap = len * 4 + ZSTD_DStreamOutSize();
+   u_char *dst = xmalloc(cap);
+   ZSTD_inBuffer in = { src, len, 0 };
+   ZSTD_outBuffer out = { dst, cap, 0 };
+   size_t ret;
+
+   /* ret is 0 once the frame is complete and flushed */
+   while ((ret = ZSTD_decompressStream(dctx, &out, &in))) {
+      if (ZSTD_isError(ret)) {
+         errno = EINVAL;
+         die((char *)ZSTD_getErrorName(ret));
+      }
+      if (out.pos == out.size) {
+         out.size *= 2;
+         if (!(dst = realloc(dst, out.size)))
+            die("realloc");
+         out.dst = dst;
+      } else if (in.pos == in.size) {
+         errno = EINVAL;
+         die("truncated zstd frame");
+      }
+   }
+   ZSTD_freeDCtx(dctx);
+   *dlen = out.pos;
+   return dst;
+}
+#endif
+
+void collect(gpointer UNUSED(key), gpointer value, gpointer user_data) {
+   struct flow_rec *rec = value;
+   struct trace *t      = user_data;
+   uint16_t ports[2], port = 0;
+   int i;
+
+   /* client port first */
+   ports[0] = (rec->cli == 1) ? rec->key.port_b : rec->key.port_a;
+   ports[1] = (rec->cli == 1) ? rec->key.port_a : rec->key.port_b;
+   if (dests) {
+      for (i = 0; i < 2 && !port; i++)
+         if (g_hash_table_lookup(dests, &ports[i]))
+            port = ports[i];
+
+      /* flows striped over the other public addresses of a destination */
+      char addr[INET6_ADDRSTRLEN];
+      struct dest *d;
+      for (i = 0; i < 2 && !port; i++) {
+         inet_ntop(rec->key.family, i ? rec->key.addr_b : rec->key.addr_a,
+                   addr, sizeof(addr));
+         if ((d = g_hash_table_lookup(dest_addrs, addr)))
+            port = d->port;
+      }
+   } else if (rec->cli >= 0)
+      port = ports[0];
+   if (!port)
+      return;
+
+   uint32_t skey = (rec->key.family == AF_INET6 ? 6 : 4) << 16 | port;
+   struct side_stat *s = g_hash_table_lookup(t->stats, &skey);
+   if (!s) {
+      s = calloc(1, sizeof(struct side_stat));
+      if (!s)
+         die("calloc");
+      s->key        = skey;
+      s->first      = rec->first;
+      s->syn_synack = -1;
+      g_hash_table_insert(t->stats, &s->key, s);
+   }
+
+   /* directions from the client side */
+   int cli = (rec->cli == 1);
+   s->flows++;
+   s->packets += rec->dir[0].packets + rec->dir[1].packets;
+   if (rec->first < s->first) s->first = rec->first;
+   if (rec->last > s->last)   s->last  = rec->last;
+   if (s->syn_synack < 0 && rec->syn && rec->synack)
+      s->syn_synack = rec->synack - rec->syn;
+   s->c2s     += rec->dir[cli].payload;
+   s->s2c     += rec->dir[!cli].payload;
+   s->retrans += rec->dir[0].retrans + rec->dir[1].retrans;
+   s->holes   += rec->dir[0].holes + rec->dir[1].holes;
+}
+
+void *worker(void *UNUSED(arg)) {
+   int i;
+
+   while ((i = __atomic_fetch_add(&next_trace, 1, __ATOMIC_RELAXED)) < ntraces) {
+      struct trace *t     = &traces[i];
+      struct flowstat *fs = NULL;
+      t->stats = g_hash_table_new(uint_hash, uint_equal);
+
+      for (int k = 0; k < t->nfiles; k++) {
+         const char *filename = t->files[k];
+         struct stat st;
+         int fd = open(filename, O_RDONLY);
+         if (fd < 0 || fstat(fd, &st) < 0) {
+            perror(filename);
+            if (fd >= 0)
+               close(fd);
+            continue;
+         }
+         if (!st.st_size) {
+            close(fd);
+            continue;
+         }
+         u_char *buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+         close(fd);
+         if (buf == MAP_FAILED) {
+            perror(filename);
+            continue;
+         }
+         madvise(buf, st.st_size, MADV_SEQUENTIAL);
+
+         size_t len = strlen(filename);
+         if (len > 4 && !strcmp(filename + len - 4, ".zst")) {
+#if defined(WITH_ZSTD)
+            size_t dlen;
+            u_char *dbuf = decompress(buf, st.st_size, &dlen);
+            t->packets += parse_buf(&fs, dbuf, dlen, filename);
+            free(dbuf);
+#else
+            fprintf(stderr, "%s: built without zstd, skipped\n", filename);
+#endif
+         } else
+            t->packets += parse_buf(&fs, buf, st.st_size, filename);
+         munmap(buf, st.st_size);
+      }
+
+      if (fs) {
+         g_hash_table_foreach(fs->flows, (GHFunc) collect, t);
+         flowstat_close(fs);
+      }
+      if (!silent)
+         fprintf(stderr, "%s%s%s: %d segment(s), %llu packets, %u ports\n",
+                 t->tun ? "tun" : "notun", *t->run ? "." : "", t->run,
+                 t->nfiles, (unsigned long long)t->packets,
+                 g_hash_table_size(t->stats));
+   }
+   return NULL;
+}
+
+/**
+ * \fn static void add_pairs(gpointer key, gpointer value, gpointer user_data)
+ * \brief Add a side aggregate to its output row.
+ */
+static void add_pairs(gpointer key, gpointer value, gpointer user_data);
+
+/* rows of the trace being paired */
+static struct pair *pairs;
+static int npairs;
+static struct trace *cur_trace;
+
+void add_pairs(gpointer UNUSED(key), gpointer value, gpointer UNUSED(user_data)) {
+   struct side_stat *s = value;
+   int i;
+
+   for (i = 0; i < npairs; i++)
+      if (pairs[i].key == s->key && !strcmp(pairs[i].run, cur_trace->run))
+         break;
+   if (i == npairs) {
+      pairs = realloc(pairs, ++npairs * sizeof(struct pair));
+      if (!pairs)
+         die("realloc");
+      memset(&pairs[i], 0, sizeof(struct pair));
+      pairs[i].run = cur_trace->run;
+      pairs[i].key = s->key;
+   }
+   pairs[i].side[cur_trace->tun] = s;
+}
+
+static int pair_cmp(const void *a, const void *b) {
+   const struct pair *pa = a, *pb = b;
+   int c = strcmp(pa->run, pb->run);
+   if (c)
+      return c;
+   if ((pa->key & 0xffff) != (pb->key & 0xffff))
+      return (int)(pa->key & 0xffff) - (int)(pb->key & 0xffff);
+   return (int)(pa->key >> 16) - (int)(pb->key >> 16);
+}
+
+static double goodput(const struct side_stat *s) {
+   if (!s || s->last <= s->first)
+      return 0;
+   return (double)(s->c2s + s->s2c) * 8e9 / (double)(s->last - s->first);
+}
+
+void write_pairs(FILE *fp) {
+   int i, k;
+
+   for (i = 0; i < ntraces; i++) {
+      cur_trace = &traces[i];
+      g_hash_table_foreach(traces[i].stats, (GHFunc) add_pairs, NULL);
+   }
+   qsort(pairs, npairs, sizeof(struct pair), pair_cmp);
+
+   fprintf(fp, "run,port,family,public,private");
+   for (k = 1; k >= 0; k--) {
+      const char *p = k ? "tun" : "notun";
+      fprintf(fp, ",%s_flows,%s_packets,%s_duration,%s_syn_synack,"
+                  "%s_c2s_payload,%s_s2c_payload,%s_goodput,%s_retrans,"
+                  "%s_holes", p, p, p, p, p, p, p, p, p);
+   }
+   fprintf(fp, ",goodput_ratio\n");
+
+   for (i = 0; i < npairs; i++) {
+      struct pair *p = &pairs[i];
+      uint16_t port = p->key & 0xffff;
+      int v6 = (p->key >> 16) == 6;
+      struct dest *d = dests ? g_hash_table_lookup(dests, &port) : NULL;
+
+      fprintf(fp, "%s,%u,%s,%s,%s", p->run, port, v6 ? "ipv6" : "ipv4",
+              d ? (v6 ? d->public6 : d->public4) : "",
+              d ? (v6 ? d->private6 : d->private4) : "");
+      for (k = 1; k >= 0; k--) {
+         struct side_stat *s = p->side[k];
+         if (!s) {
+            fprintf(fp, ",,,,,,,,,");
+            continue;
+         }
+         fprintf(fp, ",%u,%llu,%llu,%lld,%llu,%llu,%.0f,%llu,%llu", s->flows,
+                 (unsigned long long)s->packets,
+                 (unsigned long long)(s->last - s->first),
+                 (long long)s->syn_synack,
+                 (unsigned long long)s->c2s, (unsigned long long)s->s2c,
+                 goodput(s), (unsigned long long)s->retrans,
+                 (unsigned long long)s->holes);
+      }
+      if (p->side[0] && p->side[1] && goodput(p->side[0]) > 0)
+         fprintf(fp, ",%.4f\n", goodput(p->side[1]) / goodput(p->side[0]));
+      else
+         fprintf(fp, ",\n");
+   }
+}
+
+/**
+ * \fn static int extract(char **files, int nfiles, const char *out_file,
+ *                        const struct pcapidx_query *q)
+ * \brief Extract the packets matching a query from indexed traces.
+ *
+ * \return 0 on success, 1 on error
+ */
+static int extract(char **files, int nfiles, const char *out_file,
+                   const struct pcapidx_query *q) {
+   FILE *out = fopen(out_file, "w");
+   if (!out)
+      die("fopen");
+
+   int ret = 0;
+   for (int i = 0; i < nfiles; i++) {
+      struct pcapidx *idx = pcapidx_load(files[i]);
+      if (!idx) {
+         fprintf(stderr, "%s%s: %s\n", files[i], PCAPIDX_EXT, strerror(errno));
+         ret = 1;
+         continue;
+      }
+      long long n = pcapidx_extract(idx, files[i], out, q);
+      if (n < 0) {
+         fprintf(stderr, "%s: %s\n", files[i], strerror(errno));
+         ret = 1;
+      } else if (!silent)
+         fprintf(stderr, "%s: %lld packets extracted\n", files[i], n);
+      pcapidx_free(idx);
+   }
+   fclose(out);
+   return ret;
+}
+
+static int file_cmp(const void *a, const void *b) {
+   return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+int main(int argc, char *argv[]) {
+   extern char *optarg;
+   extern int   optind, optopt;
+   const char *dest_file = NULL, *out_file = NULL;
+   int jobs = sysconf(_SC_NPROCESSORS_ONLN), val, i, extracting = 0;
+   struct pcapidx_query q;
+   memset(&q, 0, sizeof(q));
+
+   while ((val = getopt(argc, argv, optstring)) != EOF) {
+      switch (val) {
+         case 'd':
+            dest_file = optarg; break;
+         case 'j':
+            jobs = strtol(optarg, NULL, 10); break;
+         case 'o':
+            out_file = optarg; break;
+         case 'p':
+            q.sport = strtol(optarg, NULL, 10);
+            extracting = 1;
+            break;
+         case 't': {
+            char *end;
+            q.from = strtod(optarg, &end) * 1e9;
+            if (*end == ',')
+               q.to = strtod(end + 1, NULL) * 1e9;
+            extracting = 1;
+            break;
+         }
+         case 'q':
+            silent = 1; break;
+         case 'V':
+            printf("%s\n", program_version);
+            return 0;
+         case '?':
+            printf("Option -%c not supported.\n", optopt);
+         default:
+            printf("%s", arg_help);
+            return 1;
+      }
+   }
+   if (optind >= argc) {
+      printf("%s", arg_help);
+      return 1;
+   }
+   if (jobs < 1)
+      jobs = 1;
+
+   /* segments sort by name */
+   qsort(argv + optind, argc - optind, sizeof(char *), file_cmp);
+   if (extracting) {
+      if (!out_file) {
+         printf("%s", arg_help);
+         return 1;
+      }
+      return extract(argv + optind, argc - optind, out_file, &q);
+   }
+
+   if (dest_file)
+      parse_dests(dest_file);
+   for (i = optind; i < argc; i++)
+      add_file(argv[i]);
+   if (jobs > ntraces)
+      jobs = ntraces;
+
+   pthread_t *threads = xmalloc(jobs * sizeof(pthread_t));
+   for (i = 0; i < jobs; i++)
+      if (pthread_create(&threads[i], NULL, worker, NULL))
+         die("pthread_create");
+   for (i = 0; i < jobs; i++)
+      pthread_join(threads[i], NULL);
+   free(threads);
+
+   FILE *fp = out_file ? fopen(out_file, "w") : stdout;
+   if (!fp)
+      die("fopen");
+   write_pairs(fp);
+   if (out_file)
+      fclose(fp);
+
+   return 0;
+}
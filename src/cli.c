@@ -24,6 +24,11 @@
 #include "sock.h"
 #include "net.h"
 #include "xpcap.h"
+#include "tap.h"
+#include "mpath.h"
+#include "lpm.h"
+#include "mss.h"
+#include "pmtu.h"
 
 /**
  * \var static volatile int loop
@@ -63,6 +68,58 @@ static void tun_cli_out6(int fd_net, int fd_tun, struct tun_state *state, char *
 static void tun_cli_single(struct arguments *args);
 static void tun_cli_dual(struct arguments *args);
 
+/**
+ * \var static int spray[2][PORT_SPRAY_MAX]
+ * \brief The v4 and v6 tunnel sockets by source port offset
+ *        (source-port-spray).
+ */
+static int spray[2][PORT_SPRAY_MAX];
+
+/**
+ * \struct cli_conn
+ * \brief The spray, path and connected sockets of one family 
+ *        (see cli_connect).
+ */
+struct cli_conn {
+   int  fd_net; /*!< The shared tunnel socket */
+   int  family; /*!< AF_INET or AF_INET6 */
+   int *fds;    /*!< The spray, path and connected sockets */
+   int  len;    /*!< The number of spray, path and connected sockets */
+   int  max;    /*!< The highest fd */
+};
+
+/**
+ * \fn static void cli_connect(struct tun_state *state, int fd_net, 
+ *                             int family, struct cli_conn *conn)
+ * \brief Open a UDP socket per source port of the block of fd_net
+ *        (source-port-spray) and per path-address, build the paths 
+ *        of each destination (multipath), then open a connected UDP 
+ *        socket per single-path destination (udp-connect).
+ *
+ * \param state The client state
+ * \param fd_net The shared tunnel socket
+ * \param family AF_INET or AF_INET6
+ * \param conn Filled with the connected sockets
+ */
+static void cli_connect(struct tun_state *state, int fd_net, int family, 
+                        struct cli_conn *conn);
+static void cli_connect_aux(gpointer key, gpointer value, gpointer data);
+
+/**
+ * \fn static void cli_spray(struct tun_state *state, struct cli_conn *conn)
+ * \brief Open the sprayed tunnel sockets of a family.
+ *
+ * \param state The client state
+ * \param conn The shared tunnel socket, filled with the new sockets
+ */
+static void cli_spray(struct tun_state *state, struct cli_conn *conn);
+
+/**
+ * \fn static void cli_conn_set(struct cli_conn *conn, fd_set *input_set)
+ * \brief Add the connected sockets to a select set.
+ */
+static void cli_conn_set(struct cli_conn *conn, fd_set *input_set);
+
 
 void cli_shutdown(int UNUSED(sig)) { 
    debug_print("shutting down client ...\n");
@@ -83,7 +140,7 @@ void tun_cli(struct arguments *args) {
 
 void tun_cli_in(int fd_tun, int fd_net4, int fd_net6,
                 struct tun_state *state, char *buf) {
-   int recvd=xread(fd_tun, buf, BUFF_SIZE);
+   int recvd=tap_read(fd_tun, buf, BUFF_SIZE);
    debug_print("recvd %db from tun\n", recvd);
 
    switch (buf[0] & 0xf0) {
@@ -101,14 +158,14 @@ void tun_cli_in(int fd_tun, int fd_net4, int fd_net6,
 
 void tun_cli_in6(int fd_net, int fd_tun, 
                  struct tun_state *state, char *buf) {
-   int recvd=xread(fd_tun, buf, BUFF_SIZE);
+   int recvd=tap_read(fd_tun, buf, BUFF_SIZE);
    debug_print("recvd %db from tun\n", recvd);
    tun_cli_in6_aux(fd_net, state, buf, recvd);
 }
 
 void tun_cli_in4(int fd_net, int fd_tun, 
                  struct tun_state *state, char *buf) {
-   int recvd=xread(fd_tun, buf, BUFF_SIZE);
+   int recvd=tap_read(fd_tun, buf, BUFF_SIZE);
    debug_print("recvd %db from tun\n", recvd);
    tun_cli_in4_aux(fd_net, state, buf, recvd);
 }
@@ -120,21 +177,35 @@ void tun_cli_in4_aux(int fd_net, struct tun_state *state, char *buf, int recvd)
    in_addr_t priv_addr4 = (int) *((uint32_t *)(buf+16));
    debug_print("%s\n", inet_ntoa((struct in_addr){priv_addr4}));
 
-   /* lookup private addr */
-   if ( (rec = g_hash_table_lookup(state->cli4, &priv_addr4)) ) {
+   /* lookup private addr, then destination prefixes */
+   if ( (rec = g_hash_table_lookup(state->cli4, &priv_addr4)) ||
+        (rec = lpm_lookup4(state->lpm, priv_addr4)) ) {
 
       /* Remove PlanetLab TUN PPI header */
       if (state->planetlab) {
          recvd-=4;
          memmove(buf, buf+4, recvd);
       }
+      /* clamp tunneled TCP handshakes */
+      mss_clamp(state, buf, recvd);
+
+      /* hashed on the inner packet */
+      struct mpath_path *path = mpath_pick(rec->mp4, buf, recvd);
+      if (!path && !rec->fd4 && state->port_spray > 1)
+         fd_net = spray[0][mpath_hash(buf, recvd) % state->port_spray];
+
       /* Add layer 4.5 header */
       if (state->raw_header) {
          buf -= state->raw_header_size;
          recvd += state->raw_header_size;
       }
 
-      int sent = xsendto4(fd_net, rec->sa4, buf, recvd);
+      int sent = path     ? mpath_send(path, buf, recvd)
+               : rec->fd4 ? xsend(rec->fd4, buf, recvd)
+                          : xsendto4(fd_net, rec->sa4, buf, recvd);
+      if (sent < 0 && errno == EMSGSIZE)
+         pmtu_too_big(state, buf, recvd, path ? (struct sockaddr *)&path->sa
+                                              : rec->sa4);
       debug_print("cli: wrote %dB to internet\n",sent);
 
    } else {
@@ -154,21 +225,35 @@ void tun_cli_in6_aux(int fd_net, struct tun_state *state, char *buf, int recvd)
    debug_print("%s\n", inet_ntop(AF_INET6, priv_addr6, 
                          str_addr6, INET6_ADDRSTRLEN));
 
-   /* lookup private addr */
-   if ( (rec = g_hash_table_lookup(state->cli6, priv_addr6)) ) {
+   /* lookup private addr, then destination prefixes */
+   if ( (rec = g_hash_table_lookup(state->cli6, priv_addr6)) ||
+        (rec = lpm_lookup6(state->lpm, priv_addr6)) ) {
 
       /* Remove PlanetLab TUN PPI header */
       if (state->planetlab) {
          recvd-=4;
          memmove(buf, buf+4, recvd);
       }
+      /* clamp tunneled TCP handshakes */
+      mss_clamp(state, buf, recvd);
+
+      /* hashed on the inner packet */
+      struct mpath_path *path = mpath_pick(rec->mp6, buf, recvd);
+      if (!path && !rec->fd6 && state->port_spray > 1)
+         fd_net = spray[1][mpath_hash(buf, recvd) % state->port_spray];
+
       /* Add layer 4.5 header */
       if (state->raw_header) {
          buf -= state->raw_header_size;
          recvd += state->raw_header_size;
       }
 
-      int sent = xsendto6(fd_net, rec->sa6, buf, recvd);
+      int sent = path     ? mpath_send(path, buf, recvd)
+               : rec->fd6 ? xsend(rec->fd6, buf, recvd)
+                          : xsendto6(fd_net, rec->sa6, buf, recvd);
+      if (sent < 0 && errno == EMSGSIZE)
+         pmtu_too_big(state, buf, recvd, path ? (struct sockaddr *)&path->sa
+                                              : rec->sa6);
       debug_print("cli: wrote %dB to udp\n",sent);
 
    } else {
@@ -192,12 +277,14 @@ void tun_cli_out4(int fd_net, int fd_tun, struct tun_state *state, char *buf) {
          recvd -= state->raw_header_size;
          memmove(buf, buf+state->raw_header_size, recvd);
       }
+      /* clamp tunneled TCP handshakes */
+      mss_clamp(state, buf, recvd);
       /* Add PlanetLab TUN PPI header */
       if (state->planetlab) {
          buf-=4; recvd+=4;
       }
 
-      int sent = xwrite(fd_tun, buf, recvd);
+      int sent = tap_write(fd_tun, buf, recvd);
       debug_print("cli: wrote %dB to tun\n", sent);
    } else if (recvd < 0) {
       /* recvd ICMP msg */
@@ -221,12 +308,14 @@ void tun_cli_out6(int fd_net, int fd_tun, struct tun_state *state, char *buf) {
          recvd -= state->raw_header_size;
          memmove(buf, buf+state->raw_header_size, recvd);
       }
+      /* clamp tunneled TCP handshakes */
+      mss_clamp(state, buf, recvd);
       /* Add PlanetLab TUN PPI header */
       if (state->planetlab) {
          buf-=4; recvd+=4;
       }
 
-      int sent = xwrite(fd_tun, buf, recvd);
+      int sent = tap_write(fd_tun, buf, recvd);
       debug_print("cli: wrote %dB to tun\n", sent);
    } else if (recvd < 0) {
       /* recvd ICMP msg */
@@ -237,6 +326,87 @@ void tun_cli_out6(int fd_net, int fd_tun, struct tun_state *state, char *buf) {
    }   
 }
 
+void cli_connect(struct tun_state *state, int fd_net, int family, 
+                 struct cli_conn *conn) {
+   GHashTable *table = (family == AF_INET6) ? state->cli6 : state->cli4;
+   int locals[MPATH_MAX], nlocals;
+
+   memset(conn, 0, sizeof(struct cli_conn));
+   conn->fd_net = fd_net;
+   conn->family = family;
+   conn->max    = fd_net;
+   if (!state->udp)
+      return;
+
+   conn->fds = xmalloc((g_hash_table_size(table) + MPATH_MAX + 
+                        state->port_spray) * sizeof(int));
+
+   /* source-port spraying */
+   if (state->port_spray > 1)
+      cli_spray(state, conn);
+
+   /* multipath */
+   nlocals = mpath_socks(state, family, fd_net, locals);
+   mpath_init(state, table, family, locals, nlocals);
+   for (int i=1; i<nlocals; i++) {
+      conn->fds[conn->len++] = locals[i];
+      conn->max = max(conn->max, locals[i]);
+   }
+
+   if (state->udp_connect)
+      g_hash_table_foreach(table, cli_connect_aux, conn);
+   debug_print("%d spray, path and connected sockets\n", conn->len);
+}
+
+void cli_spray(struct tun_state *state, struct cli_conn *conn) {
+   struct sockaddr_storage ss;
+   socklen_t sslen = sizeof(ss);
+   int *fds = spray[(conn->family == AF_INET6) ? 1 : 0];
+   int port, base;
+
+   if (getsockname(conn->fd_net, (struct sockaddr *)&ss, &sslen) < 0)
+      die("getsockname");
+   port = ntohs(((struct sockaddr_in *)&ss)->sin_port);
+   if ((base = spray_block(state, port)) < 0)
+      die("source-port-spray block");
+
+   for (int i=0; i<state->port_spray; i++) {
+      if (base + i == port) {
+         fds[i] = conn->fd_net;
+         continue;
+      }
+      if (conn->family == AF_INET6)
+         fds[i] = udp_sock6(base + i, 1, state->public_addr6, 0);
+      else
+         fds[i] = udp_sock4(base + i, 1, state->public_addr4, 0);
+      conn->fds[conn->len++] = fds[i];
+      conn->max = max(conn->max, fds[i]);
+   }
+   debug_print("spraying over ports %d-%d\n", base, 
+               base + state->port_spray - 1);
+}
+
+void cli_connect_aux(gpointer UNUSED(key), gpointer value, gpointer data) {
+   struct cli_conn *conn = data;
+   struct tun_rec *rec   = value;
+   int fd;
+
+   /* multipath destinations send through their path sockets */
+   if ((conn->family == AF_INET6) ? rec->mp6 : rec->mp4)
+      return;
+   if (conn->family == AF_INET6)
+      fd = rec->fd6 = udp_conn_sock(conn->fd_net, rec->sa6);
+   else
+      fd = rec->fd4 = udp_conn_sock(conn->fd_net, rec->sa4);
+   conn->fds[conn->len++] = fd;
+   conn->max = max(conn->max, fd);
+}
+
+void cli_conn_set(struct cli_conn *conn, fd_set *input_set) {
+   for (int i=0; i<conn->len; i++)
+      FD_SET(conn->fds[i], input_set);
+}
+
 void tun_cli_single(struct arguments *args) {
    int fd_tun = 0, fd_net = 0; 
    void (*tun_cli_in_func)(int,int,struct tun_state*,char*);
@@ -249,31 +419,36 @@ void tun_cli_single(struct arguments *args) {
    tun(state, &fd_tun);
    if (state->ipv6) {
       if (state->udp)
-         fd_net = udp_sock6(state->port, 1, state->public_addr6);
+         fd_net = udp_sock6(state->port, 1, state->public_addr6, 
+                            state->udp_connect);
       else
          fd_net = raw_sock6(state->port, state->public_addr6, 
-                            gen_bpf(state->default_if, state->public_addr6, 
-                                    state->port, 0), 
+                            gen_bpf(AF_INET6, state->protocol_num, NULL, 
+                                    state->public_addr6, state->port, 0), 
                              state->default_if, state->protocol_num, 
                             1, state->planetlab);
       tun_cli_in_func = &tun_cli_in6;
       tun_cli_out_func = &tun_cli_out6;
    } else {
       if (state->udp)
-         fd_net = udp_sock4(state->port, 1, state->public_addr4);
+         fd_net = udp_sock4(state->port, 1, state->public_addr4, 
+                            state->udp_connect);
       else
          fd_net = raw_sock4(state->port, state->public_addr4, 
-                            gen_bpf(state->default_if, state->public_addr4, 
-                                    state->port, 0), 
+                            gen_bpf(AF_INET, state->protocol_num, NULL, 
+                                    state->public_addr4, state->port, 0), 
                             state->default_if, state->protocol_num, 
                             1, state->planetlab);
       tun_cli_in_func = &tun_cli_in4;
       tun_cli_out_func = &tun_cli_out4;
    }
 
+   /* path and per-destination connected sockets */
+   struct cli_conn conn;
+   cli_connect(state, fd_net, state->ipv6 ? AF_INET6 : AF_INET, &conn);
+
    /* run capture threads */
-   xthread_create(capture_notun, (void *) state, 1);
-   synchronize();
+   run_captures(state);
 
    /* run client */
    debug_print("running cli ...\n");    
@@ -298,7 +473,7 @@ void tun_cli_single(struct arguments *args) {
       outbuffer += 4;
    }
 
-   fd_max = max(fd_net, fd_tun);
+   fd_max = max(conn.max, fd_tun);
    loop = 1;
    signal(SIGINT, cli_shutdown);
    signal(SIGTERM, cli_shutdown);
@@ -307,6 +482,7 @@ void tun_cli_single(struct arguments *args) {
       FD_ZERO(&input_set);
       FD_SET(fd_net, &input_set);
       FD_SET(fd_tun, &input_set);
+      cli_conn_set(&conn, &input_set);
 
       sel = xselect(&input_set, fd_max, &tv, state->inactivity_timeout);
 
@@ -318,6 +494,9 @@ void tun_cli_single(struct arguments *args) {
             (*tun_cli_in_func)(fd_net, fd_tun, state, inbuffer);}
          if (FD_ISSET(fd_net, &input_set)) 
             (*tun_cli_out_func)(fd_net, fd_tun, state, outbuffer);
+         for (int i=0; i<conn.len; i++)
+            if (FD_ISSET(conn.fds[i], &input_set)) 
+               (*tun_cli_out_func)(conn.fds[i], fd_tun, state, outbuffer);
       }
    }
 }
@@ -332,24 +511,30 @@ void tun_cli_dual(struct arguments *args) {
    /* create tun if and sockets */   
    tun(state, &fd_tun);
    if (state->udp) {
-      fd_net4 = udp_sock4(state->public_port, 1, state->public_addr4);
-      fd_net6 = udp_sock6(state->public_port, 1, state->public_addr6);
+      fd_net4 = udp_sock4(state->public_port, 1, state->public_addr4, 
+                          state->udp_connect);
+      fd_net6 = udp_sock6(state->public_port, 1, state->public_addr6, 
+                          state->udp_connect);
    } else {
       fd_net4 = raw_sock4(state->public_port, state->public_addr4, 
-                            gen_bpf(state->default_if, state->public_addr4, 
-                                    state->port, 0), state->default_if, 
-                            state->protocol_num, 
+                            gen_bpf(AF_INET, state->protocol_num, NULL, 
+                                    state->public_addr4, state->port, 0), 
+                            state->default_if, state->protocol_num, 
                             1, state->planetlab);
       fd_net6 = raw_sock6(state->public_port, state->public_addr6, 
-                            gen_bpf(state->default_if, state->public_addr6, 
-                                    state->port, 0), state->default_if, 
-                            state->protocol_num, 
+                            gen_bpf(AF_INET6, state->protocol_num, NULL, 
+                                    state->public_addr6, state->port, 0), 
+                            state->default_if, state->protocol_num, 
                             1, state->planetlab);
    }
 
+   /* path and per-destination connected sockets */
+   struct cli_conn conn4, conn6;
+   cli_connect(state, fd_net4, AF_INET, &conn4);
+   cli_connect(state, fd_net6, AF_INET6, &conn6);
+
    /* run capture threads */
-   xthread_create(capture_notun, (void *) state, 1);
-   synchronize();
+   run_captures(state);
 
    /* run client */
    debug_print("running cli ...\n");    
@@ -374,7 +559,7 @@ void tun_cli_dual(struct arguments *args) {
       outbuffer += 4;
    }
 
-   fd_max = max(max(fd_net4, fd_net6), fd_tun);
+   fd_max = max(max(conn4.max, conn6.max), fd_tun);
    loop = 1;
    signal(SIGINT, cli_shutdown);
    signal(SIGTERM, cli_shutdown);
@@ -384,6 +569,8 @@ void tun_cli_dual(struct arguments *args) {
       FD_SET(fd_net4, &input_set);
       FD_SET(fd_net6, &input_set);
       FD_SET(fd_tun, &input_set);
+      cli_conn_set(&conn4, &input_set);
+      cli_conn_set(&conn6, &input_set);
 
       sel = xselect(&input_set, fd_max, &tv, state->inactivity_timeout);
 
@@ -397,6 +584,12 @@ void tun_cli_dual(struct arguments *args) {
             tun_cli_out4(fd_net4, fd_tun, state, outbuffer);
          if (FD_ISSET(fd_net6, &input_set)) 
             tun_cli_out6(fd_net6, fd_tun, state, outbuffer);
+         for (int i=0; i<conn4.len; i++)
+            if (FD_ISSET(conn4.fds[i], &input_set)) 
+               tun_cli_out4(conn4.fds[i], fd_tun, state, outbuffer);
+         for (int i=0; i<conn6.len; i++)
+            if (FD_ISSET(conn6.fds[i], &input_set)) 
+               tun_cli_out6(conn6.fds[i], fd_tun, state, outbuffer);
       }
    }
 }
@@ -0,0 +1,260 @@
+/**
+ * \file control.c
+ * \brief Daemon mode control socket.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "control.h"
+#include "udptun.h"
+#include "net.h"
+#include "xpcap.h"
+#include "destruct.h"
+#include "sock.h"
+#include "debug.h"
+
+/**
+ * \struct control_run
+ * \brief A run request.
+ */
+struct control_run {
+   char    *run_id;     /*!< The run ID, NULL for none */
+   int      cli_mode;   /*!< The client scheduling mode */
+   int      capture;    /*!< 1 to capture the run */
+   uint8_t  dests[256]; /*!< The destination indexes */
+   int      len;        /*!< The number of destinations */
+};
+
+/**
+ * \var static char *run_id
+ * \brief The run ID of the last run (malloc).
+ */
+static char *run_id;
+
+/**
+ * \fn static int control_sock(const char *path)
+ * \brief Bind and listen on the control socket.
+ *
+ * \param path The socket location, replaced if it exists
+ * \return The listening socket
+ */
+static int control_sock(const char *path);
+
+/**
+ * \fn static int control_request(struct tun_state *state, int s,
+ *                                char *line, char *default_id)
+ * \brief Parse, run and answer one request.
+ *
+ * \param state The program state
+ * \param s The control connection
+ * \param line The request
+ * \param default_id The command-line run ID
+ * \return 1 if told to quit, 0 otherwise
+ */
+static int control_request(struct tun_state *state, int s,
+                           char *line, char *default_id);
+
+/**
+ * \fn static const char *control_dests(struct tun_state *state, char *val,
+ *                                      struct control_run *run)
+ * \brief Parse a destination subset (all or I[-J][,...]).
+ *
+ * \param state The program state
+ * \param val The subset
+ * \param run The request to fill
+ * \return NULL on success, the error reason otherwise
+ */
+static const char *control_dests(struct tun_state *state, char *val,
+                                 struct control_run *run);
+
+/**
+ * \fn static void control_reply(int s, const char *fmt, ...)
+ * \brief Answer a request, the client may be gone.
+ *
+ * \param s The control connection
+ * \param fmt The answer format
+ */
+static void control_reply(int s, const char *fmt, ...);
+
+int control_sock(const char *path) {
+   struct sockaddr_un sun;
+   int s;
+
+   if (strlen(path) >= sizeof(sun.sun_path)) {
+      errno=ENAMETOOLONG;
+      die("control socket");
+   }
+   memset(&sun, 0, sizeof(sun));
+   sun.sun_family = AF_UNIX;
+   strcpy(sun.sun_path, path);
+
+   if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+      die("socket");
+   set_fd(s);
+
+   /* left behind by a previous daemon */
+   unlink(path);
+   if (bind(s, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+      die("bind control socket");
+   if (chmod(path, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP) < 0)
+      die("chmod");
+   if (listen(s, 4) < 0)
+      die("listen");
+
+   return s;
+}
+
+void control_loop(struct tun_state *state) {
+   struct arguments *args = state->args;
+   char line[CONTROL_LINE], *default_id = args->run_id;
+   int s = control_sock(args->control_sock), ws, quit = 0;
+   FILE *fp;
+
+   debug_print("control socket listening at %s ...\n", args->control_sock);
+   while (!quit) {
+      if ((ws = accept(s, NULL, NULL)) < 0) {
+         if (errno == EINTR)
+            continue;
+         die("accept");
+      }
+      if (!(fp = fdopen(ws, "r")))
+         die("fdopen");
+      while (!quit && fgets(line, CONTROL_LINE, fp))
+         quit = control_request(state, ws, line, default_id);
+      fclose(fp);
+   }
+
+   unlink(args->control_sock);
+   debug_print("control socket closed\n");
+}
+
+int control_request(struct tun_state *state, int s,
+                    char *line, char *default_id) {
+   struct arguments *args = state->args;
+   struct control_run run;
+   const char *err = NULL;
+   char *save, *tok, *val;
+
+   if (!(tok = strtok_r(line, " \t\r\n", &save)))
+      return 0;
+   if (!strcmp(tok, "quit")) {
+      control_reply(s, "ok\n");
+      return 1;
+   } else if (strcmp(tok, "run")) {
+      control_reply(s, "err unknown command %s\n", tok);
+      return 0;
+   }
+
+   /* command-line defaults */
+   run.run_id   = default_id;
+   run.cli_mode = args->cli_mode;
+   run.capture  = 1;
+   control_dests(state, "all", &run);
+
+   while (!err && (tok = strtok_r(NULL, " \t\r\n", &save))) {
+      if (!(val = strchr(tok, '='))) {
+         err = "expected key=value";
+         break;
+      }
+      *val++ = '\0';
+      if (!strcmp(tok, "id")) {
+         /* ends up in file names */
+         if (!*val || strchr(val, '/'))
+            err = "bad run id";
+         run.run_id = val;
+      } else if (!strcmp(tok, "mode")) {
+         if (!strcmp(val, "parallel"))
+            run.cli_mode = PARALLEL_MODE;
+         else if (!strcmp(val, "tun"))
+            run.cli_mode = TUN_FIRST_MODE;
+         else if (!strcmp(val, "notun"))
+            run.cli_mode = NOTUN_FIRST_MODE;
+         else
+            err = "bad mode";
+      } else if (!strcmp(tok, "dest")) {
+         err = control_dests(state, val, &run);
+      } else if (!strcmp(tok, "capture")) {
+         if (!strcmp(val, "on"))
+            run.capture = 1;
+         else if (!strcmp(val, "off"))
+            run.capture = 0;
+         else
+            err = "bad capture";
+      } else
+         err = "unknown key";
+   }
+   if (err) {
+      control_reply(s, "err %s\n", err);
+      return 0;
+   }
+
+   /* per-run results are opened with the run id of the run */
+   char *prev = run_id;
+   run_id = run.run_id ? strdup(run.run_id) : NULL;
+   args->run_id = run_id;
+   free(prev);
+   capture_window_run(run.capture);
+
+   debug_print("run %s: %d destinations\n", run_id ? run_id : "-", run.len);
+   cli_run(state, run.cli_mode, run.dests, run.len);
+   control_reply(s, "ok %s %d\n", run_id ? run_id : "-", run.len);
+   return 0;
+}
+
+const char *control_dests(struct tun_state *state, char *val,
+                          struct control_run *run) {
+   char *save, *tok, *end;
+   long first, last;
+
+   run->len = 0;
+   if (!strcmp(val, "all")) {
+      for (int i = 0; i < state->sa_len; i++)
+         run->dests[run->len++] = i;
+      return NULL;
+   }
+
+   for (tok = strtok_r(val, ",", &save); tok;
+        tok = strtok_r(NULL, ",", &save)) {
+      first = last = strtol(tok, &end, 10);
+      if (*end == '-')
+         last = strtol(end + 1, &end, 10);
+      if (end == tok || *end || first < 0 || last < first)
+         return "bad destination";
+      if (last >= state->sa_len)
+         return "no such destination";
+      for (long i = first; i <= last; i++) {
+         if (run->len == sizeof(run->dests))
+            return "too many destinations";
+         run->dests[run->len++] = i;
+      }
+   }
+   return run->len ? NULL : "no destination";
+}
+
+void control_reply(int s, const char *fmt, ...) {
+   char buf[CONTROL_LINE];
+   va_list ap;
+   int len;
+
+   va_start(ap, fmt);
+   len = vsnprintf(buf, sizeof(buf), fmt, ap);
+   va_end(ap);
+   if (len >= (int)sizeof(buf))
+      len = sizeof(buf) - 1;
+   if (send(s, buf, len, MSG_NOSIGNAL) < 0)
+      debug_print("control reply: %s\n", strerror(errno));
+}
+
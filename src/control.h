@@ -0,0 +1,47 @@
+/**
+ * \file control.h
+ * \brief Daemon mode control socket prototypes.
+ *
+ *    In daemon mode (-D SOCKET), the client keeps its tun interface,
+ *    tunnel sockets and captures up and takes measurement runs from a
+ *    Unix stream socket, one request per line:
+ *
+ *    run [id=RUN-ID] [mode=parallel|tun|notun] [dest=all|I[-J][,...]]
+ *        [capture=on|off]
+ *    quit
+ *
+ *    Runs are executed in order and answered once done:
+ *
+ *    ok RUN-ID DESTINATIONS
+ *    err REASON
+ *
+ *    Unset fields take the command-line values. The goodput results and
+ *    the capture windows of a run are written under its run id; traces,
+ *    timelines and metrics are kept open across runs, the windows of a
+ *    run locate it in them. capture=off keeps the capture gate closed.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_CONTROL_H
+#define UDPTUN_CONTROL_H
+
+#include "state.h"
+
+/**
+ * \def CONTROL_LINE
+ * \brief Maximum length of a control request.
+ */
+#define CONTROL_LINE 1024
+
+/**
+ * \fn void control_loop(struct tun_state *state)
+ * \brief Serve run requests on the control socket until told to quit.
+ *
+ * \param state The program state
+ */
+void control_loop(struct tun_state *state);
+
+#endif
+
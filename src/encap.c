@@ -0,0 +1,352 @@
+/**
+ * \file encap.c
+ * \brief Tun-side/wire-side packet correlation.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "encap.h"
+#include "flowstat.h"
+#include "sock.h"
+#include "debug.h"
+
+/* FNV-1a 64 */
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME  1099511628211ULL
+
+/**
+ * \struct encap_pkt
+ * \brief A packet seen on one side only.
+ */
+struct encap_pkt {
+   uint64_t key;  /*!< hash of the inner packet, hash table key */
+   uint64_t ts;   /*!< capture time (ns) */
+   uint8_t  side; /*!< ENCAP_TUN or ENCAP_WIRE */
+};
+
+/**
+ * \struct encap_dist
+ * \brief A delay distribution.
+ */
+struct encap_dist {
+   uint64_t matched;                  /*!< matched packets */
+   uint64_t lost;                     /*!< packets seen on one side only */
+   uint64_t min, max, sum;            /*!< delays (ns) */
+   uint64_t hist[ENCAP_BUCKETS + 1];  /*!< 1 us buckets + overflow */
+};
+
+/**
+ * \struct encap
+ * \brief The correlator.
+ */
+struct encap {
+   pthread_mutex_t   lock;      /*!< both capture threads feed the table */
+   GHashTable       *pending;   /*!< uint64_t key to struct encap_pkt */
+   struct encap_dist dist[2];   /*!< encap (tun first), decap (wire first) */
+   char             *filename;  /*!< output file */
+   uint64_t          last_sweep;/*!< last expiry pass */
+   uint16_t          port;      /*!< tunnel UDP port (host order) */
+   uint8_t           udp;       /*!< UDP mode */
+   uint8_t           proto;     /*!< raw mode protocol, 0 for any */
+   uint8_t           raw_header_size; /*!< tunnel header size */
+   uint8_t           silent;    /*!< do not report */
+   int               refs;      /*!< attached capture sides */
+};
+
+/**
+ * \var static struct encap *enc
+ * \brief The correlator, NULL if disabled.
+ */
+static struct encap *enc;
+
+/**
+ * \fn static guint pkt_hash(gconstpointer key)
+ * \brief Hash of a uint64_t key.
+ */
+static guint pkt_hash(gconstpointer key);
+
+/**
+ * \fn static gboolean pkt_equal(gconstpointer a, gconstpointer b)
+ * \brief Compare two uint64_t keys.
+ */
+static gboolean pkt_equal(gconstpointer a, gconstpointer b);
+
+/**
+ * \fn static gboolean pkt_expire(gpointer key, gpointer value,
+ *                                gpointer user_data)
+ * \brief g_hash_table_foreach_remove callback, count old packets as lost.
+ *
+ * \param user_data The expiry time (uint64_t *), 0 to expire everything
+ */
+static gboolean pkt_expire(gpointer key, gpointer value, gpointer user_data);
+
+/**
+ * \fn static int encap_inner(int side, int linktype, const u_char *bytes,
+ *                            uint32_t caplen)
+ * \brief Locate the inner IP packet.
+ *
+ * \return The inner packet offset, -1 if not a tunneled packet
+ */
+static int encap_inner(int side, int linktype, const u_char *bytes,
+                       uint32_t caplen);
+
+/**
+ * \fn static int encap_key(const u_char *ip, uint32_t len, uint64_t *key)
+ * \brief Hash the invariant fields of an inner IP packet.
+ *
+ * \return 0 on success, -1 if truncated
+ */
+static int encap_key(const u_char *ip, uint32_t len, uint64_t *key);
+
+/**
+ * \fn static void encap_write()
+ * \brief Write the delay distributions.
+ */
+static void encap_write();
+
+guint pkt_hash(gconstpointer key) {
+   uint64_t k = *(const uint64_t *)key;
+   return (guint)(k ^ (k >> 32));
+}
+
+gboolean pkt_equal(gconstpointer a, gconstpointer b) {
+   return *(const uint64_t *)a == *(const uint64_t *)b;
+}
+
+gboolean pkt_expire(gpointer UNUSED(key), gpointer value, 
+                    gpointer user_data) {
+   struct encap_pkt *pkt = (struct encap_pkt *)value;
+   uint64_t before = *(uint64_t *)user_data;
+
+   if (before && pkt->ts >= before)
+      return 0;
+   enc->dist[pkt->side].lost++;
+   free(pkt);
+   return 1;
+}
+
+void encap_init(struct tun_state *state) {
+   if (!state->encap_delay)
+      return;
+
+   enc = calloc(1, sizeof(struct encap));
+   if (!enc)
+      die("calloc");
+   pthread_mutex_init(&enc->lock, NULL);
+   enc->pending  = g_hash_table_new(pkt_hash, pkt_equal);
+   enc->filename = xmalloc(STR_SIZE);
+   snprintf(enc->filename, STR_SIZE, "%s%s%s%s.csv", state->out_dir, ENCAP_FILE,
+            state->args->run_id ? "." : "",
+            state->args->run_id ? state->args->run_id : "");
+   enc->port            = state->public_port;
+   enc->udp             = state->udp;
+   enc->proto           = state->protocol_num;
+   enc->raw_header_size = state->raw_header_size;
+   enc->silent          = state->args->silent;
+   enc->dist[0].min     = enc->dist[1].min = UINT64_MAX;
+}
+
+int encap_attach() {
+   if (!enc)
+      return 0;
+   pthread_mutex_lock(&enc->lock);
+   enc->refs++;
+   pthread_mutex_unlock(&enc->lock);
+   return 1;
+}
+
+void encap_detach() {
+   if (!enc)
+      return;
+   pthread_mutex_lock(&enc->lock);
+   if (--enc->refs > 0) {
+      pthread_mutex_unlock(&enc->lock);
+      return;
+   }
+   pthread_mutex_unlock(&enc->lock);
+
+   encap_write();
+   g_hash_table_destroy(enc->pending);
+   pthread_mutex_destroy(&enc->lock);
+   free(enc->filename);
+   free(enc);
+   enc = NULL;
+   debug_print("closing encapsulation correlator...\n");
+}
+
+int encap_inner(int side, int linktype, const u_char *bytes, uint32_t caplen) {
+   int off = flow_l3_offset(linktype, bytes, caplen);
+   if (off < 0 || caplen < (uint32_t)off + 20)
+      return -1;
+   if (side == ENCAP_TUN)
+      return off;
+
+   /* outer header */
+   const u_char *ip = bytes + off;
+   int hlen, proto;
+   if ((ip[0] >> 4) == 4) {
+      hlen  = (ip[0] & 0x0f) * 4;
+      proto = ip[9];
+      /* fragments */
+      if (ntohs(*(uint16_t *)(ip + 6)) & 0x3fff)
+         return -1;
+   } else if ((ip[0] >> 4) == 6) {
+      hlen  = 40;
+      proto = ip[6];
+   } else
+      return -1;
+   off += hlen;
+
+   if (enc->udp) {
+      if (proto != IPPROTO_UDP || caplen < (uint32_t)off + 8)
+         return -1;
+      if (ntohs(*(uint16_t *)(bytes + off)) != enc->port &&
+          ntohs(*(uint16_t *)(bytes + off + 2)) != enc->port)
+         return -1;
+      off += 8;
+   } else if (enc->proto ? proto != enc->proto :
+              (proto == IPPROTO_ICMP || proto == IPPROTO_ICMPV6))
+      return -1;
+   off += enc->raw_header_size;
+
+   return caplen < (uint32_t)off + 20 ? -1 : off;
+}
+
+int encap_key(const u_char *ip, uint32_t len, uint64_t *key) {
+   const u_char *f[4];
+   uint32_t flen[4], n = 0, i, j;
+   int proto, hlen;
+
+   if ((ip[0] >> 4) == 4) {
+      hlen  = (ip[0] & 0x0f) * 4;
+      proto = ip[9];
+      /* total length, IP ID */
+      f[n] = ip + 2;  flen[n++] = 4;
+      /* protocol */
+      f[n] = ip + 9;  flen[n++] = 1;
+      /* addresses */
+      f[n] = ip + 12; flen[n++] = 8;
+   } else if ((ip[0] >> 4) == 6) {
+      if (len < 40)
+         return -1;
+      hlen  = 40;
+      proto = ip[6];
+      /* payload length, next header */
+      f[n] = ip + 4;  flen[n++] = 3;
+      /* addresses */
+      f[n] = ip + 8;  flen[n++] = 32;
+   } else
+      return -1;
+
+   /* sequence & acknowledgment numbers */
+   if (proto == IPPROTO_TCP && len >= (uint32_t)hlen + 12) {
+      f[n] = ip + hlen + 4; flen[n++] = 8;
+   }
+
+   uint64_t h = FNV_OFFSET;
+   for (i = 0; i < n; i++)
+      for (j = 0; j < flen[i]; j++) {
+         h ^= f[i][j];
+         h *= FNV_PRIME;
+      }
+   *key = h;
+   return 0;
+}
+
+void encap_packet(int side, uint64_t ts, const u_char *bytes,
+                  uint32_t caplen, int linktype) {
+   uint64_t key;
+   int off;
+
+   if (!enc)
+      return;
+   if ((off = encap_inner(side, linktype, bytes, caplen)) < 0)
+      return;
+   if (encap_key(bytes + off, caplen - off, &key) < 0)
+      return;
+
+   pthread_mutex_lock(&enc->lock);
+
+   /* expire old packets */
+   if (ts > enc->last_sweep + ENCAP_TIMEOUT) {
+      uint64_t before = ts - ENCAP_TIMEOUT;
+      if (enc->last_sweep)
+         g_hash_table_foreach_remove(enc->pending, pkt_expire, &before);
+      enc->last_sweep = ts;
+   }
+
+   struct encap_pkt *pkt = g_hash_table_lookup(enc->pending, &key);
+   if (pkt && pkt->side != side) {
+      /* matched, dir is the side seen first */
+      struct encap_dist *d = &enc->dist[pkt->side];
+      uint64_t delay = ts > pkt->ts ? ts - pkt->ts : 0;
+      uint64_t bucket = delay / 1000;
+
+      d->matched++;
+      d->sum += delay;
+      if (delay < d->min) d->min = delay;
+      if (delay > d->max) d->max = delay;
+      d->hist[bucket < ENCAP_BUCKETS ? bucket : ENCAP_BUCKETS]++;
+
+      g_hash_table_remove(enc->pending, &key);
+      free(pkt);
+   } else if (pkt) {
+      /* same packet twice on one side, keep the latest */
+      enc->dist[side].lost++;
+      pkt->ts = ts;
+   } else {
+      pkt = xmalloc(sizeof(struct encap_pkt));
+      pkt->key  = key;
+      pkt->ts   = ts;
+      pkt->side = side;
+      g_hash_table_insert(enc->pending, &pkt->key, pkt);
+   }
+
+   pthread_mutex_unlock(&enc->lock);
+}
+
+void encap_write() {
+   static const char *dirs[2] = { "encap", "decap" };
+   uint64_t all = 0;
+   int i, j;
+
+   g_hash_table_foreach_remove(enc->pending, pkt_expire, &all);
+
+   FILE *fp = fopen(enc->filename, "w");
+   if (!fp)
+      die("fopen");
+   fprintf(fp, "#summary,dir,matched,lost,min,mean,max\n"
+               "#hist,dir,delay,count\n");
+   for (i = 0; i < 2; i++) {
+      struct encap_dist *d = &enc->dist[i];
+      fprintf(fp, "summary,%s,%llu,%llu,%llu,%llu,%llu\n", dirs[i],
+              (unsigned long long)d->matched, (unsigned long long)d->lost,
+              (unsigned long long)(d->matched ? d->min : 0),
+              (unsigned long long)(d->matched ? d->sum / d->matched : 0),
+              (unsigned long long)d->max);
+      for (j = 0; j <= ENCAP_BUCKETS; j++)
+         if (d->hist[j])
+            fprintf(fp, "hist,%s,%d,%llu\n", dirs[i], j,
+                    (unsigned long long)d->hist[j]);
+      if (!enc->silent)
+         fprintf(stderr, "%s: %s %llu matched, %llu lost, mean delay %llu ns\n",
+                 enc->filename, dirs[i], (unsigned long long)d->matched,
+                 (unsigned long long)d->lost,
+                 (unsigned long long)(d->matched ? d->sum / d->matched : 0));
+   }
+   fchmod(fileno(fp), S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+   fclose(fp);
+}
@@ -0,0 +1,89 @@
+/**
+ * \file encap.h
+ * \brief Tun-side/wire-side packet correlation prototypes.
+ *
+ *    Inner packets seen on the tun interface are matched with their
+ *    encapsulated copy on the wire through a hash of their invariant
+ *    fields (addresses, IP ID or payload length, TCP sequence and
+ *    acknowledgment numbers). Matching is done incrementally in a
+ *    table of pending packets. Packets left unmatched for ENCAP_TIMEOUT
+ *    are counted as lost inside the host. When both captures end, the
+ *    delay distributions are written to a CSV file:
+ *
+ *    summary,dir,matched,lost,min,mean,max   (ns)
+ *    hist,dir,delay,count                    (us buckets)
+ *
+ *    dir is encap (tun first) or decap (wire first), the last bucket
+ *    (ENCAP_BUCKETS) counts every delay above.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_ENCAP_H
+#define UDPTUN_ENCAP_H
+
+#include <stdint.h>
+#include <pcap.h>
+
+#include "state.h"
+
+/**
+ * \def ENCAP_FILE
+ * \brief Encapsulation delay file prefix (in output-dir).
+ */
+#define ENCAP_FILE "encap"
+
+/**
+ * \def ENCAP_TIMEOUT
+ * \brief Delay after which a pending packet is lost (ns).
+ */
+#define ENCAP_TIMEOUT 1000000000ULL
+
+/**
+ * \def ENCAP_BUCKETS
+ * \brief Number of 1 us histogram buckets.
+ */
+#define ENCAP_BUCKETS 10000
+
+/* capture sides */
+#define ENCAP_TUN  0 /*!< tun interface */
+#define ENCAP_WIRE 1 /*!< default interface */
+
+/**
+ * \fn void encap_init(struct tun_state *state)
+ * \brief Create the correlator if encap-delay is set.
+ *
+ * \param state The program state
+ */
+void encap_init(struct tun_state *state);
+
+/**
+ * \fn int encap_attach()
+ * \brief Register a capture side.
+ *
+ * \return 1 if the correlator is enabled, 0 otherwise
+ */
+int encap_attach();
+
+/**
+ * \fn void encap_detach()
+ * \brief Unregister a capture side. The last one writes the results.
+ */
+void encap_detach();
+
+/**
+ * \fn void encap_packet(int side, uint64_t ts, const u_char *bytes,
+ *                       uint32_t caplen, int linktype)
+ * \brief Match a captured packet. Thread-safe.
+ *
+ * \param side ENCAP_TUN or ENCAP_WIRE
+ * \param ts The capture time (ns)
+ * \param bytes The packet
+ * \param caplen The captured length
+ * \param linktype The link-layer type (DLT_*)
+ */
+void encap_packet(int side, uint64_t ts, const u_char *bytes,
+                  uint32_t caplen, int linktype);
+
+#endif
@@ -0,0 +1,401 @@
+/**
+ * \file flowstat.c
+ * \brief Online per-flow TCP metrics.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "flowstat.h"
+#include "sock.h"
+#include "debug.h"
+
+/* link-layer types */
+#define FS_LINKTYPE_RAW 101 /*!< LINKTYPE_RAW as written in pcap files */
+#define FS_DLT_SLL      113 /*!< DLT_LINUX_SLL */
+
+/* TCP flags */
+#define FS_TH_FIN 0x01
+#define FS_TH_SYN 0x02
+#define FS_TH_ACK 0x10
+
+/* sequence number comparisons */
+#define SEQ_LT(a,b) ((int32_t)((a)-(b)) < 0)
+#define SEQ_GT(a,b) ((int32_t)((a)-(b)) > 0)
+
+/**
+ * \fn static guint flow_hash(gconstpointer key)
+ * \brief FNV-1a hash of a struct flow_key.
+ */
+static guint flow_hash(gconstpointer key);
+
+/**
+ * \fn static gboolean flow_equal(gconstpointer a, gconstpointer b)
+ * \brief struct flow_key equality.
+ */
+static gboolean flow_equal(gconstpointer a, gconstpointer b);
+
+/**
+ * \fn static void flow_collect(gpointer key, gpointer value,
+ *                              gpointer user_data)
+ * \brief Store a flow in an id-indexed array.
+ */
+static void flow_collect(gpointer key, gpointer value, gpointer user_data);
+
+/**
+ * \fn static void flow_write(struct flowstat *fs, struct flow_rec *rec)
+ * \brief Write the summary and interval lines of a flow, and free it.
+ */
+static void flow_write(struct flowstat *fs, struct flow_rec *rec);
+
+int parse_capture_output(const char *val) {
+   if (!strcmp(val, "pcap"))
+      return CAPTURE_PCAP;
+   else if (!strcmp(val, "metrics"))
+      return CAPTURE_METRICS;
+   else if (!strcmp(val, "both"))
+      return CAPTURE_BOTH;
+   return -1;
+}
+
+guint flow_hash(gconstpointer key) {
+   const uint8_t *p = key;
+   uint32_t h = 2166136261U;
+   for (size_t i=0; i<sizeof(struct flow_key); i++) {
+      h ^= p[i];
+      h *= 16777619U;
+   }
+   return h;
+}
+
+gboolean flow_equal(gconstpointer a, gconstpointer b) {
+   return !memcmp(a, b, sizeof(struct flow_key));
+}
+
+struct flowstat *flowstat_open(const char *filename, int linktype,
+                               int nano, uint32_t interval) {
+   struct flowstat *fs = calloc(1, sizeof(struct flowstat));
+   if (!fs)
+      die("calloc");
+
+   if (filename) {
+      size_t len = strlen(filename);
+      char *file_loc = xmalloc(len + sizeof(FLOWSTAT_EXT));
+      strcpy(file_loc, filename);
+      if (len > 5 && !strcmp(file_loc + len - 5, ".pcap"))
+         file_loc[len - 5] = '\0';
+      strcat(file_loc, FLOWSTAT_EXT);
+      if (!(fs->fp = fopen(file_loc, "w")))
+         die("fopen flowstat");
+      free(file_loc);
+   }
+
+   fs->flows    = g_hash_table_new(flow_hash, flow_equal);
+   fs->linktype = linktype;
+   fs->nano     = nano;
+   fs->interval = (uint64_t)interval * 1000000ULL;
+   return fs;
+}
+
+int flow_l3_offset(int linktype, const u_char *bytes, uint32_t caplen) {
+   int off;
+   uint16_t type;
+
+   switch (linktype) {
+      case DLT_EN10MB:
+         if (caplen < 14) return -1;
+         off  = 14;
+         type = ntohs(*(uint16_t *)(bytes + 12));
+         /* 802.1Q */
+         if (type == 0x8100) {
+            if (caplen < 18) return -1;
+            type = ntohs(*(uint16_t *)(bytes + 16));
+            off += 4;
+         }
+         return (type == 0x0800 || type == 0x86dd) ? off : -1;
+      case FS_DLT_SLL:
+         if (caplen < 16) return -1;
+         type = ntohs(*(uint16_t *)(bytes + 14));
+         return (type == 0x0800 || type == 0x86dd) ? 16 : -1;
+      case DLT_NULL:
+         return 4;
+      case DLT_RAW:
+      case FS_LINKTYPE_RAW:
+      default:
+         return 0;
+   }
+}
+
+int flow_key_parse(int linktype, const u_char *bytes, uint32_t caplen,
+                   struct flow_key *key) {
+   int off = flow_l3_offset(linktype, bytes, caplen);
+   if (off < 0 || caplen < (uint32_t)off + 20)
+      return -1;
+
+   const u_char *ip = bytes + off;
+   const uint8_t *src, *dst;
+   uint32_t hl;
+   uint8_t proto;
+   int alen;
+   memset(key, 0, sizeof(struct flow_key));
+
+   switch (ip[0] >> 4) {
+      case 4:
+         key->family = AF_INET;
+         hl    = (ip[0] & 0x0f) * 4;
+         proto = ip[9];
+         src   = ip + 12;
+         dst   = ip + 16;
+         alen  = 4;
+         /* non-first fragments have no ports */
+         if (ntohs(*(uint16_t *)(ip + 6)) & 0x1fff)
+            proto = 0;
+         break;
+      case 6:
+         if (caplen < (uint32_t)off + 40)
+            return -1;
+         key->family = AF_INET6;
+         hl    = 40;
+         proto = ip[6];
+         src   = ip + 8;
+         dst   = ip + 24;
+         alen  = 16;
+         break;
+      default:
+         return -1;
+   }
+
+   uint16_t sport = 0, dport = 0;
+   if ((proto == IPPROTO_TCP || proto == IPPROTO_UDP) &&
+       caplen >= off + hl + 4) {
+      key->proto = proto;
+      sport = ntohs(*(uint16_t *)(ip + hl));
+      dport = ntohs(*(uint16_t *)(ip + hl + 2));
+   }
+
+   int c = memcmp(src, dst, alen);
+   int d = (c > 0 || (c == 0 && sport > dport));
+   memcpy(key->addr_a, d ? dst : src, alen);
+   memcpy(key->addr_b, d ? src : dst, alen);
+   key->port_a = d ? dport : sport;
+   key->port_b = d ? sport : dport;
+   return d;
+}
+
+void flowstat_packet(struct flowstat *fs, const struct pcap_pkthdr *h,
+                     const u_char *bytes) {
+   uint32_t caplen = h->caplen;
+   int off = flow_l3_offset(fs->linktype, bytes, caplen);
+   if (off < 0 || caplen < (uint32_t)off + 20)
+      return;
+
+   const u_char *ip = bytes + off;
+   struct flow_key key;
+   const uint8_t *src, *dst;
+   uint32_t iplen, hl;
+   memset(&key, 0, sizeof(key));
+   key.proto = IPPROTO_TCP;
+
+   switch (ip[0] >> 4) {
+      case 4:
+         if (ip[9] != IPPROTO_TCP)
+            return;
+         key.family = AF_INET;
+         hl    = (ip[0] & 0x0f) * 4;
+         iplen = ntohs(*(uint16_t *)(ip + 2));
+         src   = ip + 12;
+         dst   = ip + 16;
+         break;
+      case 6:
+         /* no extension headers */
+         if (caplen < (uint32_t)off + 40 || ip[6] != IPPROTO_TCP)
+            return;
+         key.family = AF_INET6;
+         hl    = 40;
+         iplen = 40 + ntohs(*(uint16_t *)(ip + 4));
+         src   = ip + 8;
+         dst   = ip + 24;
+         break;
+      default:
+         return;
+   }
+   if (caplen < off + hl + 20)
+      return;
+
+   const u_char *th = ip + hl;
+   uint16_t sport = ntohs(*(uint16_t *)th);
+   uint16_t dport = ntohs(*(uint16_t *)(th + 2));
+   uint32_t seq   = ntohl(*(uint32_t *)(th + 4));
+   uint32_t thl   = (th[12] >> 4) * 4;
+   uint8_t  flags = th[13];
+   uint32_t payload = (iplen > hl + thl) ? iplen - hl - thl : 0;
+   int alen = (key.family == AF_INET) ? 4 : 16;
+
+   /* canonical key, d is the packet direction */
+   int c = memcmp(src, dst, alen);
+   int d = (c > 0 || (c == 0 && sport > dport));
+   memcpy(key.addr_a, d ? dst : src, alen);
+   memcpy(key.addr_b, d ? src : dst, alen);
+   key.port_a = d ? dport : sport;
+   key.port_b = d ? sport : dport;
+
+   uint64_t ts = (uint64_t)h->ts.tv_sec * 1000000000ULL +
+                 (uint64_t)h->ts.tv_usec * (fs->nano ? 1 : 1000);
+   if (!fs->start)
+      fs->start = ts;
+
+   struct flow_rec *rec = g_hash_table_lookup(fs->flows, &key);
+   if (!rec) {
+      rec = calloc(1, sizeof(struct flow_rec));
+      if (!rec)
+         die("calloc");
+      rec->key   = key;
+      rec->id    = fs->next_id++;
+      rec->cli   = -1;
+      rec->first = ts;
+      g_hash_table_insert(fs->flows, &rec->key, rec);
+   }
+   rec->last = ts;
+
+   /* handshake */
+   if ((flags & FS_TH_SYN) && !(flags & FS_TH_ACK)) {
+      if (!rec->syn) {
+         rec->syn = ts;
+         rec->cli = d;
+      }
+   } else if ((flags & FS_TH_SYN) && (flags & FS_TH_ACK)) {
+      if (!rec->synack)
+         rec->synack = ts;
+   } else if ((flags & FS_TH_ACK) && rec->synack && !rec->ack && d == rec->cli)
+      rec->ack = ts;
+
+   /* counters and sequence tracking */
+   struct flow_dir *dir = &rec->dir[d];
+   dir->packets++;
+   dir->bytes   += iplen;
+   dir->payload += payload;
+   if (flags & FS_TH_SYN) {
+      dir->next_seq = seq + 1;
+      dir->seq_init = 1;
+   } else if (payload) {
+      uint32_t end = seq + payload;
+      if (dir->seq_init && SEQ_LT(seq, dir->next_seq)) {
+         dir->retrans++;
+         dir->retrans_bytes += payload;
+      } else if (dir->seq_init && SEQ_GT(seq, dir->next_seq))
+         dir->holes++;
+      if (!dir->seq_init || SEQ_GT(end, dir->next_seq))
+         dir->next_seq = end;
+      dir->seq_init = 1;
+   }
+
+   /* intervals, packets timestamped before the first one (clock steps,
+      reordered captures) or too late are left out */
+   if (fs->interval && payload && ts >= fs->start) {
+      uint64_t i = (ts - fs->start) / fs->interval;
+      if (i >= FLOWSTAT_MAX_IVL)
+         return;
+      if (i >= rec->ivl_len) {
+         uint64_t len = rec->ivl_len ? rec->ivl_len : 8;
+         while (len <= i) len *= 2;
+         if (len > FLOWSTAT_MAX_IVL)
+            len = FLOWSTAT_MAX_IVL;
+         for (int k=0; k<2; k++) {
+            rec->ivl[k] = realloc(rec->ivl[k], len * sizeof(uint64_t));
+            if (!rec->ivl[k])
+               die("realloc");
+            memset(rec->ivl[k] + rec->ivl_len, 0,
+                   (len - rec->ivl_len) * sizeof(uint64_t));
+         }
+         rec->ivl_len = len;
+      }
+      rec->ivl[d][i] += payload;
+   }
+}
+
+void flow_collect(gpointer UNUSED(key), gpointer value, gpointer user_data) {
+   struct flow_rec **recs = user_data;
+   struct flow_rec *rec   = value;
+   recs[rec->id] = rec;
+}
+
+void flow_write(struct flowstat *fs, struct flow_rec *rec) {
+   if (!fs->fp)
+      goto free_rec;
+
+   char a[INET6_ADDRSTRLEN], b[INET6_ADDRSTRLEN];
+   int af = rec->key.family;
+   /* report client first */
+   int cli = (rec->cli == 1);
+
+   inet_ntop(af, cli ? rec->key.addr_b : rec->key.addr_a, a, sizeof(a));
+   inet_ntop(af, cli ? rec->key.addr_a : rec->key.addr_b, b, sizeof(b));
+   fprintf(fs->fp, "flow,%u,%s,%u,%s,%u,%llu,%llu,%lld,%lld", rec->id,
+           a, cli ? rec->key.port_b : rec->key.port_a,
+           b, cli ? rec->key.port_a : rec->key.port_b,
+           (unsigned long long)rec->first, (unsigned long long)rec->last,
+           (rec->syn && rec->synack) ?
+               (long long)(rec->synack - rec->syn) : -1LL,
+           (rec->synack && rec->ack) ?
+               (long long)(rec->ack - rec->synack) : -1LL);
+   for (int k=0; k<2; k++) {
+      struct flow_dir *dir = &rec->dir[k ^ cli];
+      fprintf(fs->fp, ",%llu,%llu,%llu,%u,%llu,%u",
+              (unsigned long long)dir->packets,
+              (unsigned long long)dir->bytes,
+              (unsigned long long)dir->payload, dir->retrans,
+              (unsigned long long)dir->retrans_bytes, dir->holes);
+   }
+   fprintf(fs->fp, "\n");
+
+   for (uint32_t i=0; i<rec->ivl_len; i++) {
+      if (!rec->ivl[0][i] && !rec->ivl[1][i])
+         continue;
+      fprintf(fs->fp, "interval,%u,%u,%llu,%llu,%llu\n", rec->id, i,
+              (unsigned long long)(fs->start + i * fs->interval),
+              (unsigned long long)rec->ivl[cli][i],
+              (unsigned long long)rec->ivl[!cli][i]);
+   }
+
+free_rec:
+   free(rec->ivl[0]);
+   free(rec->ivl[1]);
+   free(rec);
+}
+
+void flowstat_close(struct flowstat *fs) {
+   if (!fs) return;
+
+   struct flow_rec **recs = calloc(fs->next_id + 1, sizeof(struct flow_rec *));
+   if (!recs)
+      die("calloc");
+   g_hash_table_foreach(fs->flows, (GHFunc) flow_collect, recs);
+   g_hash_table_destroy(fs->flows);
+
+   if (fs->fp)
+      fprintf(fs->fp, "#flow,id,cli_addr,cli_port,serv_addr,serv_port,first,"
+                   "last,syn_synack,synack_ack,c2s_packets,c2s_bytes,"
+                   "c2s_payload,c2s_retrans,c2s_retrans_bytes,c2s_holes,"
+                   "s2c_packets,s2c_bytes,s2c_payload,s2c_retrans,"
+                   "s2c_retrans_bytes,s2c_holes\n"
+                   "#interval,id,index,start,c2s_payload,s2c_payload\n");
+   for (uint32_t i=0; i<fs->next_id; i++)
+      flow_write(fs, recs[i]);
+
+   free(recs);
+   if (fs->fp)
+      fclose(fs->fp);
+   debug_print("flowstat: %u flows\n", fs->next_id);
+   free(fs);
+}
+
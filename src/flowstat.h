@@ -0,0 +1,187 @@
+/**
+ * \file flowstat.h
+ * \brief Online per-flow TCP metrics prototypes.
+ *
+ *    Captured packets are parsed on the fly and TCP flows are tracked
+ *    in a flow table keyed by their (direction-independent) 5-tuple.
+ *    When the capture ends, one summary line per flow and one line per
+ *    flow and interval are written to a CSV file:
+ *
+ *    flow,id,cli_addr,cli_port,serv_addr,serv_port,first,last,
+ *         syn_synack,synack_ack,{packets,bytes,payload,retrans,
+ *         retrans_bytes,holes} for cli->serv then serv->cli
+ *    interval,id,index,start,payload cli->serv,payload serv->cli
+ *
+ *    Times are in ns. The client is the sender of the SYN, or the
+ *    lowest endpoint if the handshake was not captured. Retransmissions
+ *    are segments below the highest sequence number seen, holes are
+ *    segments above it (losses before the capture point or reordering).
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_FLOWSTAT_H
+#define UDPTUN_FLOWSTAT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pcap.h>
+
+#include "state.h"
+
+/**
+ * \enum capture_output
+ * \brief What captures produce (bitmask).
+ */
+enum capture_output {
+   CAPTURE_PCAP    = 1, /*!< pcap traces */
+   CAPTURE_METRICS = 2, /*!< per-flow metrics */
+   CAPTURE_BOTH    = 3  /*!< both */
+};
+
+/**
+ * \def FLOWSTAT_EXT
+ * \brief Per-flow metrics file extension, replaces .pcap.
+ */
+#define FLOWSTAT_EXT ".flows.csv"
+
+/**
+ * \def FLOWSTAT_MAX_IVL
+ * \brief Maximum number of intervals per flow, later payload is only
+ *        counted in the flow summary.
+ */
+#define FLOWSTAT_MAX_IVL 65536
+
+/**
+ * \struct flow_key
+ * \brief A direction-independent TCP 5-tuple, endpoint a is the lowest.
+ */
+struct flow_key {
+   uint8_t  family;      /*!< AF_INET or AF_INET6 */
+   uint8_t  proto;       /*!< IPPROTO_TCP or IPPROTO_UDP, 0 for others */
+   uint16_t port_a;      /*!< port of endpoint a (host order) */
+   uint16_t port_b;      /*!< port of endpoint b (host order) */
+   uint16_t pad2;
+   uint8_t  addr_a[16];  /*!< address of endpoint a */
+   uint8_t  addr_b[16];  /*!< address of endpoint b */
+};
+
+/**
+ * \struct flow_dir
+ * \brief One direction of a flow.
+ */
+struct flow_dir {
+   uint64_t packets;       /*!< packets */
+   uint64_t bytes;         /*!< IP bytes */
+   uint64_t payload;       /*!< TCP payload bytes */
+   uint64_t retrans_bytes; /*!< retransmitted payload bytes */
+   uint32_t retrans;       /*!< retransmitted segments */
+   uint32_t holes;         /*!< sequence holes */
+   uint32_t next_seq;      /*!< highest sequence number seen */
+   uint8_t  seq_init;      /*!< next_seq is valid */
+};
+
+/**
+ * \struct flow_rec
+ * \brief A tracked flow.
+ */
+struct flow_rec {
+   struct flow_key key;    /*!< the flow, hash table key */
+   uint32_t id;            /*!< flow id */
+   int8_t   cli;           /*!< direction of the SYN (0: a->b), -1 if unknown */
+   uint64_t first;         /*!< first packet time */
+   uint64_t last;          /*!< last packet time */
+   uint64_t syn;           /*!< SYN time */
+   uint64_t synack;        /*!< SYN/ACK time */
+   uint64_t ack;           /*!< handshake ACK time */
+   struct flow_dir dir[2]; /*!< a->b, b->a */
+   uint64_t *ivl[2];       /*!< payload bytes per interval and direction */
+   uint32_t ivl_len;       /*!< number of intervals */
+};
+
+/**
+ * \struct flowstat
+ * \brief A flow metrics engine.
+ */
+struct flowstat {
+   FILE       *fp;         /*!< output file */
+   GHashTable *flows;      /*!< struct flow_key to struct flow_rec */
+   int         linktype;   /*!< link-layer type of packets */
+   uint8_t     nano;       /*!< timestamps are in ns */
+   uint64_t    interval;   /*!< interval length (ns), 0 for none */
+   uint64_t    start;      /*!< first packet time */
+   uint32_t    next_id;    /*!< next flow id */
+};
+
+/**
+ * \fn int parse_capture_output(const char *val)
+ * \brief Parse a capture-output configuration value.
+ *
+ * \param val one of pcap, metrics or both
+ * \return The capture output, or -1 if unknown
+ */
+int parse_capture_output(const char *val);
+
+/**
+ * \fn struct flowstat *flowstat_open(const char *filename, int linktype,
+ *                                    int nano, uint32_t interval)
+ * \brief Create a flow metrics engine.
+ *
+ * \param filename The trace location, .pcap is replaced by FLOWSTAT_EXT,
+ *                 NULL not to write metrics (fs->flows is read by the caller)
+ * \param linktype The link-layer type of packets (DLT_*)
+ * \param nano 1 if timestamps are in ns, 0 in us
+ * \param interval The interval length in ms, 0 for no intervals
+ * \return The engine
+ */
+struct flowstat *flowstat_open(const char *filename, int linktype,
+                               int nano, uint32_t interval);
+
+/**
+ * \fn void flowstat_packet(struct flowstat *fs, const struct pcap_pkthdr *h,
+ *                          const u_char *bytes)
+ * \brief Account a packet. Not thread-safe.
+ *
+ * \param fs The engine
+ * \param h The packet header
+ * \param bytes The packet
+ */
+void flowstat_packet(struct flowstat *fs, const struct pcap_pkthdr *h,
+                     const u_char *bytes);
+
+/**
+ * \fn int flow_l3_offset(int linktype, const u_char *bytes, uint32_t caplen)
+ * \brief Locate the IP header.
+ *
+ * \param linktype The link-layer type (DLT_*)
+ * \param bytes The packet
+ * \param caplen The captured length
+ * \return The offset of the IP header, -1 if not IP
+ */
+int flow_l3_offset(int linktype, const u_char *bytes, uint32_t caplen);
+
+/**
+ * \fn int flow_key_parse(int linktype, const u_char *bytes, uint32_t caplen,
+ *                        struct flow_key *key)
+ * \brief Build the canonical 5-tuple of a packet (ports are 0 but for TCP
+ *        and UDP).
+ *
+ * \param linktype The link-layer type (DLT_*)
+ * \param bytes The packet
+ * \param caplen The captured length
+ * \param key The key to fill
+ * \return The packet direction (0: a->b, 1: b->a), -1 if not IP
+ */
+int flow_key_parse(int linktype, const u_char *bytes, uint32_t caplen,
+                   struct flow_key *key);
+
+/**
+ * \fn void flowstat_close(struct flowstat *fs)
+ * \brief Write the per-flow metrics (if any output) and free the engine.
+ *
+ * \param fs The engine
+ */
+void flowstat_close(struct flowstat *fs);
+
+#endif
@@ -0,0 +1,249 @@
+/**
+ * \file lpm.c
+ * \brief Longest-prefix-match routing.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "lpm.h"
+#include "sock.h"
+#include "debug.h"
+
+/**
+ * \fn static void lpm_insert4(struct lpm *lpm, const struct rtnl_route *r,
+ *                             uint16_t hop)
+ * \brief Insert an IPv4 prefix in the DIR-24-8 table.
+ */
+static void lpm_insert4(struct lpm *lpm, const struct rtnl_route *r,
+                        uint16_t hop);
+
+/**
+ * \fn static void lpm_insert6(struct lpm *lpm, const struct rtnl_route *r,
+ *                             uint16_t hop)
+ * \brief Insert an IPv6 prefix in the trie.
+ */
+static void lpm_insert6(struct lpm *lpm, const struct rtnl_route *r,
+                        uint16_t hop);
+
+/**
+ * \fn static uint32_t lpm_node(struct lpm *lpm)
+ * \brief Allocate an empty IPv6 trie node.
+ *
+ * \return The node index
+ */
+static uint32_t lpm_node(struct lpm *lpm);
+
+void lpm_add(struct tun_state *state, const char *prefix,
+             struct tun_rec *rec) {
+   struct lpm *lpm = state->lpm;
+   struct rtnl_route r;
+   char addr[INET6_ADDRSTRLEN], *slash, *end;
+   int family = strchr(prefix, ':') ? AF_INET6 : AF_INET;
+   int alen = (family == AF_INET6) ? 16 : 4;
+   long plen;
+   int i;
+
+   /* addr/len, host bits cleared */
+   if (!(slash = strchr(prefix, '/')) ||
+       slash - prefix >= INET6_ADDRSTRLEN) {
+      errno=EINVAL;
+      die("destination prefix");
+   }
+   memcpy(addr, prefix, slash - prefix);
+   addr[slash - prefix] = '\0';
+   plen = strtol(slash + 1, &end, 10);
+   memset(&r, 0, sizeof(r));
+   if (*end || end == slash + 1 || plen < 0 || plen > alen * 8 ||
+       inet_pton(family, addr, r.addr) != 1) {
+      errno=EINVAL;
+      die("destination prefix");
+   }
+   r.family = family;
+   r.plen   = plen;
+   for (i = 0; i < alen; i++) {
+      int bits = plen - i * 8;
+      r.addr[i] &= bits >= 8 ? 0xff : bits <= 0 ? 0 :
+                   (0xff << (8 - bits)) & 0xff;
+   }
+
+   if (!lpm && !(lpm = state->lpm = calloc(1, sizeof(struct lpm))))
+      die("calloc");
+   if (lpm->len == LPM_MAX_HOPS) {
+      errno=E2BIG;
+      die("destination prefix");
+   }
+   lpm->routes = realloc(lpm->routes,
+                         (lpm->len + 1) * sizeof(struct rtnl_route));
+   lpm->hops   = realloc(lpm->hops,
+                         (lpm->len + 1) * sizeof(struct tun_rec *));
+   if (!lpm->routes || !lpm->hops)
+      die("realloc");
+
+   /* keep prefixes sorted by length, in file order for equal lengths */
+   for (i = lpm->len; i > 0 && lpm->routes[i - 1].plen > r.plen; i--) {
+      lpm->routes[i] = lpm->routes[i - 1];
+      lpm->hops[i]   = lpm->hops[i - 1];
+   }
+   lpm->routes[i] = r;
+   lpm->hops[i]   = rec;
+   lpm->len++;
+   debug_print("%s routed to %d\n", prefix, rec->sport);
+}
+
+void lpm_build(struct lpm *lpm) {
+   if (!lpm)
+      return;
+   for (int i = 0; i < lpm->len; i++) {
+      if (lpm->routes[i].family == AF_INET6)
+         lpm_insert6(lpm, &lpm->routes[i], i + 1);
+      else
+         lpm_insert4(lpm, &lpm->routes[i], i + 1);
+   }
+   debug_print("lpm: %d prefixes, %u tbl8 groups, %u trie nodes\n",
+               lpm->len, lpm->ntbl8, lpm->nnodes);
+}
+
+void lpm_insert4(struct lpm *lpm, const struct rtnl_route *r, uint16_t hop) {
+   uint32_t addr, start, count, group;
+   uint16_t *entries;
+
+   /* untouched pages of the table are never backed */
+   if (!lpm->tbl24 && !(lpm->tbl24 = calloc(1 << 24, sizeof(uint16_t))))
+      die("calloc");
+
+   memcpy(&addr, r->addr, 4);
+   addr = ntohl(addr);
+   if (r->plen <= 24) {
+      entries = lpm->tbl24;
+      start   = addr >> 8;
+      count   = 1u << (24 - r->plen);
+   } else {
+      uint16_t *e = &lpm->tbl24[addr >> 8];
+
+      /* the group inherits the shorter prefix of its /24 */
+      if (!(*e & LPM_TBL8_FLAG)) {
+         if (lpm->ntbl8 == LPM_TBL8_FLAG) {
+            errno=E2BIG;
+            die("lpm tbl8");
+         }
+         lpm->tbl8 = realloc(lpm->tbl8,
+                             (lpm->ntbl8 + 1) * 256 * sizeof(uint16_t));
+         if (!lpm->tbl8)
+            die("realloc");
+         for (int i = 0; i < 256; i++)
+            lpm->tbl8[lpm->ntbl8 * 256 + i] = *e;
+         *e = LPM_TBL8_FLAG | lpm->ntbl8++;
+      }
+      group   = *e & ~LPM_TBL8_FLAG;
+      entries = lpm->tbl8 + group * 256;
+      start   = addr & 0xff;
+      count   = 1u << (32 - r->plen);
+   }
+   for (uint32_t i = 0; i < count; i++)
+      entries[start + i] = hop;
+}
+
+uint32_t lpm_node(struct lpm *lpm) {
+   lpm->nodes = realloc(lpm->nodes,
+                        (lpm->nnodes + 1) * sizeof(struct lpm_node));
+   if (!lpm->nodes)
+      die("realloc");
+   memset(&lpm->nodes[lpm->nnodes], 0, sizeof(struct lpm_node));
+   return lpm->nnodes++;
+}
+
+void lpm_insert6(struct lpm *lpm, const struct rtnl_route *r, uint16_t hop) {
+   uint32_t node = 0;
+   int last, bits, start, count;
+
+   if (!r->plen) {
+      lpm->hop6 = hop;
+      return;
+   }
+   if (!lpm->nnodes)
+      lpm_node(lpm);
+
+   /* walk to the node of the last prefix byte */
+   last = (r->plen - 1) / 8;
+   for (int i = 0; i < last; i++) {
+      uint32_t child = lpm->nodes[node].child[r->addr[i]];
+      if (!child) {
+         child = lpm_node(lpm);
+         lpm->nodes[node].child[r->addr[i]] = child;
+      }
+      node = child;
+   }
+
+   /* expand the remaining bits */
+   bits  = r->plen - last * 8;
+   start = r->addr[last];
+   count = 1 << (8 - bits);
+   for (int i = 0; i < count; i++)
+      lpm->nodes[node].hop[start + i] = hop;
+}
+
+struct tun_rec *lpm_lookup4(struct lpm *lpm, in_addr_t addr) {
+   uint32_t a;
+   uint16_t e;
+
+   if (!lpm || !lpm->tbl24)
+      return NULL;
+   a = ntohl(addr);
+   e = lpm->tbl24[a >> 8];
+   if (e & LPM_TBL8_FLAG)
+      e = lpm->tbl8[(e & ~LPM_TBL8_FLAG) * 256 + (a & 0xff)];
+   return e ? lpm->hops[e - 1] : NULL;
+}
+
+struct tun_rec *lpm_lookup6(struct lpm *lpm, const void *addr) {
+   const unsigned char *a = addr;
+   uint32_t node = 0;
+   uint16_t best;
+
+   if (!lpm)
+      return NULL;
+   best = lpm->hop6;
+   for (int i = 0; i < 16 && lpm->nnodes; i++) {
+      struct lpm_node *n = &lpm->nodes[node];
+      if (n->hop[a[i]])
+         best = n->hop[a[i]];
+      if (!(node = n->child[a[i]]))
+         break;
+   }
+   return best ? lpm->hops[best - 1] : NULL;
+}
+
+void lpm_routes(struct tun_state *state) {
+#if defined(LINUX_OS)
+   struct lpm *lpm = state->lpm;
+
+   if (lpm && state->tun_if && !state->planetlab &&
+       rtnl_tun_routes(state->tun_if, lpm->routes, lpm->len) < 0)
+      die("route destination prefixes");
+#else
+   (void)state;
+#endif
+}
+
+void lpm_free(struct lpm *lpm) {
+   if (!lpm)
+      return;
+   free(lpm->routes);
+   free(lpm->hops);
+   free(lpm->tbl24);
+   free(lpm->tbl8);
+   free(lpm->nodes);
+   free(lpm);
+}
+
@@ -0,0 +1,129 @@
+/**
+ * \file lpm.h
+ * \brief Longest-prefix-match routing prototypes.
+ *
+ *    Destination file lines may end with prefixes (10.1.0.0/16,
+ *    2001:db8:1::/48, ...) routed to the destination, so that peers
+ *    carry whole subnets. Private addresses are still looked up in the
+ *    exact-match tables first, prefixes are the fallback.
+ *
+ *    IPv4 prefixes are held in a DIR-24-8 table: a 2^24-entry table
+ *    indexed by the first 24 bits, pointing to a hop or to a 256-entry
+ *    group indexed by the last 8 bits, one or two memory accesses per
+ *    lookup. IPv6 prefixes are held in a multibit trie of stride 8,
+ *    one access per prefix byte. Entries are 1 + the hop index, 0 for
+ *    no route.
+ *
+ *    Tables are built once, prefixes are inserted by increasing length
+ *    so that longer prefixes overwrite the entries they cover.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_LPM_H
+#define UDPTUN_LPM_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "state.h"
+#include "rtnl.h"
+
+/**
+ * \def LPM_TBL8_FLAG
+ * \brief tbl24 entry flag of a tbl8 group index.
+ */
+#define LPM_TBL8_FLAG 0x8000
+
+/**
+ * \def LPM_MAX_HOPS
+ * \brief Maximum number of prefixes (15-bit hop indexes).
+ */
+#define LPM_MAX_HOPS 0x7fff
+
+/**
+ * \struct lpm_node
+ * \brief An IPv6 trie node, one prefix byte.
+ */
+struct lpm_node {
+   uint16_t hop[256];   /*!< 1 + hop index, 0 for none */
+   uint32_t child[256]; /*!< child node index, 0 for none */
+};
+
+/**
+ * \struct lpm
+ * \brief The prefix routes of the destination file.
+ */
+struct lpm {
+   struct rtnl_route *routes; /*!< The prefixes, by increasing length */
+   struct tun_rec   **hops;   /*!< The destination of each prefix */
+   int                len;    /*!< The number of prefixes */
+
+   uint16_t          *tbl24;  /*!< IPv4 first-level table, NULL if none */
+   uint16_t          *tbl8;   /*!< IPv4 groups of 256 entries */
+   uint32_t           ntbl8;  /*!< The number of groups */
+
+   struct lpm_node   *nodes;  /*!< IPv6 trie, node 0 is the root */
+   uint32_t           nnodes; /*!< The number of nodes */
+   uint16_t           hop6;   /*!< IPv6 default route (::/0) */
+};
+
+/**
+ * \fn void lpm_add(struct tun_state *state, const char *prefix,
+ *                  struct tun_rec *rec)
+ * \brief Route a prefix to a destination, dies on invalid prefixes.
+ *
+ * \param state The program state, state->lpm is created if needed
+ * \param prefix The prefix (addr/len)
+ * \param rec The destination
+ */
+void lpm_add(struct tun_state *state, const char *prefix,
+             struct tun_rec *rec);
+
+/**
+ * \fn void lpm_build(struct lpm *lpm)
+ * \brief Build the lookup tables once all prefixes are added.
+ *
+ * \param lpm The prefix routes
+ */
+void lpm_build(struct lpm *lpm);
+
+/**
+ * \fn struct tun_rec *lpm_lookup4(struct lpm *lpm, in_addr_t addr)
+ * \brief Find the destination of the longest IPv4 prefix of an address.
+ *
+ * \param lpm The prefix routes, may be NULL
+ * \param addr The address in network byte order
+ * \return The destination, NULL if no prefix matches
+ */
+struct tun_rec *lpm_lookup4(struct lpm *lpm, in_addr_t addr);
+
+/**
+ * \fn struct tun_rec *lpm_lookup6(struct lpm *lpm, const void *addr)
+ * \brief Find the destination of the longest IPv6 prefix of an address.
+ *
+ * \param lpm The prefix routes, may be NULL
+ * \param addr The address (16B)
+ * \return The destination, NULL if no prefix matches
+ */
+struct tun_rec *lpm_lookup6(struct lpm *lpm, const void *addr);
+
+/**
+ * \fn void lpm_routes(struct tun_state *state)
+ * \brief Route the prefixes through the tun interface.
+ *
+ * \param state The program state
+ */
+void lpm_routes(struct tun_state *state);
+
+/**
+ * \fn void lpm_free(struct lpm *lpm)
+ * \brief Free the prefix routes, not their destinations.
+ *
+ * \param lpm The prefix routes, may be NULL
+ */
+void lpm_free(struct lpm *lpm);
+
+#endif
+
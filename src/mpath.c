@@ -0,0 +1,276 @@
+/**
+ * \file mpath.c
+ * \brief Multipath striping.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "mpath.h"
+#include "udptun.h"
+#include "sock.h"
+#include "debug.h"
+
+/**
+ * \var static struct mpath **paths
+ * \brief The destinations with several paths, for statistics.
+ */
+static struct mpath **paths;
+
+/**
+ * \var static int paths_len
+ * \brief The number of destinations in paths.
+ */
+static int paths_len;
+
+/**
+ * \var static char *filename
+ * \brief The statistics file location, NULL until a path is built.
+ */
+static char *filename;
+
+/**
+ * \fn static void mpath_init_aux(gpointer key, gpointer value,
+ *                                gpointer data)
+ * \brief Build the paths of a destination (see mpath_init).
+ */
+static void mpath_init_aux(gpointer key, gpointer value, gpointer data);
+
+/**
+ * \fn static void mpath_write()
+ * \brief Write the path statistics, registered at exit.
+ */
+static void mpath_write();
+
+/**
+ * \struct mpath_ctx
+ * \brief The mpath_init_aux context.
+ */
+struct mpath_ctx {
+   int        family; /*!< AF_INET or AF_INET6 */
+   const int *fds;    /*!< The local sockets */
+   int        nfds;   /*!< The number of local sockets */
+};
+
+struct mpath *mpath_parse(int family, const char *list, int port) {
+   struct mpath *mp;
+   char *save, *tok, *copy;
+
+   if (!strchr(list, ','))
+      return NULL;
+
+   mp = calloc(1, sizeof(struct mpath));
+   if (!mp || !(copy = strdup(list)))
+      die("calloc");
+   for (tok = strtok_r(copy, ",", &save); tok;
+        tok = strtok_r(NULL, ",", &save)) {
+      struct sockaddr_storage *ss = &mp->remote[mp->nremote];
+
+      if (mp->nremote == MPATH_MAX) {
+         errno=E2BIG;
+         die("destination addresses");
+      }
+      if (family == AF_INET6) {
+         struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+         sin6->sin6_family = AF_INET6;
+         sin6->sin6_port   = htons(port);
+         if (inet_pton(AF_INET6, tok, &sin6->sin6_addr) != 1)
+            die("inet_pton");
+      } else {
+         struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+         sin->sin_family = AF_INET;
+         sin->sin_port   = htons(port);
+         if (inet_pton(AF_INET, tok, &sin->sin_addr) != 1)
+            die("inet_pton");
+      }
+      mp->nremote++;
+   }
+   free(copy);
+   return mp;
+}
+
+int mpath_socks(struct tun_state *state, int family, int fd_net, int *fds) {
+   struct sockaddr_storage ss;
+   socklen_t sslen = sizeof(ss);
+   char **addrs = (family == AF_INET6) ? state->path_addr6
+                                       : state->path_addr4;
+   int len      = (family == AF_INET6) ? state->path_len6
+                                       : state->path_len4;
+   int port, n = 0;
+
+   fds[n++] = fd_net;
+   if (!len)
+      return n;
+
+   if (getsockname(fd_net, (struct sockaddr *)&ss, &sslen) < 0)
+      die("getsockname");
+   port = ntohs(((struct sockaddr_in *)&ss)->sin_port);
+   for (int i = 0; i < len && n < MPATH_MAX; i++) {
+      if (family == AF_INET6)
+         fds[n++] = udp_sock6(port, 1, addrs[i], 0);
+      else
+         fds[n++] = udp_sock4(port, 1, addrs[i], 0);
+   }
+   return n;
+}
+
+void mpath_init(struct tun_state *state, GHashTable *table, int family,
+                const int *fds, int nfds) {
+   struct mpath_ctx ctx = { family, fds, nfds };
+
+   if (!table)
+      return;
+   g_hash_table_foreach(table, mpath_init_aux, &ctx);
+
+   if (paths_len && !filename) {
+      filename = xmalloc(STR_SIZE);
+      snprintf(filename, STR_SIZE, "%s%s%s%s.csv", state->out_dir, MPATH_FILE,
+               state->args->run_id ? "." : "",
+               state->args->run_id ? state->args->run_id : "");
+      atexit(mpath_write);
+   }
+}
+
+void mpath_init_aux(gpointer UNUSED(key), gpointer value, gpointer data) {
+   struct mpath_ctx *ctx = data;
+   struct tun_rec *rec   = value;
+   struct mpath **mpp    = (ctx->family == AF_INET6) ? &rec->mp6 : &rec->mp4;
+   struct mpath *mp      = *mpp;
+   socklen_t salen       = (ctx->family == AF_INET6) ?
+                             sizeof(struct sockaddr_in6) :
+                             sizeof(struct sockaddr_in);
+
+   if (!mp && ctx->nfds < 2)
+      return;
+   if (!mp) {
+      /* a single remote address, the destination address */
+      if (!(mp = *mpp = calloc(1, sizeof(struct mpath))))
+         die("calloc");
+      memcpy(&mp->remote[0], (ctx->family == AF_INET6) ? rec->sa6 : rec->sa4,
+             salen);
+      mp->nremote = 1;
+   }
+
+   mp->sport = rec->sport;
+   mp->len   = max(ctx->nfds, mp->nremote);
+   for (int i = 0; i < mp->len; i++) {
+      struct mpath_path *p = &mp->path[i];
+      p->fd    = ctx->fds[i % ctx->nfds];
+      p->salen = salen;
+      memcpy(&p->sa, &mp->remote[i % mp->nremote], salen);
+   }
+   debug_print("destination %d: %d paths\n", rec->sport, mp->len);
+
+   paths = realloc(paths, (paths_len + 1) * sizeof(struct mpath *));
+   if (!paths)
+      die("realloc");
+   paths[paths_len++] = mp;
+}
+
+uint32_t mpath_hash(const char *pkt, int len) {
+   const unsigned char *ip = (const unsigned char *)pkt;
+   uint32_t sum = 0, w;
+   int off = 0, proto = 0, ports = 0;
+   uint16_t p[2];
+
+   if (len >= 20 && (ip[0] >> 4) == 4) {
+      off   = (ip[0] & 0x0f) * 4;
+      proto = ip[9];
+      ports = !(ntohs(*(uint16_t *)(ip + 6)) & 0x1fff);
+      for (int i = 12; i < 20; i += 4) {
+         memcpy(&w, ip + i, 4);
+         sum += ntohl(w);
+      }
+   } else if (len >= 40 && (ip[0] >> 4) == 6) {
+      off   = 40;
+      proto = ip[6];
+      ports = 1;
+      for (int i = 8; i < 40; i += 4) {
+         memcpy(&w, ip + i, 4);
+         sum += ntohl(w);
+      }
+   }
+   if (ports && (proto == IPPROTO_TCP || proto == IPPROTO_UDP) &&
+       len >= off + 4) {
+      memcpy(p, ip + off, 4);
+      sum += ntohs(p[0]) + ntohs(p[1]);
+   }
+   sum += proto;
+
+   /* spread the sum over all bits (murmur3 finalizer) */
+   sum ^= sum >> 16;
+   sum *= 0x85ebca6b;
+   sum ^= sum >> 13;
+   sum *= 0xc2b2ae35;
+   sum ^= sum >> 16;
+   return sum;
+}
+
+struct mpath_path *mpath_pick(struct mpath *mp, const char *pkt, int len) {
+   if (!mp || mp->len < 2)
+      return NULL;
+   return &mp->path[mpath_hash(pkt, len) % mp->len];
+}
+
+int mpath_send(struct mpath_path *path, const char *buf, int len) {
+   int sent = sendto(path->fd, buf, len, 0,
+                     (struct sockaddr *)&path->sa, path->salen);
+
+   if (sent < 0) {
+      path->tx_errors++;
+   } else {
+      path->tx_pkts++;
+      path->tx_bytes += sent;
+   }
+   return sent;
+}
+
+void mpath_write() {
+   char local[INET6_ADDRSTRLEN], remote[INET6_ADDRSTRLEN];
+   struct sockaddr_storage ss;
+   socklen_t sslen;
+   FILE *fp;
+
+   if (!(fp = fopen(filename, "w"))) {
+      debug_print("%s: %s\n", filename, strerror(errno));
+      return;
+   }
+   fprintf(fp, "#sport,path,local,remote,tx_pkts,tx_bytes,tx_errors\n");
+   for (int i = 0; i < paths_len; i++) {
+      struct mpath *mp = paths[i];
+
+      for (int j = 0; j < mp->len; j++) {
+         struct mpath_path *p = &mp->path[j];
+         const void *raddr = (p->sa.ss_family == AF_INET6) ?
+               (void *)&((struct sockaddr_in6 *)&p->sa)->sin6_addr :
+               (void *)&((struct sockaddr_in *)&p->sa)->sin_addr;
+
+         sslen = sizeof(ss);
+         if (getsockname(p->fd, (struct sockaddr *)&ss, &sslen) < 0 ||
+             !inet_ntop(ss.ss_family, (ss.ss_family == AF_INET6) ?
+                   (void *)&((struct sockaddr_in6 *)&ss)->sin6_addr :
+                   (void *)&((struct sockaddr_in *)&ss)->sin_addr,
+                   local, sizeof(local)))
+            strcpy(local, "-");
+         if (!inet_ntop(p->sa.ss_family, raddr, remote, sizeof(remote)))
+            strcpy(remote, "-");
+
+         fprintf(fp, "%d,%d,%s,%s,%llu,%llu,%llu\n", mp->sport, j, local,
+                 remote, (unsigned long long)p->tx_pkts,
+                 (unsigned long long)p->tx_bytes,
+                 (unsigned long long)p->tx_errors);
+      }
+   }
+   fclose(fp);
+}
+
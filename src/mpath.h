@@ -0,0 +1,143 @@
+/**
+ * \file mpath.h
+ * \brief Multipath striping prototypes.
+ *
+ *    A client UDP tunnel may use several local public addresses
+ *    (public-address plus path-address4/6 cfg lines) and several remote
+ *    public addresses per destination (a comma-separated list in the
+ *    destination file). The paths of a destination pair them up, path i
+ *    going from local address i % locals to remote address i % remotes,
+ *    and inner flows are spread across paths by a hash of their
+ *    addresses and ports, so that a flow is never reordered across
+ *    paths. Servers listen on their path addresses too and answer
+ *    through their public address.
+ *
+ *    The packets, bytes and send errors of each path are written to
+ *    out_dir/paths[.run-id].csv at exit.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_MPATH_H
+#define UDPTUN_MPATH_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "state.h"
+
+/**
+ * \def MPATH_MAX
+ * \brief Maximum number of local addresses, remote addresses and paths.
+ */
+#define MPATH_MAX 8
+
+/**
+ * \def MPATH_FILE
+ * \brief Path statistics file prefix.
+ */
+#define MPATH_FILE "paths"
+
+/**
+ * \struct mpath_path
+ * \brief A local socket to remote address pair.
+ */
+struct mpath_path {
+   int       fd;           /*!< The local socket */
+   socklen_t salen;        /*!< The remote address length */
+   struct sockaddr_storage sa; /*!< The remote address */
+   uint64_t  tx_pkts;      /*!< sent packets */
+   uint64_t  tx_bytes;     /*!< sent bytes */
+   uint64_t  tx_errors;    /*!< failed sends */
+};
+
+/**
+ * \struct mpath
+ * \brief The paths of one destination and family.
+ */
+struct mpath {
+   int      sport;                           /*!< The destination port */
+   int      nremote;                         /*!< The number of remotes */
+   struct sockaddr_storage remote[MPATH_MAX];/*!< The remote addresses */
+   int      len;                             /*!< The number of paths */
+   struct mpath_path path[MPATH_MAX];        /*!< The paths */
+};
+
+/**
+ * \fn struct mpath *mpath_parse(int family, const char *list, int port)
+ * \brief Parse the remote addresses of a destination file field.
+ *
+ * \param family AF_INET or AF_INET6
+ * \param list The comma-separated addresses
+ * \param port The remote port
+ * \return The remote addresses (malloc), NULL for a single address
+ */
+struct mpath *mpath_parse(int family, const char *list, int port);
+
+/**
+ * \fn int mpath_socks(struct tun_state *state, int family, int fd_net,
+ *                     int *fds)
+ * \brief Open a tunnel socket per path-address of a family.
+ *
+ * \param state The program state
+ * \param family AF_INET or AF_INET6
+ * \param fd_net The tunnel socket, its port is reused
+ * \param fds Filled with fd_net then the path sockets (MPATH_MAX)
+ * \return The number of local sockets, fd_net included
+ */
+int mpath_socks(struct tun_state *state, int family, int fd_net, int *fds);
+
+/**
+ * \fn void mpath_init(struct tun_state *state, GHashTable *table,
+ *                     int family, const int *fds, int nfds)
+ * \brief Build the paths of the destinations of a table.
+ *
+ * \param state The program state
+ * \param table The destinations
+ * \param family AF_INET or AF_INET6
+ * \param fds The local sockets (mpath_socks)
+ * \param nfds The number of local sockets
+ */
+void mpath_init(struct tun_state *state, GHashTable *table, int family,
+                const int *fds, int nfds);
+
+/**
+ * \fn uint32_t mpath_hash(const char *pkt, int len)
+ * \brief Hash the addresses, protocol and ports of an IP packet.
+ *
+ *    Fields are summed, as the capture sampler does, so that both
+ *    directions of a flow hash alike; non-TCP/UDP packets and
+ *    fragments hash on their addresses only.
+ *
+ * \param pkt The IP packet
+ * \param len Its length
+ * \return The hash
+ */
+uint32_t mpath_hash(const char *pkt, int len);
+
+/**
+ * \fn struct mpath_path *mpath_pick(struct mpath *mp, const char *pkt,
+ *                                   int len)
+ * \brief Pick the path of an inner packet.
+ *
+ * \param mp The destination paths, may be NULL
+ * \param pkt The inner IP packet
+ * \param len Its length
+ * \return The path, NULL if the destination has a single path
+ */
+struct mpath_path *mpath_pick(struct mpath *mp, const char *pkt, int len);
+
+/**
+ * \fn int mpath_send(struct mpath_path *path, const char *buf, int len)
+ * \brief Send a datagram on a path and count it.
+ *
+ * \param path The path
+ * \param buf The datagram
+ * \param len Its length
+ * \return The number of bytes sent, -1 on error
+ */
+int mpath_send(struct mpath_path *path, const char *buf, int len);
+
+#endif
+
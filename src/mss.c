@@ -0,0 +1,168 @@
+/**
+ * \file mss.c
+ * \brief TCP MSS clamping.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <net/if.h>
+
+#include "mss.h"
+#include "udptun.h"
+#include "sock.h"
+#include "debug.h"
+
+/**
+ * \fn static uint32_t mss_if_mtu(const char *dev)
+ * \brief Get the MTU of an interface.
+ *
+ * \param dev The interface name, may be NULL
+ * \return The MTU, MSS_MTU_DEFAULT if unknown
+ */
+static uint32_t mss_if_mtu(const char *dev);
+
+/**
+ * \fn static uint16_t mss_of(struct tun_state *state, uint32_t mtu,
+ *                            int inner6)
+ * \brief Compute the clamp of an inner family.
+ *
+ * \param state The program state
+ * \param mtu The path MTU
+ * \param inner6 1 for IPv6 inner packets, 0 for IPv4
+ * \return The clamp
+ */
+static uint16_t mss_of(struct tun_state *state, uint32_t mtu, int inner6);
+
+/**
+ * \fn static void mss_csum(unsigned char *csum, uint16_t old, uint16_t new)
+ * \brief Update a checksum for a 16-bit word change (RFC 1624, eqn. 3).
+ *
+ * \param csum The checksum field
+ * \param old The old word
+ * \param new The new word
+ */
+static void mss_csum(unsigned char *csum, uint16_t old, uint16_t new);
+
+void mss_init(struct tun_state *state) {
+   mss_set_mtu(state, state->path_mtu ? state->path_mtu
+                                      : mss_if_mtu(state->default_if));
+}
+
+uint32_t mss_if_mtu(const char *dev) {
+   struct ifreq ifr;
+   int s, mtu = 0;
+
+   if (!dev)
+      return MSS_MTU_DEFAULT;
+   if ((s = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+      die("socket");
+   memset(&ifr, 0, sizeof(ifr));
+   strncpy(ifr.ifr_name, dev, IFNAMSIZ - 1);
+   if (ioctl(s, SIOCGIFMTU, &ifr) < 0)
+      debug_print("%s mtu: %s\n", dev, strerror(errno));
+   else
+      mtu = ifr.ifr_mtu;
+   close(s);
+   return mtu > 0 ? mtu : MSS_MTU_DEFAULT;
+}
+
+void mss_set_mtu(struct tun_state *state, uint32_t mtu) {
+   state->path_mtu = mtu;
+   state->mss4     = mss_of(state, mtu, 0);
+   state->mss6     = mss_of(state, mtu, 1);
+   debug_print("path mtu %u: mss %u/%u\n", mtu, state->mss4, state->mss6);
+}
+
+uint16_t mss_of(struct tun_state *state, uint32_t mtu, int inner6) {
+   int outer6 = state->dual_stack ? inner6 : state->ipv6;
+   int inner  = (inner6 ? 40 : 20) + 20;
+   int mss    = mtu - (outer6 ? 40 : 20) - (state->udp ? 8 : 0) -
+                state->raw_header_size - inner;
+
+   /* inner packets never exceed the tun MTU */
+   if (state->tun_mtu)
+      mss = min(mss, (int)state->tun_mtu - inner);
+   return max(mss, MSS_MIN);
+}
+
+void mss_csum(unsigned char *csum, uint16_t old, uint16_t new) {
+   uint32_t sum = (uint16_t)~(csum[0] << 8 | csum[1]);
+
+   sum += (uint16_t)~old;
+   sum += new;
+   sum  = (sum & 0xffff) + (sum >> 16);
+   sum  = (sum & 0xffff) + (sum >> 16);
+   sum  = ~sum & 0xffff;
+   csum[0] = sum >> 8;
+   csum[1] = sum & 0xff;
+}
+
+void mss_clamp(struct tun_state *state, char *pkt, int len) {
+   unsigned char *ip = (unsigned char *)pkt, *tcp, *opt, *end;
+   uint16_t mss, old;
+   int off;
+
+   if (!state->mss_clamp || len < 20)
+      return;
+
+   /* TCP first fragments and unfragmented segments */
+   if ((ip[0] >> 4) == 4) {
+      if (ip[9] != IPPROTO_TCP || (ip[6] & 0x1f) || ip[7])
+         return;
+      off = (ip[0] & 0x0f) * 4;
+      mss = state->mss4;
+   } else if ((ip[0] >> 4) == 6) {
+      if (ip[6] != IPPROTO_TCP)
+         return;
+      off = 40;
+      mss = state->mss6;
+   } else
+      return;
+
+   tcp = ip + off;
+   if (len < off + 20 || !(tcp[13] & 0x02))
+      return;
+
+   /* walk the options to the MSS option */
+   end = tcp + (tcp[12] >> 4) * 4;
+   if (end > ip + len)
+      end = ip + len;
+   for (opt = tcp + 20; opt < end; ) {
+      if (*opt == 0)
+         break;
+      if (*opt == 1) {
+         opt++;
+         continue;
+      }
+      if (opt + 1 >= end || opt[1] < 2 || opt + opt[1] > end)
+         break;
+      if (*opt == 2 && opt[1] == 4) {
+         old = opt[2] << 8 | opt[3];
+         if (old <= mss)
+            return;
+         opt[2] = mss >> 8;
+         opt[3] = mss & 0xff;
+
+         /* an odd offset swaps the bytes of the word in the sum */
+         if ((opt + 2 - tcp) & 1)
+            mss_csum(tcp + 16, old >> 8 | (old & 0xff) << 8,
+                     mss >> 8 | (mss & 0xff) << 8);
+         else
+            mss_csum(tcp + 16, old, mss);
+         debug_print("mss clamped %u -> %u\n", old, mss);
+         return;
+      }
+      opt += opt[1];
+   }
+}
+
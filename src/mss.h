@@ -0,0 +1,67 @@
+/**
+ * \file mss.h
+ * \brief TCP MSS clamping prototypes.
+ *
+ *    The MSS option of TCP SYN and SYN-ACK segments crossing the tun
+ *    interface, in both directions, is lowered so that full-sized
+ *    segments of any tunneled TCP flow fit in the path MTU once
+ *    encapsulated. The clamp of each inner family is the path MTU
+ *    minus the outer IP header, the UDP header (UDP tunnels), the
+ *    raw header, the inner IP header and the TCP header, bounded by
+ *    the tun MTU. The TCP checksum is updated incrementally (RFC 1624).
+ *
+ *    IPv6 segments behind extension headers are left untouched.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_MSS_H
+#define UDPTUN_MSS_H
+
+#include <stdint.h>
+
+#include "state.h"
+
+/**
+ * \def MSS_MTU_DEFAULT
+ * \brief Path MTU used when the default interface MTU is unknown.
+ */
+#define MSS_MTU_DEFAULT 1500
+
+/**
+ * \def MSS_MIN
+ * \brief Lowest clamp (the Linux TCP_MIN_MSS).
+ */
+#define MSS_MIN 88
+
+/**
+ * \fn void mss_init(struct tun_state *state)
+ * \brief Set the path MTU to the path-mtu cfg value, or to the default
+ *        interface MTU, and compute the clamps.
+ *
+ * \param state The program state
+ */
+void mss_init(struct tun_state *state);
+
+/**
+ * \fn void mss_set_mtu(struct tun_state *state, uint32_t mtu)
+ * \brief Recompute the clamps for a new path MTU.
+ *
+ * \param state The program state
+ * \param mtu The path MTU
+ */
+void mss_set_mtu(struct tun_state *state, uint32_t mtu);
+
+/**
+ * \fn void mss_clamp(struct tun_state *state, char *pkt, int len)
+ * \brief Lower the MSS option of a TCP SYN in place.
+ *
+ * \param state The program state
+ * \param pkt The inner IP packet
+ * \param len Its length
+ */
+void mss_clamp(struct tun_state *state, char *pkt, int len);
+
+#endif
+
@@ -38,6 +38,13 @@
 #include "thread.h"
 #include "tunalloc.h"
 #include "udptun.h"
+#include "sink.h"
+#include "tcpinfo.h"
+#include "xpcap.h"
+#include "control.h"
+#include "ready.h"
+#include "lpm.h"
+#include "pmtu.h"
 
 /** 
  * \struct cli_thread_parallel_args
@@ -49,7 +56,7 @@ struct cli_thread_parallel_args {
    char *addr;
    char *filename;
    int port;
-   int set_maxseg;
+   int tun;          /*!< tunneled flow */
 };
 
 /**
@@ -164,6 +171,8 @@ static void *forked_cli6(void *arg);
 
 void tun(struct tun_state *state, int *fd_tun) {
    struct arguments *args = state->args;
+   struct tun_opts opts = { state->tun_mtu, state->tun_txqlen, 
+                            state->tun_persist, state->tun_pool };
    char *new_if = NULL;
 #if defined(LINUX_OS)
    if (args->planetlab)
@@ -175,11 +184,11 @@ void tun(struct tun_state *state, int *fd_tun) {
    if (args->ipv6 || args->dual_stack)
       new_if = create_tun46(state->private_addr4, state->private_mask4, 
                             state->private_addr6, state->private_mask6, 
-                            state->tun_if, fd_tun); 
+                            &opts, state->tun_if, fd_tun); 
    else
       new_if = create_tun4(state->private_addr4, 
                            state->private_mask4, 
-                           state->tun_if, fd_tun); 
+                           &opts, state->tun_if, fd_tun); 
 
    /* swap wished name with actual name */
    if (new_if) {
@@ -188,13 +197,19 @@ void tun(struct tun_state *state, int *fd_tun) {
       state->tun_if = new_if;
    }
    if (*fd_tun) set_fd(*fd_tun);
+
+   /* destination prefixes go through the tunnel */
+   lpm_routes(state);
+
+   /* fit the tun MTU to the path */
+   pmtu_tun(state, *fd_tun);
 }
 
 void *forked_cli4(void *arg) {
    struct cli_thread_parallel_args *args = (struct cli_thread_parallel_args*) arg;
    tcp_cli(args->state, args->sa, 
            args->addr, args->port,
-           args->set_maxseg, args->filename, AF_INET);
+           args->tun, args->filename, AF_INET);
    return 0;
 }
 
@@ -202,7 +217,7 @@ void *forked_cli6(void *arg) {
    struct cli_thread_parallel_args *args = (struct cli_thread_parallel_args*) arg;
    tcp_cli(args->state, args->sa, 
            args->addr, args->port,
-           args->set_maxseg, args->filename, AF_INET6);
+           args->tun, args->filename, AF_INET6);
    return 0;
 }
 
@@ -213,7 +228,7 @@ void cli_thread_parallel4(struct tun_state *state, int index) {
                          state->cli_private[index]->sa4, 
                          state->private_addr4, 
                          state->cli_file_tun4,
-                         state->port, state->max_segment_size
+                         state->port, 1
                       };
    struct cli_thread_parallel_args args_notun = {state, 
                          state->cli_public[index]->sa4, 
@@ -223,12 +238,14 @@ void cli_thread_parallel4(struct tun_state *state, int index) {
                       };
 
    /* launch threads */
+   capture_window_open(state, index, "both");
    pthread_t tid_tun   = xthread_create(forked_cli4, (void*)&args_tun, 0);
    pthread_t tid_notun = xthread_create(forked_cli4, (void*)&args_notun, 0);
    
    /* join threads */
    pthread_join(tid_tun, NULL);
    pthread_join(tid_notun, NULL);
+   capture_window_close(state);
 }
 
 void cli_thread_parallel6(struct tun_state *state, int index) {
@@ -238,7 +255,7 @@ void cli_thread_parallel6(struct tun_state *state, int index) {
                          state->cli_private[index]->sa6, 
                          state->private_addr6, 
                          state->cli_file_tun6,
-                         state->port, state->max_segment_size
+                         state->port, 1
                       };
    struct cli_thread_parallel_args args_notun = {state, 
                          state->cli_public[index]->sa6, 
@@ -248,12 +265,14 @@ void cli_thread_parallel6(struct tun_state *state, int index) {
                       };
 
    /* launch threads */
+   capture_window_open(state, index, "both");
    pthread_t tid_tun   = xthread_create(forked_cli6, (void*)&args_tun, 0);
    pthread_t tid_notun = xthread_create(forked_cli6, (void*)&args_notun, 0);
    
    /* join threads */
    pthread_join(tid_tun, NULL);
    pthread_join(tid_notun, NULL);
+   capture_window_close(state);
 }
 
 void cli_thread_parallel46(struct tun_state *state, int index) {
@@ -261,7 +280,7 @@ void cli_thread_parallel46(struct tun_state *state, int index) {
                          state->cli_private[index]->sa4, 
                          state->private_addr4, 
                          state->cli_file_tun4,
-                         state->port, state->max_segment_size,
+                         state->port, 1,
                       };
    struct cli_thread_parallel_args args_notun4 = {state, 
                          state->cli_public[index]->sa4, 
@@ -273,7 +292,7 @@ void cli_thread_parallel46(struct tun_state *state, int index) {
                          state->cli_private[index]->sa6, 
                          state->private_addr6, 
                          state->cli_file_tun6,
-                         state->port, state->max_segment_size
+                         state->port, 1
                       };
    struct cli_thread_parallel_args args_notun6 = {state, 
                          state->cli_public[index]->sa6, 
@@ -283,69 +302,87 @@ void cli_thread_parallel46(struct tun_state *state, int index) {
                       };
 
    /* launch IPv4 cli */
+   capture_window_open(state, index, "notun");
    pthread_t tid4 = xthread_create(forked_cli4, (void*)&args_notun4, 0);
    pthread_t tid6 = xthread_create(forked_cli6, (void*)&args_notun6, 0);
    
    /* join threads */
    pthread_join(tid4, NULL);
    pthread_join(tid6, NULL);
+   capture_window_close(state);
 
    /* launch IPv6 cli */
+   capture_window_open(state, index, "tun");
    tid4 = xthread_create(forked_cli4, (void*)&args_tun4, 0);
    tid6 = xthread_create(forked_cli6, (void*)&args_tun6, 0);
    
    /* join threads */
    pthread_join(tid4, NULL);
    pthread_join(tid6, NULL);
+   capture_window_close(state);
 }
 
 void cli_thread_tun4(struct tun_state *state, int index) {
    /* run tunneled flow */
+   capture_window_open(state, index, "tun");
    tcp_cli(state, state->cli_private[index]->sa4,
-           state->private_addr4, state->port, state->max_segment_size, 
+           state->private_addr4, state->port, 1, 
             state->cli_file_tun4, AF_INET);
+   capture_window_close(state);
    /* run notun flow */
+   capture_window_open(state, index, "notun");
    tcp_cli(state, state->cli_public[index]->sa4, 
            NULL, state->port, 0, state->cli_file_notun4, AF_INET);
+   capture_window_close(state);
 }
 
 void cli_thread_tun6(struct tun_state *state, int index) {
    /* run tunneled flow */
+   capture_window_open(state, index, "tun");
    tcp_cli(state, state->cli_private[index]->sa6,
-           state->private_addr6, state->port, state->max_segment_size, 
+           state->private_addr6, state->port, 1, 
            state->cli_file_tun6, AF_INET6);
+   capture_window_close(state);
    /* run notun flow */
+   capture_window_open(state, index, "notun");
    tcp_cli(state, state->cli_public[index]->sa6, 
            NULL, state->port, 0, state->cli_file_notun6, AF_INET6);
+   capture_window_close(state);
 }
 
 void cli_thread_notun4(struct tun_state *state, int index) {
    /* run notun flow */
+   capture_window_open(state, index, "notun");
    tcp_cli(state, state->cli_public[index]->sa4, 
            NULL, state->port, 0, state->cli_file_notun4, AF_INET);
+   capture_window_close(state);
    /* run tunneled flow */
+   capture_window_open(state, index, "tun");
    tcp_cli(state, state->cli_private[index]->sa4, 
-           state->private_addr4, state->port, state->max_segment_size, 
+           state->private_addr4, state->port, 1, 
            state->cli_file_tun4, AF_INET);
+   capture_window_close(state);
 }
 
 void cli_thread_notun6(struct tun_state *state, int index) {
    /* run notun flow */
+   capture_window_open(state, index, "notun");
    tcp_cli(state, state->cli_public[index]->sa6, 
            NULL, state->port, 0, state->cli_file_notun6, AF_INET6);
+   capture_window_close(state);
    /* run tunneled flow */
+   capture_window_open(state, index, "tun");
    tcp_cli(state, state->cli_private[index]->sa6, 
-           state->private_addr6, state->port, state->max_segment_size, 
+           state->private_addr6, state->port, 1, 
            state->cli_file_tun6, AF_INET6);
+   capture_window_close(state);
 }
 
-void *cli_thread(void *st) {
-   struct tun_state *state = st;
-   struct arguments *args = state->args;
-
+void cli_run(struct tun_state *state, int cli_mode, 
+             const uint8_t *dests, int len) {
    /* pick functions */
    void (*cli_thread)(struct tun_state*, int);
-   switch (args->cli_mode) {
+   switch (cli_mode) {
       case PARALLEL_MODE:
          if (state->dual_stack)
             cli_thread = &cli_thread_parallel46;
@@ -374,14 +411,28 @@ void *cli_thread(void *st) {
          errno=EINVAL;
          die("cli_mode");
    }  
-      
 
-   /* initial sleep */
-   sleep(state->initial_sleep);
+   /* Client loop, a destination starts once its servers listen */
+   for (int i=0; i<len; i++) {
+      if (ready_probing(state))
+         ready_wait(state, dests ? dests[i] : i);
+      (*cli_thread)(state, dests ? dests[i] : i);
+   }
+}
+
+void *cli_thread(void *st) {
+   struct tun_state *state = st;
+   struct arguments *args = state->args;
+
+   /* initial sleep, unless destinations are probed */
+   if (!ready_probing(state))
+      sleep(state->initial_sleep);
 
-   /* Client loop */
-   for (int i=0; i<state->sa_len; i++) 
-      (*cli_thread)(state, i);
+   /* run requests until told to quit, or all destinations once */
+   if (args->control_sock)
+      control_loop(state);
+   else
+      cli_run(state, args->cli_mode, NULL, state->sa_len);
 
    /* Shutdown client, not peer */
    if (args->mode == CLI_MODE)
@@ -393,6 +444,7 @@ void *cli_thread(void *st) {
 void *serv_thread(void *st) {
    struct tun_state *state = st;
    serv_file = state->serv_file;
+   ready_serv_init(state->dual_stack ? 2 : 1);
 
    /* fork servers */
    if (state->dual_stack) {
@@ -448,7 +500,7 @@ int tcp_serv(char *addr, int port, struct tun_state *state,
    set_fd(s);
 
    /* Set Modified MSS for tunneled TCP */
-   if (set_maxseg) {
+   if (set_maxseg && state->max_segment_size) {
       int mss = state->max_segment_size;
       if (setsockopt (s, IPPROTO_TCP, TCP_MAXSEG, &mss, sizeof(mss)) < 0)
          die("setsockopt maxseg");
@@ -478,6 +530,8 @@ int tcp_serv(char *addr, int port, struct tun_state *state,
    }
    if (listen(s, state->backlog_size) < 0) 
       die("listen");
+   ready_listening(addr == state->private_addr4 || 
+                   addr == state->private_addr6);
 
    /* listen loop */
    debug_print("TCP server listening at %s:%d ...\n", addr ? addr : "*", port);
@@ -517,6 +571,8 @@ void *serv_worker_thread(void *socket_desc) {
    char buf[BUFF_SIZE];
    memset(buf, 0, BUFF_SIZE);
 
+   tcpinfo_register(s, 1);
+
    /* Send loop */
    debug_print("sending data ...\n");
    while((bsize = fread(buf, sizeof(char), BUFF_SIZE, fp)) > 0) {
@@ -535,10 +591,12 @@ void *serv_worker_thread(void *socket_desc) {
       goto err;
    }
 
+   tcpinfo_unregister(s);
    fclose(fp);close(s);
    debug_print("socket %d successfuly closed.\n", s);
    return 0;
 err:
+   tcpinfo_unregister(s);
    fclose(fp);close(s);
    debug_print("socket %d closed on error: %s\n", s, strerror(err));
    return 0;
@@ -547,8 +605,8 @@ err:
 int tcp_cli(struct tun_state *st, struct sockaddr *sa, 
             char *addr, int port, int tun, char* filename, sa_family_t sfam) {
    struct tun_state *state = st;
-   int s, err = 0; 
-   FILE *fp = NULL;
+   int s, err = 0, written = 0; 
+   struct goodput *gp = NULL;
    /* TCP socket */
    if ((s=socket(sfam, SOCK_STREAM, IPPROTO_TCP)) == -1) 
       die("socket");
@@ -565,7 +623,7 @@ int tcp_cli(struct tun_state *st, struct sockaddr *sa,
       debug_print("setsockopt sndtimeo");
 
    /* set tunnel/notunnel specific features */
-   if (tun) {
+   if (tun && state->max_segment_size) {
       int mss = state->max_segment_size;
       if (setsockopt (s, IPPROTO_TCP, TCP_MAXSEG, &mss, sizeof(mss)) < 0)
          die("setsockopt maxseg");
@@ -596,19 +654,19 @@ int tcp_cli(struct tun_state *st, struct sockaddr *sa,
       err = (errno == EINPROGRESS) ? ETIMEDOUT : errno;
       goto err;
    }
-   /* transfer file */
-   fp = fopen(filename, "w");
-   if(fp == NULL) die("fopen");
+   tcpinfo_register(s, 0);
 
-   char buf[BUFF_SIZE];
-   memset(buf, 0, BUFF_SIZE);
-   int bsize = 0;
-   while((bsize = xrecv(s, buf, BUFF_SIZE)) > 0) {
-       xfwrite(fp, buf, sizeof(char), bsize);
-       memset(buf, 0, BUFF_SIZE);
-   } 
+   /* transfer file */
+   gp = goodput_init(state->goodput_interval);
+   written = sink_run(state, s, filename, gp);
+   goodput_write(state, gp, sa, tun);
+   if (written < 0) {
+      err=errno;
+      goto err;
+   }
 
    /* shutdown connection */
+   char buf[BUFF_SIZE];
    if (shutdown(s, SHUT_RDWR) < 0) {
       err=errno;
       goto err;
@@ -620,16 +678,17 @@ int tcp_cli(struct tun_state *st, struct sockaddr *sa,
    }
 
    /* close & set file permission */
-   fclose(fp);close(s);free(sout);
+   tcpinfo_unregister(s);
+   close(s);free(sout);goodput_free(gp);
    mode_t m = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
-   if (chmod(filename, m) < 0)
+   if (written > 0 && chmod(filename, m) < 0)
       die("chmod");
 
    debug_print("socket %d successfuly closed.\n", s);
    return 0;
 err:
-   if (fp) fclose(fp); 
-   close(s);free(sout);
+   tcpinfo_unregister(s);
+   close(s);free(sout);goodput_free(gp);
    debug_print("socket %d closed on error: %s\n", s, strerror(err));
    return -1;
 }
@@ -10,6 +10,7 @@
 #ifndef UDPTUN_NET_H
 #define UDPTUN_NET_H
 
+#include <stdint.h>
 #include <netinet/in.h>
 
 #include "state.h"
@@ -33,6 +34,20 @@ void tun(struct tun_state *state, int *fd_tun);
  */ 
 void *cli_thread(void *st);
 
+/**
+ * \fn void cli_run(struct tun_state *state, int cli_mode, 
+ *                  const uint8_t *dests, int len)
+ * \brief Run the TCP file clients towards a list of destinations.
+ *
+ * \param state udptun state
+ * \param cli_mode The scheduling mode (PARALLEL_MODE, TUN_FIRST_MODE or 
+ *                 NOTUN_FIRST_MODE)
+ * \param dests The destination indexes, NULL for 0..len-1
+ * \param len The number of destinations
+ */ 
+void cli_run(struct tun_state *state, int cli_mode, 
+             const uint8_t *dests, int len);
+
 /**
  * \fn void *serv_thread(void *st);
  * \brief the TCP serv thread
@@ -0,0 +1,409 @@
+/**
+ * \file pcapidx.c
+ * \brief Sidecar index of pcap traces.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "pcapidx.h"
+#include "pcapw.h"
+#include "sock.h"
+#include "debug.h"
+
+/**
+ * \struct pcapidx_range
+ * \brief A byte range to read.
+ */
+struct pcapidx_range {
+   uint64_t off;  /*!< start offset */
+   uint64_t end;  /*!< end offset */
+};
+
+/**
+ * \fn static guint key_hash(gconstpointer key)
+ * \brief FNV-1a hash of a struct flow_key.
+ */
+static guint key_hash(gconstpointer key);
+
+/**
+ * \fn static gboolean key_equal(gconstpointer a, gconstpointer b)
+ * \brief Compare two struct flow_key.
+ */
+static gboolean key_equal(gconstpointer a, gconstpointer b);
+
+/**
+ * \fn static gboolean key_free(gpointer key, gpointer value,
+ *                              gpointer user_data)
+ * \brief g_hash_table_foreach_remove callback, free a key.
+ */
+static gboolean key_free(gpointer key, gpointer value, gpointer user_data);
+
+/**
+ * \fn static int pcapidx_match(const struct pcapidx_query *q,
+ *                              const struct flow_key *key)
+ * \brief Test a 5-tuple against a query.
+ */
+static int pcapidx_match(const struct pcapidx_query *q,
+                         const struct flow_key *key);
+
+/**
+ * \fn static void pcapidx_fwrite(const void *buf, size_t size, size_t nmemb,
+ *                                FILE *fp)
+ * \brief fwrite(3) or die.
+ */
+static void pcapidx_fwrite(const void *buf, size_t size, size_t nmemb,
+                           FILE *fp);
+
+/**
+ * \fn static char *pcapidx_name(const char *filename)
+ * \brief Build an index location.
+ *
+ * \return The (allocated) index location
+ */
+static char *pcapidx_name(const char *filename);
+
+guint key_hash(gconstpointer key) {
+   const uint8_t *p = key;
+   uint32_t h = 2166136261U;
+   for (size_t i=0; i<sizeof(struct flow_key); i++) {
+      h ^= p[i];
+      h *= 16777619U;
+   }
+   return h;
+}
+
+gboolean key_equal(gconstpointer a, gconstpointer b) {
+   return !memcmp(a, b, sizeof(struct flow_key));
+}
+
+gboolean key_free(gpointer key, gpointer UNUSED(value),
+                  gpointer UNUSED(user_data)) {
+   free(key);
+   return 1;
+}
+
+void pcapidx_fwrite(const void *buf, size_t size, size_t nmemb, FILE *fp) {
+   if (fwrite(buf, size, nmemb, fp) < nmemb)
+      die("fwrite");
+}
+
+char *pcapidx_name(const char *filename) {
+   char *name = xmalloc(strlen(filename) + sizeof(PCAPIDX_EXT));
+   strcpy(name, filename);
+   strcat(name, PCAPIDX_EXT);
+   return name;
+}
+
+struct pcapidx *pcapidx_new(int linktype, int nano) {
+   struct pcapidx *idx = calloc(1, sizeof(struct pcapidx));
+   if (!idx)
+      die("calloc");
+   idx->hdr.magic    = PCAPIDX_MAGIC;
+   idx->hdr.version  = PCAPIDX_VERSION;
+   idx->hdr.linktype = linktype;
+   idx->nano         = nano;
+   idx->table        = g_hash_table_new(key_hash, key_equal);
+   return idx;
+}
+
+void pcapidx_block(struct pcapidx *idx, const char *block, size_t len,
+                   uint64_t off) {
+   struct flow_key key;
+   size_t pos = 0;
+
+   while (pos + sizeof(struct pcapw_rec_hdr) <= len) {
+      const struct pcapw_rec_hdr *rec = (const struct pcapw_rec_hdr *)(block + pos);
+      const u_char *bytes = (const u_char *)(rec + 1);
+      uint64_t rec_off = off + pos;
+      uint64_t rec_end = rec_off + sizeof(struct pcapw_rec_hdr) + rec->caplen;
+      uint64_t ts = (uint64_t)rec->ts_sec * 1000000000ULL +
+                    (uint64_t)rec->ts_frac * (idx->nano ? 1 : 1000);
+      pos += sizeof(struct pcapw_rec_hdr) + rec->caplen;
+
+      if (!idx->hdr.first)
+         idx->hdr.first = ts;
+      idx->hdr.last = ts;
+
+      /* time mark */
+      if (rec_off == off) {
+         if (idx->hdr.marks == idx->marks_cap) {
+            idx->marks_cap = idx->marks_cap ? 2 * idx->marks_cap : 64;
+            idx->marks = realloc(idx->marks,
+                                 idx->marks_cap * sizeof(struct pcapidx_mark));
+            if (!idx->marks)
+               die("realloc");
+         }
+         idx->marks[idx->hdr.marks].ts  = ts;
+         idx->marks[idx->hdr.marks].off = rec_off;
+         idx->hdr.marks++;
+      }
+
+      if (flow_key_parse(idx->hdr.linktype, bytes, rec->caplen, &key) < 0)
+         continue;
+
+      /* flow */
+      uint32_t n = GPOINTER_TO_UINT(g_hash_table_lookup(idx->table, &key));
+      if (!n) {
+         if (idx->hdr.flows == idx->flows_cap) {
+            idx->flows_cap = idx->flows_cap ? 2 * idx->flows_cap : 64;
+            idx->flows    = realloc(idx->flows,
+                                    idx->flows_cap * sizeof(struct pcapidx_flow));
+            idx->fext     = realloc(idx->fext,
+                                    idx->flows_cap * sizeof(struct pcapidx_extent *));
+            idx->fext_cap = realloc(idx->fext_cap,
+                                    idx->flows_cap * sizeof(uint32_t));
+            if (!idx->flows || !idx->fext || !idx->fext_cap)
+               die("realloc");
+         }
+         n = ++idx->hdr.flows;
+         struct pcapidx_flow *f = &idx->flows[n - 1];
+         memset(f, 0, sizeof(struct pcapidx_flow));
+         f->key   = key;
+         f->first = ts;
+         idx->fext[n - 1]     = NULL;
+         idx->fext_cap[n - 1] = 0;
+
+         struct flow_key *k = xmalloc(sizeof(struct flow_key));
+         *k = key;
+         g_hash_table_insert(idx->table, k, GUINT_TO_POINTER(n));
+      }
+      struct pcapidx_flow *f = &idx->flows[n - 1];
+      f->packets++;
+      f->bytes += rec->caplen;
+      f->last   = ts;
+
+      /* extend the last extent or start a new one */
+      struct pcapidx_extent *e = f->extents ?
+                                 &idx->fext[n - 1][f->extents - 1] : NULL;
+      if (e && rec_off - (e->off + e->len) <= PCAPIDX_GAP) {
+         e->len  = rec_end - e->off;
+         e->last = ts;
+         e->packets++;
+         continue;
+      }
+      if (f->extents == idx->fext_cap[n - 1]) {
+         idx->fext_cap[n - 1] = idx->fext_cap[n - 1] ? 2 * idx->fext_cap[n - 1] : 4;
+         idx->fext[n - 1] = realloc(idx->fext[n - 1],
+                           idx->fext_cap[n - 1] * sizeof(struct pcapidx_extent));
+         if (!idx->fext[n - 1])
+            die("realloc");
+      }
+      e = &idx->fext[n - 1][f->extents++];
+      memset(e, 0, sizeof(struct pcapidx_extent));
+      e->off     = rec_off;
+      e->len     = rec_end - rec_off;
+      e->first   = e->last = ts;
+      e->packets = 1;
+      idx->hdr.extents++;
+   }
+}
+
+void pcapidx_write(struct pcapidx *idx, const char *filename) {
+   char *name = pcapidx_name(filename);
+   FILE *fp   = fopen(name, "w");
+   if (!fp)
+      die("fopen index");
+   fchmod(fileno(fp), 0666);
+
+   uint32_t i, extent = 0;
+   for (i = 0; i < idx->hdr.flows; i++) {
+      idx->flows[i].extent = extent;
+      extent += idx->flows[i].extents;
+   }
+   pcapidx_fwrite(&idx->hdr, sizeof(struct pcapidx_hdr), 1, fp);
+   if (idx->hdr.flows)
+      pcapidx_fwrite(idx->flows, sizeof(struct pcapidx_flow), idx->hdr.flows, fp);
+   for (i = 0; i < idx->hdr.flows; i++) {
+      pcapidx_fwrite(idx->fext[i], sizeof(struct pcapidx_extent),
+              idx->flows[i].extents, fp);
+      free(idx->fext[i]);
+   }
+   if (idx->hdr.marks)
+      pcapidx_fwrite(idx->marks, sizeof(struct pcapidx_mark), idx->hdr.marks, fp);
+   fclose(fp);
+   debug_print("%s: %u flows, %u extents, %u marks\n", name, idx->hdr.flows,
+               idx->hdr.extents, idx->hdr.marks);
+   free(name);
+
+   /* empty for the next segment */
+   g_hash_table_foreach_remove(idx->table, key_free, NULL);
+   idx->hdr.flows = idx->hdr.extents = idx->hdr.marks = 0;
+   idx->hdr.first = idx->hdr.last = 0;
+}
+
+struct pcapidx *pcapidx_load(const char *filename) {
+   char *name = pcapidx_name(filename);
+   FILE *fp   = fopen(name, "r");
+   free(name);
+   if (!fp)
+      return NULL;
+
+   struct pcapidx *idx = calloc(1, sizeof(struct pcapidx));
+   if (!idx)
+      die("calloc");
+   if (fread(&idx->hdr, sizeof(struct pcapidx_hdr), 1, fp) != 1 ||
+       idx->hdr.magic != PCAPIDX_MAGIC || idx->hdr.version != PCAPIDX_VERSION)
+      goto err;
+
+   idx->flows   = calloc(idx->hdr.flows + 1, sizeof(struct pcapidx_flow));
+   idx->extents = calloc(idx->hdr.extents + 1, sizeof(struct pcapidx_extent));
+   idx->marks   = calloc(idx->hdr.marks + 1, sizeof(struct pcapidx_mark));
+   if (!idx->flows || !idx->extents || !idx->marks)
+      die("calloc");
+   if (fread(idx->flows, sizeof(struct pcapidx_flow), idx->hdr.flows, fp)
+          != idx->hdr.flows ||
+       fread(idx->extents, sizeof(struct pcapidx_extent), idx->hdr.extents, fp)
+          != idx->hdr.extents ||
+       fread(idx->marks, sizeof(struct pcapidx_mark), idx->hdr.marks, fp)
+          != idx->hdr.marks)
+      goto err;
+   fclose(fp);
+   return idx;
+
+err:
+   fclose(fp);
+   pcapidx_free(idx);
+   errno = EINVAL;
+   return NULL;
+}
+
+int pcapidx_match(const struct pcapidx_query *q, const struct flow_key *key) {
+   if (q->key && memcmp(q->key, key, sizeof(struct flow_key)))
+      return 0;
+   if (q->sport && key->port_a != q->sport && key->port_b != q->sport)
+      return 0;
+   return 1;
+}
+
+static int range_cmp(const void *a, const void *b) {
+   const struct pcapidx_range *ra = a, *rb = b;
+   return (ra->off > rb->off) - (ra->off < rb->off);
+}
+
+long long pcapidx_extract(struct pcapidx *idx, const char *filename,
+                          FILE *out, const struct pcapidx_query *q) {
+   uint64_t from = q->from, to = q->to ? q->to : UINT64_MAX;
+   int by_flow   = (q->key || q->sport);
+   struct pcapidx_range *ranges = NULL;
+   uint32_t nranges = 0, i, k;
+   long long count = 0;
+
+   int fd = open(filename, O_RDONLY);
+   struct stat st;
+   if (fd < 0)
+      return -1;
+   if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct pcapw_file_hdr)) {
+      close(fd);
+      errno = EINVAL;
+      return -1;
+   }
+   const u_char *buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (buf == MAP_FAILED)
+      return -1;
+
+   const struct pcapw_file_hdr *fh = (const struct pcapw_file_hdr *)buf;
+   if (fh->magic != PCAPW_MAGIC && fh->magic != PCAPW_MAGIC_NANO) {
+      munmap((void *)buf, st.st_size);
+      errno = EINVAL;
+      return -1;
+   }
+   int nano = (fh->magic == PCAPW_MAGIC_NANO);
+   if (!ftell(out))
+      pcapidx_fwrite(fh, sizeof(struct pcapw_file_hdr), 1, out);
+
+   /* ranges to read */
+   if (by_flow) {
+      ranges = xmalloc((idx->hdr.extents + 1) * sizeof(struct pcapidx_range));
+      for (i = 0; i < idx->hdr.flows; i++) {
+         struct pcapidx_flow *f = &idx->flows[i];
+         if (!pcapidx_match(q, &f->key) || f->last < from || f->first > to)
+            continue;
+         for (k = 0; k < f->extents; k++) {
+            struct pcapidx_extent *e = &idx->extents[f->extent + k];
+            if (e->last < from || e->first > to)
+               continue;
+            ranges[nranges].off = e->off;
+            ranges[nranges].end = e->off + e->len;
+            nranges++;
+         }
+      }
+   } else {
+      /* last mark before the window to first mark after it */
+      ranges = xmalloc(sizeof(struct pcapidx_range));
+      ranges[0].off = sizeof(struct pcapw_file_hdr);
+      ranges[0].end = st.st_size;
+      for (i = 0; i < idx->hdr.marks; i++) {
+         if (idx->marks[i].ts <= from)
+            ranges[0].off = idx->marks[i].off;
+         else if (idx->marks[i].ts > to) {
+            ranges[0].end = idx->marks[i].off;
+            break;
+         }
+      }
+      nranges = 1;
+   }
+   qsort(ranges, nranges, sizeof(struct pcapidx_range), range_cmp);
+
+   /* read merged ranges */
+   for (i = 0; i < nranges; ) {
+      uint64_t off = ranges[i].off, end = ranges[i].end;
+      for (i++; i < nranges && ranges[i].off <= end; i++)
+         if (ranges[i].end > end)
+            end = ranges[i].end;
+      if (end > (uint64_t)st.st_size)
+         end = st.st_size;
+
+      while (off + sizeof(struct pcapw_rec_hdr) <= end) {
+         const struct pcapw_rec_hdr *rec = (const struct pcapw_rec_hdr *)(buf + off);
+         size_t len = sizeof(struct pcapw_rec_hdr) + rec->caplen;
+         if (off + len > (uint64_t)st.st_size)
+            break;
+         uint64_t ts = (uint64_t)rec->ts_sec * 1000000000ULL +
+                       (uint64_t)rec->ts_frac * (nano ? 1 : 1000);
+         off += len;
+
+         if (ts < from || ts > to)
+            continue;
+         if (by_flow) {
+            struct flow_key key;
+            if (flow_key_parse(idx->hdr.linktype, (const u_char *)(rec + 1),
+                               rec->caplen, &key) < 0 || !pcapidx_match(q, &key))
+               continue;
+         }
+         pcapidx_fwrite(rec, len, 1, out);
+         count++;
+      }
+   }
+
+   free(ranges);
+   munmap((void *)buf, st.st_size);
+   return count;
+}
+
+void pcapidx_free(struct pcapidx *idx) {
+   if (!idx) return;
+
+   if (idx->table) {
+      g_hash_table_foreach_remove(idx->table, key_free, NULL);
+      g_hash_table_destroy(idx->table);
+   }
+   free(idx->flows);
+   free(idx->extents);
+   free(idx->marks);
+   free(idx->fext);
+   free(idx->fext_cap);
+   free(idx);
+}
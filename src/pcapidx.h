@@ -0,0 +1,201 @@
+/**
+ * \file pcapidx.h
+ * \brief Sidecar index of pcap traces prototypes.
+ *
+ *    The pcap writer indexes each block before writing it: every record
+ *    is keyed by its 5-tuple and appended to the extents of its flow
+ *    (byte ranges of the trace holding its packets, merged while less
+ *    than PCAPIDX_GAP bytes apart), and the first record of each block
+ *    is kept as a time mark. The index of a segment is written next to
+ *    it (<segment>.idx) when the segment ends:
+ *
+ *    struct pcapidx_hdr
+ *    struct pcapidx_flow   x flows   (by first packet time)
+ *    struct pcapidx_extent x extents (grouped by flow, by offset)
+ *    struct pcapidx_mark   x marks   (by offset)
+ *
+ *    Readers then only visit the extents of the queried flows, or the
+ *    blocks of the queried time window.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_PCAPIDX_H
+#define UDPTUN_PCAPIDX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pcap.h>
+
+#include "flowstat.h"
+
+/**
+ * \def PCAPIDX_EXT
+ * \brief Index file extension, appended to the segment name.
+ */
+#define PCAPIDX_EXT ".idx"
+
+/**
+ * \def PCAPIDX_MAGIC
+ * \brief Index magic number ("CCIX").
+ */
+#define PCAPIDX_MAGIC 0x58494343
+
+/**
+ * \def PCAPIDX_VERSION
+ * \brief Index format version.
+ */
+#define PCAPIDX_VERSION 1
+
+/**
+ * \def PCAPIDX_GAP
+ * \brief Largest gap (bytes) merged into a flow extent.
+ */
+#define PCAPIDX_GAP 65536
+
+/**
+ * \struct pcapidx_hdr
+ * \brief Index file header.
+ */
+struct pcapidx_hdr {
+   uint32_t magic;     /*!< PCAPIDX_MAGIC */
+   uint32_t version;   /*!< PCAPIDX_VERSION */
+   uint32_t flows;     /*!< number of flows */
+   uint32_t extents;   /*!< number of extents */
+   uint32_t marks;     /*!< number of time marks */
+   uint32_t linktype;  /*!< link-layer type of the trace */
+   uint64_t first;     /*!< first packet time (ns) */
+   uint64_t last;      /*!< last packet time (ns) */
+};
+
+/**
+ * \struct pcapidx_flow
+ * \brief An indexed flow.
+ */
+struct pcapidx_flow {
+   struct flow_key key;  /*!< the flow */
+   uint32_t extent;      /*!< index of its first extent */
+   uint32_t extents;     /*!< number of extents */
+   uint64_t packets;     /*!< packets */
+   uint64_t bytes;       /*!< captured bytes */
+   uint64_t first;       /*!< first packet time (ns) */
+   uint64_t last;        /*!< last packet time (ns) */
+};
+
+/**
+ * \struct pcapidx_extent
+ * \brief A byte range of the trace holding packets of one flow.
+ */
+struct pcapidx_extent {
+   uint64_t off;         /*!< offset of the first record */
+   uint64_t len;         /*!< up to the end of the last record */
+   uint64_t first;       /*!< first packet time (ns) */
+   uint64_t last;        /*!< last packet time (ns) */
+   uint32_t packets;     /*!< packets of the flow in the range */
+   uint32_t pad;
+};
+
+/**
+ * \struct pcapidx_mark
+ * \brief A time mark (first record of a written block).
+ */
+struct pcapidx_mark {
+   uint64_t ts;          /*!< record time (ns) */
+   uint64_t off;         /*!< record offset */
+};
+
+/**
+ * \struct pcapidx_query
+ * \brief Packets to extract.
+ */
+struct pcapidx_query {
+   const struct flow_key *key; /*!< a 5-tuple or NULL */
+   uint16_t sport;             /*!< a port of either endpoint, 0 for any */
+   uint64_t from;              /*!< window start (ns), 0 for none */
+   uint64_t to;                /*!< window end (ns), 0 for none */
+};
+
+/**
+ * \struct pcapidx
+ * \brief An index, being built or loaded.
+ */
+struct pcapidx {
+   struct pcapidx_hdr     hdr;       /*!< header */
+   struct pcapidx_flow   *flows;     /*!< flows */
+   struct pcapidx_extent *extents;   /*!< extents (loaded index) */
+   struct pcapidx_mark   *marks;     /*!< time marks */
+   uint32_t               marks_cap; /*!< allocated marks */
+   uint32_t               flows_cap; /*!< allocated flows */
+   GHashTable            *table;     /*!< struct flow_key to flow number */
+   struct pcapidx_extent **fext;     /*!< per-flow extents (index being built) */
+   uint32_t              *fext_cap;  /*!< per-flow allocated extents */
+   uint8_t                nano;      /*!< record timestamps are in ns */
+};
+
+/**
+ * \fn struct pcapidx *pcapidx_new(int linktype, int nano)
+ * \brief Create an empty index.
+ *
+ * \param linktype The link-layer type (DLT_*)
+ * \param nano 1 if timestamps are in ns, 0 in us
+ * \return The index
+ */
+struct pcapidx *pcapidx_new(int linktype, int nano);
+
+/**
+ * \fn void pcapidx_block(struct pcapidx *idx, const char *block, size_t len,
+ *                        uint64_t off)
+ * \brief Index the records of a block of the trace.
+ *
+ * \param idx The index
+ * \param block The records
+ * \param len The block length
+ * \param off The offset of the block in the trace
+ */
+void pcapidx_block(struct pcapidx *idx, const char *block, size_t len,
+                   uint64_t off);
+
+/**
+ * \fn void pcapidx_write(struct pcapidx *idx, const char *filename)
+ * \brief Write the index of a trace and empty it.
+ *
+ * \param idx The index
+ * \param filename The trace location, PCAPIDX_EXT is appended
+ */
+void pcapidx_write(struct pcapidx *idx, const char *filename);
+
+/**
+ * \fn struct pcapidx *pcapidx_load(const char *filename)
+ * \brief Load the index of a trace.
+ *
+ * \param filename The trace location, PCAPIDX_EXT is appended
+ * \return The index, NULL on error (errno is filled)
+ */
+struct pcapidx *pcapidx_load(const char *filename);
+
+/**
+ * \fn long long pcapidx_extract(struct pcapidx *idx, const char *filename,
+ *                               FILE *out, const struct pcapidx_query *q)
+ * \brief Copy the packets of a trace matching a query to a pcap file,
+ *        reading only the indexed ranges.
+ *
+ * \param idx The index of the trace
+ * \param filename The trace location
+ * \param out The output pcap file
+ * \param q The query
+ * \return The number of packets, -1 on error (errno is filled)
+ */
+long long pcapidx_extract(struct pcapidx *idx, const char *filename,
+                          FILE *out, const struct pcapidx_query *q);
+
+/**
+ * \fn void pcapidx_free(struct pcapidx *idx)
+ * \brief Free an index.
+ *
+ * \param idx The index
+ */
+void pcapidx_free(struct pcapidx *idx);
+
+#endif
@@ -0,0 +1,430 @@
+/**
+ * \file pcapw.c
+ * \brief Asynchronous block-buffered pcap trace writer.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "debug.h"
+#include "sysconfig.h"
+#if defined(WITH_ZSTD)
+#  include <zstd.h>
+#endif
+
+#include "pcapw.h"
+#include "pcapidx.h"
+#include "sock.h"
+
+/**
+ * \fn static void *pcapw_thread(void *arg)
+ * \brief The writer thread.
+ *
+ * \param arg The writer (struct pcapw *)
+ */
+static void *pcapw_thread(void *arg);
+
+/**
+ * \fn static void pcapw_push(struct pcapw *w)
+ * \brief Hand the current block over to the writer thread and wait
+ *        for a free block.
+ *
+ * \param w The writer
+ */
+static void pcapw_push(struct pcapw *w);
+
+/**
+ * \fn static void pcapw_flush(int fd, const char *buf, size_t len)
+ * \brief write(2) a whole buffer.
+ */
+static void pcapw_flush(int fd, const char *buf, size_t len);
+
+/**
+ * \fn static void pcapw_emit(struct pcapw *w, const char *buf, size_t len,
+ *                            int end)
+ * \brief Write (and compress) data to the current segment.
+ *
+ * \param w The writer
+ * \param buf The data
+ * \param len The data length
+ * \param end 1 to end the compressed frame
+ */
+static void pcapw_emit(struct pcapw *w, const char *buf, size_t len, int end);
+
+/**
+ * \fn static void pcapw_end(struct pcapw *w)
+ * \brief Finish and close the current segment.
+ *
+ * \param w The writer
+ */
+static void pcapw_end(struct pcapw *w);
+
+/**
+ * \fn static void pcapw_segment(struct pcapw *w)
+ * \brief Open the next segment and write its file header.
+ *
+ * \param w The writer
+ */
+static void pcapw_segment(struct pcapw *w);
+
+/**
+ * \fn static void pcapw_rotate(struct pcapw *w, int last)
+ * \brief Close the current segment, run the post-rotate hook on it,
+ *        enforce the retention cap and open the next segment.
+ *
+ * \param w The writer
+ * \param last 1 not to open a new segment
+ */
+static void pcapw_rotate(struct pcapw *w, int last);
+
+/**
+ * \fn static char *pcapw_segname(struct pcapw *w, uint32_t seq)
+ * \brief Build a segment location.
+ *
+ * \param w The writer
+ * \param seq The segment number
+ * \return The (allocated) segment location
+ */
+static char *pcapw_segname(struct pcapw *w, uint32_t seq);
+
+struct pcapw *pcapw_open(const char *filename, int linktype,
+                         unsigned int snaplen, int nano,
+                         const struct pcapw_rotate *rot, int zlevel,
+                         int index) {
+   struct pcapw *w = calloc(1, sizeof(struct pcapw));
+   if (!w)
+      die("calloc");
+   for (int i=0; i<PCAPW_BLOCKS; i++) {
+      if (posix_memalign((void **)&w->blocks[i], 4096, PCAPW_BLOCK_SIZE))
+         die("posix_memalign");
+   }
+   if (pthread_mutex_init(&w->lock, NULL) != 0 ||
+       pthread_cond_init(&w->full, NULL) != 0 ||
+       pthread_cond_init(&w->empty, NULL) != 0)
+      die("pthread init");
+
+   w->hdr.magic         = nano ? PCAPW_MAGIC_NANO : PCAPW_MAGIC;
+   w->hdr.version_major = 2;
+   w->hdr.version_minor = 4;
+   w->hdr.snaplen       = snaplen;
+   w->hdr.linktype      = linktype;
+
+   if (zlevel) {
+#if defined(WITH_ZSTD)
+      w->zctx = ZSTD_createCCtx();
+      if (!w->zctx)
+         die("ZSTD_createCCtx");
+      ZSTD_CCtx_setParameter(w->zctx, ZSTD_c_compressionLevel, zlevel);
+      w->zbuf_len = ZSTD_CStreamOutSize();
+      w->zbuf     = xmalloc(w->zbuf_len);
+#else
+      fprintf(stderr, "%s: built without zstd, not compressing\n", filename);
+#endif
+   }
+
+   /* offsets of compressed segments are meaningless */
+   if (index && !w->zctx)
+      w->idx = pcapidx_new(linktype, nano);
+
+   /* strip the .pcap extension off segment names */
+   w->base = strdup(filename);
+   if (rot && (rot->size || rot->time)) {
+      w->rot      = *rot;
+      w->rotating = 1;
+      size_t len  = strlen(w->base);
+      if (len > 5 && !strcmp(w->base + len - 5, ".pcap"))
+         w->base[len - 5] = '\0';
+   }
+   pcapw_segment(w);
+   if (w->rot.time)
+      w->push_deadline = w->seg_start + w->rot.time;
+
+   if (pthread_create(&w->writer, NULL, pcapw_thread, w) != 0)
+      die("pthread_create");
+   return w;
+}
+
+char *pcapw_segname(struct pcapw *w, uint32_t seq) {
+   size_t len = strlen(w->base) + 20;
+   char *filename = xmalloc(len);
+   if (w->rotating)
+      snprintf(filename, len, "%s-%05u.pcap%s", w->base, seq, 
+               w->zctx ? ".zst" : "");
+   else
+      snprintf(filename, len, "%s%s", w->base, w->zctx ? ".zst" : "");
+   return filename;
+}
+
+void pcapw_segment(struct pcapw *w) {
+   char *filename = pcapw_segname(w, w->seq);
+   if ((w->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+      die("open pcap");
+   if (fchmod(w->fd, 0666) < 0)
+      die("chmod");
+   free(filename);
+
+   /* one compressed frame per segment */
+   w->seg_bytes = 0;
+#if defined(WITH_ZSTD)
+   if (w->zctx)
+      ZSTD_CCtx_reset(w->zctx, ZSTD_reset_session_only);
+#endif
+   pcapw_emit(w, (const char *)&w->hdr, sizeof(struct pcapw_file_hdr), 0);
+   w->seg_raw   = sizeof(struct pcapw_file_hdr);
+   w->seg_start = time(NULL);
+}
+
+void pcapw_emit(struct pcapw *w, const char *buf, size_t len, int end) {
+#if defined(WITH_ZSTD)
+   if (w->zctx) {
+      ZSTD_inBuffer in = { buf, len, 0 };
+      size_t rem;
+      do {
+         ZSTD_outBuffer out = { w->zbuf, w->zbuf_len, 0 };
+         rem = ZSTD_compressStream2(w->zctx, &out, &in,
+                                    end ? ZSTD_e_end : ZSTD_e_continue);
+         if (ZSTD_isError(rem)) {
+            errno=EIO;
+            die("ZSTD_compressStream2");
+         }
+         pcapw_flush(w->fd, w->zbuf, out.pos);
+         w->seg_bytes += out.pos;
+      } while (end ? rem != 0 : in.pos < in.size);
+      return;
+   }
+#endif
+   (void)end;
+   pcapw_flush(w->fd, buf, len);
+   w->seg_bytes += len;
+}
+
+void pcapw_end(struct pcapw *w) {
+   if (w->zctx)
+      pcapw_emit(w, NULL, 0, 1);
+   close(w->fd);
+   if (w->idx) {
+      char *filename = pcapw_segname(w, w->seq);
+      pcapidx_write(w->idx, filename);
+      free(filename);
+   }
+}
+
+void pcapw_rotate(struct pcapw *w, int last) {
+   pcapw_end(w);
+
+   char *filename = pcapw_segname(w, w->seq);
+   if (w->rot.hook) {
+      /* double fork, the hook is reparented to init */
+      pid_t pid = fork();
+      if (pid == 0) {
+         if (fork() == 0) {
+            execl(w->rot.hook, w->rot.hook, filename, (char *)NULL);
+            _exit(127);
+         }
+         _exit(0);
+      } else if (pid < 0)
+         debug_print("post-rotate hook: %s\n", strerror(errno));
+      else
+         waitpid(pid, NULL, 0);
+   }
+
+   w->segs = realloc(w->segs, (w->segs_len + 1) * sizeof(struct pcapw_seg));
+   if (!w->segs)
+      die("realloc");
+   w->segs[w->segs_len].filename = filename;
+   w->segs[w->segs_len].size     = w->seg_bytes;
+   w->segs_len++;
+   w->segs_bytes += w->seg_bytes;
+
+   /* retention cap, never delete the last finished segment */
+   unsigned int n = 0;
+   while (w->rot.retain && w->segs_bytes > w->rot.retain &&
+          n < w->segs_len - 1) {
+      if (unlink(w->segs[n].filename) < 0)
+         debug_print("unlink %s: %s\n", w->segs[n].filename, strerror(errno));
+      if (w->idx) {
+         char *name = xmalloc(strlen(w->segs[n].filename) + sizeof(PCAPIDX_EXT));
+         sprintf(name, "%s%s", w->segs[n].filename, PCAPIDX_EXT);
+         unlink(name);
+         free(name);
+      }
+      w->segs_bytes -= w->segs[n].size;
+      free(w->segs[n].filename);
+      n++;
+   }
+   if (n) {
+      w->segs_len -= n;
+      memmove(w->segs, w->segs + n, w->segs_len * sizeof(struct pcapw_seg));
+   }
+
+   if (!last) {
+      w->seq++;
+      pcapw_segment(w);
+   }
+}
+
+void pcapw_handler(u_char *user, const struct pcap_pkthdr *h,
+                   const u_char *bytes) {
+   pcapw_write((struct pcapw *)user, h, bytes);
+}
+
+void pcapw_write(struct pcapw *w, const struct pcap_pkthdr *h,
+                 const u_char *bytes) {
+   size_t len = sizeof(struct pcapw_rec_hdr) + h->caplen;
+   if (len > PCAPW_BLOCK_SIZE)
+      return;
+   /* hand over partial blocks of idle traces for time rotation */
+   if (w->lens[w->head] + len > PCAPW_BLOCK_SIZE ||
+       (w->push_deadline && h->ts.tv_sec >= w->push_deadline)) {
+      pcapw_push(w);
+      if (w->push_deadline)
+         w->push_deadline = h->ts.tv_sec + w->rot.time;
+   }
+
+   char *p = w->blocks[w->head] + w->lens[w->head];
+   struct pcapw_rec_hdr *rec = (struct pcapw_rec_hdr *)p;
+   rec->ts_sec  = h->ts.tv_sec;
+   rec->ts_frac = h->ts.tv_usec;
+   rec->caplen  = h->caplen;
+   rec->len     = h->len;
+   memcpy(p + sizeof(struct pcapw_rec_hdr), bytes, h->caplen);
+   w->lens[w->head] += len;
+   w->packets++;
+}
+
+void pcapw_push(struct pcapw *w) {
+   int old;
+   /* the capture thread must not be cancelled while holding the lock */
+   pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+   if (pthread_mutex_lock(&w->lock) != 0)
+      die("mutex lock");
+   w->count++;
+   pthread_cond_signal(&w->full);
+   if (w->count == PCAPW_BLOCKS)
+      w->stalls++;
+   while (w->count == PCAPW_BLOCKS)
+      pthread_cond_wait(&w->empty, &w->lock);
+   w->head = (w->tail + w->count) % PCAPW_BLOCKS;
+   if (pthread_mutex_unlock(&w->lock) != 0)
+      die("mutex unlock");
+   pthread_setcancelstate(old, NULL);
+}
+
+void pcapw_flush(int fd, const char *buf, size_t len) {
+   while (len) {
+      ssize_t n = write(fd, buf, len);
+      if (n < 0) {
+         if (errno == EINTR) continue;
+         die("write pcap");
+      }
+      buf += n;
+      len -= n;
+   }
+}
+
+void *pcapw_thread(void *arg) {
+   struct pcapw *w = (struct pcapw *)arg;
+
+   while (1) {
+      if (pthread_mutex_lock(&w->lock) != 0)
+         die("mutex lock");
+      while (!w->count && !w->stop) {
+         if (!w->rotating || !w->rot.time) {
+            pthread_cond_wait(&w->full, &w->lock);
+            continue;
+         }
+         /* close idle segments on time, packets of the partial
+            block go to the next segment when it is pushed */
+         struct timespec dl = { w->seg_start + w->rot.time, 0 };
+         if (pthread_cond_timedwait(&w->full, &w->lock, &dl) != ETIMEDOUT ||
+             w->count || w->stop)
+            continue;
+         if (pthread_mutex_unlock(&w->lock) != 0)
+            die("mutex unlock");
+         if (w->seg_raw > sizeof(struct pcapw_file_hdr))
+            pcapw_rotate(w, 0);
+         else
+            w->seg_start = time(NULL);
+         if (pthread_mutex_lock(&w->lock) != 0)
+            die("mutex lock");
+      }
+      if (!w->count) {
+         pthread_mutex_unlock(&w->lock);
+         break;
+      }
+      unsigned int i = w->tail;
+      if (pthread_mutex_unlock(&w->lock) != 0)
+         die("mutex unlock");
+
+      if (w->idx)
+         pcapidx_block(w->idx, w->blocks[i], w->lens[i], w->seg_raw);
+      w->seg_raw += w->lens[i];
+      pcapw_emit(w, w->blocks[i], w->lens[i], 0);
+      if (w->rotating &&
+          ((w->rot.size && w->seg_bytes >= w->rot.size) ||
+           (w->rot.time && time(NULL) >= w->seg_start + w->rot.time)))
+         pcapw_rotate(w, 0);
+
+      if (pthread_mutex_lock(&w->lock) != 0)
+         die("mutex lock");
+      w->lens[i] = 0;
+      w->tail = (w->tail + 1) % PCAPW_BLOCKS;
+      w->count--;
+      pthread_cond_signal(&w->empty);
+      if (pthread_mutex_unlock(&w->lock) != 0)
+         die("mutex unlock");
+   }
+   return 0;
+}
+
+void pcapw_close(struct pcapw *w) {
+   if (!w) return;
+
+   if (pthread_mutex_lock(&w->lock) != 0)
+      die("mutex lock");
+   /* queue the partial block, there is always room for it */
+   if (w->lens[w->head])
+      w->count++;
+   w->stop = 1;
+   pthread_cond_signal(&w->full);
+   if (pthread_mutex_unlock(&w->lock) != 0)
+      die("mutex unlock");
+   pthread_join(w->writer, NULL);
+
+   /* the last segment goes through the hook too */
+   if (w->rotating)
+      pcapw_rotate(w, 1);
+   else
+      pcapw_end(w);
+
+   for (unsigned int i=0; i<w->segs_len; i++)
+      free(w->segs[i].filename);
+   free(w->segs);
+   free(w->base);
+#if defined(WITH_ZSTD)
+   ZSTD_freeCCtx(w->zctx);
+#endif
+   free(w->zbuf);
+   pcapidx_free(w->idx);
+   for (int i=0; i<PCAPW_BLOCKS; i++)
+      free(w->blocks[i]);
+   pthread_cond_destroy(&w->full);
+   pthread_cond_destroy(&w->empty);
+   pthread_mutex_destroy(&w->lock);
+   debug_print("pcap writer: %llu packets, %llu stalls, %u segments\n",
+               (unsigned long long)w->packets,
+               (unsigned long long)w->stalls, w->seq + 1);
+   free(w);
+}
+
@@ -0,0 +1,191 @@
+/**
+ * \file pcapw.h
+ * \brief Asynchronous block-buffered pcap trace writer prototypes.
+ *
+ *    Packets are appended to large page-aligned blocks by the capture
+ *    thread. Full blocks are handed over to a dedicated writer thread
+ *    that flushes them with a single write(2) each. If every block is
+ *    waiting to be written, the capture thread blocks and the backlog
+ *    piles up in the kernel capture ring.
+ *
+ *    Optionally, the trace is rotated into <name>-<seq>.pcap segments
+ *    by size or age, the oldest segments are deleted beyond a total
+ *    size cap and each finished segment is passed to a post-rotate
+ *    command (executed with the segment location as sole argument).
+ *
+ *    If built with libzstd, traces can be compressed by the writer
+ *    thread into one zstd frame per segment (.pcap.zst), readable with
+ *    e.g. zstdcat notun.pcap.zst | tcpdump -r -
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_PCAPW_H
+#define UDPTUN_PCAPW_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include <pcap.h>
+
+/**
+ * \def PCAPW_BLOCK_SIZE
+ * \brief Size of a write block in bytes.
+ */
+#define PCAPW_BLOCK_SIZE (1024*1024)
+
+/**
+ * \def PCAPW_BLOCKS
+ * \brief Number of write blocks.
+ */
+#define PCAPW_BLOCKS 8
+
+/**
+ * \def PCAPW_MAGIC
+ * \brief pcap magic number (microsecond timestamps).
+ */
+#define PCAPW_MAGIC 0xa1b2c3d4
+
+/**
+ * \def PCAPW_MAGIC_NANO
+ * \brief pcap magic number (nanosecond timestamps).
+ */
+#define PCAPW_MAGIC_NANO 0xa1b23c4d
+
+/**
+ * \struct pcapw_file_hdr
+ * \brief pcap file header.
+ */
+struct pcapw_file_hdr {
+   uint32_t magic;         /*!< PCAPW_MAGIC or PCAPW_MAGIC_NANO */
+   uint16_t version_major; /*!< 2 */
+   uint16_t version_minor; /*!< 4 */
+   int32_t  thiszone;      /*!< 0 */
+   uint32_t sigfigs;       /*!< 0 */
+   uint32_t snaplen;       /*!< snapshot length */
+   uint32_t linktype;      /*!< DLT_* */
+};
+
+/**
+ * \struct pcapw_rec_hdr
+ * \brief pcap record header.
+ */
+struct pcapw_rec_hdr {
+   uint32_t ts_sec;        /*!< timestamp seconds */
+   uint32_t ts_frac;       /*!< timestamp us or ns */
+   uint32_t caplen;        /*!< captured length */
+   uint32_t len;           /*!< original length */
+};
+
+/**
+ * \struct pcapw_rotate
+ * \brief Trace rotation settings.
+ */
+struct pcapw_rotate {
+   uint64_t size;    /*!< rotate segments beyond size bytes, 0 for no limit */
+   uint32_t time;    /*!< rotate segments older than time s, 0 for no limit */
+   uint64_t retain;  /*!< total size of kept segments, 0 for no limit */
+   char    *hook;    /*!< post-rotate executable or NULL */
+};
+
+/**
+ * \struct pcapw_seg
+ * \brief A finished segment.
+ */
+struct pcapw_seg {
+   char    *filename; /*!< segment location */
+   uint64_t size;     /*!< segment size */
+};
+
+/**
+ * \struct pcapw
+ * \brief An open pcap writer.
+ */
+struct pcapw {
+   int             fd;                   /*!< trace file descriptor */
+   char           *blocks[PCAPW_BLOCKS]; /*!< write blocks */
+   size_t          lens[PCAPW_BLOCKS];   /*!< block fill levels */
+   unsigned int    head;                 /*!< block being filled */
+   unsigned int    tail;                 /*!< next block to write */
+   unsigned int    count;                /*!< full blocks */
+   uint8_t         stop;                 /*!< writer termination flag */
+   pthread_mutex_t lock;                 /*!< protects head, tail, count */
+   pthread_cond_t  full;                 /*!< a block was filled */
+   pthread_cond_t  empty;                /*!< a block was written */
+   pthread_t       writer;               /*!< writer thread */
+   uint64_t        packets;              /*!< written packets */
+   uint64_t        stalls;               /*!< waits for a free block */
+
+   struct pcapw_file_hdr hdr;            /*!< file header of each segment */
+   struct pcapw_rotate rot;              /*!< rotation settings */
+   uint8_t         rotating;             /*!< rotation is enabled */
+   char           *base;                 /*!< segment name prefix */
+   uint32_t        seq;                  /*!< current segment number */
+   uint64_t        seg_bytes;            /*!< current segment size */
+   time_t          seg_start;            /*!< current segment creation time */
+   time_t          push_deadline;        /*!< push a partial block after */
+   struct pcapw_seg *segs;               /*!< finished segments, oldest first */
+   unsigned int    segs_len;             /*!< number of finished segments */
+   uint64_t        segs_bytes;           /*!< total size of finished segments */
+
+   struct pcapidx *idx;                  /*!< sidecar index or NULL */
+   uint64_t        seg_raw;              /*!< uncompressed segment size */
+
+   void           *zctx;                 /*!< zstd compression context or NULL */
+   char           *zbuf;                 /*!< compressed output buffer */
+   size_t          zbuf_len;             /*!< compressed output buffer size */
+};
+
+/**
+ * \fn struct pcapw *pcapw_open(const char *filename, int linktype,
+ *                              unsigned int snaplen, int nano,
+ *                              const struct pcapw_rotate *rot, int zlevel,
+ *                              int index)
+ * \brief Create a pcap trace and run its writer thread.
+ *
+ * \param filename The trace location, ending with .pcap
+ * \param linktype The link-layer type (DLT_*)
+ * \param snaplen The snapshot length
+ * \param nano 1 if timestamps are in ns, 0 in us
+ * \param rot The rotation settings or NULL
+ * \param zlevel The zstd compression level, 0 not to compress
+ * \param index 1 to write a sidecar index of each (uncompressed) segment
+ * \return The writer
+ */
+struct pcapw *pcapw_open(const char *filename, int linktype,
+                         unsigned int snaplen, int nano,
+                         const struct pcapw_rotate *rot, int zlevel,
+                         int index);
+
+/**
+ * \fn void pcapw_write(struct pcapw *w, const struct pcap_pkthdr *h,
+ *                      const u_char *bytes)
+ * \brief Append a packet. Single producer, usable as a pcap_handler
+ *        through pcapw_handler.
+ *
+ * \param w The writer
+ * \param h The packet header
+ * \param bytes The packet
+ */
+void pcapw_write(struct pcapw *w, const struct pcap_pkthdr *h,
+                 const u_char *bytes);
+
+/**
+ * \fn void pcapw_handler(u_char *user, const struct pcap_pkthdr *h,
+ *                        const u_char *bytes)
+ * \brief pcap_loop callback, user is a struct pcapw.
+ */
+void pcapw_handler(u_char *user, const struct pcap_pkthdr *h,
+                   const u_char *bytes);
+
+/**
+ * \fn void pcapw_close(struct pcapw *w)
+ * \brief Flush pending blocks, stop the writer thread and close the trace.
+ *
+ * \param w The writer
+ */
+void pcapw_close(struct pcapw *w);
+
+#endif
@@ -23,6 +23,12 @@
 #include "sock.h"
 #include "net.h"
 #include "xpcap.h"
+#include "tap.h"
+#include "ready.h"
+#include "session.h"
+#include "lpm.h"
+#include "mss.h"
+#include "pmtu.h"
 
 /**
  * \var static volatile int loop
@@ -106,7 +112,7 @@ void tun_peer(struct arguments *args) {
 void tun_peer_in(int fd_tun, int fd_cli4, int fd_serv4, 
                  int fd_cli6, int fd_serv6, 
                  struct tun_state *state, char *buf) {
-   int recvd=xread(fd_tun, buf, BUFF_SIZE);
+   int recvd=tap_read(fd_tun, buf, BUFF_SIZE);
    debug_print("recvd %db from tun\n", recvd);
 
    switch (buf[0] & 0xf0) {
@@ -124,14 +130,14 @@ void tun_peer_in(int fd_tun, int fd_cli4, int fd_serv4,
 
 void tun_peer_in6(int fd_tun, int fd_cli, int fd_serv, 
                  struct tun_state *state, char *buf) {
-   int recvd=xread(fd_tun, buf, BUFF_SIZE);
+   int recvd=tap_read(fd_tun, buf, BUFF_SIZE);
    debug_print("recvd %db from tun\n", recvd);
    tun_peer_in6_aux(fd_cli, fd_serv, state, buf, recvd);
 }
 
 void tun_peer_in4(int fd_tun, int fd_cli, int fd_serv, 
                  struct tun_state *state, char *buf) {
-   int recvd=xread(fd_tun, buf, BUFF_SIZE);
+   int recvd=tap_read(fd_tun, buf, BUFF_SIZE);
    debug_print("recvd %db from tun\n", recvd);
    tun_peer_in4_aux(fd_cli, fd_serv, state, buf, recvd);
 }
@@ -145,20 +151,23 @@ void tun_peer_in4_aux(int fd_cli, int fd_serv,
          recvd-=4;
          memmove(buf, buf+4, recvd);
       }
+      /* clamp tunneled TCP handshakes */
+      mss_clamp(state, buf, recvd);
 
       struct tun_rec *rec = NULL; 
       /* read sport for clients mapping */
       int dport = (int)ntohs( *((uint16_t *)(buf+22)) );
+      in_addr_t priv_addr = (int)*((uint32_t *)(buf+16));
 
       /* cli */
       if (dport == state->private_port) {
 
          /* lookup initial server database from file */
-         in_addr_t priv_addr = (int)*((uint32_t *)(buf+16));
          debug_print("%s\n", inet_ntoa((struct in_addr){priv_addr}));
 
-         /* lookup private addr */
-         if ( (rec = g_hash_table_lookup(state->cli4, &priv_addr)) ) {
+         /* lookup private addr, then destination prefixes */
+         if ( (rec = g_hash_table_lookup(state->cli4, &priv_addr)) ||
+              (rec = lpm_lookup4(state->lpm, priv_addr)) ) {
             debug_print("priv addr lookup: OK\n");
 
             /* Add layer 4.5 header */
@@ -168,11 +177,13 @@ void tun_peer_in4_aux(int fd_cli, int fd_serv,
             }
 
             int sent = xsendto4(fd_cli, rec->sa4, buf, recvd);
+            if (sent < 0 && errno == EMSGSIZE)
+               pmtu_too_big(state, buf, recvd, rec->sa4);
             debug_print("wrote %db to internet\n",sent);
 
          } else {
-            errno=EFAULT;
-            die("cli lookup");
+            debug_print("cli lookup failed: %s\n", 
+                        inet_ntoa((struct in_addr){priv_addr}));
          }
 
       /* serv */
@@ -185,6 +196,22 @@ void tun_peer_in4_aux(int fd_cli, int fd_serv,
          }
 
          int sent = xsendto4(fd_serv, rec->sa4, buf, recvd);
+         if (sent < 0 && errno == EMSGSIZE)
+            pmtu_too_big(state, buf, recvd, rec->sa4);
+         debug_print("wrote %db to internet\n",sent);
+
+      /* subnets behind a peer */
+      } else if ((rec = lpm_lookup4(state->lpm, priv_addr))) {
+
+         /* Add layer 4.5 header */
+         if (state->raw_header) {
+            buf -= state->raw_header_size;
+            recvd += state->raw_header_size;
+         }
+
+         int sent = xsendto4(fd_cli, rec->sa4, buf, recvd);
+         if (sent < 0 && errno == EMSGSIZE)
+            pmtu_too_big(state, buf, recvd, rec->sa4);
          debug_print("wrote %db to internet\n",sent);
       } else {
          debug_print("serv lookup failed proto:%d sport:%d dport:%d\n", 
@@ -204,22 +231,25 @@ void tun_peer_in6_aux(int fd_cli, int fd_serv,
          recvd-=4;
          memmove(buf, buf+4, recvd);
       }
+      /* clamp tunneled TCP handshakes */
+      mss_clamp(state, buf, recvd);
 
       struct tun_rec *rec = NULL; 
       /* read sport for clients mapping */
       int dport = (int)ntohs( *((uint16_t *)(buf+42)) );
+      char priv_addr6[16], str_addr6[INET6_ADDRSTRLEN];
+      memcpy(priv_addr6, buf+24, 16);
 
       /* cli */
       if (dport == state->private_port) { 
 
          /* lookup initial server database from file */
-         char priv_addr6[16], str_addr6[INET6_ADDRSTRLEN];
-         memcpy(priv_addr6, buf+24, 16);
          debug_print("%s\n", inet_ntop(AF_INET6, priv_addr6, 
                                str_addr6, INET6_ADDRSTRLEN));
          
-         /* lookup private addr */
-         if ( (rec = g_hash_table_lookup(state->cli6, priv_addr6)) ) {
+         /* lookup private addr, then destination prefixes */
+         if ( (rec = g_hash_table_lookup(state->cli6, priv_addr6)) ||
+              (rec = lpm_lookup6(state->lpm, priv_addr6)) ) {
             debug_print("priv addr lookup: OK\n");
 
             /* Add layer 4.5 header */
@@ -228,11 +258,13 @@ void tun_peer_in6_aux(int fd_cli, int fd_serv,
                recvd += state->raw_header_size;
             }
             int sent = xsendto6(fd_cli, rec->sa6, buf, recvd);
+            if (sent < 0 && errno == EMSGSIZE)
+               pmtu_too_big(state, buf, recvd, rec->sa6);
             debug_print("wrote %db to internet\n",sent);
             if (sent <0) debug_perror();
          } else {
-            errno=EFAULT;
-            die("cli lookup");
+            debug_print("cli lookup failed: %s\n", inet_ntop(AF_INET6, 
+                        priv_addr6, str_addr6, INET6_ADDRSTRLEN));
          }
 
       /* serv */
@@ -245,6 +277,22 @@ void tun_peer_in6_aux(int fd_cli, int fd_serv,
          }
 
          int sent = xsendto6(fd_serv, rec->sa6, buf, recvd);
+         if (sent < 0 && errno == EMSGSIZE)
+            pmtu_too_big(state, buf, recvd, rec->sa6);
+         debug_print("wrote %db to internet\n",sent);
+
+      /* subnets behind a peer */
+      } else if ((rec = lpm_lookup6(state->lpm, priv_addr6))) {
+
+         /* Add layer 4.5 header */
+         if (state->raw_header) {
+            buf -= state->raw_header_size;
+            recvd += state->raw_header_size;
+         }
+
+         int sent = xsendto6(fd_cli, rec->sa6, buf, recvd);
+         if (sent < 0 && errno == EMSGSIZE)
+            pmtu_too_big(state, buf, recvd, rec->sa6);
          debug_print("wrote %db to internet\n",sent);
       } else {
          debug_print("serv lookup failed proto:%d sport:%d dport:%d\n", 
@@ -268,12 +316,14 @@ void tun_peer_out_cli4(int fd_udp, int fd_tun, struct tun_state *state, char *bu
          recvd -= state->raw_header_size;
          memmove(buf, buf+state->raw_header_size, recvd);
       }
+      /* clamp tunneled TCP handshakes */
+      mss_clamp(state, buf, recvd);
       /* Add PlanetLab TUN PPI header */
       if (state->planetlab) {
          buf-=4; recvd+=4;
       }
 
-      int sent = xwrite(fd_tun, buf, recvd);
+      int sent = tap_write(fd_tun, buf, recvd);
       debug_print("cli: wrote %dB to tun\n", sent);
    } else if (recvd < 0) {
       /* recvd ICMP msg */
@@ -297,12 +347,14 @@ void tun_peer_out_cli6(int fd_udp, int fd_tun, struct tun_state *state, char *bu
          recvd -= state->raw_header_size;
          memmove(buf, buf+state->raw_header_size, recvd);
       }
+      /* clamp tunneled TCP handshakes */
+      mss_clamp(state, buf, recvd);
       /* Add PlanetLab TUN PPI header */
       if (state->planetlab) {
          buf-=4; recvd+=4;
       }
 
-      int sent = xwrite(fd_tun, buf, recvd);
+      int sent = tap_write(fd_tun, buf, recvd);
       debug_print("cli: wrote %dB to tun\n", sent);
    } else if (recvd < 0) {
       /* recvd ICMP msg */
@@ -328,6 +380,8 @@ void tun_peer_out_serv4(int fd_udp, int fd_tun, struct tun_state *state, char *b
          recvd -= state->raw_header_size;
          memmove(buf, buf+state->raw_header_size, recvd);
       }
+      /* clamp tunneled TCP handshakes */
+      mss_clamp(state, buf, recvd);
       /* Add PlanetLab TUN PPI header */
       if (state->planetlab) {
          buf-=4; recvd+=4;
@@ -338,18 +392,20 @@ void tun_peer_out_serv4(int fd_udp, int fd_tun, struct tun_state *state, char *b
       int sent            = 0;
       if ( (rec = g_hash_table_lookup(state->serv, &sport)) ) {
 
-         sent = xwrite(fd_tun, buf, recvd);
+         sent = tap_write(fd_tun, buf, recvd);
          debug_print("serv: wrote %dB to internet\n", sent); 
       } 
 #if !defined(LOCKED)
       else if (g_hash_table_size(state->serv) <= state->fd_lim) { 
          
-         sent = xwrite(fd_tun, buf, recvd);
+         sent = tap_write(fd_tun, buf, recvd);
 
          //add new record to lookup tables  
          nrec->sport = sport;
          g_hash_table_insert(state->serv, &nrec->sport, nrec);
+         session_learn(nrec, AF_INET);
          debug_print("serv: added new entry: %d\n", sport);
+         nrec = NULL;
       } 
 #endif
       else {
@@ -359,11 +415,12 @@ void tun_peer_out_serv4(int fd_udp, int fd_tun, struct tun_state *state, char *b
    } else if (recvd < 0) {
        /* recvd ICMP msg */
       xrecverr(fd_udp, buf,  BUFF_SIZE, 0, NULL);
-   } else {
+   } else if (!ready_answer(fd_udp, buf, recvd, nrec->sa4, nrec->slen4)) {
       /* recvd unknown packet */
       debug_print("serv: recvd empty pkt\n");
    }
-   free_tun_rec(nrec);
+   if (nrec)
+      free_tun_rec(nrec);
 }
 
 void tun_peer_out_serv6(int fd_udp, int fd_tun, struct tun_state *state, char *buf) {
@@ -381,6 +438,8 @@ void tun_peer_out_serv6(int fd_udp, int fd_tun, struct tun_state *state, char *b
          recvd -= state->raw_header_size;
          memmove(buf, buf+state->raw_header_size, recvd);
       }
+      /* clamp tunneled TCP handshakes */
+      mss_clamp(state, buf, recvd);
       /* Add PlanetLab TUN PPI header */
       if (state->planetlab) {
          buf-=4; recvd+=4;
@@ -390,17 +449,19 @@ void tun_peer_out_serv6(int fd_udp, int fd_tun, struct tun_state *state, char *b
       int sport           = ntohs(((struct sockaddr_in *)nrec->sa6)->sin_port);
       int sent            = 0;
       if ( (rec = g_hash_table_lookup(state->serv, &sport)) ) {
-         sent = xwrite(fd_tun, buf, recvd);
+         sent = tap_write(fd_tun, buf, recvd);
          debug_print("serv: wrote %dB to tun\n", sent); 
       } 
 #if !defined(LOCKED)
       else if (g_hash_table_size(state->serv) <= state->fd_lim) { 
-         sent = xwrite(fd_tun, buf, recvd);
+         sent = tap_write(fd_tun, buf, recvd);
 
          /* add new record to lookup tables */
          nrec->sport = sport;
          g_hash_table_insert(state->serv, &nrec->sport, nrec);
+         session_learn(nrec, AF_INET6);
          debug_print("serv: added new entry: %d\n", sport);
+         nrec = NULL;
       } 
 #endif
       else {
@@ -410,11 +471,12 @@ void tun_peer_out_serv6(int fd_udp, int fd_tun, struct tun_state *state, char *b
    } else if (recvd < 0) {
        /* recvd ICMP msg */
       xrecverr(fd_udp, buf,  BUFF_SIZE, 0, NULL);
-   } else {
+   } else if (!ready_answer(fd_udp, buf, recvd, nrec->sa6, nrec->slen6)) {
       /* recvd unknown packet */
       debug_print("serv: recvd empty pkt\n");
    }
-   free_tun_rec(nrec);
+   if (nrec)
+      free_tun_rec(nrec);
 }
 
 void tun_peer_single(struct arguments *args) {
@@ -430,17 +492,17 @@ void tun_peer_single(struct arguments *args) {
    tun(state, &fd_tun);   
    if (state->ipv6) {
       if (state->udp) {
-         fd_serv = udp_sock6(state->public_port, 1, state->public_addr6);
-         fd_cli  = udp_sock6(state->port, 1, state->public_addr6);
+         fd_serv = udp_sock6(state->public_port, 1, state->public_addr6, 0);
+         fd_cli  = udp_sock6(state->port, 1, state->public_addr6, 0);
       } else {
          fd_serv = raw_sock6(state->public_port, state->public_addr6, 
-                            gen_bpf(state->default_if, state->public_addr6, 
-                                    state->public_port, 0), 
+                            gen_bpf(AF_INET6, state->protocol_num, NULL, 
+                                    state->public_addr6, state->public_port, 0), 
                             state->default_if, state->protocol_num, 
                             1, state->planetlab);
          fd_cli  = raw_sock6(state->port, state->public_addr6, 
-                            gen_bpf(state->default_if, state->public_addr6, 
-                                    state->port, 0), 
+                            gen_bpf(AF_INET6, state->protocol_num, NULL, 
+                                    state->public_addr6, state->port, 0), 
                             state->default_if, state->protocol_num, 
                             1, state->planetlab);
       }
@@ -449,17 +511,17 @@ void tun_peer_single(struct arguments *args) {
       tun_peer_in_func = &tun_peer_in6;
    } else {
       if (state->udp) {
-         fd_serv = udp_sock4(state->public_port, 1, state->public_addr4);
-         fd_cli  = udp_sock4(state->port, 1, state->public_addr4);
+         fd_serv = udp_sock4(state->public_port, 1, state->public_addr4, 0);
+         fd_cli  = udp_sock4(state->port, 1, state->public_addr4, 0);
       } else {
          fd_serv = raw_sock4(state->public_port, state->public_addr4, 
-                            gen_bpf(state->default_if, state->public_addr4, 
-                                    state->public_port, 0), 
+                            gen_bpf(AF_INET, state->protocol_num, NULL, 
+                                    state->public_addr4, state->public_port, 0), 
                             state->default_if, state->protocol_num, 
                             1, state->planetlab);
          fd_cli  = raw_sock4(state->port, state->public_addr4, 
-                            gen_bpf(state->default_if, state->public_addr4, 
-                                    state->port, 0), 
+                            gen_bpf(AF_INET, state->protocol_num, NULL, 
+                                    state->public_addr4, state->port, 0), 
                             state->default_if, state->protocol_num, 
                             1, state->planetlab);
       }
@@ -470,8 +532,7 @@ void tun_peer_single(struct arguments *args) {
    }
 
    /* run capture threads */
-   xthread_create(capture_notun, (void *) state, 1);
-   synchronize();
+   run_captures(state);
 
    /* run server */
    debug_print("running serv ...\n");  
@@ -536,36 +597,35 @@ void tun_peer_dual(struct arguments *args) {
    /* create tun if and sockets */
    tun(state, &fd_tun);   
    if (state->udp) {
-      fd_serv4 = udp_sock4(state->public_port, 1, state->public_addr4);
-      fd_cli4  = udp_sock4(state->port, 1, state->public_addr4);
-      fd_serv6 = udp_sock6(state->public_port, 1, state->public_addr6);
-      fd_cli6  = udp_sock6(state->port, 1, state->public_addr6);
+      fd_serv4 = udp_sock4(state->public_port, 1, state->public_addr4, 0);
+      fd_cli4  = udp_sock4(state->port, 1, state->public_addr4, 0);
+      fd_serv6 = udp_sock6(state->public_port, 1, state->public_addr6, 0);
+      fd_cli6  = udp_sock6(state->port, 1, state->public_addr6, 0);
    } else {
       fd_serv4 = raw_sock4(state->public_port, state->public_addr4, 
-                            gen_bpf(state->default_if, state->public_addr4, 
-                                    state->public_port, 0), 
+                            gen_bpf(AF_INET, state->protocol_num, NULL, 
+                                    state->public_addr4, state->public_port, 0), 
                             state->default_if, state->protocol_num, 
                             1, state->planetlab);
       fd_cli4  = raw_sock4(state->port, state->public_addr4, 
-                            gen_bpf(state->default_if, state->public_addr4, 
-                                    state->port, 0), 
+                            gen_bpf(AF_INET, state->protocol_num, NULL, 
+                                    state->public_addr4, state->port, 0), 
                             state->default_if, state->protocol_num, 
                             1, state->planetlab);
       fd_serv6 = raw_sock6(state->public_port, state->public_addr6, 
-                            gen_bpf(state->default_if, state->public_addr6, 
-                                    state->public_port, 0), 
+                            gen_bpf(AF_INET6, state->protocol_num, NULL, 
+                                    state->public_addr6, state->public_port, 0), 
                             state->default_if, state->protocol_num, 
                             1, state->planetlab);
       fd_cli6  = raw_sock6(state->port, state->public_addr6, 
-                            gen_bpf(state->default_if, state->public_addr6, 
-                                    state->port, 0), 
+                            gen_bpf(AF_INET6, state->protocol_num, NULL, 
+                                    state->public_addr6, state->port, 0), 
                             state->default_if, state->protocol_num, 
                             1, state->planetlab);
    }
 
    /* run capture threads */
-   xthread_create(capture_notun, (void *) state, 1);
-   synchronize();
+   run_captures(state);
 
    /* run server */
    debug_print("running serv ...\n");  
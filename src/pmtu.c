@@ -0,0 +1,517 @@
+/**
+ * \file pmtu.c
+ * \brief Path MTU discovery.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+
+#include "pmtu.h"
+#include "mss.h"
+#include "udptun.h"
+#include "thread.h"
+#include "sock.h"
+#include "debug.h"
+
+/**
+ * \struct pmtu_dst
+ * \brief A tracked destination.
+ */
+struct pmtu_dst {
+   struct sockaddr_storage sa; /*!< The destination, port ignored */
+   uint32_t mtu;               /*!< Its path MTU */
+   time_t   learned;           /*!< Last learn time */
+};
+
+/**
+ * \var static struct tun_state *pstate
+ * \brief The program state, NULL if discovery is disabled.
+ */
+static struct tun_state *pstate;
+
+/**
+ * \var static int tun_fd
+ * \brief The tun interface, 0 until created.
+ */
+static int tun_fd;
+
+/**
+ * \var static uint32_t ceiling
+ * \brief The highest path MTU (path-mtu or default interface MTU).
+ */
+static uint32_t ceiling;
+
+/**
+ * \var static uint32_t tun_max
+ * \brief The highest tun MTU (tun-mtu), 0 for no bound.
+ */
+static uint32_t tun_max;
+
+/**
+ * \var static struct pmtu_dst dsts[PMTU_MAX_DST]
+ * \brief The tracked destinations.
+ */
+static struct pmtu_dst dsts[PMTU_MAX_DST];
+
+/**
+ * \var static int ndsts
+ * \brief The number of tracked destinations.
+ */
+static int ndsts;
+
+/**
+ * \var static pthread_mutex_t lock
+ * \brief Guards dsts between forwarding loops and the prober.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * \var static uint32_t nonce
+ * \brief The last probe nonce.
+ */
+static uint32_t nonce;
+
+/**
+ * \fn static int pmtu_overhead(int family)
+ * \brief The encapsulation overhead of an outer family.
+ */
+static int pmtu_overhead(int family);
+
+/**
+ * \fn static struct pmtu_dst *pmtu_find(const struct sockaddr *sa)
+ * \brief Find a tracked destination, lock held.
+ *
+ * \return The destination, NULL if not tracked
+ */
+static struct pmtu_dst *pmtu_find(const struct sockaddr *sa);
+
+/**
+ * \fn static void pmtu_apply()
+ * \brief Derive the tun MTU and the MSS clamp from the smallest path
+ *        MTU, lock held.
+ */
+static void pmtu_apply();
+
+/**
+ * \fn static void *pmtu_expire(void *arg)
+ * \brief Forget the path MTUs older than PMTU_EXPIRE periodically.
+ *
+ * \param arg Unused
+ */
+static void *pmtu_expire(void *arg);
+
+/**
+ * \fn static void pmtu_set_tun(uint32_t mtu)
+ * \brief Set the tun interface MTU.
+ */
+static void pmtu_set_tun(uint32_t mtu);
+
+/**
+ * \fn static uint16_t pmtu_sum(const unsigned char *p, int len,
+ *                              uint32_t sum)
+ * \brief The internet checksum of a buffer, from a partial sum.
+ */
+static uint16_t pmtu_sum(const unsigned char *p, int len, uint32_t sum);
+
+/**
+ * \fn static void *pmtu_thread(void *arg)
+ * \brief Probe the destinations periodically.
+ *
+ * \param arg The program state
+ */
+static void *pmtu_thread(void *arg);
+
+/**
+ * \fn static void pmtu_search(struct tun_state *state,
+ *                             const struct sockaddr *sa, char *buf)
+ * \brief Search the path MTU of a destination by probing.
+ *
+ * \param state The program state
+ * \param sa The destination tunnel address
+ * \param buf A probe buffer of ceiling bytes
+ */
+static void pmtu_search(struct tun_state *state, const struct sockaddr *sa,
+                        char *buf);
+
+/**
+ * \fn static int pmtu_probe(int s, const struct sockaddr *sa, char *buf,
+ *                           int size)
+ * \brief Probe a size until answered or PMTU_PROBE_TRIES.
+ *
+ * \return 1 if answered, 0 otherwise
+ */
+static int pmtu_probe(int s, const struct sockaddr *sa, char *buf, int size);
+
+void pmtu_init(struct tun_state *state) {
+   if (!state->pmtu_disc)
+      return;
+   pstate  = state;
+   ceiling = state->path_mtu;
+   tun_max = state->tun_mtu;
+}
+
+int pmtu_overhead(int family) {
+   return (family == AF_INET6 ? 40 : 20) + 8 + pstate->raw_header_size;
+}
+
+void pmtu_tun(struct tun_state *state, int fd_tun) {
+   if (!pstate)
+      return;
+   tun_fd = fd_tun;
+
+   pthread_mutex_lock(&lock);
+   pmtu_apply();
+   pthread_mutex_unlock(&lock);
+
+   xthread_create(pmtu_expire, NULL, 1);
+   if (state->pmtu_probe_interval && state->args->mode == CLI_MODE)
+      xthread_create(pmtu_thread, (void *)state, 1);
+}
+
+void pmtu_sock(int fd, int family) {
+#if defined(IP_MTU_DISCOVER) && defined(IPV6_MTU_DISCOVER)
+   int val;
+
+   if (!pstate)
+      return;
+   if (family == AF_INET6) {
+      val = IPV6_PMTUDISC_DO;
+      if (setsockopt(fd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &val, sizeof(val)))
+         die("IPV6_MTU_DISCOVER");
+   } else {
+      val = IP_PMTUDISC_DO;
+      if (setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(val)))
+         die("IP_MTU_DISCOVER");
+   }
+#else
+   (void)fd; (void)family;
+#endif
+}
+
+struct pmtu_dst *pmtu_find(const struct sockaddr *sa) {
+   for (int i = 0; i < ndsts; i++) {
+      struct sockaddr *d = (struct sockaddr *)&dsts[i].sa;
+
+      if (d->sa_family != sa->sa_family)
+         continue;
+      if (sa->sa_family == AF_INET6 ?
+          !memcmp(&((struct sockaddr_in6 *)d)->sin6_addr,
+                  &((struct sockaddr_in6 *)sa)->sin6_addr, 16) :
+          ((struct sockaddr_in *)d)->sin_addr.s_addr ==
+          ((struct sockaddr_in *)sa)->sin_addr.s_addr)
+         return &dsts[i];
+   }
+   return NULL;
+}
+
+void pmtu_learn(const struct sockaddr *sa, uint32_t mtu) {
+   struct pmtu_dst *d;
+   uint32_t low = (sa->sa_family == AF_INET6) ? PMTU_MIN6 : PMTU_MIN4;
+
+   if (!pstate || (sa->sa_family != AF_INET && sa->sa_family != AF_INET6))
+      return;
+   mtu = min(max(mtu, low), ceiling);
+
+   pthread_mutex_lock(&lock);
+   if (!(d = pmtu_find(sa)) && ndsts < PMTU_MAX_DST) {
+      d = &dsts[ndsts++];
+      memcpy(&d->sa, sa, sa->sa_family == AF_INET6 ?
+                            sizeof(struct sockaddr_in6) :
+                            sizeof(struct sockaddr_in));
+      d->mtu = 0;
+   }
+   if (d)
+      d->learned = time(NULL);
+   if (d && d->mtu != mtu) {
+      d->mtu = mtu;
+      pmtu_apply();
+   }
+   pthread_mutex_unlock(&lock);
+}
+
+void pmtu_apply() {
+   struct tun_state *state = pstate;
+   int outer    = state->ipv6 || state->dual_stack ? AF_INET6 : AF_INET;
+   uint32_t mtu = ceiling, tun = ceiling - pmtu_overhead(outer);
+
+   for (int i = 0; i < ndsts; i++) {
+      int family = dsts[i].sa.ss_family;
+      mtu = min(mtu, dsts[i].mtu);
+      tun = min(tun, dsts[i].mtu - pmtu_overhead(family));
+   }
+   if (tun_max)
+      tun = min(tun, tun_max);
+
+   if (tun != state->tun_mtu || mtu != state->path_mtu) {
+      state->tun_mtu = tun;
+      if (tun_fd)
+         pmtu_set_tun(tun);
+      mss_set_mtu(state, mtu);
+   }
+}
+
+void *pmtu_expire(void *UNUSED(arg)) {
+   struct timespec ts = { PMTU_EXPIRE / 10, 0 };
+
+   for (;;) {
+      nanosleep(&ts, NULL);
+
+      pthread_mutex_lock(&lock);
+      time_t now = time(NULL);
+      int expired = 0;
+      for (int i = 0; i < ndsts; ) {
+         if (now - dsts[i].learned < PMTU_EXPIRE) {
+            i++;
+            continue;
+         }
+         debug_print("pmtu %u expired\n", dsts[i].mtu);
+         dsts[i] = dsts[--ndsts];
+         expired = 1;
+      }
+      if (expired)
+         pmtu_apply();
+      pthread_mutex_unlock(&lock);
+   }
+   return 0;
+}
+
+void pmtu_set_tun(uint32_t mtu) {
+   struct ifreq ifr;
+   int s;
+
+   if (!pstate->tun_if || pstate->planetlab)
+      return;
+   if ((s = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+      die("socket");
+   memset(&ifr, 0, sizeof(ifr));
+   strncpy(ifr.ifr_name, pstate->tun_if, IFNAMSIZ - 1);
+   ifr.ifr_mtu = mtu;
+   if (ioctl(s, SIOCSIFMTU, &ifr) < 0)
+      debug_print("%s mtu %u: %s\n", pstate->tun_if, mtu, strerror(errno));
+   else
+      debug_print("%s mtu %u\n", pstate->tun_if, mtu);
+   close(s);
+}
+
+uint16_t pmtu_sum(const unsigned char *p, int len, uint32_t sum) {
+   for (; len > 1; len -= 2, p += 2)
+      sum += p[0] << 8 | p[1];
+   if (len)
+      sum += p[0] << 8;
+   while (sum >> 16)
+      sum = (sum & 0xffff) + (sum >> 16);
+   return ~sum & 0xffff;
+}
+
+void pmtu_too_big(struct tun_state *state, const char *buf, int len,
+                  const struct sockaddr *sa) {
+   const unsigned char *ip;
+   unsigned char pkt[PMTU_MIN6];
+   struct pmtu_dst *d;
+   uint32_t mtu;
+   uint16_t sum;
+   int quote, off = state->raw_header ? state->raw_header_size : 0;
+
+   if (!pstate || !tun_fd || state->planetlab || len - off < 40)
+      return;
+   ip   = (const unsigned char *)buf + off;
+   len -= off;
+
+   pthread_mutex_lock(&lock);
+   mtu = (d = pmtu_find(sa)) ? d->mtu : state->path_mtu;
+   pthread_mutex_unlock(&lock);
+   mtu -= pmtu_overhead(sa->sa_family);
+   memset(pkt, 0, sizeof(pkt));
+
+   if ((ip[0] >> 4) == 4 && state->private_addr4) {
+      int hl = (ip[0] & 0x0f) * 4;
+
+      /* DF packets only, never about ICMP errors */
+      if (!(ip[6] & 0x40) || (ip[9] == IPPROTO_ICMP &&
+          (len <= hl || (ip[hl] != 0 && ip[hl] != 8))))
+         return;
+      quote = min(len, PMTU_MIN4 - 28);
+
+      pkt[0]  = 0x45;
+      pkt[2]  = (28 + quote) >> 8;
+      pkt[3]  = (28 + quote) & 0xff;
+      pkt[8]  = 64;
+      pkt[9]  = IPPROTO_ICMP;
+      inet_pton(AF_INET, state->private_addr4, pkt + 12);
+      memcpy(pkt + 16, ip + 12, 4);
+      sum = pmtu_sum(pkt, 20, 0);
+      pkt[10] = sum >> 8;
+      pkt[11] = sum & 0xff;
+
+      /* fragmentation needed, next-hop MTU */
+      pkt[20] = 3;
+      pkt[21] = 4;
+      pkt[26] = mtu >> 8;
+      pkt[27] = mtu & 0xff;
+      memcpy(pkt + 28, ip, quote);
+      sum = pmtu_sum(pkt + 20, 8 + quote, 0);
+      pkt[22] = sum >> 8;
+      pkt[23] = sum & 0xff;
+      len = 28 + quote;
+   } else if ((ip[0] >> 4) == 6 && state->private_addr6) {
+      uint32_t pseudo;
+
+      if (ip[6] == IPPROTO_ICMPV6 && (len <= 40 || ip[40] < 128))
+         return;
+      mtu   = max(mtu, (uint32_t)PMTU_MIN6);
+      quote = min(len, PMTU_MIN6 - 48);
+
+      pkt[0] = 0x60;
+      pkt[4] = (8 + quote) >> 8;
+      pkt[5] = (8 + quote) & 0xff;
+      pkt[6] = IPPROTO_ICMPV6;
+      pkt[7] = 64;
+      inet_pton(AF_INET6, state->private_addr6, pkt + 8);
+      memcpy(pkt + 24, ip + 8, 16);
+
+      /* packet too big, MTU */
+      pkt[40] = 2;
+      pkt[44] = mtu >> 24;
+      pkt[45] = (mtu >> 16) & 0xff;
+      pkt[46] = (mtu >> 8) & 0xff;
+      pkt[47] = mtu & 0xff;
+      memcpy(pkt + 48, ip, quote);
+      pseudo = pmtu_sum(pkt + 8, 32, 8 + quote + IPPROTO_ICMPV6);
+      sum = pmtu_sum(pkt + 40, 8 + quote, (uint16_t)~pseudo);
+      pkt[42] = sum >> 8;
+      pkt[43] = sum & 0xff;
+      len = 48 + quote;
+   } else
+      return;
+
+   if (write(tun_fd, pkt, len) < 0)
+      debug_print("packet too big: %s\n", strerror(errno));
+   else
+      debug_print("packet too big, mtu %u\n", mtu);
+}
+
+int pmtu_answer(int fd, const char *buf, int len,
+                const struct sockaddr *sa, socklen_t salen) {
+   struct pmtu_msg msg;
+
+   if (len < (int)sizeof(msg))
+      return 0;
+   memcpy(&msg, buf, sizeof(msg));
+   if (msg.magic != htonl(PMTU_MAGIC) || msg.type != 0)
+      return 0;
+
+   msg.type = 1;
+   if (sendto(fd, &msg, sizeof(msg), 0, sa, salen) < 0)
+      debug_print("pmtu: %s\n", strerror(errno));
+   return 1;
+}
+
+void *pmtu_thread(void *arg) {
+   struct tun_state *state = arg;
+   struct timespec ts = { state->pmtu_probe_interval, 0 };
+   char *buf = xmalloc(ceiling);
+
+   for (;;) {
+      nanosleep(&ts, NULL);
+      for (int i = 0; i < state->sa_len; i++) {
+         struct tun_rec *rec = state->cli_public[i];
+
+         if ((!state->ipv6 || state->dual_stack) && rec->sa4 &&
+             rec->sa4->sa_family == AF_INET)
+            pmtu_search(state, rec->sa4, buf);
+         if ((state->ipv6 || state->dual_stack) && rec->sa6 &&
+             rec->sa6->sa_family == AF_INET6)
+            pmtu_search(state, rec->sa6, buf);
+      }
+   }
+   return 0;
+}
+
+void pmtu_search(struct tun_state *state, const struct sockaddr *sa,
+                 char *buf) {
+   int s, lo = PMTU_BASE, hi = ceiling;
+
+   if ((s = socket(sa->sa_family, SOCK_DGRAM, 0)) < 0)
+      die("socket");
+
+   /* leave from the tunnel address, DF set, cached path MTU ignored */
+   if (sa->sa_family == AF_INET6) {
+      struct sockaddr_in6 sin6 = { .sin6_family = AF_INET6 };
+      inet_pton(AF_INET6, state->public_addr6, &sin6.sin6_addr);
+      if (bind(s, (struct sockaddr *)&sin6, sizeof(sin6)) < 0)
+         debug_print("pmtu bind: %s\n", strerror(errno));
+#if defined(IPV6_MTU_DISCOVER)
+      int val = IPV6_PMTUDISC_PROBE;
+      setsockopt(s, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &val, sizeof(val));
+#endif
+   } else {
+      struct sockaddr_in sin = { .sin_family = AF_INET };
+      inet_pton(AF_INET, state->public_addr4, &sin.sin_addr);
+      if (bind(s, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+         debug_print("pmtu bind: %s\n", strerror(errno));
+#if defined(IP_MTU_DISCOVER)
+      int val = IP_PMTUDISC_PROBE;
+      setsockopt(s, IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(val));
+#endif
+   }
+
+   /* an unanswered base size is a lost destination, not a small path */
+   if (hi < lo || !pmtu_probe(s, sa, buf, lo)) {
+      debug_print("pmtu: destination not answering\n");
+      close(s);
+      return;
+   }
+   while (lo < hi) {
+      int mid = (lo + hi + 1) / 2;
+      if (pmtu_probe(s, sa, buf, mid))
+         lo = mid;
+      else
+         hi = mid - 1;
+   }
+   close(s);
+   pmtu_learn(sa, lo);
+}
+
+int pmtu_probe(int s, const struct sockaddr *sa, char *buf, int size) {
+   struct pmtu_msg *req = (struct pmtu_msg *)buf, ans;
+   struct pollfd pfd = { s, POLLIN, 0 };
+   socklen_t salen = (sa->sa_family == AF_INET6) ?
+                        sizeof(struct sockaddr_in6) :
+                        sizeof(struct sockaddr_in);
+   int payload = size - (sa->sa_family == AF_INET6 ? 40 : 20) - 8;
+
+   memset(buf, 0, payload);
+   req->magic = htonl(PMTU_MAGIC);
+   req->size  = htons(size);
+   for (int i = 0; i < PMTU_PROBE_TRIES; i++) {
+      req->nonce = __atomic_add_fetch(&nonce, 1, __ATOMIC_RELAXED) ^ getpid();
+
+      /* larger than the local interface */
+      if (sendto(s, buf, payload, 0, sa, salen) < 0)
+         return 0;
+      while (poll(&pfd, 1, PMTU_PROBE_TIMEOUT) > 0) {
+         if (recv(s, &ans, sizeof(ans), 0) == sizeof(ans) &&
+             ans.magic == req->magic && ans.nonce == req->nonce &&
+             ans.type == 1 && ans.size == req->size)
+            return 1;
+      }
+   }
+   return 0;
+}
+
@@ -0,0 +1,164 @@
+/**
+ * \file pmtu.h
+ * \brief Path MTU discovery prototypes.
+ *
+ *    UDP tunnel sockets set the DF bit (IP_MTU_DISCOVER), so that the
+ *    path MTU of each destination is learned from the EMSGSIZE
+ *    notifications of the socket error queues (ICMP fragmentation
+ *    needed and packet too big, or local MTU errors), and optionally
+ *    from client probes through the tunnel (PLPMTUD, RFC 8899): at
+ *    every pmtu-probe-interval, the largest datagram answered by each
+ *    server is searched between PMTU_BASE and the path-mtu ceiling.
+ *    Probes and answers are UDP datagrams starting with:
+ *
+ *    magic (4B) nonce (4B) type (1B) pad (1B) size (2B)
+ *
+ *    the probe being padded to size bytes of outer IP packet. The
+ *    magic never reads as an IPv4 or IPv6 header.
+ *
+ *    The smallest path MTU, minus the encapsulation overhead, becomes
+ *    the tun MTU (bounded by tun-mtu) and feeds the MSS clamp. A path
+ *    MTU not learned again for PMTU_EXPIRE s is forgotten, so that a
+ *    stale or forged notification does not shrink the tunnel for
+ *    good. Inner
+ *    packets dropped by an EMSGSIZE send are answered with an ICMP
+ *    fragmentation needed (DF packets) or ICMPv6 packet too big
+ *    message carrying the tunnel MTU of their destination.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_PMTU_H
+#define UDPTUN_PMTU_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "state.h"
+
+/**
+ * \def PMTU_MAGIC
+ * \brief Probe message magic ("PMTP").
+ */
+#define PMTU_MAGIC 0x504d5450
+
+/**
+ * \def PMTU_BASE
+ * \brief Path MTU confirmed before searching (RFC 8899 BASE_PLPMTU).
+ */
+#define PMTU_BASE 1200
+
+/**
+ * \def PMTU_MIN4
+ * \brief Lowest IPv4 path MTU.
+ */
+#define PMTU_MIN4 576
+
+/**
+ * \def PMTU_MIN6
+ * \brief Lowest IPv6 path MTU.
+ */
+#define PMTU_MIN6 1280
+
+/**
+ * \def PMTU_MAX_DST
+ * \brief Maximum number of tracked destinations.
+ */
+#define PMTU_MAX_DST 256
+
+/**
+ * \def PMTU_EXPIRE
+ * \brief Lifetime of a learned path MTU (s), as the kernel mtu_expires.
+ */
+#define PMTU_EXPIRE 600
+
+/**
+ * \def PMTU_PROBE_TRIES
+ * \brief Probes sent per size before it is deemed too big.
+ */
+#define PMTU_PROBE_TRIES 3
+
+/**
+ * \def PMTU_PROBE_TIMEOUT
+ * \brief Probe answer timeout (ms).
+ */
+#define PMTU_PROBE_TIMEOUT 200
+
+/**
+ * \struct pmtu_msg
+ * \brief A probe or answer header.
+ */
+struct pmtu_msg {
+   uint32_t magic; /*!< PMTU_MAGIC, network byte order */
+   uint32_t nonce; /*!< echoed by the answer */
+   uint8_t  type;  /*!< 0 for a probe, 1 for an answer */
+   uint8_t  pad;
+   uint16_t size;  /*!< outer IP packet size, network byte order */
+};
+
+/**
+ * \fn void pmtu_init(struct tun_state *state)
+ * \brief Enable path MTU discovery, before tunnel sockets are created.
+ *
+ * \param state The program state
+ */
+void pmtu_init(struct tun_state *state);
+
+/**
+ * \fn void pmtu_tun(struct tun_state *state, int fd_tun)
+ * \brief Set the initial tun MTU and run the prober (client).
+ *
+ * \param state The program state
+ * \param fd_tun The tun interface
+ */
+void pmtu_tun(struct tun_state *state, int fd_tun);
+
+/**
+ * \fn void pmtu_sock(int fd, int family)
+ * \brief Set the DF bit of a tunnel socket if discovery is enabled.
+ *
+ * \param fd The socket
+ * \param family AF_INET or AF_INET6
+ */
+void pmtu_sock(int fd, int family);
+
+/**
+ * \fn void pmtu_learn(const struct sockaddr *sa, uint32_t mtu)
+ * \brief Record the path MTU of a destination. Thread-safe.
+ *
+ * \param sa The destination
+ * \param mtu Its path MTU
+ */
+void pmtu_learn(const struct sockaddr *sa, uint32_t mtu);
+
+/**
+ * \fn void pmtu_too_big(struct tun_state *state, const char *buf,
+ *                       int len, const struct sockaddr *sa)
+ * \brief Answer a tunneled packet that did not fit its path.
+ *
+ * \param state The program state
+ * \param buf The datagram, raw header included
+ * \param len Its length
+ * \param sa The destination
+ */
+void pmtu_too_big(struct tun_state *state, const char *buf, int len,
+                  const struct sockaddr *sa);
+
+/**
+ * \fn int pmtu_answer(int fd, const char *buf, int len,
+ *                     const struct sockaddr *sa, socklen_t salen)
+ * \brief Answer a probe received on a tunnel socket.
+ *
+ * \param fd The tunnel socket
+ * \param buf The received datagram
+ * \param len Its length
+ * \param sa The sender
+ * \param salen The sender address length
+ * \return 1 if it was a probe, 0 otherwise
+ */
+int pmtu_answer(int fd, const char *buf, int len,
+                const struct sockaddr *sa, socklen_t salen);
+
+#endif
+
@@ -0,0 +1,146 @@
+/**
+ * \file ready.c
+ * \brief Readiness handshake.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ready.h"
+#include "sock.h"
+#include "debug.h"
+
+/**
+ * \var static int expected
+ * \brief The number of servers of each kind, 0 until servers start.
+ */
+static int expected;
+
+/**
+ * \var static int listening
+ * \brief The number of private and public servers listening, atomic.
+ */
+static int listening[2];
+
+/**
+ * \var static uint32_t nonce
+ * \brief The last probe nonce.
+ */
+static uint32_t nonce;
+
+/**
+ * \fn static uint64_t ready_now()
+ * \brief The monotonic time in ms.
+ */
+static uint64_t ready_now();
+
+uint64_t ready_now() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void ready_serv_init(int nservers) {
+   __atomic_store_n(&expected, nservers, __ATOMIC_RELEASE);
+}
+
+void ready_listening(int tun) {
+   __atomic_add_fetch(&listening[tun ? 0 : 1], 1, __ATOMIC_RELEASE);
+}
+
+int ready_answer(int fd, const char *buf, int len,
+                 const struct sockaddr *sa, socklen_t salen) {
+   struct ready_msg msg;
+   int n = __atomic_load_n(&expected, __ATOMIC_ACQUIRE);
+
+   if (len != sizeof(msg))
+      return 0;
+   memcpy(&msg, buf, sizeof(msg));
+   if (msg.magic != htonl(READY_MAGIC) || msg.type != 0)
+      return 0;
+
+   msg.type  = 1;
+   msg.ready = 0;
+   if (n && __atomic_load_n(&listening[0], __ATOMIC_ACQUIRE) >= n)
+      msg.ready |= READY_TUN;
+   if (n && __atomic_load_n(&listening[1], __ATOMIC_ACQUIRE) >= n)
+      msg.ready |= READY_NOTUN;
+   if (sendto(fd, &msg, sizeof(msg), 0, sa, salen) < 0)
+      debug_print("ready: %s\n", strerror(errno));
+   return 1;
+}
+
+int ready_probing(struct tun_state *state) {
+   return state->ready_timeout && state->udp;
+}
+
+int ready_wait(struct tun_state *state, int index) {
+   struct tun_rec *rec = state->cli_public[index];
+   struct sockaddr *sa;
+   socklen_t salen;
+   struct ready_msg req, ans;
+   struct pollfd pfd;
+   uint64_t start = ready_now(), deadline, round;
+   int s, backoff = READY_BACKOFF_MIN, probes = 0, ready = 0, left;
+
+   if (state->ipv6 && !state->dual_stack) {
+      sa    = rec->sa6;
+      salen = sizeof(struct sockaddr_in6);
+   } else {
+      sa    = rec->sa4;
+      salen = sizeof(struct sockaddr_in);
+   }
+   if ((s = socket(sa->sa_family, SOCK_DGRAM, 0)) < 0)
+      die("socket");
+
+   memset(&req, 0, sizeof(req));
+   req.magic = htonl(READY_MAGIC);
+   req.nonce = __atomic_add_fetch(&nonce, 1, __ATOMIC_RELAXED) ^ getpid();
+   deadline  = start + (uint64_t)state->ready_timeout * 1000;
+   pfd.fd     = s;
+   pfd.events = POLLIN;
+
+   while (!ready && ready_now() < deadline) {
+      /* refused or unreachable peers are retried as lost probes */
+      if (sendto(s, &req, sizeof(req), 0, sa, salen) < 0)
+         debug_print("ready probe: %s\n", strerror(errno));
+      probes++;
+
+      /* wait for an answer to any probe until the next one */
+      round = ready_now() + backoff;
+      if (round > deadline)
+         round = deadline;
+      while (!ready && (left = (int)(round - ready_now())) > 0) {
+         if (poll(&pfd, 1, left) <= 0)
+            continue;
+         if (recv(s, &ans, sizeof(ans), 0) != sizeof(ans) ||
+             ans.magic != req.magic || ans.nonce != req.nonce ||
+             ans.type != 1)
+            continue;
+         ready = (ans.ready & READY_BOTH) == READY_BOTH;
+      }
+      if (backoff < READY_BACKOFF_MAX)
+         backoff = (backoff * 2 > READY_BACKOFF_MAX) ?
+                     READY_BACKOFF_MAX : backoff * 2;
+   }
+   close(s);
+
+   debug_print("destination %d %s after %d probes, %llu ms\n", index,
+               ready ? "ready" : "not ready", probes,
+               (unsigned long long)(ready_now() - start));
+   return ready;
+}
+
@@ -0,0 +1,120 @@
+/**
+ * \file ready.h
+ * \brief Readiness handshake prototypes.
+ *
+ *    Before running the flows of a destination, the client probes its
+ *    tunnel port until both its tunneled and direct TCP servers listen,
+ *    instead of sleeping initial-sleep seconds. Probes and answers are
+ *    UDP datagrams shorter than MIN_PKT_SIZE, so that they are never
+ *    mistaken for tunneled packets:
+ *
+ *    magic (4B) nonce (4B) type (1B) ready (1B) pad (2B)
+ *
+ *    Probes are retransmitted with exponential backoff, from
+ *    READY_BACKOFF_MIN to READY_BACKOFF_MAX, until ready-timeout.
+ *    Non-UDP tunnels keep the initial sleep.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_READY_H
+#define UDPTUN_READY_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "state.h"
+
+/**
+ * \def READY_MAGIC
+ * \brief Readiness message magic ("CCRP").
+ */
+#define READY_MAGIC 0x43435250
+
+/**
+ * \def READY_BACKOFF_MIN
+ * \brief Initial probe retransmission timeout (ms).
+ */
+#define READY_BACKOFF_MIN 10
+
+/**
+ * \def READY_BACKOFF_MAX
+ * \brief Maximum probe retransmission timeout (ms).
+ */
+#define READY_BACKOFF_MAX 1000
+
+/**
+ * \enum ready_flags
+ * \brief The servers of a destination that listen.
+ */
+enum ready_flags {
+   READY_TUN   = 1, /*!< private (tunneled) servers */
+   READY_NOTUN = 2, /*!< public (direct) servers */
+   READY_BOTH  = 3
+};
+
+/**
+ * \struct ready_msg
+ * \brief A readiness probe or answer.
+ */
+struct ready_msg {
+   uint32_t magic; /*!< READY_MAGIC, network byte order */
+   uint32_t nonce; /*!< echoed by the answer */
+   uint8_t  type;  /*!< 0 for a probe, 1 for an answer */
+   uint8_t  ready; /*!< enum ready_flags */
+   uint16_t pad;
+};
+
+/**
+ * \fn void ready_serv_init(int nservers)
+ * \brief Set the number of servers of each kind to wait for.
+ *
+ * \param nservers The number of private (and of public) servers
+ */
+void ready_serv_init(int nservers);
+
+/**
+ * \fn void ready_listening(int tun)
+ * \brief Report a TCP server as listening. Thread-safe.
+ *
+ * \param tun 1 for a private server, 0 for a public one
+ */
+void ready_listening(int tun);
+
+/**
+ * \fn int ready_answer(int fd, const char *buf, int len,
+ *                      const struct sockaddr *sa, socklen_t salen)
+ * \brief Answer a readiness probe received on a tunnel socket.
+ *
+ * \param fd The tunnel socket
+ * \param buf The received datagram
+ * \param len Its length
+ * \param sa The sender
+ * \param salen The sender address length
+ * \return 1 if it was a probe, 0 otherwise
+ */
+int ready_answer(int fd, const char *buf, int len,
+                 const struct sockaddr *sa, socklen_t salen);
+
+/**
+ * \fn int ready_probing(struct tun_state *state)
+ * \brief Tell if destinations are probed rather than waited for.
+ *
+ * \param state The program state
+ * \return 1 if ready-timeout is set on a UDP tunnel, 0 otherwise
+ */
+int ready_probing(struct tun_state *state);
+
+/**
+ * \fn int ready_wait(struct tun_state *state, int index)
+ * \brief Probe a destination until its servers listen or ready-timeout.
+ *
+ * \param state The program state
+ * \param index The destination index
+ * \return 1 if ready, 0 on timeout
+ */
+int ready_wait(struct tun_state *state, int index);
+
+#endif
+
@@ -0,0 +1,549 @@
+/**
+ * \file rtnl.c
+ * \brief rtnetlink interface configuration.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+
+#include "rtnl.h"
+
+#if defined(LINUX_OS)
+#  include <linux/netlink.h>
+#  include <linux/rtnetlink.h>
+#  include <linux/if_addr.h>
+#  include <linux/if_link.h>
+
+#include "sock.h"
+#include "debug.h"
+
+/* older headers */
+#ifndef IFA_F_NOPREFIXROUTE
+#  define IFA_F_NOPREFIXROUTE 0x200
+#endif
+
+/**
+ * \struct rtnl_batch
+ * \brief A batch of requests.
+ */
+struct rtnl_batch {
+   char     buf[RTNL_BUFSIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+   uint32_t len;   /*!< used bytes */
+   uint32_t seq;   /*!< last sequence number */
+};
+
+/**
+ * \struct rtnl_addr
+ * \brief An interface address.
+ */
+struct rtnl_addr {
+   uint8_t       family;   /*!< AF_INET or AF_INET6 */
+   uint8_t       plen;     /*!< prefix length */
+   unsigned char addr[16]; /*!< address */
+};
+
+/**
+ * \struct rtnl_link
+ * \brief The dumped state of an interface, compared to a configuration.
+ */
+struct rtnl_link {
+   int              index;     /*!< interface index */
+   struct rtnl_addr want[2];   /*!< configured IPv4 and IPv6 addresses */
+   struct rtnl_addr net[2];    /*!< configured IPv4 and IPv6 prefixes */
+   uint32_t         flags;     /*!< interface flags */
+   uint32_t         mtu;       /*!< MTU */
+   uint32_t         txqlen;    /*!< txqueuelen */
+   uint8_t          addrs;     /*!< found addresses (bitmask of want) */
+   uint8_t          routes;    /*!< found prefix routes (bitmask of net) */
+   uint32_t         stale;     /*!< unknown global addresses */
+   struct rtnl_addr stale_addr[RTNL_STALE_MAX]; /*!< the first ones */
+};
+
+/**
+ * \fn static struct nlmsghdr *rtnl_msg(struct rtnl_batch *b, int type,
+ *                                      int flags, const void *hdr,
+ *                                      size_t hdrlen)
+ * \brief Append a request to a batch.
+ *
+ * \return The request header
+ */
+static struct nlmsghdr *rtnl_msg(struct rtnl_batch *b, int type, int flags,
+                                 const void *hdr, size_t hdrlen);
+
+/**
+ * \fn static void rtnl_attr(struct rtnl_batch *b, struct nlmsghdr *nlh,
+ *                           int type, const void *data, size_t len)
+ * \brief Append an attribute to the last request of a batch.
+ */
+static void rtnl_attr(struct rtnl_batch *b, struct nlmsghdr *nlh, int type,
+                      const void *data, size_t len);
+
+/**
+ * \fn static int rtnl_prefix(int family, const char *prefix)
+ * \brief Parse a prefix length or a netmask.
+ *
+ * \return The prefix length, -1 if invalid
+ */
+static int rtnl_prefix(int family, const char *prefix);
+
+/**
+ * \fn static int rtnl_addr(struct rtnl_batch *b, int family, int index,
+ *                          const char *addr, const char *prefix)
+ * \brief Append the address and prefix route requests of a family.
+ *
+ * \return 0 on success, -1 if the address or prefix is invalid
+ */
+static int rtnl_addr(struct rtnl_batch *b, int family, int index,
+                     const char *addr, const char *prefix);
+
+/**
+ * \fn static int rtnl_parse(int family, const char *addr, 
+ *                           const char *prefix, struct rtnl_addr *a,
+ *                           struct rtnl_addr *net)
+ * \brief Parse an address and its prefix, and compute the network.
+ *
+ * \return 0 on success, -1 if invalid
+ */
+static int rtnl_parse(int family, const char *addr, const char *prefix,
+                      struct rtnl_addr *a, struct rtnl_addr *net);
+
+/**
+ * \fn static int rtnl_dump(int s, int type, 
+ *                          void (*cb)(struct nlmsghdr *, struct rtnl_link *),
+ *                          struct rtnl_link *link)
+ * \brief Dump links, addresses or routes.
+ *
+ * \param s A NETLINK_ROUTE socket
+ * \param type RTM_GETLINK, RTM_GETADDR or RTM_GETROUTE
+ * \param cb Called on each dumped object
+ * \param link The callback argument
+ * \return 0 on success, -1 on error (errno is filled)
+ */
+static int rtnl_dump(int s, int type, 
+                     void (*cb)(struct nlmsghdr *, struct rtnl_link *),
+                     struct rtnl_link *link);
+
+/**
+ * \fn static void rtnl_dump_cb(struct nlmsghdr *nlh, struct rtnl_link *link)
+ * \brief rtnl_dump callback, compare an object with the configuration.
+ */
+static void rtnl_dump_cb(struct nlmsghdr *nlh, struct rtnl_link *link);
+
+/**
+ * \fn static int rtnl_commit(struct rtnl_batch *b)
+ * \brief Send a batch and wait for every acknowledgment.
+ *
+ * \return 0 on success, -1 on error (errno is filled)
+ */
+static int rtnl_commit(struct rtnl_batch *b);
+
+struct nlmsghdr *rtnl_msg(struct rtnl_batch *b, int type, int flags,
+                          const void *hdr, size_t hdrlen) {
+   struct nlmsghdr *nlh = (struct nlmsghdr *)(b->buf + b->len);
+
+   if (b->len + NLMSG_SPACE(hdrlen) > RTNL_BUFSIZE) {
+      errno=ENOBUFS;
+      die("rtnl batch");
+   }
+   memset(nlh, 0, NLMSG_SPACE(hdrlen));
+   nlh->nlmsg_len   = NLMSG_LENGTH(hdrlen);
+   nlh->nlmsg_type  = type;
+   nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+   nlh->nlmsg_seq   = ++b->seq;
+   memcpy(NLMSG_DATA(nlh), hdr, hdrlen);
+   b->len += NLMSG_ALIGN(nlh->nlmsg_len);
+   return nlh;
+}
+
+void rtnl_attr(struct rtnl_batch *b, struct nlmsghdr *nlh, int type,
+               const void *data, size_t len) {
+   struct rtattr *rta = (struct rtattr *)(b->buf + b->len);
+
+   if (b->len + RTA_SPACE(len) > RTNL_BUFSIZE) {
+      errno=ENOBUFS;
+      die("rtnl batch");
+   }
+   memset(rta, 0, RTA_SPACE(len));
+   rta->rta_type = type;
+   rta->rta_len  = RTA_LENGTH(len);
+   memcpy(RTA_DATA(rta), data, len);
+   nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+   b->len += RTA_ALIGN(rta->rta_len);
+}
+
+int rtnl_prefix(int family, const char *prefix) {
+   int max = family == AF_INET ? 32 : 128, len = 0;
+   struct in_addr mask;
+
+   if (!prefix)
+      return max;
+   if (family == AF_INET && strchr(prefix, '.')) {
+      if (inet_pton(AF_INET, prefix, &mask) != 1)
+         return -1;
+      for (uint32_t m = ntohl(mask.s_addr); m & 0x80000000; m <<= 1)
+         len++;
+      return len;
+   }
+   len = strtol(prefix, NULL, 10);
+   return (len < 0 || len > max) ? -1 : len;
+}
+
+int rtnl_parse(int family, const char *addr, const char *prefix,
+               struct rtnl_addr *a, struct rtnl_addr *net) {
+   int alen = family == AF_INET ? 4 : 16, plen, i;
+
+   if (inet_pton(family, addr, a->addr) != 1 ||
+       (plen = rtnl_prefix(family, prefix)) < 0) {
+      errno=EINVAL;
+      return -1;
+   }
+   a->family = net->family = family;
+   a->plen   = net->plen   = plen;
+   for (i = 0; i < alen; i++) {
+      int bits = plen - i * 8;
+      net->addr[i] = a->addr[i] & (bits >= 8 ? 0xff : bits <= 0 ? 0 :
+                                   (0xff << (8 - bits)) & 0xff);
+   }
+   return 0;
+}
+
+int rtnl_addr(struct rtnl_batch *b, int family, int index,
+              const char *addr, const char *prefix) {
+   struct rtnl_addr a, net;
+   int alen = family == AF_INET ? 4 : 16;
+   uint32_t flags = IFA_F_NOPREFIXROUTE;
+
+   if (rtnl_parse(family, addr, prefix, &a, &net) < 0)
+      return -1;
+
+   /* address */
+   struct ifaddrmsg ifa = {
+      .ifa_family = family, .ifa_prefixlen = a.plen,
+      .ifa_scope  = RT_SCOPE_UNIVERSE, .ifa_index = index
+   };
+   if (family == AF_INET6)
+      flags |= IFA_F_NODAD;
+   struct nlmsghdr *nlh = rtnl_msg(b, RTM_NEWADDR,
+                                   NLM_F_CREATE | NLM_F_REPLACE,
+                                   &ifa, sizeof(ifa));
+   rtnl_attr(b, nlh, IFA_LOCAL, a.addr, alen);
+   rtnl_attr(b, nlh, IFA_ADDRESS, a.addr, alen);
+   rtnl_attr(b, nlh, IFA_FLAGS, &flags, sizeof(flags));
+
+   /* private prefix route */
+   struct rtmsg rtm = {
+      .rtm_family   = family, .rtm_dst_len = net.plen,
+      .rtm_table    = RT_TABLE_MAIN, .rtm_protocol = RTPROT_BOOT,
+      .rtm_scope    = family == AF_INET ? RT_SCOPE_LINK : RT_SCOPE_UNIVERSE,
+      .rtm_type     = RTN_UNICAST
+   };
+   nlh = rtnl_msg(b, RTM_NEWROUTE, NLM_F_CREATE | NLM_F_REPLACE,
+                  &rtm, sizeof(rtm));
+   rtnl_attr(b, nlh, RTA_DST, net.addr, alen);
+   rtnl_attr(b, nlh, RTA_OIF, &index, sizeof(index));
+   if (family == AF_INET)
+      rtnl_attr(b, nlh, RTA_PREFSRC, a.addr, alen);
+   return 0;
+}
+
+int rtnl_dump(int s, int type, 
+              void (*cb)(struct nlmsghdr *, struct rtnl_link *),
+              struct rtnl_link *link) {
+   struct sockaddr_nl sa = { .nl_family = AF_NETLINK };
+   char buf[RTNL_BUFSIZE * 4] __attribute__((aligned(NLMSG_ALIGNTO)));
+   struct {
+      struct nlmsghdr  nlh;
+      struct ifinfomsg ifi; /* the largest of the request headers */
+   } req;
+   int len;
+
+   memset(&req, 0, sizeof(req));
+   req.nlh.nlmsg_len   = sizeof(req);
+   req.nlh.nlmsg_type  = type;
+   req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+   req.ifi.ifi_family  = AF_UNSPEC;
+   if (sendto(s, &req, sizeof(req), 0, (struct sockaddr *)&sa, 
+              sizeof(sa)) < 0)
+      return -1;
+
+   while (1) {
+      if ((len = recv(s, buf, sizeof(buf), 0)) < 0) {
+         if (errno == EINTR)
+            continue;
+         return -1;
+      }
+      struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+      for (; NLMSG_OK(nlh, (uint32_t)len); nlh = NLMSG_NEXT(nlh, len)) {
+         if (nlh->nlmsg_type == NLMSG_DONE)
+            return 0;
+         if (nlh->nlmsg_type == NLMSG_ERROR) {
+            errno = -((struct nlmsgerr *)NLMSG_DATA(nlh))->error;
+            return -1;
+         }
+         cb(nlh, link);
+      }
+   }
+}
+
+void rtnl_dump_cb(struct nlmsghdr *nlh, struct rtnl_link *link) {
+   struct rtattr *rta;
+   int rlen, i;
+
+   if (nlh->nlmsg_type == RTM_NEWLINK) {
+      struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+      if (ifi->ifi_index != link->index)
+         return;
+      link->flags = ifi->ifi_flags;
+      rlen = IFLA_PAYLOAD(nlh);
+      for (rta = IFLA_RTA(ifi); RTA_OK(rta, rlen); rta = RTA_NEXT(rta, rlen))
+         if (rta->rta_type == IFLA_MTU)
+            link->mtu = *(uint32_t *)RTA_DATA(rta);
+         else if (rta->rta_type == IFLA_TXQLEN)
+            link->txqlen = *(uint32_t *)RTA_DATA(rta);
+
+   } else if (nlh->nlmsg_type == RTM_NEWADDR) {
+      struct ifaddrmsg *ifa = NLMSG_DATA(nlh);
+      struct rtnl_addr a = { .family = ifa->ifa_family, 
+                            .plen   = ifa->ifa_prefixlen };
+      size_t alen = ifa->ifa_family == AF_INET ? 4 : 16;
+      int found = 0;
+      if ((int)ifa->ifa_index != link->index || 
+          ifa->ifa_scope != RT_SCOPE_UNIVERSE)
+         return;
+      rlen = IFA_PAYLOAD(nlh);
+      for (rta = IFA_RTA(ifa); RTA_OK(rta, rlen); rta = RTA_NEXT(rta, rlen))
+         /* IFA_LOCAL is the address of IPv4 point-to-point links */
+         if ((rta->rta_type == IFA_LOCAL || (rta->rta_type == IFA_ADDRESS && 
+              ifa->ifa_family == AF_INET6)) && RTA_PAYLOAD(rta) >= alen)
+            memcpy(a.addr, RTA_DATA(rta), alen);
+      for (i = 0; i < 2; i++)
+         if (link->want[i].family == a.family && 
+             link->want[i].plen == a.plen &&
+             !memcmp(link->want[i].addr, a.addr, alen)) {
+            link->addrs |= 1 << i;
+            found = 1;
+         }
+      if (!found && link->stale++ < RTNL_STALE_MAX)
+         link->stale_addr[link->stale - 1] = a;
+
+   } else if (nlh->nlmsg_type == RTM_NEWROUTE) {
+      struct rtmsg *rtm = NLMSG_DATA(nlh);
+      struct rtnl_addr dst = { .family = rtm->rtm_family, 
+                              .plen   = rtm->rtm_dst_len };
+      size_t alen = rtm->rtm_family == AF_INET ? 4 : 16;
+      int oif = 0;
+      if (rtm->rtm_table != RT_TABLE_MAIN)
+         return;
+      rlen = RTM_PAYLOAD(nlh);
+      for (rta = RTM_RTA(rtm); RTA_OK(rta, rlen); rta = RTA_NEXT(rta, rlen))
+         if (rta->rta_type == RTA_DST && RTA_PAYLOAD(rta) >= alen)
+            memcpy(dst.addr, RTA_DATA(rta), alen);
+         else if (rta->rta_type == RTA_OIF)
+            oif = *(int *)RTA_DATA(rta);
+      if (oif != link->index)
+         return;
+      for (i = 0; i < 2; i++)
+         if (link->net[i].family == dst.family && 
+             link->net[i].plen == dst.plen &&
+             !memcmp(link->net[i].addr, dst.addr, alen))
+            link->routes |= 1 << i;
+   }
+}
+
+int rtnl_commit(struct rtnl_batch *b) {
+   struct sockaddr_nl sa = { .nl_family = AF_NETLINK };
+   char ack[RTNL_BUFSIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+   uint32_t acked = 0;
+   int s, len, err = 0;
+
+   if ((s = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)) < 0)
+      return -1;
+   if (sendto(s, b->buf, b->len, 0, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+      goto err;
+
+   /* one acknowledgment per request */
+   while (acked < b->seq) {
+      if ((len = recv(s, ack, sizeof(ack), 0)) < 0) {
+         if (errno == EINTR)
+            continue;
+         goto err;
+      }
+      struct nlmsghdr *nlh = (struct nlmsghdr *)ack;
+      for (; NLMSG_OK(nlh, (uint32_t)len); nlh = NLMSG_NEXT(nlh, len)) {
+         if (nlh->nlmsg_type != NLMSG_ERROR)
+            continue;
+         struct nlmsgerr *e = (struct nlmsgerr *)NLMSG_DATA(nlh);
+         if (e->error && !err) {
+            err = -e->error;
+            debug_print("rtnetlink request %u: %s\n", nlh->nlmsg_seq,
+                        strerror(err));
+         }
+         acked++;
+      }
+   }
+   close(s);
+   if (err) {
+      errno = err;
+      return -1;
+   }
+   return 0;
+
+err:
+   err = errno;
+   close(s);
+   errno = err;
+   return -1;
+}
+
+int rtnl_tun_setup(const char *dev, const struct rtnl_tun *cfg) {
+   struct rtnl_batch *b;
+   int index, ret = -1;
+
+   if (!(index = if_nametoindex(dev)))
+      return -1;
+   if (!(b = calloc(1, sizeof(struct rtnl_batch))))
+      return -1;
+
+   /* link up first, addresses and routes need it */
+   struct ifinfomsg ifi = {
+      .ifi_family = AF_UNSPEC, .ifi_index = index,
+      .ifi_flags  = IFF_UP, .ifi_change = IFF_UP
+   };
+   struct nlmsghdr *nlh = rtnl_msg(b, RTM_NEWLINK, 0, &ifi, sizeof(ifi));
+   if (cfg->mtu)
+      rtnl_attr(b, nlh, IFLA_MTU, &cfg->mtu, sizeof(cfg->mtu));
+   if (cfg->txqlen)
+      rtnl_attr(b, nlh, IFLA_TXQLEN, &cfg->txqlen, sizeof(cfg->txqlen));
+
+   if (cfg->addr4 && rtnl_addr(b, AF_INET, index, cfg->addr4, cfg->prefix4))
+      goto out;
+   if (cfg->addr6 && rtnl_addr(b, AF_INET6, index, cfg->addr6, cfg->prefix6))
+      goto out;
+
+   ret = rtnl_commit(b);
+   debug_print("%s configured with %u rtnetlink requests\n", dev, b->seq);
+out:
+   free(b);
+   return ret;
+}
+
+int rtnl_tun_verify(const char *dev, const struct rtnl_tun *cfg, int flush) {
+   struct rtnl_link *link;
+   uint8_t want = 0;
+   int s, ret = -1;
+   uint32_t i;
+
+   if (!(link = calloc(1, sizeof(struct rtnl_link))))
+      return -1;
+   if (!(link->index = if_nametoindex(dev)))
+      goto out;
+   if (cfg->addr4) {
+      if (rtnl_parse(AF_INET, cfg->addr4, cfg->prefix4, 
+                     &link->want[0], &link->net[0]) < 0)
+         goto out;
+      want |= 1;
+   }
+   if (cfg->addr6) {
+      if (rtnl_parse(AF_INET6, cfg->addr6, cfg->prefix6, 
+                     &link->want[1], &link->net[1]) < 0)
+         goto out;
+      want |= 2;
+   }
+
+   if ((s = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)) < 0)
+      goto out;
+   if (rtnl_dump(s, RTM_GETLINK,  rtnl_dump_cb, link) < 0 ||
+       rtnl_dump(s, RTM_GETADDR,  rtnl_dump_cb, link) < 0 ||
+       rtnl_dump(s, RTM_GETROUTE, rtnl_dump_cb, link) < 0) {
+      close(s);
+      goto out;
+   }
+   close(s);
+
+   ret = (link->flags & IFF_UP) && 
+         (!cfg->mtu || link->mtu == cfg->mtu) &&
+         (!cfg->txqlen || link->txqlen == cfg->txqlen) &&
+         link->addrs == want && link->routes == want && !link->stale;
+   debug_print("%s: up %d mtu %u txqlen %u addresses %x/%x routes %x/%x "
+               "stale %u\n", dev, !!(link->flags & IFF_UP), link->mtu, 
+               link->txqlen, link->addrs, want, link->routes, want, 
+               link->stale);
+
+   /* remove the addresses (and IPv4 prefix routes) of another config */
+   if (!ret && flush && link->stale) {
+      struct rtnl_batch *b = calloc(1, sizeof(struct rtnl_batch));
+      if (!b) {
+         ret = -1;
+         goto out;
+      }
+      for (i = 0; i < link->stale && i < RTNL_STALE_MAX; i++) {
+         struct rtnl_addr *a = &link->stale_addr[i];
+         struct ifaddrmsg ifa = {
+            .ifa_family = a->family, .ifa_prefixlen = a->plen,
+            .ifa_index  = link->index
+         };
+         struct nlmsghdr *nlh = rtnl_msg(b, RTM_DELADDR, 0, &ifa, 
+                                         sizeof(ifa));
+         rtnl_attr(b, nlh, IFA_LOCAL, a->addr, a->family == AF_INET ? 4 : 16);
+      }
+      if (rtnl_commit(b) < 0)
+         ret = -1;
+      free(b);
+   }
+out:
+   free(link);
+   return ret;
+}
+
+int rtnl_tun_routes(const char *dev, const struct rtnl_route *routes, 
+                    int len) {
+   struct rtnl_batch *b;
+   int index, i, ret = 0;
+
+   if (!len)
+      return 0;
+   if (!(index = if_nametoindex(dev)))
+      return -1;
+   if (!(b = calloc(1, sizeof(struct rtnl_batch))))
+      return -1;
+
+   for (i = 0; i < len && !ret; i++) {
+      const struct rtnl_route *r = &routes[i];
+      int alen = r->family == AF_INET ? 4 : 16;
+      struct rtmsg rtm = {
+         .rtm_family   = r->family, .rtm_dst_len = r->plen,
+         .rtm_table    = RT_TABLE_MAIN, .rtm_protocol = RTPROT_BOOT,
+         .rtm_scope    = r->family == AF_INET ? RT_SCOPE_LINK 
+                                              : RT_SCOPE_UNIVERSE,
+         .rtm_type     = RTN_UNICAST
+      };
+      struct nlmsghdr *nlh = rtnl_msg(b, RTM_NEWROUTE, 
+                                      NLM_F_CREATE | NLM_F_REPLACE,
+                                      &rtm, sizeof(rtm));
+      rtnl_attr(b, nlh, RTA_DST, r->addr, alen);
+      rtnl_attr(b, nlh, RTA_OIF, &index, sizeof(index));
+
+      /* commit full batches */
+      if (b->len + 128 > RTNL_BUFSIZE || i == len - 1) {
+         ret = rtnl_commit(b);
+         b->len = b->seq = 0;
+      }
+   }
+   debug_print("%d prefixes routed through %s\n", i, dev);
+   free(b);
+   return ret;
+}
+
+#endif
@@ -0,0 +1,109 @@
+/**
+ * \file rtnl.h
+ * \brief rtnetlink interface configuration prototypes.
+ *
+ *    The whole configuration of a tun interface is sent as one batch of
+ *    rtnetlink requests in a single datagram, then every request is
+ *    acknowledged:
+ *
+ *    RTM_NEWLINK   link up, MTU, txqueuelen
+ *    RTM_NEWADDR   IPv4 address/prefix (no kernel prefix route)
+ *    RTM_NEWADDR   IPv6 address/prefix (no kernel prefix route, no DAD)
+ *    RTM_NEWROUTE  IPv4 private prefix
+ *    RTM_NEWROUTE  IPv6 private prefix
+ *
+ *    Destination prefixes (rtnl_tun_routes) are routed through the
+ *    interface in batches of RTM_NEWROUTE requests as well.
+ *
+ *    Addresses and routes are created or replaced, so that configuring
+ *    an interface twice is harmless. Persistent interfaces are verified
+ *    against their configuration with link, address and route dumps.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_RTNL_H
+#define UDPTUN_RTNL_H
+
+#include <stdint.h>
+
+#include "sysconfig.h"
+
+/**
+ * \def RTNL_BUFSIZE
+ * \brief Size of the request & acknowledgment buffers.
+ */
+#define RTNL_BUFSIZE 4096
+
+/**
+ * \def RTNL_STALE_MAX
+ * \brief Maximum number of unknown addresses removed from an interface.
+ */
+#define RTNL_STALE_MAX 16
+
+/**
+ * \struct rtnl_tun
+ * \brief A tun interface configuration.
+ */
+struct rtnl_tun {
+   const char *addr4;   /*!< IPv4 address or NULL */
+   const char *prefix4; /*!< IPv4 prefix length or netmask */
+   const char *addr6;   /*!< IPv6 address or NULL */
+   const char *prefix6; /*!< IPv6 prefix length */
+   uint32_t    mtu;     /*!< MTU, 0 to keep the default */
+   uint32_t    txqlen;  /*!< txqueuelen, 0 to keep the default */
+};
+
+/**
+ * \struct rtnl_route
+ * \brief A prefix routed through a tun interface.
+ */
+struct rtnl_route {
+   uint8_t       family;   /*!< AF_INET or AF_INET6 */
+   uint8_t       plen;     /*!< prefix length */
+   unsigned char addr[16]; /*!< prefix, host bits cleared */
+};
+
+#if defined(LINUX_OS)
+/**
+ * \fn int rtnl_tun_setup(const char *dev, const struct rtnl_tun *cfg)
+ * \brief Configure an interface in one rtnetlink transaction.
+ *
+ * \param dev The interface name
+ * \param cfg The configuration
+ * \return 0 on success, -1 on error (errno is filled with the error
+ *         of the first failed request)
+ */
+int rtnl_tun_setup(const char *dev, const struct rtnl_tun *cfg);
+
+/**
+ * \fn int rtnl_tun_verify(const char *dev, const struct rtnl_tun *cfg, 
+ *                         int flush)
+ * \brief Check that an existing interface matches a configuration.
+ *
+ *    The link must be up, with the configured MTU and txqueuelen (if
+ *    set), and carry exactly the configured global addresses and their
+ *    private prefix routes.
+ *
+ * \param dev The interface name
+ * \param cfg The configuration
+ * \param flush 1 to remove unknown global addresses on mismatch
+ * \return 1 if it matches, 0 if not, -1 on error (errno is filled)
+ */
+int rtnl_tun_verify(const char *dev, const struct rtnl_tun *cfg, int flush);
+
+/**
+ * \fn int rtnl_tun_routes(const char *dev, const struct rtnl_route *routes,
+ *                         int len)
+ * \brief Route prefixes through an interface (created or replaced).
+ *
+ * \param dev The interface name
+ * \param routes The prefixes
+ * \param len The number of prefixes
+ * \return 0 on success, -1 on error (errno is filled)
+ */
+int rtnl_tun_routes(const char *dev, const struct rtnl_route *routes, int len);
+#endif
+
+#endif
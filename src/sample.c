@@ -0,0 +1,155 @@
+/**
+ * \file sample.c
+ * \brief Sampled capture.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sample.h"
+#include "flowstat.h"
+#include "sock.h"
+#include "debug.h"
+
+/**
+ * \fn static uint32_t sample_flow_hash(const u_char *ip, uint32_t len,
+ *                                      int *hashed)
+ * \brief Compute the flow hash of an IP packet as the kernel filter does.
+ *
+ * \param ip The IP header
+ * \param len The captured length from the IP header
+ * \param hashed Set to 0 if the packet is not sampled by flow
+ * \return The hash of the addresses and ports
+ */
+static uint32_t sample_flow_hash(const u_char *ip, uint32_t len, 
+                                 int *hashed);
+
+int parse_sample_mode(const char *val) {
+   if (!strcmp(val, "none"))
+      return SAMPLE_NONE;
+   else if (!strcmp(val, "packet"))
+      return SAMPLE_PACKET;
+   else if (!strcmp(val, "flow"))
+      return SAMPLE_FLOW;
+   return -1;
+}
+
+void sample_init(struct sampler *s, int mode, uint32_t rate) {
+   memset(s, 0, sizeof(struct sampler));
+   if (rate < 2)
+      mode = SAMPLE_NONE;
+   s->mode = mode;
+   s->rate = rate;
+}
+
+int sample_filter(struct sampler *s, char *buf, size_t len) {
+   if (s->mode != SAMPLE_FLOW)
+      return 0;
+
+   /* and/or are left-associative with the same precedence, filter
+      arithmetic is unsigned 32-bit like sample_flow_hash */
+   snprintf(buf, len,
+      "(ip and ((ip[9] != 6 and ip[9] != 17) or ip[6:2] & 0x1fff != 0 or "
+      "(((ip[12:4] + ip[16:4] + ip[(ip[0] & 0xf) << 2:2] + "
+      "ip[((ip[0] & 0xf) << 2) + 2:2]) * %u) >> 16) %% %u = 0)) or "
+      "(ip6 and ((ip6[6] != 6 and ip6[6] != 17) or "
+      "(((ip6[8:4] + ip6[12:4] + ip6[16:4] + ip6[20:4] + ip6[24:4] + "
+      "ip6[28:4] + ip6[32:4] + ip6[36:4] + ip6[40:2] + ip6[42:2]) * %u) "
+      ">> 16) %% %u = 0)) or not (ip or ip6)", 
+      SAMPLE_HASH_MUL, s->rate, SAMPLE_HASH_MUL, s->rate);
+   s->in_kernel = 1;
+   return 1;
+}
+
+uint32_t sample_flow_hash(const u_char *ip, uint32_t len, int *hashed) {
+   uint32_t sum = 0, off, i;
+
+   *hashed = 0;
+   if (len < 20)
+      return 0;
+   if ((ip[0] >> 4) == 4) {
+      off = (ip[0] & 0x0f) * 4;
+      if ((ip[9] != IPPROTO_TCP && ip[9] != IPPROTO_UDP) ||
+          (ntohs(*(uint16_t *)(ip + 6)) & 0x1fff) || len < off + 4)
+         return 0;
+      sum = ntohl(*(uint32_t *)(ip + 12)) + ntohl(*(uint32_t *)(ip + 16));
+   } else if ((ip[0] >> 4) == 6) {
+      off = 40;
+      if ((ip[6] != IPPROTO_TCP && ip[6] != IPPROTO_UDP) || len < off + 4)
+         return 0;
+      for (i = 8; i < 40; i += 4)
+         sum += ntohl(*(uint32_t *)(ip + i));
+   } else
+      return 0;
+
+   *hashed = 1;
+   sum += ntohs(*(uint16_t *)(ip + off)) + ntohs(*(uint16_t *)(ip + off + 2));
+   /* the low bits of a sum cluster on close addresses and ports */
+   return (sum * SAMPLE_HASH_MUL) >> 16;
+}
+
+int sample_keep(struct sampler *s, int linktype, const u_char *bytes,
+                uint32_t caplen) {
+   int off, hashed;
+   uint32_t hash;
+
+   switch (s->mode) {
+      case SAMPLE_PACKET:
+         if (s->seen++ % s->rate)
+            return 0;
+         break;
+      case SAMPLE_FLOW:
+         if (s->in_kernel)
+            break;
+         s->seen++;
+         if ((off = flow_l3_offset(linktype, bytes, caplen)) < 0)
+            break;
+         hash = sample_flow_hash(bytes + off, caplen - off, &hashed);
+         if (hashed && hash % s->rate)
+            return 0;
+         break;
+      default:
+         return 1;
+   }
+   s->kept++;
+   return 1;
+}
+
+void sample_write(struct sampler *s, const char *filename) {
+   static const char *modes[3] = { "none", "packet", "flow" };
+
+   if (s->mode == SAMPLE_NONE)
+      return;
+
+   size_t len = strlen(filename);
+   char *file_loc = xmalloc(len + sizeof(SAMPLE_EXT));
+   strcpy(file_loc, filename);
+   if (len > 5 && !strcmp(file_loc + len - 5, ".pcap"))
+      file_loc[len - 5] = '\0';
+   strcat(file_loc, SAMPLE_EXT);
+
+   FILE *fp = fopen(file_loc, "w");
+   if (!fp)
+      die("fopen sampling");
+   fprintf(fp, "#sampling,mode,rate,where,seen,kept\n");
+   if (s->in_kernel)
+      fprintf(fp, "sampling,%s,%u,kernel,,%llu\n", modes[s->mode], s->rate,
+              (unsigned long long)s->kept);
+   else
+      fprintf(fp, "sampling,%s,%u,user,%llu,%llu\n", modes[s->mode], s->rate,
+              (unsigned long long)s->seen, (unsigned long long)s->kept);
+   fchmod(fileno(fp), S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+   fclose(fp);
+   free(file_loc);
+}
@@ -0,0 +1,130 @@
+/**
+ * \file sample.h
+ * \brief Sampled capture prototypes.
+ *
+ *    Two deterministic samplers are available:
+ *
+ *    packet: 1-in-N packets, counted in userspace.
+ *    flow:   whole TCP/UDP flows, kept if their hash is a multiple of
+ *            N. The direction-independent sum of their addresses and
+ *            ports (32-bit words) is multiplied by SAMPLE_HASH_MUL, the
+ *            hash is the top 16 bits of the product. The decision is
+ *            compiled into the kernel filter of libpcap captures, so
+ *            dropped flows never reach userspace. Other packets (ICMP,
+ *            non-first fragments) are always kept.
+ *
+ *    When a sampled capture ends, its parameters and counters are
+ *    written next to the trace (<trace>.sampling.csv, .pcap replaced):
+ *
+ *    sampling,mode,rate,where,seen,kept
+ *
+ *    where is kernel or user, seen is empty if sampled in the kernel.
+ *    Sampled counts are rescaled by multiplying them by rate.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_SAMPLE_H
+#define UDPTUN_SAMPLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pcap.h>
+
+/**
+ * \def SAMPLE_EXT
+ * \brief Sampling metadata file extension, replaces .pcap.
+ */
+#define SAMPLE_EXT ".sampling.csv"
+
+/**
+ * \def SAMPLE_HASH_MUL
+ * \brief Flow hash multiplier, 2^32 divided by the golden ratio.
+ */
+#define SAMPLE_HASH_MUL 0x9e3779b1U
+
+/**
+ * \def SAMPLE_FLOW_RATE_MAX
+ * \brief Largest flow sampling rate, the flow hash has 16 bits.
+ */
+#define SAMPLE_FLOW_RATE_MAX 65536
+
+/**
+ * \enum sample_mode
+ * \brief Capture sampling modes.
+ */
+enum sample_mode {
+   SAMPLE_NONE   = 0, /*!< every packet */
+   SAMPLE_PACKET = 1, /*!< 1-in-N packets */
+   SAMPLE_FLOW   = 2  /*!< 1-in-N flows (by hash) */
+};
+
+/**
+ * \struct sampler
+ * \brief A capture sampler.
+ */
+struct sampler {
+   uint8_t  mode;      /*!< enum sample_mode */
+   uint8_t  in_kernel; /*!< the decision is made by the capture filter */
+   uint32_t rate;      /*!< N */
+   uint64_t seen;      /*!< packets sampled in userspace */
+   uint64_t kept;      /*!< packets kept */
+};
+
+/**
+ * \fn int parse_sample_mode(const char *val)
+ * \brief Parse a capture-sample configuration value.
+ *
+ * \param val one of none, packet or flow
+ * \return The sampling mode, or -1 if unknown
+ */
+int parse_sample_mode(const char *val);
+
+/**
+ * \fn void sample_init(struct sampler *s, int mode, uint32_t rate)
+ * \brief Initialize a sampler, rates below 2 disable sampling.
+ *
+ * \param s The sampler
+ * \param mode The sampling mode
+ * \param rate N
+ */
+void sample_init(struct sampler *s, int mode, uint32_t rate);
+
+/**
+ * \fn int sample_filter(struct sampler *s, char *buf, size_t len)
+ * \brief Write the kernel filter expression of a flow sampler.
+ *
+ *    The sampler is then marked as in_kernel.
+ *
+ * \param s The sampler
+ * \param buf The expression buffer
+ * \param len The buffer size
+ * \return 1 if an expression was written, 0 if not a flow sampler
+ */
+int sample_filter(struct sampler *s, char *buf, size_t len);
+
+/**
+ * \fn int sample_keep(struct sampler *s, int linktype, const u_char *bytes,
+ *                     uint32_t caplen)
+ * \brief Tell if a packet is to be kept. Not thread-safe.
+ *
+ * \param s The sampler
+ * \param linktype The link-layer type (DLT_*)
+ * \param bytes The packet
+ * \param caplen The captured length
+ * \return 1 to keep the packet, 0 to drop it
+ */
+int sample_keep(struct sampler *s, int linktype, const u_char *bytes,
+                uint32_t caplen);
+
+/**
+ * \fn void sample_write(struct sampler *s, const char *filename)
+ * \brief Write the sampling metadata of a trace, if sampled.
+ *
+ * \param s The sampler
+ * \param filename The trace location
+ */
+void sample_write(struct sampler *s, const char *filename);
+
+#endif
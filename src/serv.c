@@ -24,6 +24,12 @@
 #include "thread.h"
 #include "net.h"
 #include "xpcap.h"
+#include "tap.h"
+#include "ready.h"
+#include "session.h"
+#include "mpath.h"
+#include "mss.h"
+#include "pmtu.h"
 
 /**
  * \var static volatile int loop
@@ -85,7 +91,7 @@ void tun_serv(struct arguments *args) {
 
 void tun_serv_in(int fd_tun, int fd_net4, 
                  int fd_net6, struct tun_state *state, char *buf) {
-   int recvd=xread(fd_tun, buf, BUFF_SIZE);
+   int recvd=tap_read(fd_tun, buf, BUFF_SIZE);
    debug_print("recvd %db from tun\n", recvd);
 
    switch (buf[0] & 0xf0) {
@@ -110,10 +116,13 @@ void tun_serv_in4_aux(int fd_net, struct tun_state *state, char *buf, int recvd)
          recvd-=4;
          memmove(buf, buf+4, recvd);
       }
+      /* clamp tunneled TCP handshakes */
+      mss_clamp(state, buf, recvd);
 
       struct tun_rec *rec = NULL; 
       /* read sport for clients mapping */
-      int sport = (int) ntohs( *((uint16_t *)(buf+22)) ); 
+      int sport = spray_base(state, ntohs( *((uint16_t *)(buf+22)) )); 
+      uint32_t hash = (state->port_spray > 1) ? mpath_hash(buf, recvd) : 0;
 
       /* Add layer 4.5 header */
       if (state->raw_header) {
@@ -122,8 +131,19 @@ void tun_serv_in4_aux(int fd_net, struct tun_state *state, char *buf, int recvd)
       }
 
       if ( (rec = g_hash_table_lookup(state->serv, &sport)) ) {   
-
-         int sent = xsendto4(fd_net, rec->sa4, buf, recvd);
+         struct sockaddr_in sin, *sa = (struct sockaddr_in *)rec->sa4;
+
+         /* answer sprayed flows on their own port, other clients on
+            their dest file or learned port */
+         if (state->port_spray > 1 && 
+             __atomic_load_n(&rec->sprays, __ATOMIC_RELAXED)) {
+            sin          = *sa;
+            sin.sin_port = htons(sport + hash % state->port_spray);
+            sa           = &sin;
+         }
+         int sent = xsendto4(fd_net, (struct sockaddr *)sa, buf, recvd);
+         if (sent < 0 && errno == EMSGSIZE)
+            pmtu_too_big(state, buf, recvd, (struct sockaddr *)sa);
          debug_print("serv: wrote %dB to internet\n",sent);
       } else {
          errno=EFAULT;
@@ -141,10 +161,13 @@ void tun_serv_in6_aux(int fd_net, struct tun_state *state, char *buf, int recvd)
          recvd-=4;
          memmove(buf, buf+4, recvd);
       }
+      /* clamp tunneled TCP handshakes */
+      mss_clamp(state, buf, recvd);
 
       struct tun_rec *rec = NULL; 
       /* read sport for clients mapping */
-      int sport = (int) ntohs( *((uint16_t *)(buf+42)) ); 
+      int sport = spray_base(state, ntohs( *((uint16_t *)(buf+42)) )); 
+      uint32_t hash = (state->port_spray > 1) ? mpath_hash(buf, recvd) : 0;
 
       /* Add layer 4.5 header */
       if (state->raw_header) {
@@ -153,8 +176,19 @@ void tun_serv_in6_aux(int fd_net, struct tun_state *state, char *buf, int recvd)
       }
 
       if ( (rec = g_hash_table_lookup(state->serv, &sport)) ) {   
-
-         int sent = xsendto6(fd_net, rec->sa6, buf, recvd);
+         struct sockaddr_in6 sin6, *sa = (struct sockaddr_in6 *)rec->sa6;
+
+         /* answer sprayed flows on their own port, other clients on
+            their dest file or learned port */
+         if (state->port_spray > 1 && 
+             __atomic_load_n(&rec->sprays, __ATOMIC_RELAXED)) {
+            sin6           = *sa;
+            sin6.sin6_port = htons(sport + hash % state->port_spray);
+            sa             = &sin6;
+         }
+         int sent = xsendto6(fd_net, (struct sockaddr *)sa, buf, recvd);
+         if (sent < 0 && errno == EMSGSIZE)
+            pmtu_too_big(state, buf, recvd, (struct sockaddr *)sa);
          debug_print("serv: wrote %dB to internet\n",sent);
       } else {
          errno=EFAULT;
@@ -165,14 +199,14 @@ void tun_serv_in6_aux(int fd_net, struct tun_state *state, char *buf, int recvd)
 
 void tun_serv_in6(int fd_tun, int fd_net, 
                  struct tun_state *state, char *buf) {
-   int recvd=xread(fd_tun, buf, BUFF_SIZE);
+   int recvd=tap_read(fd_tun, buf, BUFF_SIZE);
    debug_print("recvd %db from tun\n", recvd);
    tun_serv_in6_aux(fd_net, state, buf, recvd);
 }
 
 void tun_serv_in4(int fd_tun, int fd_net, 
                  struct tun_state *state, char *buf) {
-   int recvd=xread(fd_tun, buf, BUFF_SIZE);
+   int recvd=tap_read(fd_tun, buf, BUFF_SIZE);
    debug_print("recvd %db from tun\n", recvd);
    tun_serv_in4_aux(fd_net, state, buf, recvd);
 }
@@ -182,7 +216,9 @@ void tun_serv_out4(int fd_net, int fd_tun, struct tun_state *state, char *buf) {
    int recvd = xrecvfrom(fd_net, (struct sockaddr *)nrec->sa4, 
                          &nrec->slen4, buf, BUFF_SIZE);
 
-   if (recvd > MIN_PKT_SIZE) {
+   /* path MTU probes are answered, not tunneled */
+   if (recvd > MIN_PKT_SIZE && 
+       !pmtu_answer(fd_net, buf, recvd, nrec->sa4, nrec->slen4)) {
       debug_print("serv: recvd %dB from internet\n", recvd);
 
       /* Remove layer 4.5 header */
@@ -192,26 +228,36 @@ void tun_serv_out4(int fd_net, int fd_tun, struct tun_state *state, char *buf) {
          recvd -= state->raw_header_size;
          memmove(buf, buf+state->raw_header_size, recvd);
       }
+      /* clamp tunneled TCP handshakes */
+      mss_clamp(state, buf, recvd);
       /* Add PlanetLab TUN PPI header */
       if (state->planetlab) {
          buf-=4; recvd+=4;
       }
 
       struct tun_rec *rec = NULL;
-      int sport           = ntohs(((struct sockaddr_in *)nrec->sa4)->sin_port);
+      int sport           = spray_base(state, 
+                               ntohs(((struct sockaddr_in *)nrec->sa4)->sin_port));
       int sent            = 0;
       if ( (rec = g_hash_table_lookup(state->serv, &sport)) ) {
-         sent = xwrite(fd_tun, buf, recvd);
+         sent = tap_write(fd_tun, buf, recvd);
          debug_print("serv: wrote %dB to tun\n", sent); 
+         /* a datagram from another port of the block */
+         if (state->port_spray > 1 && !rec->sprays && 
+             ((struct sockaddr_in *)nrec->sa4)->sin_port != 
+             ((struct sockaddr_in *)rec->sa4)->sin_port)
+            __atomic_store_n(&rec->sprays, 1, __ATOMIC_RELAXED);
       } 
 #if !defined(LOCKED)
       else if (g_hash_table_size(state->serv) <= state->fd_lim) { 
-         sent = xwrite(fd_tun, buf, recvd);
+         sent = tap_write(fd_tun, buf, recvd);
 
          /* add new record to lookup tables */
          nrec->sport = sport;
          g_hash_table_insert(state->serv, &nrec->sport, nrec);
+         session_learn(nrec, AF_INET);
          debug_print("serv: added new entry: %d\n", sport);
+         nrec = NULL;
       } 
 #endif
       else {
@@ -221,11 +267,13 @@ void tun_serv_out4(int fd_net, int fd_tun, struct tun_state *state, char *buf) {
    } else if (recvd < 0) {
        /* recvd ICMP msg */
       xrecverr(fd_net, buf,  BUFF_SIZE, 0, NULL);
-   } else {
+   } else if (recvd <= MIN_PKT_SIZE &&
+              !ready_answer(fd_net, buf, recvd, nrec->sa4, nrec->slen4)) {
       /* recvd unknown packet */
       debug_print("serv: recvd empty pkt\n");
    }
-   free_tun_rec(nrec);
+   if (nrec)
+      free_tun_rec(nrec);
 }
 
 void tun_serv_out6(int fd_net, int fd_tun, struct tun_state *state, char *buf) {
@@ -233,7 +281,9 @@ void tun_serv_out6(int fd_net, int fd_tun, struct tun_state *state, char *buf) {
    int recvd = xrecvfrom(fd_net, (struct sockaddr *)nrec->sa6, 
                          &nrec->slen6, buf, BUFF_SIZE);
 
-   if (recvd > MIN_PKT_SIZE) {
+   /* path MTU probes are answered, not tunneled */
+   if (recvd > MIN_PKT_SIZE && 
+       !pmtu_answer(fd_net, buf, recvd, nrec->sa6, nrec->slen6)) {
       debug_print("serv: recvd %dB from internet\n", recvd);
 
       /* Remove layer 4.5 header */
@@ -243,26 +293,36 @@ void tun_serv_out6(int fd_net, int fd_tun, struct tun_state *state, char *buf) {
          recvd -= state->raw_header_size;
          memmove(buf, buf+state->raw_header_size, recvd);
       }
+      /* clamp tunneled TCP handshakes */
+      mss_clamp(state, buf, recvd);
       /* Add PlanetLab TUN PPI header */
       if (state->planetlab) {
          buf-=4; recvd+=4;
       }
 
       struct tun_rec *rec = NULL;
-      int sport           = ntohs(((struct sockaddr_in *)nrec->sa6)->sin_port);
+      int sport           = spray_base(state, 
+                               ntohs(((struct sockaddr_in6 *)nrec->sa6)->sin6_port));
       int sent            = 0;
       if ( (rec = g_hash_table_lookup(state->serv, &sport)) ) {
-         sent = xwrite(fd_tun, buf, recvd);
+         sent = tap_write(fd_tun, buf, recvd);
          debug_print("serv: wrote %dB to tun\n", sent); 
+         /* a datagram from another port of the block */
+         if (state->port_spray > 1 && !rec->sprays && 
+             ((struct sockaddr_in6 *)nrec->sa6)->sin6_port != 
+             ((struct sockaddr_in6 *)rec->sa6)->sin6_port)
+            __atomic_store_n(&rec->sprays, 1, __ATOMIC_RELAXED);
       } 
 #if !defined(LOCKED)
       else if (g_hash_table_size(state->serv) <= state->fd_lim) { 
-         sent = xwrite(fd_tun, buf, recvd);
+         sent = tap_write(fd_tun, buf, recvd);
 
          /* add new record to lookup tables */
          nrec->sport = sport;
          g_hash_table_insert(state->serv, &nrec->sport, nrec);
+         session_learn(nrec, AF_INET6);
          debug_print("serv: added new entry: %d\n", sport);
+         nrec = NULL;
       } 
 #endif
       else {
@@ -272,11 +332,13 @@ void tun_serv_out6(int fd_net, int fd_tun, struct tun_state *state, char *buf) {
    } else if (recvd < 0) {
        /* recvd ICMP msg */
       xrecverr(fd_net, buf,  BUFF_SIZE, 0, NULL);
-   } else {
+   } else if (recvd <= MIN_PKT_SIZE &&
+              !ready_answer(fd_net, buf, recvd, nrec->sa6, nrec->slen6)) {
       /* recvd unknown packet */
       debug_print("serv: recvd empty pkt\n");
    }
-   free_tun_rec(nrec);
+   if (nrec)
+      free_tun_rec(nrec);
 }
 
 void tun_serv_single(struct arguments *args) {
@@ -291,31 +353,36 @@ void tun_serv_single(struct arguments *args) {
    tun(state, &fd_tun); 
    if (state->ipv6) {
       if (state->udp)
-         fd_net = udp_sock6(state->public_port, 1, state->public_addr6);
+         fd_net = udp_sock6(state->public_port, 1, state->public_addr6, 0);
       else
          fd_net = raw_sock6(state->public_port, state->public_addr6, 
-                            gen_bpf(state->default_if, state->public_addr6, 
-                                    state->public_port, 0), 
+                            gen_bpf(AF_INET6, state->protocol_num, NULL, 
+                                    state->public_addr6, state->public_port, 0), 
                             state->default_if, state->protocol_num, 
                             1, state->planetlab);
       tun_serv_in_func = &tun_serv_in6;
       tun_serv_out     = &tun_serv_out6;
    } else {
       if (state->udp)
-         fd_net = udp_sock4(state->public_port, 1, state->public_addr4);
+         fd_net = udp_sock4(state->public_port, 1, state->public_addr4, 0);
       else
          fd_net = raw_sock4(state->public_port, state->public_addr4, 
-                            gen_bpf(state->default_if, state->public_addr4, 
-                                    state->public_port, 0), 
+                            gen_bpf(AF_INET, state->protocol_num, NULL, 
+                                    state->public_addr4, state->public_port, 0), 
                             state->default_if, state->protocol_num, 
                             1, state->planetlab);
       tun_serv_in_func = &tun_serv_in4;
       tun_serv_out     = &tun_serv_out4;
    }
 
+   /* listen on path addresses (multipath clients) */
+   int locals[MPATH_MAX], nlocals = 1;
+   if (state->udp)
+      nlocals = mpath_socks(state, state->ipv6 ? AF_INET6 : AF_INET, 
+                            fd_net, locals);
+
    /* run capture threads */
-   xthread_create(capture_notun, (void *) state, 1);
-   synchronize();
+   run_captures(state);
 
    /* run server */
    debug_print("running serv ...\n");  
@@ -341,6 +408,8 @@ void tun_serv_single(struct arguments *args) {
    }
 
    fd_max=max(fd_tun,fd_net);
+   for (int i=1; i<nlocals; i++)
+      fd_max=max(fd_max,locals[i]);
    loop=1;
    signal(SIGINT, serv_shutdown);
    signal(SIGTERM, serv_shutdown);
@@ -349,6 +418,8 @@ void tun_serv_single(struct arguments *args) {
       FD_ZERO(&input_set);
       FD_SET(fd_net, &input_set);
       FD_SET(fd_tun, &input_set);
+      for (int i=1; i<nlocals; i++)
+         FD_SET(locals[i], &input_set);
   
       sel = xselect(&input_set, fd_max, &tv, state->inactivity_timeout);
 
@@ -360,6 +431,9 @@ void tun_serv_single(struct arguments *args) {
             (*tun_serv_out)(fd_net, fd_tun, state, outbuffer);
          if (FD_ISSET(fd_tun, &input_set)) 
             (*tun_serv_in_func)(fd_net, fd_tun, state, inbuffer);
+         for (int i=1; i<nlocals; i++)
+            if (FD_ISSET(locals[i], &input_set)) 
+               (*tun_serv_out)(locals[i], fd_tun, state, outbuffer);
       }
    }
 }
@@ -373,24 +447,30 @@ void tun_serv_dual(struct arguments *args) {
    /* create tun if and sockets */
    tun(state, &fd_tun); 
    if (state->udp) {
-      fd_net4 = udp_sock4(state->public_port, 1, state->public_addr4);
-      fd_net6 = udp_sock6(state->public_port, 1, state->public_addr6);
+      fd_net4 = udp_sock4(state->public_port, 1, state->public_addr4, 0);
+      fd_net6 = udp_sock6(state->public_port, 1, state->public_addr6, 0);
    } else {
       fd_net4 = raw_sock4(state->public_port, state->public_addr4, 
-                         gen_bpf(state->default_if, state->public_addr4, 
-                                 state->public_port, 0), 
+                         gen_bpf(AF_INET, state->protocol_num, NULL, 
+                                 state->public_addr4, state->public_port, 0), 
                          state->default_if, state->protocol_num, 
                          1, state->planetlab);
       fd_net6 = raw_sock6(state->public_port, state->public_addr6, 
-                         gen_bpf(state->default_if, state->public_addr6, 
-                                 state->public_port, 0), 
+                         gen_bpf(AF_INET6, state->protocol_num, NULL, 
+                                 state->public_addr6, state->public_port, 0), 
                          state->default_if, state->protocol_num, 
                          1, state->planetlab);
    }
 
+   /* listen on path addresses (multipath clients) */
+   int locals4[MPATH_MAX], locals6[MPATH_MAX], nlocals4 = 1, nlocals6 = 1;
+   if (state->udp) {
+      nlocals4 = mpath_socks(state, AF_INET, fd_net4, locals4);
+      nlocals6 = mpath_socks(state, AF_INET6, fd_net6, locals6);
+   }
+
    /* run capture threads */
-   xthread_create(capture_notun, (void *) state, 1);
-   synchronize();
+   run_captures(state);
 
    /* run server */
    debug_print("running serv ...\n");  
@@ -416,6 +496,10 @@ void tun_serv_dual(struct arguments *args) {
    }
 
    fd_max=max(fd_tun,max(fd_net4, fd_net6));
+   for (int i=1; i<nlocals4; i++)
+      fd_max=max(fd_max,locals4[i]);
+   for (int i=1; i<nlocals6; i++)
+      fd_max=max(fd_max,locals6[i]);
    loop=1;
    signal(SIGINT, serv_shutdown);
    signal(SIGTERM, serv_shutdown);
@@ -425,6 +509,10 @@ void tun_serv_dual(struct arguments *args) {
       FD_SET(fd_net4, &input_set);
       FD_SET(fd_net6, &input_set);
       FD_SET(fd_tun, &input_set);
+      for (int i=1; i<nlocals4; i++)
+         FD_SET(locals4[i], &input_set);
+      for (int i=1; i<nlocals6; i++)
+         FD_SET(locals6[i], &input_set);
   
       sel = xselect(&input_set, fd_max, &tv, state->inactivity_timeout);
 
@@ -438,6 +526,12 @@ void tun_serv_dual(struct arguments *args) {
             tun_serv_out6(fd_net6, fd_tun, state, outbuffer);
          if (FD_ISSET(fd_tun, &input_set)) 
             tun_serv_in(fd_tun, fd_net4, fd_net6, state, inbuffer);
+         for (int i=1; i<nlocals4; i++)
+            if (FD_ISSET(locals4[i], &input_set)) 
+               tun_serv_out4(locals4[i], fd_tun, state, outbuffer);
+         for (int i=1; i<nlocals6; i++)
+            if (FD_ISSET(locals6[i], &input_set)) 
+               tun_serv_out6(locals6[i], fd_tun, state, outbuffer);
       }
    }
 }
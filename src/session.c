@@ -0,0 +1,243 @@
+/**
+ * \file session.c
+ * \brief Session table checkpoint.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "session.h"
+#include "thread.h"
+#include "sock.h"
+#include "debug.h"
+
+/**
+ * \var static struct session_hdr *hdr
+ * \brief The mapped session file, NULL if not checkpointing.
+ */
+static struct session_hdr *hdr;
+
+/**
+ * \var static size_t map_len
+ * \brief The mapping length.
+ */
+static size_t map_len;
+
+/**
+ * \var static uint32_t ttl
+ * \brief The entry lifetime (s), 0 for none.
+ */
+static uint32_t ttl;
+
+/**
+ * \fn static void *session_thread(void *arg)
+ * \brief Sync the session file periodically.
+ *
+ * \param arg The sync interval in ms (uintptr_t)
+ */
+static void *session_thread(void *arg);
+
+/**
+ * \fn static void session_sync()
+ * \brief Sync the session file, registered at exit.
+ */
+static void session_sync();
+
+/**
+ * \fn static int session_stale(const struct session_entry *e, time_t now)
+ * \brief Tell if an entry has expired.
+ *
+ * \param e The entry
+ * \param now The current time
+ * \return 1 if the entry is older than ttl, 0 otherwise
+ */
+static int session_stale(const struct session_entry *e, time_t now);
+
+/**
+ * \fn static struct session_entry *session_slot(int32_t sport)
+ * \brief Find the entry of a peer, or the entry to store a new peer in.
+ *
+ * \param sport The peer source port
+ * \return The entry of sport, else a stale entry, a free entry (count
+ *         not incremented) or the oldest entry, NULL for a full file
+ *         without entries.
+ */
+static struct session_entry *session_slot(int32_t sport);
+
+/**
+ * \fn static int session_restore(struct tun_state *state)
+ * \brief Insert the peers of the session file in state->serv.
+ *
+ * \param state The program state
+ * \return The number of restored peers
+ */
+static int session_restore(struct tun_state *state);
+
+void session_init(struct tun_state *state) {
+   struct stat st;
+   uint32_t capacity = state->fd_lim;
+   int fd, fresh;
+
+   if (!state->session_file || !state->serv)
+      return;
+   ttl = state->session_ttl;
+
+   if ((fd = open(state->session_file, O_RDWR | O_CREAT,
+                  S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH)) < 0)
+      die("open session file");
+   if (fstat(fd, &st) < 0)
+      die("fstat");
+
+   /* keep the entries of a larger file */
+   fresh = (size_t)st.st_size < sizeof(struct session_hdr);
+   if (!fresh) {
+      struct session_hdr old;
+      if (pread(fd, &old, sizeof(old), 0) != sizeof(old))
+         die("read session file");
+      fresh = old.magic != SESSION_MAGIC || old.version != SESSION_VERSION ||
+              (size_t)st.st_size < sizeof(old) +
+                        (size_t)old.capacity * sizeof(struct session_entry);
+      if (!fresh && old.capacity > capacity)
+         capacity = old.capacity;
+   }
+   map_len = sizeof(struct session_hdr) +
+             (size_t)capacity * sizeof(struct session_entry);
+   if (ftruncate(fd, map_len) < 0)
+      die("ftruncate");
+
+   hdr = mmap(NULL, map_len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+   if (hdr == MAP_FAILED)
+      die("mmap session file");
+   close(fd);
+
+   if (fresh) {
+      memset(hdr, 0, sizeof(struct session_hdr));
+      hdr->magic   = SESSION_MAGIC;
+      hdr->version = SESSION_VERSION;
+      debug_print("session file %s created\n", state->session_file);
+   } else if (hdr->count > hdr->capacity)
+      hdr->count = hdr->capacity;
+   hdr->capacity = capacity;
+
+   debug_print("%d peers restored from %s\n", session_restore(state),
+               state->session_file);
+
+   atexit(session_sync);
+   if (state->session_interval)
+      xthread_create(session_thread,
+                     (void *)(uintptr_t)state->session_interval, 1);
+}
+
+int session_restore(struct tun_state *state) {
+   struct session_entry *entries = (struct session_entry *)(hdr + 1);
+   struct tun_rec *rec;
+   time_t now = time(NULL);
+   int restored = 0;
+
+   for (uint32_t i = 0; i < hdr->count; i++) {
+      struct session_entry *e = &entries[i];
+
+      /* the destination file comes first */
+      if (session_stale(e, now) ||
+          g_hash_table_lookup(state->serv, &e->sport))
+         continue;
+
+      rec = init_tun_rec(state);
+      rec->sport = e->sport;
+      if (e->family == AF_INET6 && rec->sa6)
+         memcpy(rec->sa6, &e->sa.sa6, sizeof(struct sockaddr_in6));
+      else if (e->family == AF_INET && rec->sa4)
+         memcpy(rec->sa4, &e->sa.sa4, sizeof(struct sockaddr_in));
+      else {
+         free_tun_rec(rec);
+         continue;
+      }
+      g_hash_table_insert(state->serv, &rec->sport, rec);
+      restored++;
+   }
+   return restored;
+}
+
+int session_stale(const struct session_entry *e, time_t now) {
+   return ttl && now - (time_t)e->learned > (time_t)ttl;
+}
+
+struct session_entry *session_slot(int32_t sport) {
+   struct session_entry *entries = (struct session_entry *)(hdr + 1);
+   struct session_entry *oldest = NULL, *stale = NULL;
+   time_t now = time(NULL);
+
+   for (uint32_t i = 0; i < hdr->count; i++) {
+      struct session_entry *e = &entries[i];
+      if (e->family && e->sport == sport)
+         return e;
+      if (!stale && (!e->family || session_stale(e, now)))
+         stale = e;
+      if (!oldest || e->learned < oldest->learned)
+         oldest = e;
+   }
+   if (stale)
+      return stale;
+   if (hdr->count < hdr->capacity)
+      return entries + hdr->count;
+   return oldest;
+}
+
+void session_learn(struct tun_rec *rec, int family) {
+   struct session_entry *e;
+   uint32_t count;
+
+   if (!hdr)
+      return;
+   if (!(e = session_slot(rec->sport))) {
+      debug_print("session file full, peer %d not saved\n", rec->sport);
+      return;
+   }
+
+   /* a zero family invalidates a reused entry until it is complete */
+   count = hdr->count;
+   __atomic_store_n(&e->family, 0, __ATOMIC_RELEASE);
+   memset(e, 0, sizeof(struct session_entry));
+   e->sport   = rec->sport;
+   e->learned = time(NULL);
+   if (family == AF_INET6)
+      memcpy(&e->sa.sa6, rec->sa6, sizeof(struct sockaddr_in6));
+   else
+      memcpy(&e->sa.sa4, rec->sa4, sizeof(struct sockaddr_in));
+   __atomic_store_n(&e->family, family, __ATOMIC_RELEASE);
+   if (e == (struct session_entry *)(hdr + 1) + count)
+      __atomic_store_n(&hdr->count, count + 1, __ATOMIC_RELEASE);
+}
+
+void session_sync() {
+   if (hdr && msync(hdr, map_len, MS_SYNC) < 0)
+      debug_print("msync: %s\n", strerror(errno));
+}
+
+void *session_thread(void *arg) {
+   uintptr_t interval = (uintptr_t)arg;
+   struct timespec ts = { interval / 1000, (interval % 1000) * 1000000 };
+
+   /* writes reach the page cache as peers are learned, syncing only
+      bounds what a host crash loses */
+   for (;;) {
+      nanosleep(&ts, NULL);
+      if (msync(hdr, map_len, MS_SYNC) < 0)
+         debug_print("msync: %s\n", strerror(errno));
+   }
+   return 0;
+}
+
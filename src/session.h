@@ -0,0 +1,91 @@
+/**
+ * \file session.h
+ * \brief Session table checkpoint prototypes.
+ *
+ *    The peers learned by the server (state->serv) are checkpointed to
+ *    an mmap'ed session file and restored on startup, before the
+ *    forwarding loop opens, so that a restarted server keeps forwarding
+ *    to its clients. A learned peer is appended to the mapping as it is
+ *    learned; the mapping is synced every session-sync-interval ms and
+ *    on shutdown.
+ *
+ *    header  magic (4B) version (4B) capacity (4B) count (4B)
+ *    entry   sport (4B) family (1B) pad (3B) sockaddr (28B) learned (4B)
+ *
+ *    A peer learned again updates its entry. Entries older than
+ *    session-ttl are not restored and are reused first by new peers,
+ *    then the oldest entry is evicted once the file is full.
+ *
+ *    An entry is written before count is incremented, and a reused
+ *    entry has a zero family until it is complete: a crash never
+ *    leaves a partial entry behind.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_SESSION_H
+#define UDPTUN_SESSION_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "state.h"
+
+/**
+ * \def SESSION_MAGIC
+ * \brief Session file magic ("CCSS").
+ */
+#define SESSION_MAGIC 0x43435353
+
+/**
+ * \def SESSION_VERSION
+ * \brief Session file version.
+ */
+#define SESSION_VERSION 2
+
+/**
+ * \struct session_hdr
+ * \brief The session file header.
+ */
+struct session_hdr {
+   uint32_t magic;    /*!< SESSION_MAGIC */
+   uint32_t version;  /*!< SESSION_VERSION */
+   uint32_t capacity; /*!< number of entries the file can hold */
+   uint32_t count;    /*!< number of entries, atomic */
+};
+
+/**
+ * \struct session_entry
+ * \brief A learned peer.
+ */
+struct session_entry {
+   int32_t sport;  /*!< the peer source port (state->serv key) */
+   uint8_t family; /*!< AF_INET or AF_INET6 */
+   uint8_t pad[3];
+   union {
+      struct sockaddr_in  sa4;
+      struct sockaddr_in6 sa6;
+   } sa;           /*!< the peer address */
+   uint32_t learned; /*!< last learn time (s since the epoch) */
+};
+
+/**
+ * \fn void session_init(struct tun_state *state)
+ * \brief Map the session file and restore its peers into state->serv.
+ *
+ * \param state The program state
+ */
+void session_init(struct tun_state *state);
+
+/**
+ * \fn void session_learn(struct tun_rec *rec, int family)
+ * \brief Checkpoint a learned peer. Not thread-safe.
+ *
+ * \param rec The peer
+ * \param family The family of the learned address
+ */
+void session_learn(struct tun_rec *rec, int family);
+
+#endif
+
@@ -0,0 +1,283 @@
+/**
+ * \file sink.c
+ * \brief Client data sinks and goodput timelines.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "sink.h"
+#include "sock.h"
+#include "debug.h"
+#include "udptun.h"
+
+/**
+ * \var static pthread_mutex_t gp_lock
+ * \brief Serialize goodput file appends of parallel flows.
+ */
+static pthread_mutex_t gp_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * \fn static uint64_t now_ns(clockid_t clk)
+ * \brief Read a clock in nanoseconds.
+ */
+static uint64_t now_ns(clockid_t clk);
+
+/**
+ * \fn static int sink_file(int s, const char *filename, struct goodput *gp)
+ * \brief Write received data to filename.
+ */
+static int sink_file(int s, const char *filename, struct goodput *gp);
+
+/**
+ * \fn static int sink_discard(int s, struct goodput *gp)
+ * \brief Count and drop received data.
+ */
+static int sink_discard(int s, struct goodput *gp);
+
+/**
+ * \fn static int sink_splice(int s, const char *filename, struct goodput *gp)
+ * \brief Move received data to filename without copying it to userspace.
+ */
+static int sink_splice(int s, const char *filename, struct goodput *gp);
+
+/**
+ * \fn static int sink_verify(int s, const char *ref, struct goodput *gp)
+ * \brief Compare received data with the reference file ref.
+ */
+static int sink_verify(int s, const char *ref, struct goodput *gp);
+
+uint64_t now_ns(clockid_t clk) {
+   struct timespec ts;
+   clock_gettime(clk, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int parse_sink_mode(const char *val) {
+   if (!strcmp(val, "file"))
+      return SINK_FILE;
+   else if (!strcmp(val, "discard"))
+      return SINK_DISCARD;
+   else if (!strcmp(val, "splice"))
+      return SINK_SPLICE;
+   else if (!strcmp(val, "verify"))
+      return SINK_VERIFY;
+   return -1;
+}
+
+struct goodput *goodput_init(uint32_t interval) {
+   struct goodput *gp = calloc(1, sizeof(struct goodput));
+   if (!gp)
+      die("calloc");
+   gp->interval   = interval ? interval : 1;
+   gp->cap        = 1024;
+   gp->bytes      = calloc(gp->cap, sizeof(uint32_t));
+   if (!gp->bytes)
+      die("calloc");
+   gp->start      = now_ns(CLOCK_MONOTONIC);
+   gp->start_real = now_ns(CLOCK_REALTIME);
+   return gp;
+}
+
+void goodput_add(struct goodput *gp, uint32_t bytes) {
+   uint64_t idx = (now_ns(CLOCK_MONOTONIC) - gp->start)
+                     / (1000ULL * gp->interval);
+
+   if (idx >= gp->cap) {
+      uint32_t ncap = gp->cap;
+      while (ncap <= idx) ncap *= 2;
+      gp->bytes = realloc(gp->bytes, ncap * sizeof(uint32_t));
+      if (!gp->bytes)
+         die("realloc");
+      memset(gp->bytes + gp->cap, 0, (ncap - gp->cap) * sizeof(uint32_t));
+      gp->cap = ncap;
+   }
+   gp->bytes[idx] += bytes;
+   if (idx >= gp->len)
+      gp->len = idx + 1;
+   gp->total += bytes;
+}
+
+void goodput_write(struct tun_state *state, struct goodput *gp,
+                   struct sockaddr *sa, int tun) {
+   struct goodput_hdr hdr;
+   memset(&hdr, 0, sizeof(hdr));
+   hdr.magic      = GOODPUT_MAGIC;
+   hdr.tun        = tun ? 1 : 0;
+   hdr.sink       = state->sink_mode;
+   hdr.interval   = gp->interval;
+   hdr.nintervals = gp->len;
+   hdr.start      = gp->start_real;
+   hdr.total      = gp->total;
+   hdr.errors     = gp->errors;
+   if (sa->sa_family == AF_INET6) {
+      hdr.family = 6;
+      memcpy(hdr.addr, &((struct sockaddr_in6 *)sa)->sin6_addr, 16);
+      hdr.port   = ntohs(((struct sockaddr_in6 *)sa)->sin6_port);
+   } else {
+      hdr.family = 4;
+      memcpy(hdr.addr, &((struct sockaddr_in *)sa)->sin_addr, 4);
+      hdr.port   = ntohs(((struct sockaddr_in *)sa)->sin_port);
+   }
+
+   char file_loc[STR_SIZE];
+   snprintf(file_loc, STR_SIZE, "%s%s%s%s.dat", state->out_dir, GOODPUT_FILE,
+            state->args->run_id ? "." : "",
+            state->args->run_id ? state->args->run_id : "");
+
+   if (pthread_mutex_lock(&gp_lock) != 0)
+      die("mutex lock");
+   FILE *fp = fopen(file_loc, "a");
+   if (!fp)
+      die("fopen goodput");
+   xfwrite(fp, (char *)&hdr, sizeof(hdr), 1);
+   if (gp->len)
+      xfwrite(fp, (char *)gp->bytes, sizeof(uint32_t), gp->len);
+   fclose(fp);
+   if (pthread_mutex_unlock(&gp_lock) != 0)
+      die("mutex unlock");
+
+   debug_print("goodput: %lu B in %u intervals\n",
+               (unsigned long)gp->total, gp->len);
+}
+
+void goodput_free(struct goodput *gp) {
+   if (!gp) return;
+   free(gp->bytes);
+   free(gp);
+}
+
+int sink_run(struct tun_state *state, int s,
+             const char *filename, struct goodput *gp) {
+   /* large receive buffers for high-rate sinks */
+   if (state->sink_mode != SINK_FILE && state->sink_rcvbuf) {
+      int rcvbuf = state->sink_rcvbuf;
+      if (setsockopt(s, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0)
+         debug_print("setsockopt rcvbuf");
+   }
+
+   switch (state->sink_mode) {
+      case SINK_DISCARD:
+         return sink_discard(s, gp);
+      case SINK_SPLICE:
+         return sink_splice(s, filename, gp);
+      case SINK_VERIFY:
+         return sink_verify(s, state->serv_file, gp);
+      case SINK_FILE:
+      default:
+         return sink_file(s, filename, gp);
+   }
+}
+
+int sink_file(int s, const char *filename, struct goodput *gp) {
+   FILE *fp = fopen(filename, "w");
+   if(fp == NULL) die("fopen");
+
+   char buf[BUFF_SIZE];
+   int bsize = 0;
+   while((bsize = xrecv(s, buf, BUFF_SIZE)) > 0) {
+      xfwrite(fp, buf, sizeof(char), bsize);
+      goodput_add(gp, bsize);
+   }
+
+   fclose(fp);
+   return bsize < 0 ? -1 : 1;
+}
+
+int sink_discard(int s, struct goodput *gp) {
+   char *buf = xmalloc(SINK_BUFF_SIZE);
+   int bsize = 0;
+   while((bsize = xrecv(s, buf, SINK_BUFF_SIZE)) > 0)
+      goodput_add(gp, bsize);
+
+   free(buf);
+   return bsize < 0 ? -1 : 0;
+}
+
+int sink_splice(int s, const char *filename, struct goodput *gp) {
+#if defined(SPLICE_F_MOVE)
+   int fd, p[2];
+   ssize_t in, out;
+   if ((fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+      die("open");
+   if (pipe(p) < 0)
+      die("pipe");
+#  if defined(F_SETPIPE_SZ)
+   fcntl(p[1], F_SETPIPE_SZ, SINK_PIPE_SIZE);
+#  endif
+
+   while ((in = splice(s, NULL, p[1], NULL, SINK_PIPE_SIZE,
+                       SPLICE_F_MOVE | SPLICE_F_MORE)) > 0) {
+      goodput_add(gp, in);
+      /* drain pipe to file */
+      while (in > 0) {
+         if ((out = splice(p[0], NULL, fd, NULL, in, SPLICE_F_MOVE)) <= 0)
+            die("splice");
+         in -= out;
+      }
+   }
+   close(p[0]);close(p[1]);close(fd);
+   return in < 0 ? -1 : 1;
+#else
+   return sink_file(s, filename, gp);
+#endif
+}
+
+int sink_verify(int s, const char *ref, struct goodput *gp) {
+   int fd;
+   struct stat st;
+   if (!ref || (fd = open(ref, O_RDONLY)) < 0)
+      die("verify sink: server-file");
+   if (fstat(fd, &st) < 0)
+      die("fstat");
+
+   char *map = NULL;
+   if (st.st_size && (map = mmap(NULL, st.st_size, PROT_READ,
+                                 MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+      die("mmap");
+   close(fd);
+
+   char *buf = xmalloc(SINK_BUFF_SIZE);
+   uint64_t off = 0;
+   int bsize = 0;
+   while((bsize = xrecv(s, buf, SINK_BUFF_SIZE)) > 0) {
+      goodput_add(gp, bsize);
+      uint64_t n = (off < (uint64_t)st.st_size) ? st.st_size - off : 0;
+      if (n > (uint64_t)bsize) n = bsize;
+
+      /* byte-wise diff only on mismatching chunks */
+      if (n && memcmp(buf, map+off, n)) {
+         for (uint64_t i=0; i<n; i++)
+            if (buf[i] != map[off+i]) gp->errors++;
+      }
+      gp->errors += bsize - n;
+      off += bsize;
+   }
+   /* truncated transfer */
+   if (off < (uint64_t)st.st_size)
+      gp->errors += st.st_size - off;
+   debug_print("verify: %lu bytes, %lu errors\n",
+               (unsigned long)off, (unsigned long)gp->errors);
+
+   free(buf);
+   if (map) munmap(map, st.st_size);
+   return bsize < 0 ? -1 : 0;
+}
+
@@ -0,0 +1,154 @@
+/**
+ * \file sink.h
+ * \brief Client data sinks and goodput timelines prototypes.
+ *
+ *    A sink consumes the bytes received by a TCP client flow. Every
+ *    sink feeds a per-interval goodput timeline that is appended to
+ *    the goodput file of the run when the flow terminates.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_SINK_H
+#define UDPTUN_SINK_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "state.h"
+
+/**
+ * \def SINK_BUFF_SIZE
+ * \brief The receive buffer size of the discard and verify sinks.
+ */
+#define SINK_BUFF_SIZE (256*1024)
+
+/**
+ * \def SINK_PIPE_SIZE
+ * \brief The pipe size requested by the splice sink.
+ */
+#define SINK_PIPE_SIZE (1024*1024)
+
+/**
+ * \def GOODPUT_MAGIC
+ * \brief Magic number of goodput timeline records ("CCGP").
+ */
+#define GOODPUT_MAGIC 0x50474343
+
+/**
+ * \def GOODPUT_FILE
+ * \brief Goodput timeline file prefix (in output-dir).
+ */
+#define GOODPUT_FILE "goodput"
+
+/**
+ * \enum sink_mode
+ * \brief The client sink modes.
+ */
+enum sink_mode {
+   SINK_FILE,     /*!< write received data to the client file */
+   SINK_DISCARD,  /*!< count and drop received data */
+   SINK_SPLICE,   /*!< splice received data to the client file */
+   SINK_VERIFY    /*!< compare received data with server-file */
+};
+
+/**
+ * \struct goodput
+ * \brief A per-interval goodput timeline of one flow.
+ */
+struct goodput {
+   uint64_t  start;       /*!< monotonic start time (ns) */
+   uint64_t  start_real;  /*!< wall-clock start time (ns) */
+   uint32_t  interval;    /*!< interval length (us) */
+   uint32_t  len;         /*!< number of used intervals */
+   uint32_t  cap;         /*!< number of allocated intervals */
+   uint32_t *bytes;       /*!< bytes received per interval */
+   uint64_t  total;       /*!< total bytes received */
+   uint64_t  errors;      /*!< mismatching bytes (verify sink) */
+};
+
+/**
+ * \struct goodput_hdr
+ * \brief On-disk header of a goodput timeline record, followed by
+ *        nintervals uint32_t byte counts. Host byte order.
+ */
+struct goodput_hdr {
+   uint32_t magic;        /*!< GOODPUT_MAGIC */
+   uint8_t  family;       /*!< 4 or 6 */
+   uint8_t  tun;          /*!< 1 for tunneled flow, 0 otherwise */
+   uint8_t  sink;         /*!< enum sink_mode */
+   uint8_t  pad;
+   uint8_t  addr[16];     /*!< destination address */
+   uint16_t port;         /*!< destination port */
+   uint16_t pad2;
+   uint32_t interval;     /*!< interval length (us) */
+   uint32_t nintervals;   /*!< number of intervals */
+   uint64_t start;        /*!< wall-clock start time (ns) */
+   uint64_t total;        /*!< total bytes received */
+   uint64_t errors;       /*!< mismatching bytes (verify sink) */
+} __attribute__((packed));
+
+/**
+ * \fn int parse_sink_mode(const char *val)
+ * \brief Parse a client-sink configuration value.
+ *
+ * \param val one of file, discard, splice or verify
+ * \return The sink mode, or -1 if unknown
+ */
+int parse_sink_mode(const char *val);
+
+/**
+ * \fn struct goodput *goodput_init(uint32_t interval)
+ * \brief Allocate a goodput timeline starting now.
+ *
+ * \param interval The interval length in us
+ * \return The timeline
+ */
+struct goodput *goodput_init(uint32_t interval);
+
+/**
+ * \fn void goodput_add(struct goodput *gp, uint32_t bytes)
+ * \brief Account received bytes to the current interval.
+ *
+ * \param gp The timeline
+ * \param bytes The amount of bytes received
+ */
+void goodput_add(struct goodput *gp, uint32_t bytes);
+
+/**
+ * \fn void goodput_write(struct tun_state *state, struct goodput *gp,
+ *                        struct sockaddr *sa, int tun)
+ * \brief Append a timeline to the goodput file of the run. Thread-safe.
+ *
+ * \param state The program state
+ * \param gp The timeline
+ * \param sa The destination of the flow
+ * \param tun 1 for a tunneled flow, 0 otherwise
+ */
+void goodput_write(struct tun_state *state, struct goodput *gp,
+                   struct sockaddr *sa, int tun);
+
+/**
+ * \fn void goodput_free(struct goodput *gp)
+ * \brief Free a goodput timeline.
+ *
+ * \param gp The timeline
+ */
+void goodput_free(struct goodput *gp);
+
+/**
+ * \fn int sink_run(struct tun_state *state, int s,
+ *                  const char *filename, struct goodput *gp)
+ * \brief Consume a connected socket until EOF with the configured sink.
+ *
+ * \param state The program state
+ * \param s The connected socket
+ * \param filename The client file (file and splice sinks)
+ * \param gp The timeline to feed
+ * \return 1 if filename was written, 0 if not, -1 on error (errno is set)
+ */
+int sink_run(struct tun_state *state, int s,
+             const char *filename, struct goodput *gp);
+
+#endif
@@ -46,6 +46,7 @@
 #include "net.h"
 #include "xpcap.h"
 #include "destruct.h"
+#include "pmtu.h"
 
 /**
  * \fn static build_sel(fd_set *input_set, int *fds_raw, int len, int *max_fd_raw)
@@ -86,7 +87,7 @@ struct sockaddr_in6 *get_addr6(const char *addr, int port) {
    return ret;
 }
 
-int udp_sock6(int port, uint8_t register_gc, char *addr) {
+int udp_sock6(int port, uint8_t register_gc, char *addr, uint8_t shared) {
    int s;
    /* UDP socket */
    if ((s=socket(AF_INET6, SOCK_DGRAM, 0)) == -1)
@@ -101,6 +102,12 @@ int udp_sock6(int port, uint8_t register_gc, char *addr) {
    sin.sin6_port        = htons(port);
    inet_pton(AF_INET6, addr, &sin.sin6_addr);
 
+   /* per-destination connected sockets share the address */
+   int on = 1;
+   if (shared && 
+       setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+      die("SO_REUSEPORT");
+
    /* bind to port */
    if( bind(s, (struct sockaddr*)&sin, sizeof(sin) ) == -1)
       die("bind udp socket");
@@ -113,15 +120,15 @@ int udp_sock6(int port, uint8_t register_gc, char *addr) {
 
 #if defined(IPV6_RECVERR)
    /* enable icmp catching */
-   int on = 1;
    if (setsockopt(s, SOL_IPV6, IPV6_RECVERR, (char*)&on, sizeof(on))) 
       die("IPV6_RECVERR");
 #endif
+   pmtu_sock(s, AF_INET6);
    debug_print("udp socket created at %s:%d\n", addr, port);
    return s;
 }
 
-int udp_sock4(int port, uint8_t register_gc, char *addr) {
+int udp_sock4(int port, uint8_t register_gc, char *addr, uint8_t shared) {
    int s;
    /* UDP socket */
    if ((s=socket(AF_INET, SOCK_DGRAM, 0)) == -1)
@@ -136,6 +143,12 @@ int udp_sock4(int port, uint8_t register_gc, char *addr) {
    sin.sin_port        = htons(port);
    inet_pton(AF_INET, addr, &sin.sin_addr);
 
+   /* per-destination connected sockets share the address */
+   int on = 1;
+   if (shared && 
+       setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+      die("SO_REUSEPORT");
+
    /* bind to port */
    if( bind(s, (struct sockaddr*)&sin, sizeof(sin) ) == -1)
       die("bind udp socket");
@@ -148,14 +161,54 @@ int udp_sock4(int port, uint8_t register_gc, char *addr) {
 
 #if defined(IP_RECVERR)
    /* enable icmp catching */
-   int on = 1;
    if (setsockopt(s, SOL_IP, IP_RECVERR, (char*)&on, sizeof(on))) 
       die("IP_RECVERR");
 #endif
+   pmtu_sock(s, AF_INET);
    debug_print("udp socket created at %s:%d\n", addr, port);
    return s;
 }
 
+int udp_conn_sock(int fd, const struct sockaddr *sa) {
+   struct sockaddr_storage local;
+   socklen_t llen = sizeof(local), salen;
+   int s, on = 1;
+
+   salen = (sa->sa_family == AF_INET6) ? sizeof(struct sockaddr_in6) 
+                                       : sizeof(struct sockaddr_in);
+   if (getsockname(fd, (struct sockaddr *)&local, &llen) < 0)
+      die("getsockname");
+   if ((s=socket(sa->sa_family, SOCK_DGRAM, 0)) == -1)
+      die("socket");
+   set_fd(s);
+
+   if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+      die("SO_REUSEPORT");
+   if (bind(s, (struct sockaddr *)&local, llen) < 0)
+      die("bind udp socket");
+
+   int sndbuf = 1024*1024, rcvbuf = 1024*1024;
+   if (setsockopt(s, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)))
+      die("SNDBUF");
+   if (setsockopt(s, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)))
+      die("RCVBUF");
+
+#if defined(IP_RECVERR) && defined(IPV6_RECVERR)
+   /* enable icmp catching */
+   if (sa->sa_family == AF_INET6) {
+      if (setsockopt(s, SOL_IPV6, IPV6_RECVERR, (char*)&on, sizeof(on))) 
+         die("IPV6_RECVERR");
+   } else if (setsockopt(s, SOL_IP, IP_RECVERR, (char*)&on, sizeof(on))) 
+      die("IP_RECVERR");
+#endif
+   pmtu_sock(s, sa->sa_family);
+
+   /* resolve the route once */
+   if (connect(s, sa, salen) < 0)
+      die("connect udp socket");
+   return s;
+}
+
 #if defined(LINUX_OS)
 int raw_tcp_sock4(int port, char *addr, const struct sock_fprog * bpf, const char *dev,
                  int planetlab) {
@@ -199,7 +252,7 @@ int raw_sock6(int port, char *addr, const struct sock_fprog * bpf, const char *d
              int proto, uint8_t register_gc, int planetlab) {
    int s;
    struct sockaddr_in6 sin;
-   if ((s=socket(PF_INET, SOCK_RAW, proto)) == -1) 
+   if ((s=socket(PF_INET6, SOCK_RAW, proto)) == -1) 
       die("socket");
    if (register_gc)
       set_fd(s);
@@ -242,6 +295,10 @@ int xselect(fd_set *input_set, int fd_max, struct timeval *tv, int timeout) {
    return sel;
 }
 
+int xsend(int fd, const void *buf, size_t buflen) {
+   return send(fd, buf, buflen, 0);
+}
+
 int xsendto4(int fd, struct sockaddr *sa, const void *buf, 
             size_t buflen) {
    int sent = 0;
@@ -269,7 +326,7 @@ int xrecverr(int fd, void *buf, size_t buflen, int fd_out, struct tun_state *sta
    struct cmsghdr *cmsg;                   
    struct sock_extended_err *sock_err;     
    struct icmphdr icmph;  
-   struct sockaddr_in remote;
+   struct sockaddr_storage remote;
 
    /* init structs */
    iov.iov_base       = &icmph;
@@ -291,6 +348,9 @@ int xrecverr(int fd, void *buf, size_t buflen, int fd_out, struct tun_state *sta
       /* ip level and error */
       if (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) {
          sock_err = (struct sock_extended_err*)CMSG_DATA(cmsg); 
+         /* path MTU of the original destination */
+         if (sock_err && sock_err->ee_errno == EMSGSIZE)
+            pmtu_learn((struct sockaddr *)&remote, sock_err->ee_info);
          /* icmp msgs */
          if (sock_err && sock_err->ee_origin == SO_EE_ORIGIN_ICMP) 
             print_icmp_type(sock_err->ee_type, sock_err->ee_code);
@@ -303,7 +363,18 @@ int xrecverr(int fd, void *buf, size_t buflen, int fd_out, struct tun_state *sta
             xwrite(fd_out, pkt, pkt_len);
             free(pkt); 
          }
-      } 
+      }
+#if defined(IPV6_RECVERR)
+      else if (cmsg->cmsg_level == SOL_IPV6 && 
+               cmsg->cmsg_type == IPV6_RECVERR) {
+         sock_err = (struct sock_extended_err*)CMSG_DATA(cmsg); 
+         if (sock_err && sock_err->ee_errno == EMSGSIZE)
+            pmtu_learn((struct sockaddr *)&remote, sock_err->ee_info);
+         else if (sock_err)
+            debug_print("icmp6 type %d code %d\n", 
+                        sock_err->ee_type, sock_err->ee_code);
+      }
+#endif
    }
 #else
    debug_print("recvd icmp\n");
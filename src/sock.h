@@ -74,24 +74,44 @@ char *addr_to_itf4(char *addr);
 char *addr_to_itf6(char *addr);
 
 /**
- * \fn int udp_sock4(int port, uint8_t register_gc, char *addr)
+ * \fn int udp_sock4(int port, uint8_t register_gc, char *addr, 
+ *                   uint8_t shared)
  * \brief Create and bind an IPv4 UDP DGRAM socket.
  *
  * \param port The port for the bind call.
  * \param register_gc Register fd to garbage collector.
+ * \param shared 1 to allow connected sockets on the same address 
+ *               (see udp_conn_sock), 0 not to.
  * \return The socket fd.
  */ 
-int udp_sock4(int port, uint8_t register_gc, char *addr);
+int udp_sock4(int port, uint8_t register_gc, char *addr, uint8_t shared);
 
 /**
- * \fn int udp_sock6(int port, uint8_t register_gc, char *addr)
+ * \fn int udp_sock6(int port, uint8_t register_gc, char *addr, 
+ *                   uint8_t shared)
  * \brief Create and bind an IPv6 UDP DGRAM socket.
  *
  * \param port The port for the bind call.
  * \param register_gc Register fd to garbage collector.
+ * \param shared 1 to allow connected sockets on the same address 
+ *               (see udp_conn_sock), 0 not to.
  * \return The socket fd.
  */ 
-int udp_sock6(int port, uint8_t register_gc, char *addr);
+int udp_sock6(int port, uint8_t register_gc, char *addr, uint8_t shared);
+
+/**
+ * \fn int udp_conn_sock(int fd, const struct sockaddr *sa)
+ * \brief Create a UDP socket connected to one destination, bound to the
+ *        address of a shared socket.
+ *
+ *    The route of the destination is cached in the socket, and its
+ *    datagrams are received on it rather than on the shared socket.
+ *
+ * \param fd The shared socket (udp_sock4/6 with shared set)
+ * \param sa The destination
+ * \return The socket fd, registered to the garbage collector.
+ */ 
+int udp_conn_sock(int fd, const struct sockaddr *sa);
 
 #if defined(LINUX_OS)
 /**
@@ -130,6 +150,17 @@ int raw_sock6(int port, char *addr, const struct sock_fprog * bpf, const char *d
              int proto, uint8_t register_gc, int planetlab);
 #endif
 
+/**
+ * \fn int xsend(int fd, const void *buf, size_t buflen)
+ * \brief send syscall wrapper for connected sockets.
+ *
+ * \param fd The file descriptor of the connected sending socket.
+ * \param buf A pointer to the buffer.
+ * \param buflen The size of the buffer.
+ * \return The amount of bytes sent, -1 on failure (errno is set).
+ */ 
+int xsend(int fd, const void *buf, size_t buflen);
+
 /**
  * \fn int xsendto(int fd, struct sockaddr *sa, const void *buf, size_t buflen)
  * \brief sendto syscall wrapper that dies with failure.
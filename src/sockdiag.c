@@ -0,0 +1,391 @@
+/**
+ * \file sockdiag.c
+ * \brief Bulk sock_diag (INET_DIAG) sampler of server-side connections.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sysconfig.h"
+#if defined(LINUX_OS)
+#  include <linux/netlink.h>
+#  include <linux/rtnetlink.h>
+#  include <linux/sock_diag.h>
+#  include <linux/inet_diag.h>
+#  include <linux/tcp.h>
+#endif
+
+#include "sockdiag.h"
+#include "tlog.h"
+#include "sock.h"
+#include "thread.h"
+#include "debug.h"
+#include "udptun.h"
+
+#if defined(LINUX_OS)
+
+/* TCP states as in include/net/tcp_states.h */
+#define SD_TCP_LISTEN     10
+#define SD_TCP_TIME_WAIT  6
+#define SD_TCP_CLOSE      7
+#define SD_TCP_MAX_STATES 12
+
+/**
+ * \def SD_STATES
+ * \brief Dumped socket states: every connection state but listening,
+ *        time-wait and closed sockets.
+ */
+#define SD_STATES (((1 << SD_TCP_MAX_STATES) - 1) & ~((1 << SD_TCP_LISTEN) | \
+                   (1 << SD_TCP_TIME_WAIT) | (1 << SD_TCP_CLOSE)))
+
+/**
+ * \def SD_BC_LEN
+ * \brief Length of the port filter bytecode: two 16-byte source port
+ *        matches joined by a 4-byte jump.
+ */
+#define SD_BC_LEN (2*16 + 4)
+
+/**
+ * \struct sockdiag_req
+ *	\brief A filtered INET_DIAG dump request.
+ */
+struct sockdiag_req {
+   struct nlmsghdr         nlh;
+   struct inet_diag_req_v2 r;
+   struct rtattr           rta;
+   unsigned char           bc[SD_BC_LEN];
+};
+
+/**
+ * \struct sockdiag_flow
+ *	\brief A known socket.
+ */
+struct sockdiag_flow {
+   uint32_t inode;  /*!< socket inode, hash table key */
+   uint32_t id;     /*!< flow id in the timeline log */
+   uint8_t  flags;  /*!< TLOG_* flags */
+   uint8_t  seen;   /*!< present in the last dump */
+};
+
+/**
+ * \var static GHashTable *flows
+ * \brief Inode to struct sockdiag_flow lookup table.
+ */
+static GHashTable *flows;
+
+/**
+ * \var static uint32_t next_id
+ * \brief The next flow id.
+ */
+static uint32_t next_id;
+
+/**
+ * \var static struct tlog *diag_log
+ * \brief The sock_diag timeline log.
+ */
+static struct tlog *diag_log;
+
+/**
+ * \var static int fd_diag
+ * \brief The NETLINK_SOCK_DIAG socket.
+ */
+static int fd_diag = -1;
+
+/**
+ * \var static struct in_addr priv4; static struct in6_addr priv6
+ * \brief The private (tunneled) addresses of this node.
+ */
+static struct in_addr  priv4;
+static struct in6_addr priv6;
+
+/**
+ * \var static struct sockdiag_req req
+ * \brief The dump request template.
+ */
+static struct sockdiag_req req;
+
+/**
+ * \fn static void sockdiag_bc_port(unsigned char *bc, int off, uint16_t port)
+ * \brief Write a (sport == port) match at offset off of the bytecode.
+ *        A mismatch jumps to off+20, i.e. past the following 4-byte jump.
+ *
+ * \param bc The bytecode
+ * \param off The match offset
+ * \param port The source port
+ */
+static void sockdiag_bc_port(unsigned char *bc, int off, uint16_t port);
+
+/**
+ * \fn static void sockdiag_dump(int af, char *buf)
+ * \brief Dump and log the sockets of an address family.
+ *
+ * \param af AF_INET or AF_INET6
+ * \param buf A SOCKDIAG_BUFF_SIZE receive buffer
+ */
+static void sockdiag_dump(int af, char *buf);
+
+/**
+ * \fn static void sockdiag_sample(struct inet_diag_msg *msg, int len,
+ *                                 uint64_t now)
+ * \brief Log a dumped socket.
+ *
+ * \param msg The socket
+ * \param len The message payload length
+ * \param now The dump time
+ */
+static void sockdiag_sample(struct inet_diag_msg *msg, int len, uint64_t now);
+
+/**
+ * \fn static gboolean sockdiag_expire(gpointer key, gpointer value,
+ *                                     gpointer user_data)
+ * \brief Remove sockets absent from the last dump, and clear the seen
+ *        flag of the others.
+ */
+static gboolean sockdiag_expire(gpointer key, gpointer value,
+                                gpointer user_data);
+
+#endif
+
+/**
+ * \fn static void *sockdiag_thread(void *arg)
+ * \brief The sampler thread.
+ *
+ * \param arg The sampling interval in ms (uintptr_t)
+ */
+static void *sockdiag_thread(void *arg);
+
+/**
+ * \fn static void term_sockdiag(void *arg)
+ * \brief Close the netlink socket and the timeline log.
+ */
+static void term_sockdiag(void *arg);
+
+void sockdiag_init(struct tun_state *state) {
+   if (!state->sockdiag_interval)
+      return;
+#if defined(LINUX_OS)
+   if (state->private_addr4)
+      inet_pton(AF_INET, state->private_addr4, &priv4);
+   if (state->private_addr6)
+      inet_pton(AF_INET6, state->private_addr6, &priv6);
+
+   if ((fd_diag = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC,
+                         NETLINK_SOCK_DIAG)) < 0)
+      die("socket NETLINK_SOCK_DIAG");
+
+   /* filter on the server ports in-kernel */
+   memset(&req, 0, sizeof(req));
+   req.nlh.nlmsg_len      = sizeof(req);
+   req.nlh.nlmsg_type     = SOCK_DIAG_BY_FAMILY;
+   req.nlh.nlmsg_flags    = NLM_F_REQUEST | NLM_F_DUMP;
+   req.r.sdiag_protocol   = IPPROTO_TCP;
+   req.r.idiag_states     = SD_STATES;
+   req.r.idiag_ext        = 1 << (INET_DIAG_INFO - 1);
+   req.rta.rta_type       = INET_DIAG_REQ_BYTECODE;
+   req.rta.rta_len        = RTA_LENGTH(SD_BC_LEN);
+   sockdiag_bc_port(req.bc, 0, state->public_port);
+   struct inet_diag_bc_op *jmp = (struct inet_diag_bc_op *)(req.bc + 16);
+   jmp->code = INET_DIAG_BC_JMP;
+   jmp->yes  = 4;
+   jmp->no   = SD_BC_LEN - 16;
+   sockdiag_bc_port(req.bc, 20, state->private_port);
+
+   char file_loc[STR_SIZE];
+   snprintf(file_loc, STR_SIZE, "%s%s%s%s.dat", state->out_dir, SOCKDIAG_FILE,
+            state->args->run_id ? "." : "",
+            state->args->run_id ? state->args->run_id : "");
+   diag_log = tlog_open(file_loc);
+   flows    = g_hash_table_new(g_int_hash, g_int_equal);
+
+   xthread_create(sockdiag_thread,
+                  (void *)(uintptr_t)state->sockdiag_interval, 1);
+#else
+   debug_print("sock_diag is not supported on this platform\n");
+#endif
+}
+
+#if defined(LINUX_OS)
+
+void sockdiag_bc_port(unsigned char *bc, int off, uint16_t port) {
+   struct inet_diag_bc_op *op = (struct inet_diag_bc_op *)(bc + off);
+   /* jump targets are relative, SD_BC_LEN+4 rejects */
+   int fail = ((off + 20 > SD_BC_LEN) ? SD_BC_LEN + 4 : off + 20) - off;
+
+   op[0].code = INET_DIAG_BC_S_GE;
+   op[0].yes  = 8;
+   op[0].no   = fail;
+   op[1].no   = port;
+   op[2].code = INET_DIAG_BC_S_LE;
+   op[2].yes  = 8;
+   op[2].no   = fail - 8;
+   op[3].no   = port;
+}
+
+void sockdiag_dump(int af, char *buf) {
+   struct sockaddr_nl nladdr;
+   memset(&nladdr, 0, sizeof(nladdr));
+   nladdr.nl_family = AF_NETLINK;
+
+   req.r.sdiag_family = af;
+   req.nlh.nlmsg_seq++;
+   if (sendto(fd_diag, &req, sizeof(req), 0,
+              (struct sockaddr *)&nladdr, sizeof(nladdr)) < 0) {
+      debug_print("sock_diag: %s\n", strerror(errno));
+      return;
+   }
+
+   uint64_t now = tlog_now();
+   while (1) {
+      int len = recv(fd_diag, buf, SOCKDIAG_BUFF_SIZE, 0);
+      if (len < 0) {
+         if (errno == EINTR) continue;
+         debug_print("sock_diag: %s\n", strerror(errno));
+         return;
+      }
+
+      struct nlmsghdr *h = (struct nlmsghdr *)buf;
+      for (; NLMSG_OK(h, (unsigned int)len); h = NLMSG_NEXT(h, len)) {
+         if (h->nlmsg_seq != req.nlh.nlmsg_seq)
+            continue;
+         if (h->nlmsg_type == NLMSG_DONE)
+            return;
+         if (h->nlmsg_type == NLMSG_ERROR) {
+            debug_print("sock_diag: %s\n", strerror(
+                        -((struct nlmsgerr *)NLMSG_DATA(h))->error));
+            return;
+         }
+         sockdiag_sample(NLMSG_DATA(h), h->nlmsg_len - NLMSG_LENGTH(0), now);
+      }
+   }
+}
+
+void sockdiag_sample(struct inet_diag_msg *msg, int len, uint64_t now) {
+   struct tlog_rec rec;
+   struct sockdiag_flow *flow = g_hash_table_lookup(flows, &msg->idiag_inode);
+
+   if (!flow) {
+      flow = xmalloc(sizeof(struct sockdiag_flow));
+      flow->inode = msg->idiag_inode;
+      flow->id    = next_id++;
+      flow->flags = TLOG_DIAG | TLOG_SERV;
+      if (msg->idiag_family == AF_INET6) {
+         flow->flags |= TLOG_V6;
+         if (!memcmp(msg->id.idiag_src, &priv6, sizeof(priv6)))
+            flow->flags |= TLOG_TUN;
+      } else if (msg->id.idiag_src[0] == priv4.s_addr)
+         flow->flags |= TLOG_TUN;
+      g_hash_table_insert(flows, &flow->inode, flow);
+
+      memset(&rec, 0, sizeof(rec));
+      rec.type  = TLOG_FLOW;
+      rec.flags = flow->flags;
+      rec.id    = flow->id;
+      rec.ts    = now;
+      memcpy(rec.u.flow.laddr, msg->id.idiag_src,
+             (flow->flags & TLOG_V6) ? 16 : 4);
+      memcpy(rec.u.flow.raddr, msg->id.idiag_dst,
+             (flow->flags & TLOG_V6) ? 16 : 4);
+      rec.u.flow.lport = ntohs(msg->id.idiag_sport);
+      rec.u.flow.rport = ntohs(msg->id.idiag_dport);
+      tlog_append(diag_log, &rec);
+   }
+   flow->seen = 1;
+
+   /* look for the tcp_info attribute */
+   struct rtattr *attr = (struct rtattr *)(msg + 1);
+   int attrlen = len - NLMSG_ALIGN(sizeof(*msg));
+   for (; RTA_OK(attr, attrlen); attr = RTA_NEXT(attr, attrlen)) {
+      if (attr->rta_type != INET_DIAG_INFO)
+         continue;
+      struct tcp_info ti;
+      size_t tilen = RTA_PAYLOAD(attr);
+      if (tilen > sizeof(ti))
+         tilen = sizeof(ti);
+      memset(&ti, 0, sizeof(ti));
+      memcpy(&ti, RTA_DATA(attr), tilen);
+
+      memset(&rec, 0, sizeof(rec));
+      rec.flags = flow->flags;
+      rec.id    = flow->id;
+      rec.ts    = now;
+      tlog_fill_sample(&rec, &ti, tilen);
+      tlog_append(diag_log, &rec);
+      break;
+   }
+}
+
+gboolean sockdiag_expire(gpointer UNUSED(key), gpointer value,
+                         gpointer UNUSED(user_data)) {
+   struct sockdiag_flow *flow = value;
+   if (!flow->seen) {
+      free(flow);
+      return 1;
+   }
+   flow->seen = 0;
+   return 0;
+}
+
+#endif
+
+void term_sockdiag(void *UNUSED(arg)) {
+#if defined(LINUX_OS)
+   if (flows) {
+      /* the first pass clears the seen flags */
+      g_hash_table_foreach_remove(flows, sockdiag_expire, NULL);
+      g_hash_table_foreach_remove(flows, sockdiag_expire, NULL);
+      g_hash_table_destroy(flows);
+      flows = NULL;
+   }
+   if (fd_diag >= 0)
+      close(fd_diag);
+   fd_diag = -1;
+   tlog_close(diag_log);
+   diag_log = NULL;
+#endif
+   debug_print("closing sock_diag sampler...\n");
+}
+
+void *sockdiag_thread(void *arg) {
+   uint32_t interval = (uint32_t)(uintptr_t)arg;
+   struct timespec next;
+   char *buf = xmalloc(SOCKDIAG_BUFF_SIZE);
+
+   clock_gettime(CLOCK_MONOTONIC, &next);
+   pthread_cleanup_push(&free, buf);
+   pthread_cleanup_push(&term_sockdiag, NULL);
+   while (1) {
+      /* absolute deadlines, no drift */
+      next.tv_nsec += (interval % 1000) * 1000000L;
+      next.tv_sec  += interval / 1000 + next.tv_nsec / 1000000000L;
+      next.tv_nsec %= 1000000000L;
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                             &next, NULL) == EINTR);
+
+#if defined(LINUX_OS)
+      /* no cancellation inside a dump */
+      int old;
+      pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+      sockdiag_dump(AF_INET, buf);
+      sockdiag_dump(AF_INET6, buf);
+      g_hash_table_foreach_remove(flows, sockdiag_expire, NULL);
+      pthread_setcancelstate(old, NULL);
+#endif
+   }
+   pthread_cleanup_pop(0);
+   pthread_cleanup_pop(0);
+   return 0;
+}
+
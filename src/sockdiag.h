@@ -0,0 +1,40 @@
+/**
+ * \file sockdiag.h
+ * \brief Bulk sock_diag (INET_DIAG) sampler of server-side connections.
+ *
+ *    Every interval, one netlink dump per address family collects the
+ *    TCP info of all sockets bound to public-server-port or
+ *    private-server-port, filtered in-kernel by a bytecode program.
+ *    Samples are written to a timeline log (see tlog.h).
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_SOCKDIAG_H
+#define UDPTUN_SOCKDIAG_H
+
+#include "state.h"
+
+/**
+ * \def SOCKDIAG_FILE
+ * \brief sock_diag timeline log prefix (in output-dir).
+ */
+#define SOCKDIAG_FILE "sockdiag"
+
+/**
+ * \def SOCKDIAG_BUFF_SIZE
+ * \brief Netlink receive buffer size.
+ */
+#define SOCKDIAG_BUFF_SIZE (64*1024)
+
+/**
+ * \fn void sockdiag_init(struct tun_state *state)
+ * \brief Run the sock_diag sampler thread if sock-diag-interval is set.
+ *        Call after init_destructors().
+ *
+ * \param state The program state
+ */
+void sockdiag_init(struct tun_state *state);
+
+#endif
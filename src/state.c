@@ -21,6 +21,31 @@
 #include "net.h"
 #include "xpcap.h"
 #include "thread.h"
+#include "sink.h"
+#include "tcpinfo.h"
+#include "sockdiag.h"
+#include "tap.h"
+#include "flowstat.h"
+#include "encap.h"
+#include "sample.h"
+#include "session.h"
+#include "mpath.h"
+#include "lpm.h"
+#include "mss.h"
+#include "pmtu.h"
+
+/**
+ * \def ADDR_LIST_SIZE
+ * \brief Size of a destination file address field (a comma-separated list
+ *        of up to MPATH_MAX public addresses).
+ */
+#define ADDR_LIST_SIZE (MPATH_MAX * INET6_ADDRSTRLEN)
+
+/**
+ * \def DEST_LINE_SIZE
+ * \brief Maximum length of a destination file line.
+ */
+#define DEST_LINE_SIZE 4096
 
 /**
  * \fn static int parse_dest_file4(struct arguments *args, struct tun_state *state)
@@ -51,6 +76,28 @@ static int parse_dest_file(struct arguments *args, struct tun_state *state);
  */
 static int parse_cfg_file(struct tun_state *state);
 
+/**
+ * \fn static void add_path_addr(char ***addrs, uint8_t *len, const char *val)
+ * \brief Append a path-address cfg value, up to MPATH_MAX - 1.
+ *
+ * \param addrs The address array
+ * \param len Its length
+ * \param val The address
+ */
+static void add_path_addr(char ***addrs, uint8_t *len, const char *val);
+
+/**
+ * \fn static void parse_prefixes(struct tun_state *state, char *list, 
+ *                                struct tun_rec *rec)
+ * \brief Route the trailing prefixes of a destination file line.
+ *
+ * \param state The program state
+ * \param list The prefixes, separated by blanks or commas
+ * \param rec The destination
+ */
+static void parse_prefixes(struct tun_state *state, char *list, 
+                           struct tun_rec *rec);
+
 /**
  * \fn static void free_tun_rec_aux(gpointer key,
  *                                  gpointer value,
@@ -65,6 +112,17 @@ static void free_tun_rec_aux(gpointer key,
                       gpointer value,
                       gpointer user_data);
 
+/**
+ * \fn static int spray_key(struct tun_state *state, int sport)
+ * \brief The state->serv key of a destination file port, dies on a 
+ *        block that is out of range or overlaps a previous one.
+ *
+ * \param state The program state
+ * \param sport The destination unique port
+ * \return The first port of its block
+ */
+static int spray_key(struct tun_state *state, int sport);
+
 static GHashTable *init_table(int v);
 
 GHashTable *init_table(int v) {
@@ -86,6 +144,26 @@ struct tun_state *init_tun_state(struct arguments *args) {
    if (parse_cfg_file(state) < 0)
       die("configuration file");
 
+   /* peers and non-UDP tunnels keep a single source port, before the
+      destination file is keyed by port block */
+   if (!state->port_spray || !args->udp || args->mode == FULLMESH_MODE)
+      state->port_spray = 1;
+   else if (state->port_spray > PORT_SPRAY_MAX) {
+      errno=E2BIG;
+      die("source-port-spray");
+   }
+   /* clients bind source-port, dual-stack ones public-server-port */
+   if (args->mode == CLI_MODE && state->port_spray > 1 &&
+       spray_block(state, args->dual_stack ? state->public_port 
+                                           : state->port) < 0)
+      die("source-port-spray block");
+
+   if (state->capture_sample_mode == SAMPLE_FLOW && 
+       state->capture_sample_rate > SAMPLE_FLOW_RATE_MAX) {
+      errno=E2BIG;
+      die("capture-sample-rate");
+   }
+
    /* create htables */
    if (args->mode == SERV_MODE || args->mode == FULLMESH_MODE) {
       state->serv = init_table(4);
@@ -106,6 +184,9 @@ struct tun_state *init_tun_state(struct arguments *args) {
    /* Replace cfg value with args */
    if (args->inactivity_timeout)
       state->inactivity_timeout = args->inactivity_timeout;
+   /* daemons idle between runs */
+   if (args->control_sock)
+      state->inactivity_timeout = -1;
    if (args->planetlab)
       state->planetlab = 1;
    if (args->freebsd)
@@ -116,6 +197,7 @@ struct tun_state *init_tun_state(struct arguments *args) {
       state->dual_stack = 1; 
    state->udp = args->udp;
    state->protocol_num = args->protocol_num;
+
    state->raw_header_size = args->raw_header_size;
 
    if (args->raw_header) {
@@ -142,6 +224,18 @@ struct tun_state *init_tun_state(struct arguments *args) {
       state->snaplen = NOTUN_SNAPLEN4;
    state->snaplen += state->raw_header_size;
 
+   /* default capture ring size */
+   if (!state->capture_bufsize)
+      state->capture_bufsize = CAPTURE_BUFFER;
+
+   /* default capture outputs */
+   if (!state->capture_output)
+      state->capture_output = CAPTURE_PCAP;
+
+   /* default goodput timeline granularity */
+   if (!state->goodput_interval)
+      state->goodput_interval = GOODPUT_INTERVAL;
+
    /* File locations */
    state->cli_file_tun4   = xmalloc(STR_SIZE);
    state->cli_file_notun4 = xmalloc(STR_SIZE);
@@ -161,11 +255,28 @@ struct tun_state *init_tun_state(struct arguments *args) {
       state->default_if = addr_to_itf6(state->public_addr6);
    else
       state->default_if = addr_to_itf4(state->public_addr4);
+
+   /* clamp tunneled TCP to the path MTU, track it on UDP tunnels */
+   mss_init(state);
+   if (!state->udp)
+      state->pmtu_disc = 0;
+   pmtu_init(state);
    
    /* init synchronizer and garbage collector */
    init_barrier(2);
    init_destructors(state);
 
+   /* restore learned peers before forwarding */
+   session_init(state);
+
+   /* run TCP_INFO and sock_diag samplers */
+   tcpinfo_init(state);
+   sockdiag_init(state);
+
+   /* run tun-side capture tap and encapsulation correlator */
+   encap_init(state);
+   tap_init(state);
+
    return state;
 }
 
@@ -193,6 +304,7 @@ void free_tun_state(struct tun_state *state) {
       g_hash_table_destroy(state->cli4); 
    if (state->cli6)
       g_hash_table_destroy(state->cli6);
+   lpm_free(state->lpm);
 
    /* Free mallocs */
    if (state->private_addr4)
@@ -207,12 +319,22 @@ void free_tun_state(struct tun_state *state) {
       free(state->public_addr4);
    if (state->public_addr6)
       free(state->public_addr6);
+   for (int i = 0; i < state->path_len4; i++)
+      free(state->path_addr4[i]);
+   free(state->path_addr4);
+   for (int i = 0; i < state->path_len6; i++)
+      free(state->path_addr6[i]);
+   free(state->path_addr6);
    if (state->cli_dir)
       free(state->cli_dir);
    if (state->serv_file)
       free(state->serv_file);
+   if (state->session_file)
+      free(state->session_file);
    if (state->tun_if)
       free(state->tun_if);
+   if (state->capture_hook)
+      free(state->capture_hook);
    if (state->default_if)
       free(state->default_if);
    if (state->cli_file_tun4)
@@ -276,9 +398,40 @@ void free_tun_rec_aux(gpointer UNUSED(key),
    free_tun_rec((struct tun_rec *)value); 
 }
 
+int spray_base(struct tun_state *state, int port) {
+   return port - port % state->port_spray;
+}
+
+int spray_block(struct tun_state *state, int port) {
+   int base = spray_base(state, port);
+
+   /* the whole block must be bindable */
+   if (port <= 0 || port > 65535 || 
+       (state->port_spray > 1 && 
+        (!base || base + state->port_spray - 1 > 65535))) {
+      errno=EINVAL;
+      return -1;
+   }
+   return base;
+}
+
+int spray_key(struct tun_state *state, int sport) {
+   int base = spray_block(state, sport);
+
+   if (base < 0)
+      die("destination port");
+   if (g_hash_table_lookup(state->serv, &base)) {
+      errno=EEXIST;
+      die("overlapping destination port blocks");
+   }
+   return base;
+}
+
 void free_tun_rec(struct tun_rec *rec) { 
    if (rec->sa4) free(rec->sa4);
    if (rec->sa6) free(rec->sa6);
+   if (rec->mp4) free(rec->mp4);
+   if (rec->mp6) free(rec->mp6);
    if (rec) free(rec); 
 }
 
@@ -309,6 +462,8 @@ int parse_cfg_file(struct tun_state *state) {
             state->private_port = strtol(val, NULL, 10);
          else if (!strcmp(key, "source-port")) 
             state->port = strtol(val, NULL, 10);
+         else if (!strcmp(key, "source-port-spray")) 
+            state->port_spray = strtol(val, NULL, 10);
          else if (!strcmp(key, "private-address4")) 
             state->private_addr4 = strdup(val);
          else if (!strcmp(key, "private-mask4")) 
@@ -321,11 +476,17 @@ int parse_cfg_file(struct tun_state *state) {
             state->public_addr4  = strdup(val);
          else if (!strcmp(key, "public-address6")) 
             state->public_addr6 = strdup(val);
+         else if (!strcmp(key, "path-address4")) 
+            add_path_addr(&state->path_addr4, &state->path_len4, val);
+         else if (!strcmp(key, "path-address6")) 
+            add_path_addr(&state->path_addr6, &state->path_len6, val);
          /* timeouts */
          else if (!strcmp(key, "inactivity-timeout")) 
             state->inactivity_timeout = strtol(val, NULL, 10);
          else if (!strcmp(key, "initial-sleep")) 
             state->initial_sleep = strtol(val, NULL, 10);
+         else if (!strcmp(key, "ready-timeout")) 
+            state->ready_timeout = strtol(val, NULL, 10);
          else if (!strcmp(key, "tcp-send-timeout")) 
             state->tcp_snd_timeout = strtol(val, NULL, 10);
          else if (!strcmp(key, "tcp-receive-timeout")) 
@@ -337,18 +498,97 @@ int parse_cfg_file(struct tun_state *state) {
             state->out_dir = strdup(val);
          else if (!strcmp(key, "server-file")) 
             state->serv_file = strdup(val);
+         else if (!strcmp(key, "session-file")) 
+            state->session_file = strdup(val);
+         else if (!strcmp(key, "session-sync-interval")) 
+            state->session_interval = strtol(val, NULL, 10);
+         else if (!strcmp(key, "session-ttl")) 
+            state->session_ttl = strtol(val, NULL, 10);
          /* system settings */
          else if (!strcmp(key, "buffer-length")) 
             state->buf_length = strtol(val, NULL, 10);
+         else if (!strcmp(key, "udp-connect")) 
+            state->udp_connect = strtol(val, NULL, 10);
          else if (!strcmp(key, "backlog-size")) 
             state->backlog_size = strtol(val, NULL, 10);
          else if (!strcmp(key, "fd-lim")) 
             state->fd_lim = strtol(val, NULL, 10);
          else if (!strcmp(key, "tun-tcp-mss")) 
             state->max_segment_size = strtol(val, NULL, 10);
+         else if (!strcmp(key, "tun-mss-clamp")) 
+            state->mss_clamp = strtol(val, NULL, 10);
+         else if (!strcmp(key, "path-mtu")) 
+            state->path_mtu = strtol(val, NULL, 10);
+         else if (!strcmp(key, "pmtu-discovery")) 
+            state->pmtu_disc = strtol(val, NULL, 10);
+         else if (!strcmp(key, "pmtu-probe-interval")) 
+            state->pmtu_probe_interval = strtol(val, NULL, 10);
+         /* client sink */
+         else if (!strcmp(key, "client-sink")) {
+            int mode = parse_sink_mode(val);
+            if (mode < 0) {
+               errno=EINVAL;
+               die("client-sink");
+            }
+            state->sink_mode = mode;
+         } else if (!strcmp(key, "sink-receive-buffer")) 
+            state->sink_rcvbuf = strtol(val, NULL, 10);
+         else if (!strcmp(key, "goodput-interval")) 
+            state->goodput_interval = strtol(val, NULL, 10) * 1000;
+         /* measurements */
+         else if (!strcmp(key, "capture-buffer")) 
+            state->capture_bufsize = strtol(val, NULL, 10);
+         else if (!strcmp(key, "capture-tap")) 
+            state->capture_tap = strtol(val, NULL, 10);
+         else if (!strcmp(key, "capture-rotate-size")) 
+            state->capture_rotate_size = strtoull(val, NULL, 10);
+         else if (!strcmp(key, "capture-rotate-time")) 
+            state->capture_rotate_time = strtol(val, NULL, 10);
+         else if (!strcmp(key, "capture-retain")) 
+            state->capture_retain = strtoull(val, NULL, 10);
+         else if (!strcmp(key, "capture-post-rotate")) 
+            state->capture_hook = strdup(val);
+         else if (!strcmp(key, "capture-compress")) 
+            state->capture_zlevel = strtol(val, NULL, 10);
+         else if (!strcmp(key, "capture-index")) 
+            state->capture_index = strtol(val, NULL, 10);
+         else if (!strcmp(key, "capture-gating")) 
+            state->capture_gating = strtol(val, NULL, 10);
+         else if (!strcmp(key, "capture-sample")) {
+            int mode = parse_sample_mode(val);
+            if (mode < 0) {
+               errno=EINVAL;
+               die("capture-sample");
+            }
+            state->capture_sample_mode = mode;
+         } else if (!strcmp(key, "capture-sample-rate")) 
+            state->capture_sample_rate = strtol(val, NULL, 10);
+         else if (!strcmp(key, "capture-output")) {
+            int output = parse_capture_output(val);
+            if (output < 0) {
+               errno=EINVAL;
+               die("capture-output");
+            }
+            state->capture_output = output;
+         } else if (!strcmp(key, "metrics-interval")) 
+            state->metrics_interval = strtol(val, NULL, 10);
+         else if (!strcmp(key, "encap-delay")) 
+            state->encap_delay = strtol(val, NULL, 10);
+         else if (!strcmp(key, "tcp-info-interval")) 
+            state->tcpinfo_interval = strtol(val, NULL, 10);
+         else if (!strcmp(key, "sock-diag-interval")) 
+            state->sockdiag_interval = strtol(val, NULL, 10);
          /* interfaces */
          else if (!strcmp(key, "tun-if")) 
             state->tun_if = strdup(val);
+         else if (!strcmp(key, "tun-mtu")) 
+            state->tun_mtu = strtol(val, NULL, 10);
+         else if (!strcmp(key, "tun-txqueuelen")) 
+            state->tun_txqlen = strtol(val, NULL, 10);
+         else if (!strcmp(key, "tun-persist")) 
+            state->tun_persist = strtol(val, NULL, 10);
+         else if (!strcmp(key, "tun-pool")) 
+            state->tun_pool = strtol(val, NULL, 10);
       
          /* NOTE: add cfg parameters here */
       } 
@@ -362,6 +602,35 @@ int parse_cfg_file(struct tun_state *state) {
    return 0;
 }
 
+void add_path_addr(char ***addrs, uint8_t *len, const char *val) {
+   /* the public address holds the first path */
+   if (*len >= MPATH_MAX - 1) {
+      errno=E2BIG;
+      die("path-address");
+   }
+   *addrs = realloc(*addrs, (*len + 1) * sizeof(char *));
+   if (!*addrs)
+      die("realloc");
+   (*addrs)[(*len)++] = strdup(val);
+}
+
+void parse_prefixes(struct tun_state *state, char *list, 
+                    struct tun_rec *rec) {
+   char *save, *tok;
+
+   for (tok = strtok_r(list, " \t\r\n,", &save); tok;
+        tok = strtok_r(NULL, " \t\r\n,", &save)) {
+      /* families without a tunnel are never looked up */
+      if ((strchr(tok, ':') && !state->cli6) || 
+          (!strchr(tok, ':') && state->args->ipv6 && 
+           !state->args->dual_stack)) {
+         errno=EAFNOSUPPORT;
+         die("destination prefix");
+      }
+      lpm_add(state, tok, rec);
+   }
+}
+
 int parse_dest_file(struct arguments *args, struct tun_state *state) {
    if (!args->dest_file) {
       errno=ENOENT;
@@ -376,13 +645,23 @@ int parse_dest_file(struct arguments *args, struct tun_state *state) {
    }
 
    int sport, count=0;
-   char public4[INET_ADDRSTRLEN], private4[INET_ADDRSTRLEN]; 
-   char public6[INET6_ADDRSTRLEN], private6[INET6_ADDRSTRLEN];
+   char public4[ADDR_LIST_SIZE], private4[INET_ADDRSTRLEN]; 
+   char public6[ADDR_LIST_SIZE], private6[INET6_ADDRSTRLEN];
+   char line[DEST_LINE_SIZE];
+   int prefixes;
    struct tun_rec *nrec_priv = NULL;
    /* build port to public addr lookup table */
-   while (fscanf(fp, "%d %s %s %s %s", &sport, public4, private4, 
-                                               public6, private6) == 5) {
+   while (fgets(line, DEST_LINE_SIZE, fp) &&
+          sscanf(line, "%d %s %s %s %s %n", &sport, public4, private4, 
+                       public6, private6, &prefixes) == 5) {
       nrec_priv        = init_tun_rec(state);
+      nrec_priv->mp4   = mpath_parse(AF_INET, public4, state->public_port);
+      nrec_priv->mp6   = mpath_parse(AF_INET6, public6, state->public_port);
+
+      /* public4,public4',... lists multipath addresses, the first one
+         is the destination address */
+      public4[strcspn(public4, ",")] = '\0';
+      public6[strcspn(public6, ",")] = '\0';
       nrec_priv->sa4   = (struct sockaddr *)get_addr4(public4, state->public_port);
       nrec_priv->sa6   = (struct sockaddr *)get_addr6(public6, state->public_port);
       nrec_priv->sport = sport;  
@@ -399,15 +678,18 @@ int parse_dest_file(struct arguments *args, struct tun_state *state) {
          struct tun_rec *nrec_pub  = init_tun_rec(state);
          nrec_pub->sa4    = (struct sockaddr *)get_addr4(public4, sport);
          nrec_pub->sa6    = (struct sockaddr *)get_addr6(public6, sport);
-         nrec_pub->sport = sport;  
+         nrec_pub->sport = spray_key(state, sport);  
          g_hash_table_insert(state->serv, &nrec_pub->sport, nrec_pub);
       }
 
       debug_print("%s:%d\n", public4, sport);
       debug_print("%s:%d\n", public6, sport);
 
+      /* optional trailing prefixes routed to the destination */
+      parse_prefixes(state, line + prefixes, nrec_priv);
       count++;
    }   
+   lpm_build(state->lpm);
   
    /* browse twice because of array malloc */
    rewind(fp);
@@ -417,11 +699,16 @@ int parse_dest_file(struct arguments *args, struct tun_state *state) {
    state->cli_public  = xmalloc(count * sizeof(struct tun_rec *));
    state->sa_len      = count;
    int i = 0, ret; 
-   while (fscanf(fp, "%d %s %s %s %s", &sport, public4, private4, 
-                                               public6, private6) == 5) {
+   while (fgets(line, DEST_LINE_SIZE, fp) &&
+          sscanf(line, "%d %s %s %s %s", &sport, public4, private4, 
+                       public6, private6) == 5) {
       struct tun_rec *nrec_priv = init_tun_rec(state);
       struct tun_rec *nrec_pub  = init_tun_rec(state);
 
+      /* the first public address only */
+      public4[strcspn(public4, ",")] = '\0';
+      public6[strcspn(public6, ",")] = '\0';
+
       /* add private sockaddr */
       nrec_priv->sa4    = (struct sockaddr *)get_addr4(private4, state->private_port);
       nrec_priv->sa6    = (struct sockaddr *)get_addr6(private6, state->private_port);
@@ -458,10 +745,19 @@ int parse_dest_file4(struct arguments *args, struct tun_state *state) {
    }
 
    int sport, count=0;
-   char public[INET_ADDRSTRLEN], private[INET_ADDRSTRLEN];
+   char public[ADDR_LIST_SIZE], private[INET_ADDRSTRLEN];
+   char line[DEST_LINE_SIZE];
+   int prefixes;
    /* build port to public addr lookup table */
-   while (fscanf(fp, "%d %s %s", &sport, public, private) == 3) {
+   while (fgets(line, DEST_LINE_SIZE, fp) &&
+          sscanf(line, "%d %s %s %n", &sport, public, private, 
+                       &prefixes) == 3) {
       struct tun_rec *nrec_priv = init_tun_rec(state);
+      nrec_priv->mp4   = mpath_parse(AF_INET, public, state->public_port);
+
+      /* public,public',... lists multipath addresses, the first one is 
+         the destination address */
+      public[strcspn(public, ",")] = '\0';
       nrec_priv->sa4   = (struct sockaddr *)get_addr4(public, state->public_port);
       nrec_priv->sport = sport;  
       if (!inet_pton(AF_INET, private, &nrec_priv->priv_addr4))
@@ -472,11 +768,15 @@ int parse_dest_file4(struct arguments *args, struct tun_state *state) {
       if (state->serv) {
          struct tun_rec *nrec_pub  = init_tun_rec(state);
          nrec_pub->sa4   = (struct sockaddr *)get_addr4(public, sport);
-         nrec_pub->sport = sport;  
+         nrec_pub->sport = spray_key(state, sport);  
          g_hash_table_insert(state->serv, &nrec_pub->sport, nrec_pub);
       }
+
+      /* optional trailing prefixes routed to the destination */
+      parse_prefixes(state, line + prefixes, nrec_priv);
       count++;
    }   
+   lpm_build(state->lpm);
   
    /* browse twice because of array malloc */
    rewind(fp);
@@ -486,10 +786,14 @@ int parse_dest_file4(struct arguments *args, struct tun_state *state) {
    state->cli_public  = xmalloc(count * sizeof(struct tun_rec *));
    state->sa_len      = count;
    int i = 0, ret; 
-   while ( (ret = fscanf(fp, "%d %s %s", &sport, public, private)) == 3) {
+   while (fgets(line, DEST_LINE_SIZE, fp) &&
+          (ret = sscanf(line, "%d %s %s", &sport, public, private)) == 3) {
       struct tun_rec *nrec_priv = init_tun_rec(state);
       struct tun_rec *nrec_pub  = init_tun_rec(state);
 
+      /* the first public address only */
+      public[strcspn(public, ",")] = '\0';
+
       /* add private sockaddr */
       nrec_priv->sa4   = (struct sockaddr *)get_addr4(private, state->private_port);
       nrec_priv->sport = sport;  
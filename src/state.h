@@ -28,6 +28,12 @@ struct tun_rec {
    //struct in6_addr  priv_addr6;  /*!<  The private v6 address in network byte order to be used as a key */
 
    int              sport;     /*!<  The udp source port. */
+   int              fd4;       /*!<  The connected v4 socket, 0 for none. */
+   int              fd6;       /*!<  The connected v6 socket, 0 for none. */
+   int              sprays;    /*!<  The client sends from several ports of
+                                      its block (source-port-spray). */
+   struct mpath    *mp4;       /*!<  The v4 paths, NULL for a single path. */
+   struct mpath    *mp6;       /*!<  The v6 paths, NULL for a single path. */
 };
 
 /** 
@@ -47,6 +53,7 @@ struct tun_state {
    char *raw_header;        /*!<  raw header hexstring */
    uint8_t raw_header_size;    /*!<  raw header size */
    uint8_t protocol_num;       /*!<  protocol number */
+   uint8_t udp_connect;        /*!<  per-destination connected sockets */
 
    /* From destination file */
    GHashTable      *serv;        /*!<  Source port to public address lookup table. */
@@ -55,9 +62,14 @@ struct tun_state {
    struct tun_rec **cli_private; /*!<  Destination list. (private sockaddr's) */
    struct tun_rec **cli_public;  /*!<  Destination list. (public sockaddr's) */ 
    uint8_t sa_len;               /*!<  Number of destinations. */
+   struct lpm *lpm;              /*!<  Destination prefixes, NULL for none */
 
    /* From cfg file */
    char    *tun_if;            /*!< The tun interface name. */
+   uint32_t tun_mtu;           /*!< The tun interface MTU, 0 for default */
+   uint32_t tun_txqlen;        /*!< The tun txqueuelen, 0 for default */
+   uint8_t  tun_persist;       /*!< Keep the tun interface after exit */
+   uint8_t  tun_pool;          /*!< Size of the tun interface pool, 0 for none */
    char    *default_if;         /*!< The default interface name. */
    char    *private_addr4;       /*!< The private ip address */
    char    *private_mask4;       /*!< The private ip mask */
@@ -65,8 +77,14 @@ struct tun_state {
    char    *private_mask6;      /*!< The private ipv6 mask */
    char    *public_addr4;        /*!< The public ip address */
    char    *public_addr6;       /*!< The public ipv6 address */
+   char   **path_addr4;         /*!< Additional public addresses (multipath) */
+   uint8_t  path_len4;          /*!< Number of path_addr4 */
+   char   **path_addr6;         /*!< Additional public ipv6 addresses */
+   uint8_t  path_len6;          /*!< Number of path_addr6 */
 
    uint16_t port;               /*!< The UNIQUE per-peer port number */
+   uint16_t port_spray;         /*!< Tunnel source ports per client, aligned
+                                     blocks of port_spray ports */
    uint16_t public_port;        /*!< The udp listen port */
    uint16_t private_port;       /*!< The tcp listen port */
 
@@ -74,8 +92,14 @@ struct tun_state {
    uint16_t tcp_rcv_timeout;    /*!< TCP client receive timeout */
    int16_t  inactivity_timeout; /*!< Inactivity timeout */
    uint16_t initial_sleep;      /*!< Initial sleep time (client & peer) */
+   uint16_t ready_timeout;      /*!< Readiness probe timeout (s), 0 to sleep */
 
    char    *serv_file;          /*!< The server file location */
+   char    *session_file;       /*!< The session checkpoint, NULL for none */
+   uint32_t session_interval;   /*!< session file sync interval (ms), 0 for 
+                                     shutdown only */
+   uint32_t session_ttl;        /*!< session entry lifetime (s), 0 to keep
+                                     entries forever */
    char    *cli_dir;            /*!< The data directory (for client) */
    char    *out_dir;            /*!< The output directory */
    /* cli_dir+macro from udptun.h */
@@ -89,9 +113,38 @@ struct tun_state {
    uint32_t fd_lim;             /*!< max simultaneously open fd */
    
    uint32_t max_segment_size;   /*!< The value passed as TCP_MAXSEG 
-                                     optval (max mss) for tun flow */
+                                     optval (max mss) for tun flow, 0 for
+                                     the kernel default */
+   uint8_t  mss_clamp;          /*!< clamp the MSS of tunneled TCP SYNs */
+   uint32_t path_mtu;           /*!< The path MTU, 0 for the default 
+                                     interface MTU */
+   uint16_t mss4;               /*!< MSS clamp of IPv4 inner packets */
+   uint16_t mss6;               /*!< MSS clamp of IPv6 inner packets */
+   uint8_t  pmtu_disc;          /*!< path MTU discovery (UDP tunnels) */
+   uint16_t pmtu_probe_interval;/*!< PLPMTUD probing interval (s), 0 for 
+                                     error queue notifications only */
 
    uint16_t snaplen;            /*!< the size of saved packets in pcap traces  */
+   uint32_t capture_bufsize;    /*!< kernel capture ring size in bytes */
+   uint8_t  capture_tap;        /*!< capture the tun side in-process */
+   uint64_t capture_rotate_size;/*!< rotate traces beyond size bytes, 0 to disable */
+   uint32_t capture_rotate_time;/*!< rotate traces older than time s, 0 to disable */
+   uint64_t capture_retain;     /*!< total size of kept segments per trace, 0 for no limit */
+   char    *capture_hook;       /*!< post-rotate command, NULL for none */
+   uint8_t  capture_zlevel;     /*!< zstd level of pcap traces, 0 not to compress */
+   uint8_t  capture_index;      /*!< write a sidecar index of pcap traces */
+   uint8_t  capture_gating;     /*!< capture client measurement windows only */
+   uint8_t  capture_sample_mode;/*!< capture sampling (enum sample_mode) */
+   uint32_t capture_sample_rate;/*!< keep 1-in-rate packets or flows */
+   uint8_t  capture_output;     /*!< traces and/or metrics (enum capture_output) */
+   uint32_t metrics_interval;   /*!< per-flow metrics interval (ms), 0 for none */
+   uint8_t  encap_delay;        /*!< correlate tun and wire captures */
+
+   uint8_t  sink_mode;          /*!< client sink mode (enum sink_mode) */
+   uint32_t sink_rcvbuf;        /*!< SO_RCVBUF of discard/splice/verify sinks */
+   uint32_t goodput_interval;   /*!< goodput timeline interval (us) */
+   uint32_t tcpinfo_interval;   /*!< TCP_INFO sampling interval (ms), 0 to disable */
+   uint32_t sockdiag_interval;  /*!< sock_diag sampling interval (ms), 0 to disable */
 };
 
 /**
@@ -127,5 +180,26 @@ struct tun_rec *init_tun_rec(struct tun_state *state);
  */
 void free_tun_rec(struct tun_rec *rec);
 
+/**
+ * \fn int spray_base(struct tun_state *state, int port)
+ * \brief The client port of a tunnel source port (source-port-spray).
+ *
+ * \param state The program state
+ * \param port A tunnel source port
+ * \return The first port of its block, the state->serv key
+ */
+int spray_base(struct tun_state *state, int port);
+
+/**
+ * \fn int spray_block(struct tun_state *state, int port)
+ * \brief Check that the block of a client port holds valid ports.
+ *
+ * \param state The program state
+ * \param port A client port
+ * \return The first port of its block, -1 if the block does not fit
+ *         in 1-65535 (errno is set)
+ */
+int spray_block(struct tun_state *state, int port);
+
 #endif
 
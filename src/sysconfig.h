@@ -52,4 +52,9 @@
 #  define GLIB1
 #endif
 
+/* zstd trace compression */
+#if defined(HAVE_LIBZSTD) && defined(HAVE_ZSTD_H)
+#  define WITH_ZSTD
+#endif
+
 #endif 
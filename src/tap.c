@@ -0,0 +1,226 @@
+/**
+ * \file tap.c
+ * \brief In-process capture tap of the tun side.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "tap.h"
+#include "pcapw.h"
+#include "flowstat.h"
+#include "encap.h"
+#include "sample.h"
+#include "sock.h"
+#include "thread.h"
+#include "debug.h"
+#include "udptun.h"
+#include "xpcap.h"
+
+/**
+ * \var static struct tap_slot *ring
+ * \brief The SPSC ring, NULL if the tap is disabled.
+ */
+static struct tap_slot *ring;
+
+/**
+ * \var static uint32_t head, tail
+ * \brief Free-running producer and consumer positions.
+ */
+static uint32_t head, tail;
+
+/**
+ * \var static uint32_t skip
+ * \brief Bytes to skip in front of each packet (PlanetLab PPI header).
+ */
+static uint32_t skip;
+
+/**
+ * \var static uint32_t snaplen
+ * \brief The tap snapshot length.
+ */
+static uint32_t snaplen;
+
+/**
+ * \var static struct sampler sample
+ * \brief The tap sampler, run by the producer.
+ */
+static struct sampler sample;
+
+/**
+ * \var static uint64_t drops
+ * \brief Packets dropped because the ring was full.
+ */
+static uint64_t drops;
+
+/**
+ * \struct tap_ctx
+ *	\brief The writer thread context.
+ */
+struct tap_ctx {
+   struct pcapw    *writer;   /*!< The trace writer or NULL */
+   struct flowstat *stats;    /*!< The flow metrics engine or NULL */
+   char            *filename; /*!< The trace location */
+   uint8_t          silent;   /*!< Do not report drops */
+   uint8_t          encap;    /*!< Feed the encapsulation correlator */
+};
+
+/**
+ * \fn static void *tap_thread(void *arg)
+ * \brief The writer thread.
+ *
+ * \param arg The writer context (struct tap_ctx *)
+ */
+static void *tap_thread(void *arg);
+
+/**
+ * \fn static void tap_drain(struct tap_ctx *ctx)
+ * \brief Write and/or account every packet in the ring.
+ *
+ * \param ctx The writer context
+ */
+static void tap_drain(struct tap_ctx *ctx);
+
+/**
+ * \fn static void term_tap(void *arg)
+ * \brief Drain the ring, report drops and close the trace.
+ *
+ * \param arg The writer context (struct tap_ctx *)
+ */
+static void term_tap(void *arg);
+
+void tap_init(struct tun_state *state) {
+   if (!state->capture_tap)
+      return;
+
+   struct tap_ctx *ctx = calloc(1, sizeof(struct tap_ctx));
+   if (!ctx)
+      die("calloc");
+   ctx->filename = xmalloc(STR_SIZE);
+   ctx->silent   = state->args->silent;
+   snprintf(ctx->filename, STR_SIZE, "%s%s%s%s.pcap", state->out_dir, TAP_FILE,
+            state->args->run_id ? "." : "",
+            state->args->run_id ? state->args->run_id : "");
+
+   if (state->ipv6)
+      snaplen = TUN_SNAPLEN6;
+   else if (state->dual_stack)
+      snaplen = TUN_SNAPLEN46;
+   else
+      snaplen = TUN_SNAPLEN4;
+   if (snaplen > TAP_SNAPLEN)
+      snaplen = TAP_SNAPLEN;
+   skip = state->planetlab ? 4 : 0;
+   sample_init(&sample, state->capture_sample_mode, 
+               state->capture_sample_rate);
+
+   if (state->capture_output & CAPTURE_PCAP) {
+      struct pcapw_rotate rot = { state->capture_rotate_size, 
+                                  state->capture_rotate_time, 
+                                  state->capture_retain, state->capture_hook };
+      ctx->writer = pcapw_open(ctx->filename, LINKTYPE_RAW, snaplen, 1, &rot, 
+                               state->capture_zlevel, state->capture_index);
+   }
+   if (state->capture_output & CAPTURE_METRICS)
+      ctx->stats = flowstat_open(ctx->filename, LINKTYPE_RAW, 1, 
+                                 state->metrics_interval);
+
+   ctx->encap = encap_attach();
+
+   ring = xmalloc(TAP_SLOTS * sizeof(struct tap_slot));
+   xthread_create(tap_thread, (void *)ctx, 1);
+}
+
+void tap_packet(const char *buf, int len) {
+   if (!ring || len <= (int)skip || !capture_gate_open())
+      return;
+   if (!sample_keep(&sample, LINKTYPE_RAW, (const u_char *)buf + skip, 
+                    len - skip))
+      return;
+
+   /* the consumer only moves tail forward */
+   uint32_t t = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+   if (head - t >= TAP_SLOTS) {
+      drops++;
+      return;
+   }
+
+   struct tap_slot *slot = &ring[head & (TAP_SLOTS - 1)];
+   clock_gettime(CLOCK_REALTIME, &slot->ts);
+   slot->len    = len - skip;
+   slot->caplen = slot->len < snaplen ? slot->len : snaplen;
+   memcpy(slot->data, buf + skip, slot->caplen);
+   __atomic_store_n(&head, head + 1, __ATOMIC_RELEASE);
+}
+
+int tap_read(int fd, char *buf, int buflen) {
+   int recvd = xread(fd, buf, buflen);
+   tap_packet(buf, recvd);
+   return recvd;
+}
+
+int tap_write(int fd, char *buf, int buflen) {
+   tap_packet(buf, buflen);
+   return xwrite(fd, buf, buflen);
+}
+
+void tap_drain(struct tap_ctx *ctx) {
+   struct pcap_pkthdr h;
+   uint32_t hd = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+
+   for (; tail != hd; ) {
+      struct tap_slot *slot = &ring[tail & (TAP_SLOTS - 1)];
+      h.ts.tv_sec  = slot->ts.tv_sec;
+      h.ts.tv_usec = slot->ts.tv_nsec;
+      h.caplen     = slot->caplen;
+      h.len        = slot->len;
+      if (ctx->writer)
+         pcapw_write(ctx->writer, &h, (const u_char *)slot->data);
+      if (ctx->stats)
+         flowstat_packet(ctx->stats, &h, (const u_char *)slot->data);
+      if (ctx->encap)
+         encap_packet(ENCAP_TUN, (uint64_t)slot->ts.tv_sec * 1000000000ULL +
+                      slot->ts.tv_nsec, (const u_char *)slot->data, 
+                      slot->caplen, LINKTYPE_RAW);
+      __atomic_store_n(&tail, tail + 1, __ATOMIC_RELEASE);
+   }
+}
+
+void term_tap(void *arg) {
+   struct tap_ctx *ctx = (struct tap_ctx *)arg;
+
+   tap_drain(ctx);
+   if (!ctx->silent)
+      fprintf(stderr, "%s: %u packets captured, %llu dropped by tap\n",
+              ctx->filename, head, (unsigned long long)drops);
+   sample_write(&sample, ctx->filename);
+   pcapw_close(ctx->writer);
+   flowstat_close(ctx->stats);
+   if (ctx->encap)
+      encap_detach();
+   free(ctx->filename);
+   free(ctx);
+   debug_print("closing tap writer...\n");
+}
+
+void *tap_thread(void *arg) {
+   struct tap_ctx *ctx = (struct tap_ctx *)arg;
+
+   pthread_cleanup_push(&term_tap, ctx);
+   while (1) {
+      if (tail == __atomic_load_n(&head, __ATOMIC_ACQUIRE))
+         usleep(TAP_POLL);
+      else
+         tap_drain(ctx);
+   }
+   pthread_cleanup_pop(0);
+   return 0;
+}
+
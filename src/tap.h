@@ -0,0 +1,96 @@
+/**
+ * \file tap.h
+ * \brief In-process capture tap of the tun side prototypes.
+ *
+ *    The forwarding loop copies the first bytes of every packet read
+ *    from or written to the tun interface, along with a timestamp,
+ *    into a lock-free single-producer single-consumer ring. A writer
+ *    thread drains the ring into a pcap trace. The forwarding loop
+ *    never blocks: packets are dropped (and counted) if the ring is
+ *    full.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_TAP_H
+#define UDPTUN_TAP_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "state.h"
+
+/**
+ * \def TAP_FILE
+ * \brief Tap trace prefix (in output-dir).
+ */
+#define TAP_FILE "tun"
+
+/**
+ * \def TAP_SLOTS
+ * \brief Number of ring slots, a power of 2.
+ */
+#define TAP_SLOTS 16384
+
+/**
+ * \def TAP_SNAPLEN
+ * \brief Maximum snapshot length of the tap.
+ */
+#define TAP_SNAPLEN 128
+
+/**
+ * \def TAP_POLL
+ * \brief Writer thread polling interval when the ring is empty (us).
+ */
+#define TAP_POLL 1000
+
+/**
+ * \def LINKTYPE_RAW
+ * \brief pcap link type of raw IPv4/IPv6 packets.
+ */
+#define LINKTYPE_RAW 101
+
+/**
+ * \struct tap_slot
+ * \brief A captured packet.
+ */
+struct tap_slot {
+   struct timespec ts;        /*!< capture time */
+   uint32_t caplen;           /*!< captured length */
+   uint32_t len;              /*!< original length */
+   char     data[TAP_SNAPLEN];/*!< first caplen bytes */
+};
+
+/**
+ * \fn void tap_init(struct tun_state *state)
+ * \brief Run the tap writer thread if capture-tap is set.
+ *        Call after init_destructors().
+ *
+ * \param state The program state
+ */
+void tap_init(struct tun_state *state);
+
+/**
+ * \fn void tap_packet(const char *buf, int len)
+ * \brief Capture a tun packet. No-op if the tap is disabled.
+ *        Must always be called from the same thread.
+ *
+ * \param buf The packet, including PlanetLab PPI header if any
+ * \param len The packet length
+ */
+void tap_packet(const char *buf, int len);
+
+/**
+ * \fn int tap_read(int fd, char *buf, int buflen)
+ * \brief xread() a packet from the tun interface and capture it.
+ */
+int tap_read(int fd, char *buf, int buflen);
+
+/**
+ * \fn int tap_write(int fd, char *buf, int buflen)
+ * \brief Capture a packet and xwrite() it to the tun interface.
+ */
+int tap_write(int fd, char *buf, int buflen);
+
+#endif
@@ -0,0 +1,243 @@
+/**
+ * \file tcpinfo.c
+ * \brief Periodic TCP_INFO sampling of measurement flows.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sysconfig.h"
+#if defined(LINUX_OS)
+#  include <linux/tcp.h>
+#endif
+
+#include "tcpinfo.h"
+#include "tlog.h"
+#include "sock.h"
+#include "thread.h"
+#include "debug.h"
+#include "udptun.h"
+
+/**
+ * \struct tcpinfo_slot
+ *	\brief A sampled socket.
+ */
+struct tcpinfo_slot {
+   int      fd;     /*!< socket fd, -1 if the slot is free */
+   uint32_t id;     /*!< flow id in the timeline log */
+   uint8_t  flags;  /*!< TLOG_* flags */
+};
+
+/**
+ * \var static struct tcpinfo_slot *slots
+ * \brief The sampled sockets.
+ */
+static struct tcpinfo_slot *slots;
+
+/**
+ * \var static unsigned int slots_len
+ * \brief The number of slots (fd-lim).
+ */
+static unsigned int slots_len;
+
+/**
+ * \var static uint32_t next_id
+ * \brief The next flow id.
+ */
+static uint32_t next_id;
+
+/**
+ * \var static pthread_mutex_t lock
+ * \brief Protect slots against concurrent (un)registrations.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * \var static struct tlog *info_log
+ * \brief The tcpinfo timeline log.
+ */
+static struct tlog *info_log;
+
+/**
+ * \var static struct in_addr priv4; static struct in6_addr priv6
+ * \brief The private (tunneled) addresses of this node.
+ */
+static struct in_addr  priv4;
+static struct in6_addr priv6;
+
+/**
+ * \fn static void *tcpinfo_thread(void *arg)
+ * \brief The sampler thread.
+ *
+ * \param arg The sampling interval in ms (uintptr_t)
+ */
+static void *tcpinfo_thread(void *arg);
+
+/**
+ * \fn static void term_tcpinfo(void *arg)
+ * \brief Flush and close the timeline log.
+ */
+static void term_tcpinfo(void *arg);
+
+void tcpinfo_init(struct tun_state *state) {
+   if (!state->tcpinfo_interval)
+      return;
+
+   if (state->private_addr4)
+      inet_pton(AF_INET, state->private_addr4, &priv4);
+   if (state->private_addr6)
+      inet_pton(AF_INET6, state->private_addr6, &priv6);
+
+   char file_loc[STR_SIZE];
+   snprintf(file_loc, STR_SIZE, "%s%s%s%s.dat", state->out_dir, TCPINFO_FILE,
+            state->args->run_id ? "." : "",
+            state->args->run_id ? state->args->run_id : "");
+   info_log = tlog_open(file_loc);
+
+   slots_len = state->fd_lim;
+   slots = xmalloc(slots_len * sizeof(struct tcpinfo_slot));
+   for (unsigned int i=0; i<slots_len; i++)
+      slots[i].fd = -1;
+
+   xthread_create(tcpinfo_thread,
+                  (void *)(uintptr_t)state->tcpinfo_interval, 1);
+}
+
+void tcpinfo_register(int fd, int serv) {
+   if (!slots) return;
+
+   struct sockaddr_storage l, r;
+   socklen_t llen = sizeof(l), rlen = sizeof(r);
+   if (getsockname(fd, (struct sockaddr *)&l, &llen) < 0 ||
+       getpeername(fd, (struct sockaddr *)&r, &rlen) < 0) {
+      debug_print("tcpinfo: %s\n", strerror(errno));
+      return;
+   }
+
+   struct tlog_rec rec;
+   memset(&rec, 0, sizeof(rec));
+   rec.type  = TLOG_FLOW;
+   rec.ts    = tlog_now();
+   if (serv) rec.flags |= TLOG_SERV;
+   if (l.ss_family == AF_INET6) {
+      struct sockaddr_in6 *l6 = (struct sockaddr_in6 *)&l;
+      struct sockaddr_in6 *r6 = (struct sockaddr_in6 *)&r;
+      rec.flags |= TLOG_V6;
+      if (!memcmp(&l6->sin6_addr, &priv6, sizeof(priv6)))
+         rec.flags |= TLOG_TUN;
+      memcpy(rec.u.flow.laddr, &l6->sin6_addr, 16);
+      memcpy(rec.u.flow.raddr, &r6->sin6_addr, 16);
+      rec.u.flow.lport = ntohs(l6->sin6_port);
+      rec.u.flow.rport = ntohs(r6->sin6_port);
+   } else {
+      struct sockaddr_in *l4 = (struct sockaddr_in *)&l;
+      struct sockaddr_in *r4 = (struct sockaddr_in *)&r;
+      if (l4->sin_addr.s_addr == priv4.s_addr)
+         rec.flags |= TLOG_TUN;
+      memcpy(rec.u.flow.laddr, &l4->sin_addr, 4);
+      memcpy(rec.u.flow.raddr, &r4->sin_addr, 4);
+      rec.u.flow.lport = ntohs(l4->sin_port);
+      rec.u.flow.rport = ntohs(r4->sin_port);
+   }
+
+   if (pthread_mutex_lock(&lock) != 0)
+      die("mutex lock");
+   unsigned int i;
+   for (i=0; i<slots_len && slots[i].fd >= 0; i++);
+   if (i < slots_len) {
+      slots[i].fd    = fd;
+      slots[i].flags = rec.flags;
+      slots[i].id    = rec.id = next_id++;
+      /* term_tcpinfo closes the log under the lock */
+      if (info_log)
+         tlog_append(info_log, &rec);
+   }
+   if (pthread_mutex_unlock(&lock) != 0)
+      die("mutex unlock");
+
+   if (i >= slots_len)
+      debug_print("tcpinfo: no free slot for socket %d\n", fd);
+}
+
+void tcpinfo_unregister(int fd) {
+   if (!slots) return;
+
+   if (pthread_mutex_lock(&lock) != 0)
+      die("mutex lock");
+   for (unsigned int i=0; i<slots_len; i++) {
+      if (slots[i].fd == fd) {
+         slots[i].fd = -1;
+         break;
+      }
+   }
+   if (pthread_mutex_unlock(&lock) != 0)
+      die("mutex unlock");
+}
+
+void term_tcpinfo(void *UNUSED(arg)) {
+   pthread_mutex_lock(&lock);
+   free(slots);
+   slots     = NULL;
+   slots_len = 0;
+   tlog_close(info_log);
+   info_log = NULL;
+   pthread_mutex_unlock(&lock);
+   debug_print("closing tcpinfo sampler...\n");
+}
+
+void *tcpinfo_thread(void *arg) {
+   uint32_t interval = (uint32_t)(uintptr_t)arg;
+   struct timespec next;
+   struct tlog_rec rec;
+#if defined(LINUX_OS)
+   struct tcp_info ti;
+#endif
+
+   clock_gettime(CLOCK_MONOTONIC, &next);
+   pthread_cleanup_push(&term_tcpinfo, NULL);
+   while (1) {
+      /* absolute deadlines, no drift */
+      next.tv_nsec += (interval % 1000) * 1000000L;
+      next.tv_sec  += interval / 1000 + next.tv_nsec / 1000000000L;
+      next.tv_nsec %= 1000000000L;
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                             &next, NULL) == EINTR);
+
+      if (pthread_mutex_lock(&lock) != 0)
+         die("mutex lock");
+      uint64_t now = tlog_now();
+      for (unsigned int i=0; i<slots_len; i++) {
+         if (slots[i].fd < 0) continue;
+#if defined(LINUX_OS)
+         socklen_t len = sizeof(ti);
+         memset(&ti, 0, sizeof(ti));
+         if (getsockopt(slots[i].fd, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0)
+            continue;
+         memset(&rec, 0, sizeof(rec));
+         rec.flags = slots[i].flags;
+         rec.id    = slots[i].id;
+         rec.ts    = now;
+         tlog_fill_sample(&rec, &ti, len);
+         tlog_append(info_log, &rec);
+#endif
+      }
+      if (pthread_mutex_unlock(&lock) != 0)
+         die("mutex unlock");
+   }
+   pthread_cleanup_pop(0);
+   return 0;
+}
+
@@ -0,0 +1,52 @@
+/**
+ * \file tcpinfo.h
+ * \brief Periodic TCP_INFO sampling of measurement flows prototypes.
+ *
+ *    Client and server sockets register themselves while they are
+ *    open. A single timer thread polls TCP_INFO on every registered
+ *    socket and appends the samples to the tcpinfo timeline log.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_TCPINFO_H
+#define UDPTUN_TCPINFO_H
+
+#include "state.h"
+
+/**
+ * \def TCPINFO_FILE
+ * \brief TCP_INFO timeline log prefix (in output-dir).
+ */
+#define TCPINFO_FILE "tcpinfo"
+
+/**
+ * \fn void tcpinfo_init(struct tun_state *state)
+ * \brief Open the timeline log and run the sampler thread if
+ *        tcp-info-interval is set. Call after init_destructors().
+ *
+ * \param state The program state
+ */
+void tcpinfo_init(struct tun_state *state);
+
+/**
+ * \fn void tcpinfo_register(int fd, int serv)
+ * \brief Start sampling a connected TCP socket. The flow is tagged
+ *        as tunneled if it is bound to a private address.
+ *        No-op if the sampler is disabled.
+ *
+ * \param fd The socket
+ * \param serv 1 for a server-side socket, 0 for a client socket
+ */
+void tcpinfo_register(int fd, int serv);
+
+/**
+ * \fn void tcpinfo_unregister(int fd)
+ * \brief Stop sampling a socket. Call before close().
+ *
+ * \param fd The socket
+ */
+void tcpinfo_unregister(int fd);
+
+#endif
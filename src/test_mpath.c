@@ -0,0 +1,172 @@
+/**
+ * \file test_mpath.c
+ * \brief Limits of the path-address and destination address lists.
+ *
+ *    Run by make check, exits 0 on success. state.c is included to
+ *    reach its configuration file parser.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "state.c"
+
+/**
+ * \def check
+ * \brief Fail the test with the line of a false condition.
+ */
+#define check(cond) do { \
+   if (!(cond)) { \
+      fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+      exit(1); \
+   } \
+} while (0)
+
+/**
+ * \fn static void addr_list(char *buf, size_t len, const char *fmt, int n)
+ * \brief Write n addresses from a format taking their index.
+ *
+ * \param buf The output buffer
+ * \param len Its size
+ * \param fmt The address (and separator) format
+ * \param n The number of addresses
+ */
+static void addr_list(char *buf, size_t len, const char *fmt, int n);
+
+/**
+ * \fn static void tmp_file(char *path, const char *lines)
+ * \brief Write a temporary file.
+ *
+ * \param path The /tmp/copycat-test-XXXXXX template, set to the file
+ * \param lines The file content
+ */
+static void tmp_file(char *path, const char *lines);
+
+/**
+ * \fn static struct tun_state *parse_cfg(const char *path)
+ * \brief Parse a configuration file.
+ *
+ * \param path The configuration file
+ * \return The state
+ */
+static struct tun_state *parse_cfg(const char *path);
+
+/**
+ * \fn static int cfg_rejected(const char *cfg)
+ * \brief Tell if a configuration file is rejected.
+ *
+ * \param cfg The configuration file content
+ * \return 1 if parsing dies, 0 otherwise
+ */
+static int cfg_rejected(const char *cfg);
+
+/**
+ * \fn static int list_rejected(const char *list)
+ * \brief Tell if a destination address list is rejected.
+ *
+ * \param list The comma-separated IPv4 addresses
+ * \return 1 if parsing dies, 0 otherwise
+ */
+static int list_rejected(const char *list);
+
+void addr_list(char *buf, size_t len, const char *fmt, int n) {
+   size_t off = 0;
+
+   buf[0] = '\0';
+   for (int i = 0; i < n; i++) {
+      off += snprintf(buf + off, len - off, fmt, i + 1);
+      check(off < len);
+   }
+}
+
+void tmp_file(char *path, const char *lines) {
+   int fd = mkstemp(path);
+
+   check(fd >= 0);
+   check(write(fd, lines, strlen(lines)) == (ssize_t)strlen(lines));
+   close(fd);
+}
+
+struct tun_state *parse_cfg(const char *path) {
+   static struct arguments args;
+   struct tun_state *state = calloc(1, sizeof(struct tun_state));
+
+   args.config_file = (char *)path;
+   state->args      = &args;
+   check(!parse_cfg_file(state));
+   return state;
+}
+
+int cfg_rejected(const char *cfg) {
+   char path[] = "/tmp/copycat-test-XXXXXX";
+   int status;
+   pid_t pid;
+
+   tmp_file(path, cfg);
+   check((pid = fork()) >= 0);
+   if (!pid) {
+      /* die() reports to stderr */
+      check(freopen("/dev/null", "w", stderr));
+      parse_cfg(path);
+      _exit(0);
+   }
+   check(waitpid(pid, &status, 0) == pid);
+   unlink(path);
+   return !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+int list_rejected(const char *list) {
+   int status;
+   pid_t pid;
+
+   check((pid = fork()) >= 0);
+   if (!pid) {
+      check(freopen("/dev/null", "w", stderr));
+      mpath_parse(AF_INET, list, 80);
+      _exit(0);
+   }
+   check(waitpid(pid, &status, 0) == pid);
+   return !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+int main() {
+   char buf[MPATH_MAX * 64], last[INET_ADDRSTRLEN];
+   char path[] = "/tmp/copycat-test-XXXXXX";
+   struct tun_state *state;
+   struct mpath *mp;
+
+   /* the public address and up to MPATH_MAX - 1 path-addresses */
+   addr_list(buf, sizeof(buf), "path-address4 192.0.2.%d\n", 
+             MPATH_MAX - 1);
+   tmp_file(path, buf);
+   state = parse_cfg(path);
+   unlink(path);
+   check(state->path_len4 == MPATH_MAX - 1);
+   snprintf(last, sizeof(last), "192.0.2.%d", MPATH_MAX - 1);
+   check(!strcmp(state->path_addr4[MPATH_MAX - 2], last));
+   check(!cfg_rejected(buf));
+   addr_list(buf, sizeof(buf), "path-address4 192.0.2.%d\n", MPATH_MAX);
+   check(cfg_rejected(buf));
+   addr_list(buf, sizeof(buf), "path-address6 2001:db8::%d\n", MPATH_MAX);
+   check(cfg_rejected(buf));
+
+   /* a single destination address has no paths */
+   check(!mpath_parse(AF_INET, "192.0.2.1", 80));
+
+   /* up to MPATH_MAX destination addresses */
+   check((mp = mpath_parse(AF_INET, "192.0.2.1,192.0.2.2", 80)));
+   check(mp->nremote == 2);
+   check(ntohs(((struct sockaddr_in *)&mp->remote[1])->sin_port) == 80);
+   addr_list(buf, sizeof(buf), "192.0.2.%d,", MPATH_MAX);
+   check(!list_rejected(buf));
+   addr_list(buf, sizeof(buf), "192.0.2.%d,", MPATH_MAX + 1);
+   check(list_rejected(buf));
+   check(list_rejected("192.0.2.1,not-an-address"));
+
+   return 0;
+}
@@ -0,0 +1,142 @@
+/**
+ * \file test_sample.c
+ * \brief Packet and flow capture samplers.
+ *
+ *    Run by make check, exits 0 on success.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sample.h"
+
+/**
+ * \def check
+ * \brief Fail the test with the line of a false condition.
+ */
+#define check(cond) do { \
+   if (!(cond)) { \
+      fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+      exit(1); \
+   } \
+} while (0)
+
+/**
+ * \def FLOWS
+ * \brief The number of flows of the distribution checks.
+ */
+#define FLOWS 2048
+
+/**
+ * \fn static void ip4(u_char *pkt, uint8_t proto, uint32_t src,
+ *                     uint32_t dst, uint16_t sport, uint16_t dport)
+ * \brief Write an IPv4 header followed by the transport ports.
+ *
+ * \param pkt The 24-byte packet
+ * \param proto The IP protocol
+ * \param src The source address
+ * \param dst The destination address
+ * \param sport The source port
+ * \param dport The destination port
+ */
+static void ip4(u_char *pkt, uint8_t proto, uint32_t src, uint32_t dst,
+                uint16_t sport, uint16_t dport);
+
+/**
+ * \fn static int kept(uint32_t rate, uint16_t base, uint16_t stride)
+ * \brief Count the flows kept by a flow sampler.
+ *
+ * \param rate N
+ * \param base The first source port
+ * \param stride The source port step between flows
+ * \return The number of flows kept out of FLOWS
+ */
+static int kept(uint32_t rate, uint16_t base, uint16_t stride);
+
+void ip4(u_char *pkt, uint8_t proto, uint32_t src, uint32_t dst,
+         uint16_t sport, uint16_t dport) {
+   memset(pkt, 0, 24);
+   pkt[0] = 0x45;
+   pkt[9] = proto;
+   src    = htonl(src);
+   dst    = htonl(dst);
+   sport  = htons(sport);
+   dport  = htons(dport);
+   memcpy(pkt + 12, &src, 4);
+   memcpy(pkt + 16, &dst, 4);
+   memcpy(pkt + 20, &sport, 2);
+   memcpy(pkt + 22, &dport, 2);
+}
+
+int kept(uint32_t rate, uint16_t base, uint16_t stride) {
+   struct sampler s;
+   u_char pkt[24];
+   int n = 0;
+
+   sample_init(&s, SAMPLE_FLOW, rate);
+   for (int i = 0; i < FLOWS; i++) {
+      ip4(pkt, IPPROTO_UDP, 0xc0000201, 0xc6336401,
+          base + i * stride, 443);
+      n += sample_keep(&s, DLT_RAW, pkt, sizeof(pkt));
+   }
+   check(s.seen == FLOWS && s.kept == (uint64_t)n);
+   return n;
+}
+
+int main() {
+   struct sampler s;
+   u_char pkt[24], rev[24];
+   char exp[1024];
+   int n;
+
+   /* 1-in-N packets */
+   sample_init(&s, SAMPLE_PACKET, 4);
+   ip4(pkt, IPPROTO_TCP, 0xc0000201, 0xc6336401, 40000, 80);
+   for (n = 0; n < 16; n++)
+      check(sample_keep(&s, DLT_RAW, pkt, sizeof(pkt)) == !(n % 4));
+
+   /* both directions of a flow are sampled alike */
+   sample_init(&s, SAMPLE_FLOW, 16);
+   for (n = 0; n < FLOWS; n++) {
+      ip4(pkt, IPPROTO_TCP, 0xc0000201, 0xc6336401, 1024 + n, 80);
+      ip4(rev, IPPROTO_TCP, 0xc6336401, 0xc0000201, 80, 1024 + n);
+      check(sample_keep(&s, DLT_RAW, pkt, sizeof(pkt)) ==
+            sample_keep(&s, DLT_RAW, rev, sizeof(rev)));
+   }
+
+   /* ports that share their low bits still spread (e.g. one per
+      source-port-spray block) */
+   for (int stride = 1; stride <= 16; stride *= 2) {
+      n = kept(16, 1024, stride);
+      check(n > FLOWS / 16 * 3 / 4 && n < FLOWS / 16 * 5 / 4);
+   }
+   n = kept(3, 1024, 3);
+   check(n > FLOWS / 3 * 3 / 4 && n < FLOWS / 3 * 5 / 4);
+
+   /* other packets are kept */
+   ip4(pkt, IPPROTO_ICMP, 0xc0000201, 0xc6336401, 0, 0);
+   for (n = 0; n < 16; n++)
+      check(sample_keep(&s, DLT_RAW, pkt, sizeof(pkt)));
+
+   /* flow samplers move to the kernel filter */
+   sample_init(&s, SAMPLE_PACKET, 16);
+   check(!sample_filter(&s, exp, sizeof(exp)) && !s.in_kernel);
+   sample_init(&s, SAMPLE_FLOW, 16);
+   check(sample_filter(&s, exp, sizeof(exp)) && s.in_kernel);
+   check(strstr(exp, "* 2654435761) >> 16) % 16 = 0"));
+   ip4(pkt, IPPROTO_TCP, 0xc0000201, 0xc6336401, 1025, 80);
+   check(sample_keep(&s, DLT_RAW, pkt, sizeof(pkt)));
+
+   /* rates below 2 sample nothing */
+   sample_init(&s, SAMPLE_FLOW, 1);
+   check(s.mode == SAMPLE_NONE);
+
+   return 0;
+}
@@ -0,0 +1,218 @@
+/**
+ * \file test_spray.c
+ * \brief Port block checks of destinations and clients (source-port-spray).
+ *
+ *    Run by make check, exits 0 on success. state.c is included to
+ *    reach its destination file parser and init_tun_state.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "state.c"
+
+/**
+ * \def check
+ * \brief Fail the test with the line of a false condition.
+ */
+#define check(cond) do { \
+   if (!(cond)) { \
+      fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+      exit(1); \
+   } \
+} while (0)
+
+/**
+ * \fn static void tmp_file(char *path, const char *lines)
+ * \brief Write a temporary file.
+ *
+ * \param path The /tmp/copycat-test-XXXXXX template, set to the file
+ * \param lines The file content
+ */
+static void tmp_file(char *path, const char *lines);
+
+/**
+ * \fn static struct tun_state *parse(const char *path, int spray)
+ * \brief Parse an IPv4 destination file into a server table.
+ *
+ * \param path The destination file
+ * \param spray The source-port-spray value
+ * \return The state
+ */
+static struct tun_state *parse(const char *path, int spray);
+
+/**
+ * \fn static struct tun_state *load(const char *lines, int spray)
+ * \brief Parse IPv4 destination file content into a server table.
+ *
+ * \param lines The destination file content
+ * \param spray The source-port-spray value
+ * \return The state
+ */
+static struct tun_state *load(const char *lines, int spray);
+
+/**
+ * \fn static int rejected(const char *lines, int spray)
+ * \brief Tell if a destination file is rejected.
+ *
+ * \param lines The destination file content
+ * \param spray The source-port-spray value
+ * \return 1 if parsing dies, 0 otherwise
+ */
+static int rejected(const char *lines, int spray);
+
+/**
+ * \fn static int cli_rejected(const char *cfg, int dual_stack)
+ * \brief Tell if a client configuration is rejected at startup.
+ *
+ * \param cfg The configuration file content
+ * \param dual_stack The dual-stack client mode
+ * \return 1 if init_tun_state dies before the destination file, 
+ *         0 otherwise
+ */
+static int cli_rejected(const char *cfg, int dual_stack);
+
+void tmp_file(char *path, const char *lines) {
+   int fd = mkstemp(path);
+
+   check(fd >= 0);
+   check(write(fd, lines, strlen(lines)) == (ssize_t)strlen(lines));
+   close(fd);
+}
+
+struct tun_state *parse(const char *path, int spray) {
+   static struct arguments args;
+   struct tun_state *state = calloc(1, sizeof(struct tun_state));
+
+   args.dest_file    = (char *)path;
+   state->args       = &args;
+   state->port_spray = spray;
+   state->serv       = init_table(4);
+   state->cli4       = init_table(4);
+   parse_dest_file4(&args, state);
+   return state;
+}
+
+struct tun_state *load(const char *lines, int spray) {
+   struct tun_state *state;
+   char path[] = "/tmp/copycat-test-XXXXXX";
+
+   tmp_file(path, lines);
+   state = parse(path, spray);
+   unlink(path);
+   return state;
+}
+
+int rejected(const char *lines, int spray) {
+   char path[] = "/tmp/copycat-test-XXXXXX";
+   int status;
+   pid_t pid;
+
+   tmp_file(path, lines);
+   check((pid = fork()) >= 0);
+   if (!pid) {
+      /* die() reports to stderr */
+      check(freopen("/dev/null", "w", stderr));
+      parse(path, spray);
+      _exit(0);
+   }
+   check(waitpid(pid, &status, 0) == pid);
+   unlink(path);
+   return !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+int cli_rejected(const char *cfg, int dual_stack) {
+   struct arguments args = { .mode = CLI_MODE, .udp = 1, 
+                             .dual_stack = dual_stack, 
+                             .dest_file = "/nonexistent" };
+   char path[] = "/tmp/copycat-test-XXXXXX";
+   int status, pipefd[2];
+   char msg[256] = "";
+   size_t len = 0;
+   ssize_t n;
+   pid_t pid;
+
+   tmp_file(path, cfg);
+   args.config_file = path;
+   check(pipe(pipefd) == 0);
+   check((pid = fork()) >= 0);
+   if (!pid) {
+      check(dup2(pipefd[1], 2) == 2);
+      init_tun_state(&args);
+      _exit(0);
+   }
+   close(pipefd[1]);
+   while (len < sizeof(msg) - 1 && 
+          (n = read(pipefd[0], msg + len, sizeof(msg) - 1 - len)) > 0)
+      len += n;
+   close(pipefd[0]);
+   check(waitpid(pid, &status, 0) == pid);
+   unlink(path);
+   return WIFEXITED(status) && WEXITSTATUS(status) && 
+          strstr(msg, "source-port-spray block");
+}
+
+int main() {
+   struct tun_state *state;
+   struct tun_rec *rec;
+   int port;
+
+   /* an unaligned port is keyed by its block */
+   state = load("22050 192.0.2.1 10.0.0.2\n"
+                "22057 192.0.2.2 10.0.0.3\n", 4);
+   for (port = 22048; port < 22052; port++) {
+      int key = spray_base(state, port);
+      check((rec = g_hash_table_lookup(state->serv, &key)));
+      check(ntohs(((struct sockaddr_in *)rec->sa4)->sin_port) == 22050);
+      check(!rec->sprays);
+   }
+   port = spray_base(state, 22059);
+   check((rec = g_hash_table_lookup(state->serv, &port)));
+   check(ntohs(((struct sockaddr_in *)rec->sa4)->sin_port) == 22057);
+   port = spray_base(state, 22052);
+   check(!g_hash_table_lookup(state->serv, &port));
+
+   /* a single port per client keeps the port as key */
+   state = load("22050 192.0.2.1 10.0.0.2\n", 1);
+   port  = 22050;
+   check(g_hash_table_lookup(state->serv, &port));
+
+   /* overlapping and out of range blocks */
+   check(!rejected("22050 192.0.2.1 10.0.0.2\n"
+                   "22052 192.0.2.2 10.0.0.3\n", 4));
+   check(rejected("22050 192.0.2.1 10.0.0.2\n"
+                  "22049 192.0.2.2 10.0.0.3\n", 4));
+   check(rejected("65535 192.0.2.1 10.0.0.2\n", 3));
+   check(rejected("2 192.0.2.1 10.0.0.2\n", 4));
+   check(!rejected("65534 192.0.2.1 10.0.0.2\n", 4));
+   check(rejected("0 192.0.2.1 10.0.0.2\n", 1));
+   check(rejected("65536 192.0.2.1 10.0.0.2\n", 1));
+
+   /* spray_block */
+   state->port_spray = 4;
+   check(spray_block(state, 22050) == 22048);
+   check(spray_block(state, 65535) == 65532);
+   check(spray_block(state, 3) < 0 && errno == EINVAL);
+   check(spray_block(state, 65536) < 0);
+   state->port_spray = 1;
+   check(spray_block(state, 1) == 1);
+   check(spray_block(state, 0) < 0);
+
+   /* clients check the block of the port they bind */
+   check(cli_rejected("source-port 65535\npublic-server-port 80\n"
+                      "source-port-spray 3\n", 0));
+   check(!cli_rejected("source-port 22050\npublic-server-port 65535\n"
+                       "source-port-spray 3\n", 0));
+   check(cli_rejected("source-port 22050\npublic-server-port 65535\n"
+                      "source-port-spray 3\n", 1));
+   check(!cli_rejected("source-port 65535\npublic-server-port 80\n"
+                       "source-port-spray 3\n", 1));
+
+   return 0;
+}
+
@@ -0,0 +1,184 @@
+/**
+ * \file tlog.c
+ * \brief Append-only mmap'ed binary timeline log.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "sysconfig.h"
+#if defined(LINUX_OS)
+#  include <linux/tcp.h>
+#endif
+
+#include "tlog.h"
+#include "sock.h"
+#include "debug.h"
+
+/**
+ * \fn static void tlog_grow(struct tlog *log)
+ * \brief Extend the log file and its mapping by TLOG_CHUNK bytes.
+ *
+ * \param log The log
+ */
+static void tlog_grow(struct tlog *log);
+
+uint64_t tlog_now() {
+   struct timespec ts;
+   clock_gettime(CLOCK_REALTIME, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct tlog *tlog_open(const char *filename) {
+   struct tlog *log = calloc(1, sizeof(struct tlog));
+   if (!log)
+      die("calloc");
+   if ((log->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0)
+      die("open tlog");
+   if (pthread_mutex_init(&log->lock, NULL) != 0)
+      die("mutex init");
+   tlog_grow(log);
+
+   struct tlog_hdr *hdr = (struct tlog_hdr *)log->map;
+   hdr->magic    = TLOG_MAGIC;
+   hdr->version  = TLOG_VERSION;
+   hdr->rec_size = sizeof(struct tlog_rec);
+   hdr->start    = tlog_now();
+   log->off      = sizeof(struct tlog_hdr);
+
+   debug_print("timeline log %s opened\n", filename);
+   return log;
+}
+
+void tlog_grow(struct tlog *log) {
+   if (log->map && munmap(log->map, log->size) < 0)
+      die("munmap");
+   log->size += TLOG_CHUNK;
+   if (ftruncate(log->fd, log->size) < 0)
+      die("ftruncate");
+   log->map = mmap(NULL, log->size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, log->fd, 0);
+   if (log->map == MAP_FAILED)
+      die("mmap");
+}
+
+void tlog_append(struct tlog *log, const struct tlog_rec *rec) {
+   if (pthread_mutex_lock(&log->lock) != 0)
+      die("mutex lock");
+   if (log->off + sizeof(struct tlog_rec) > log->size)
+      tlog_grow(log);
+   memcpy(log->map + log->off, rec, sizeof(struct tlog_rec));
+   log->off += sizeof(struct tlog_rec);
+   if (pthread_mutex_unlock(&log->lock) != 0)
+      die("mutex unlock");
+}
+
+void tlog_close(struct tlog *log) {
+   if (!log) return;
+   munmap(log->map, log->size);
+   if (ftruncate(log->fd, log->off) < 0)
+      debug_print("ftruncate: %s\n", strerror(errno));
+   close(log->fd);
+   pthread_mutex_destroy(&log->lock);
+   free(log);
+}
+
+void tlog_fill_sample(struct tlog_rec *rec, const struct tcp_info *ti,
+                      size_t len) {
+#if defined(LINUX_OS)
+   rec->type                   = TLOG_SAMPLE;
+   rec->u.sample.state         = ti->tcpi_state;
+   rec->u.sample.ca_state      = ti->tcpi_ca_state;
+   rec->u.sample.retransmits   = ti->tcpi_retransmits;
+   rec->u.sample.rtt           = ti->tcpi_rtt;
+   rec->u.sample.rttvar        = ti->tcpi_rttvar;
+   rec->u.sample.snd_cwnd      = ti->tcpi_snd_cwnd;
+   rec->u.sample.snd_ssthresh  = ti->tcpi_snd_ssthresh;
+   rec->u.sample.snd_mss       = ti->tcpi_snd_mss;
+   rec->u.sample.unacked       = ti->tcpi_unacked;
+   rec->u.sample.lost          = ti->tcpi_lost;
+   rec->u.sample.total_retrans = ti->tcpi_total_retrans;
+   /* older kernels return a shorter struct */
+   if (len >= offsetof(struct tcp_info, tcpi_bytes_acked)
+                + sizeof(ti->tcpi_bytes_acked))
+      rec->u.sample.bytes_acked = ti->tcpi_bytes_acked;
+#endif
+}
+
+int tlog_decode(const char *filename, FILE *out) {
+   int fd;
+   struct stat st;
+   if ((fd = open(filename, O_RDONLY)) < 0)
+      return -1;
+   if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct tlog_hdr)) {
+      close(fd);
+      errno=EINVAL;
+      return -1;
+   }
+   char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED)
+      return -1;
+
+   struct tlog_hdr *hdr = (struct tlog_hdr *)map;
+   if (hdr->magic != TLOG_MAGIC || hdr->rec_size != sizeof(struct tlog_rec)) {
+      munmap(map, st.st_size);
+      errno=EINVAL;
+      return -1;
+   }
+
+   char laddr[INET6_ADDRSTRLEN], raddr[INET6_ADDRSTRLEN];
+   size_t off;
+   for (off = sizeof(struct tlog_hdr);
+        off + sizeof(struct tlog_rec) <= (size_t)st.st_size;
+        off += sizeof(struct tlog_rec)) {
+      struct tlog_rec *rec = (struct tlog_rec *)(map + off);
+      int af = (rec->flags & TLOG_V6) ? AF_INET6 : AF_INET;
+
+      switch (rec->type) {
+         case TLOG_FLOW:
+            inet_ntop(af, rec->u.flow.laddr, laddr, INET6_ADDRSTRLEN);
+            inet_ntop(af, rec->u.flow.raddr, raddr, INET6_ADDRSTRLEN);
+            fprintf(out, "flow,%u,%llu,%s,%s,%s,%s,%u,%s,%u\n",
+                    rec->id, (unsigned long long)rec->ts,
+                    (rec->flags & TLOG_TUN) ? "tun" : "notun",
+                    (rec->flags & TLOG_SERV) ? "serv" : "cli",
+                    (rec->flags & TLOG_DIAG) ? "diag" : "sockopt",
+                    laddr, rec->u.flow.lport, raddr, rec->u.flow.rport);
+            break;
+         case TLOG_SAMPLE:
+            fprintf(out, "sample,%u,%llu,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%llu\n",
+                    rec->id, (unsigned long long)rec->ts,
+                    rec->u.sample.state, rec->u.sample.ca_state,
+                    rec->u.sample.retransmits, rec->u.sample.rtt,
+                    rec->u.sample.rttvar, rec->u.sample.snd_cwnd,
+                    rec->u.sample.snd_ssthresh, rec->u.sample.snd_mss,
+                    rec->u.sample.unacked, rec->u.sample.lost,
+                    rec->u.sample.total_retrans,
+                    (unsigned long long)rec->u.sample.bytes_acked);
+            break;
+         case TLOG_NONE:
+         default:
+            /* unfinished log */
+            goto end;
+      }
+   }
+end:
+   munmap(map, st.st_size);
+   return 0;
+}
+
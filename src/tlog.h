@@ -0,0 +1,166 @@
+/**
+ * \file tlog.h
+ * \brief Append-only mmap'ed binary timeline log prototypes.
+ *
+ *    A timeline log is a struct tlog_hdr followed by fixed-size
+ *    struct tlog_rec records. TLOG_FLOW records describe a flow once,
+ *    TLOG_SAMPLE records carry its TCP state at a point in time.
+ *    All fields are in host byte order.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_TLOG_H
+#define UDPTUN_TLOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/**
+ * \def TLOG_MAGIC
+ * \brief Magic number of timeline logs ("CCTL").
+ */
+#define TLOG_MAGIC 0x4c544343
+
+/**
+ * \def TLOG_VERSION
+ * \brief Version of the timeline log format.
+ */
+#define TLOG_VERSION 1
+
+/**
+ * \def TLOG_CHUNK
+ * \brief Timeline log file growth step in bytes.
+ */
+#define TLOG_CHUNK (4*1024*1024)
+
+/* record types */
+#define TLOG_NONE   0 /*!< unused record (end of log) */
+#define TLOG_FLOW   1 /*!< flow description record */
+#define TLOG_SAMPLE 2 /*!< TCP state sample record */
+
+/* record flags */
+#define TLOG_TUN  0x01 /*!< tunneled flow */
+#define TLOG_SERV 0x02 /*!< server-side socket */
+#define TLOG_V6   0x04 /*!< IPv6 flow */
+#define TLOG_DIAG 0x08 /*!< sampled through sock_diag */
+
+/**
+ * \struct tlog_hdr
+ * \brief Timeline log file header.
+ */
+struct tlog_hdr {
+   uint32_t magic;      /*!< TLOG_MAGIC */
+   uint16_t version;    /*!< TLOG_VERSION */
+   uint16_t rec_size;   /*!< sizeof(struct tlog_rec) */
+   uint64_t start;      /*!< wall-clock creation time (ns) */
+};
+
+/**
+ * \struct tlog_rec
+ * \brief A 64-byte timeline log record.
+ */
+struct tlog_rec {
+   uint8_t  type;       /*!< TLOG_FLOW or TLOG_SAMPLE */
+   uint8_t  flags;      /*!< TLOG_TUN | TLOG_SERV | TLOG_V6 | TLOG_DIAG */
+   uint16_t pad;
+   uint32_t id;         /*!< flow id */
+   uint64_t ts;         /*!< wall-clock time (ns) */
+   union {
+      struct {
+         uint8_t  laddr[16];     /*!< local address */
+         uint8_t  raddr[16];     /*!< remote address */
+         uint16_t lport;         /*!< local port */
+         uint16_t rport;         /*!< remote port */
+      } flow;
+      struct {
+         uint8_t  state;         /*!< tcpi_state */
+         uint8_t  ca_state;      /*!< tcpi_ca_state */
+         uint8_t  retransmits;   /*!< tcpi_retransmits */
+         uint8_t  pad;
+         uint32_t rtt;           /*!< smoothed rtt (us) */
+         uint32_t rttvar;        /*!< rtt variance (us) */
+         uint32_t snd_cwnd;      /*!< congestion window (segments) */
+         uint32_t snd_ssthresh;  /*!< slow start threshold */
+         uint32_t snd_mss;       /*!< sender mss */
+         uint32_t unacked;       /*!< unacked segments */
+         uint32_t lost;          /*!< lost segments */
+         uint32_t total_retrans; /*!< total retransmitted segments */
+         uint32_t pad2;
+         uint64_t bytes_acked;   /*!< bytes acked (0 if unsupported) */
+      } sample;
+   } u;
+};
+
+/**
+ * \struct tlog
+ * \brief An open timeline log.
+ */
+struct tlog {
+   int             fd;    /*!< log file descriptor */
+   char           *map;   /*!< mapping of the whole file */
+   size_t          size;  /*!< file (and mapping) size */
+   size_t          off;   /*!< append offset */
+   pthread_mutex_t lock;  /*!< append lock */
+};
+
+struct tcp_info;
+
+/**
+ * \fn struct tlog *tlog_open(const char *filename)
+ * \brief Create a timeline log.
+ *
+ * \param filename The log location
+ * \return The log
+ */
+struct tlog *tlog_open(const char *filename);
+
+/**
+ * \fn void tlog_append(struct tlog *log, const struct tlog_rec *rec)
+ * \brief Append a record. Thread-safe.
+ *
+ * \param log The log
+ * \param rec The record
+ */
+void tlog_append(struct tlog *log, const struct tlog_rec *rec);
+
+/**
+ * \fn void tlog_close(struct tlog *log)
+ * \brief Truncate the log to its content and close it.
+ *
+ * \param log The log
+ */
+void tlog_close(struct tlog *log);
+
+/**
+ * \fn void tlog_fill_sample(struct tlog_rec *rec,
+ *                           const struct tcp_info *ti, size_t len)
+ * \brief Fill the sample part of a record from a struct tcp_info.
+ *
+ * \param rec The record
+ * \param ti The TCP info
+ * \param len The valid length of ti (as returned by the kernel)
+ */
+void tlog_fill_sample(struct tlog_rec *rec, const struct tcp_info *ti,
+                      size_t len);
+
+/**
+ * \fn uint64_t tlog_now()
+ * \brief Wall-clock time in ns.
+ */
+uint64_t tlog_now();
+
+/**
+ * \fn int tlog_decode(const char *filename, FILE *out)
+ * \brief Decode a timeline log to CSV.
+ *
+ * \param filename The log location
+ * \param out The output stream
+ * \return 0 for success, -1 on error (errno is set)
+ */
+int tlog_decode(const char *filename, FILE *out);
+
+#endif
@@ -24,6 +24,7 @@
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <net/ethernet.h>
+#include <net/if.h>
 
 #include "sysconfig.h"
 #if defined(__DragonFly__)
@@ -43,6 +44,8 @@
 #endif
 
 #include "sock.h"
+#include "rtnl.h"
+#include "tunalloc.h"
 #include "debug.h"
 
 /**
@@ -63,51 +66,38 @@
  */
 #define VSYS_VIFUP_OUT "/vsys/vif_up.out"
 
-/** 
- * \struct in6_ifreq
- *	\brief struct ifreq IPv6 equivalent
- */
-struct in6_ifreq {
-    struct in6_addr ifr6_addr;
-    __u32 ifr6_prefixlen;
-    unsigned int ifr6_ifindex;
-};
-
+#if defined(BSD_OS)
 /**
- * \fn int tun_alloc(int iftype, char *if_name)
- * \brief Allocate a tun interface with ipv4 address.
+ * \fn static int tun_alloc(const struct rtnl_tun *cfg, char *dev, int common)
+ * \brief Allocate and configure a tun interface.
  *
- * \param iftype The interface type (IFFTUN or IFFTAP)
- * \param if_name buffer to be filled with newly created if name.
+ * \param cfg The addresses (IPv4 and/or IPv6) & link configuration
+ * \param dev The wished device name, filled with the actual name.
+ * \param common 1 to clone /dev/net/tun, 0 to open /dev/<dev>
  * \return fd
  */ 
-static int tun_alloc(const char *ip4, const char *prefix4, 
-                       const char *ip6, const char *prefix6, 
-                       char *dev, int common);
-
+static int tun_alloc(const struct rtnl_tun *cfg, char *dev, int common);
+#elif defined(LINUX_OS)
 /**
- * \fn int tun_alloc6(int iftype, char *if_name)
- * \brief Allocate a tun interface with ipv6 address.
+ * \fn static int tun_attach(const struct rtnl_tun *cfg, 
+ *                           const struct tun_opts *opts, char *dev, 
+ *                           int match_only)
+ * \brief Create or attach to a tun interface and configure it.
  *
- * \param iftype The interface type (IFFTUN or IFFTAP)
- * \param if_name buffer to be filled with newly created if name.
- * \return fd
- */ 
-static int tun_alloc6(const char *ip4, const char *prefix4, 
-                       const char *ip6, const char *prefix6, 
-                       char *dev, int common);
-
-/**
- * \fn int tun_alloc46(int iftype, char *if_name)
- * \brief Allocate a tun interface with ipv4 and ipv6 address.
+ *    An existing (persistent) interface is verified and only 
+ *    reconfigured if it does not match the configuration.
  *
- * \param iftype The interface type (IFFTUN or IFFTAP)
- * \param if_name buffer to be filled with newly created if name.
- * \return fd
+ * \param cfg The addresses (IPv4 and/or IPv6) & link configuration
+ * \param opts The interface options
+ * \param dev The wished device name ("" to let the kernel pick one), 
+ *            filled with the actual name.
+ * \param match_only 1 to give up existing interfaces that do not match
+ * \return fd, -1 if busy (attached by another instance) or given up
  */ 
-static int tun_alloc46(const char *ip4, const char *prefix4, 
-                       const char *ip6, const char *prefix6, 
-                       char *dev, int common);
+static int tun_attach(const struct rtnl_tun *cfg, 
+                      const struct tun_opts *opts, char *dev, 
+                      int match_only);
+#endif
 
 /**
  * \fn int tun_alloc_pl(int iftype, char *if_name)
@@ -120,11 +110,9 @@ static int tun_alloc46(const char *ip4, const char *prefix4,
  */ 
 static int tun_alloc_pl(int iftype, char *if_name);
 
-static char *create_tun(const char *ip4, const char *prefix4, 
-                       const char *ip6, const char *prefix6, 
-                       char *dev, int *tun_fds, 
-                       int (*func_alloc)(const char*,const char*, 
-                       const char*,const char*, char*,int));
+static char *create_tun(const struct rtnl_tun *cfg, 
+                        const struct tun_opts *opts, char *dev, 
+                        int *tun_fds);
 
 /* Reads vif FD from "fd", writes interface name to vif_name, and returns vif FD.
  * vif_name should be IFNAMSIZ chars long. */
@@ -162,32 +150,53 @@ int receive_vif_fd(int fd, char *vif_name) {
 }
 
 char *create_tun4(const char *ip4, const char *prefix4, 
-                  char *dev, int *tun_fds) {
-   return create_tun(ip4, prefix4, NULL, NULL, dev, tun_fds, &tun_alloc);
+                  const struct tun_opts *opts, char *dev, int *tun_fds) {
+   struct rtnl_tun cfg = { ip4, prefix4, NULL, NULL, opts->mtu, opts->txqlen };
+   return create_tun(&cfg, opts, dev, tun_fds);
 }
 
 char *create_tun46(const char *ip4, const char *prefix4, 
                    const char *ip6, const char *prefix6, 
-                   char *dev, int *tun_fds) {
-   return create_tun(ip4, prefix4, ip6, prefix6, dev, tun_fds, &tun_alloc46);
+                   const struct tun_opts *opts, char *dev, int *tun_fds) {
+   struct rtnl_tun cfg = { ip4, prefix4, ip6, prefix6, opts->mtu, opts->txqlen };
+   return create_tun(&cfg, opts, dev, tun_fds);
 }
 
 char *create_tun6(const char *ip6, const char *prefix6, 
-                  char *dev, int *tun_fds) {
-   return create_tun(NULL, NULL, ip6, prefix6, dev, tun_fds, &tun_alloc6);
+                  const struct tun_opts *opts, char *dev, int *tun_fds) {
+   struct rtnl_tun cfg = { NULL, NULL, ip6, prefix6, opts->mtu, opts->txqlen };
+   return create_tun(&cfg, opts, dev, tun_fds);
 }
 
-char *create_tun(const char *ip4, const char *prefix4, 
-                 const char *ip6, const char *prefix6, 
-                 char *dev, int *tun_fds, 
-                 int (*func_alloc)(const char*,const char*, 
-                                   const char*,const char*, 
-                                   char*,int)) {
-   int   fd; 
+char *create_tun(const struct rtnl_tun *cfg, const struct tun_opts *opts, 
+                 char *dev, int *tun_fds) {
+   int   fd = -1; 
    char *if_name = xmalloc(IFNAMSIZ);
 
+#if defined(LINUX_OS)
+   if (opts->pool) {
+      const char *base = dev ? dev : TUN_POOL_NAME;
+      /* free members that already match first, then any free member */
+      for (int pass = 0; pass < 2 && fd < 0; pass++) 
+         for (int i = 0; i < opts->pool && fd < 0; i++) {
+            snprintf(if_name, IFNAMSIZ, "%s%d", base, i);
+            if (!pass && !if_nametoindex(if_name))
+               continue;
+            fd = tun_attach(cfg, opts, if_name, !pass);
+         }
+      if (fd < 0) {
+         errno=EBUSY;
+         die("tun pool");
+      }
+   } else {
+      /* the kernel picks a free name if none is wished */
+      snprintf(if_name, IFNAMSIZ, "%s", dev ? dev : "");
+      if ((fd = tun_attach(cfg, opts, if_name, 0)) < 0)
+         die("tun attach");
+   }
+#else
    if (dev) {
-      if ((fd = (*func_alloc)(ip4, prefix4, ip6, prefix6, dev, 0)) >= 0) {
+      if ((fd = tun_alloc(cfg, dev, 0)) >= 0) {
          strcpy(if_name, dev);
          goto succ;
       } else goto err;
@@ -195,24 +204,26 @@ char *create_tun(const char *ip4, const char *prefix4,
 
    for (int i=0; i<99; i++) {
       sprintf(if_name, "tun%d", i);
-      if ((fd = (*func_alloc)(ip4, prefix4, ip6, prefix6, if_name, 1)) >= 0) {
+      if ((fd = tun_alloc(cfg, if_name, 1)) >= 0) {
          break;
       } else goto err;
    }
 
 succ:
+#endif
    debug_print("%s interface created at fd %d\n", if_name, fd);
    if (tun_fds) 
       *tun_fds = fd;
    return if_name;
+#if !defined(LINUX_OS)
 err:
    return NULL;
+#endif
 }
 
 #if defined(BSD_OS)
 
-int tun_alloc(const char *ip4, const char *prefix4, 
-              const char *ip6, const char *prefix6, char *dev, int common) {
+int tun_alloc(const struct rtnl_tun *cfg, char *dev, int common) {
    struct ifreq ifr; 
    int fd;
    
@@ -255,241 +266,67 @@ int tun_alloc(const char *ip4, const char *prefix4,
    struct sockaddr_in  tun_addr;
    memset((char *) &tun_addr, 0, sizeof(tun_addr));
    tun_addr.sin_family = AF_INET;
-   tun_addr.sin_addr.s_addr = htonl(inet_network(ip4));
+   tun_addr.sin_addr.s_addr = htonl(inet_network(cfg->addr4));
    memcpy(&ifr.ifr_addr, &tun_addr, sizeof(struct sockaddr));
 
    if (ioctl(s, SIOCSIFADDR, &ifr) < 0) 
       die("cannot set IP address. ");
 
    char net_prefix_cmd[128];
-   sprintf(net_prefix_cmd, "ip addr add %s/%s dev %s", ip4, prefix4, dev);
+   sprintf(net_prefix_cmd, "ip addr add %s/%s dev %s", cfg->addr4, 
+           cfg->prefix4, dev);
    if (system(net_prefix_cmd) < 0) 
       die("tun prefix");
 
    close(s);
    return fd;
 }       
-
-int tun_alloc6(const char *ip4, const char *prefix4, 
-                const char *ip6, const char *prefix6, char *dev, int common) {
-   return 0;
-}
-int tun_alloc46(const char *ip4, const char *prefix4, 
-                const char *ip6, const char *prefix6, char *dev, int common) {
-   return 0;
-}
 #elif defined(LINUX_OS)
 
-int tun_alloc(const char *ip4, const char *prefix4, 
-              const char *ip6, const char *prefix6, char *dev, int common) {
+int tun_attach(const struct rtnl_tun *cfg, const struct tun_opts *opts, 
+               char *dev, int match_only) {
    struct ifreq ifr; 
-   int fd, err;
+   int fd, match, existed = *dev && if_nametoindex(dev);
    
-   if (common) {
-      if((fd = open("/dev/net/tun", O_RDWR)) < 0 ) 
-         die("err opening tun fd\n");
-   } else {
-      char tunname[14];
-      sprintf(tunname, "/dev/%s", dev);
-      if((fd = open(tunname, O_RDWR)) < 0 ) 
-         //      mknod /dev/tun1 c 10 200
-         die("err opening tun fd\n");
-      return fd;
-   }
+   if((fd = open("/dev/net/tun", O_RDWR)) < 0 ) 
+      die("err opening tun fd\n");
 
    memset(&ifr, 0, sizeof(ifr));
    ifr.ifr_flags = IFF_TUN | IFF_NO_PI; 
    if( *dev )
-      strncpy(ifr.ifr_name, dev, IFNAMSIZ);
-
-   if( (err = ioctl(fd, TUNSETIFF, (void *) &ifr)) < 0 ) 
-      die("ioctl\n");
-   strcpy(dev, ifr.ifr_name);
-
-   /* Create socket */
-   int s;
-   if ( (s = socket(AF_INET, SOCK_DGRAM, 0)) < 0) 
-      die("socket");
-
-   /* Get interface flags */
-   if (ioctl(s, SIOCGIFFLAGS, &ifr) < 0) 
-      die("cannot get interface flags");
-
-   /* Turn on interface */
-   ifr.ifr_flags |= IFF_UP;
-   if (ioctl(s, SIOCSIFFLAGS, &ifr) < 0) 
-      die("ioctl ifup");
-
-   /* Set interface address */
-   struct sockaddr_in  tun_addr;
-   memset((char *) &tun_addr, 0, sizeof(tun_addr));
-   tun_addr.sin_family = AF_INET;
-   tun_addr.sin_addr.s_addr = htonl(inet_network(ip4));
-   memcpy(&ifr.ifr_addr, &tun_addr, sizeof(struct sockaddr));
-
-   if (ioctl(s, SIOCSIFADDR, &ifr) < 0) 
-      die("cannot set IP address. ");
-
-   char net_prefix_cmd[128];
-   sprintf(net_prefix_cmd, "ip addr add %s/%s dev %s", ip4, prefix4, dev);
-   if (system(net_prefix_cmd) < 0) 
-      die("tun prefix");
-
-   close(s);
-   return fd;
-}                   
+      strncpy(ifr.ifr_name, dev, IFNAMSIZ - 1);
 
-int tun_alloc46(const char *ip4, const char *prefix4, 
-                const char *ip6, const char *prefix6, char *dev, int common) {
-   struct ifreq ifr; //TODO:compact
-   struct in6_ifreq ifr6;
-   int fd, err;
-   
-   if (common) {
-      if((fd = open("/dev/net/tun", O_RDWR)) < 0 ) 
-         die("err opening tun fd\n");
-   } else {
-      char tunname[14];
-      sprintf(tunname, "/dev/%s", dev);
-      if((fd = open(tunname, O_RDWR)) < 0 ) 
-         //      mknod /dev/tun1 c 10 200
-         die("err opening tun fd\n");
-      return fd;
+   /* EBUSY: attached by another instance */
+   if (ioctl(fd, TUNSETIFF, (void *) &ifr) < 0) {
+      debug_print("%s: %s\n", dev, strerror(errno));
+      close(fd);
+      return -1;
    }
-
-   memset(&ifr, 0, sizeof(ifr));
-   ifr.ifr_flags = IFF_TUN | IFF_NO_PI; 
-   if( *dev )
-      strncpy(ifr.ifr_name, dev, IFNAMSIZ);
-
-   if( (err = ioctl(fd, TUNSETIFF, (void *) &ifr)) < 0 ) 
-      die("ioctl\n");
    strcpy(dev, ifr.ifr_name);
 
-   /* Create  sockets */
-   int s4, s6;
-   if ( (s4 = socket(AF_INET, SOCK_DGRAM, 0)) < 0) 
-      die("socket");
-   if ( (s6 = socket(AF_INET6, SOCK_DGRAM, 0)) < 0) 
-      die("socket");
-
-   /* Get interface flags */
-   if (ioctl(s4, SIOCGIFFLAGS, &ifr) < 0) 
-      die("cannot get interface flags");
-
-   /* Turn on interface */
-   ifr.ifr_flags |= IFF_UP;
-   if (ioctl(s4, SIOCSIFFLAGS, &ifr) < 0) 
-      die("ioctl ifup");
-
-   /* Set interface address */
-   struct sockaddr_in  tun_addr4;
-   memset((char *) &tun_addr4, 0, sizeof(tun_addr4));
-   tun_addr4.sin_family = AF_INET;
-   tun_addr4.sin_addr.s_addr = htonl(inet_network(ip4));
-   memcpy(&ifr.ifr_addr, &tun_addr4, sizeof(struct sockaddr));
-
-   if (ioctl(s4, SIOCSIFADDR, &ifr) < 0) 
-      die("cannot set IP address. ");
-
-   //if (ioctl(s6, SIOCGIFFLAGS, &ifr) < 0) 
-   //   die("cannot get interface flags");
-
-   char net_prefix_cmd[128];
-   sprintf(net_prefix_cmd, "ip addr add %s/%s dev %s", ip4, prefix4, dev);
-   if (system(net_prefix_cmd) < 0) 
-      die("tun prefix");
-
-   /* Set interface address */
-   struct sockaddr_in6  tun_addr6;
-   memset(&tun_addr6, 0, sizeof(tun_addr6));
-   tun_addr6.sin6_family = AF_INET6;
-   if(inet_pton(AF_INET6, ip6, (void *)&tun_addr6.sin6_addr) <= 0) 
-        die("Bad address\n");
-   if(inet_pton(AF_INET6, ip6, (void *)&ifr6.ifr6_addr) <= 0) 
-        die("Bad address\n");
-
-    if (ioctl(s6, SIOGIFINDEX, &ifr) < 0) 
-        die("SIOGIFINDEX");
-    ifr6.ifr6_ifindex   = ifr.ifr_ifindex;
-    ifr6.ifr6_prefixlen = strtol(prefix6, NULL, 10);
-    if (ioctl(s6, SIOCSIFADDR, &ifr6) < 0) 
-        die("SIOCSIFADDR");
-
-    /*ifr.ifr_flags |= IFF_UP | IFF_RUNNING;
-    if (ioctl(s, SIOCSIFFLAGS, &ifr) < 0)
-      die("SIOCSIFFLAGS");*/
-   close(s4);close(s6);
-   return fd;
-}              
-
-int tun_alloc6(const char *ip4, const char *prefix4, 
-                const char *ip6, const char *prefix6, char *dev, int common) {
-   struct ifreq ifr;
-   struct in6_ifreq ifr6;
-   int fd, err;
-
-   if (common) {
-      if((fd = open("/dev/net/tun", O_RDWR)) < 0 ) 
-         die("err opening tun fd\n");
-   } else {
-      char tunname[14];
-      sprintf(tunname, "/dev/%s", dev);
-      if((fd = open(tunname, O_RDWR)) < 0 ) 
-         //      mknod /dev/tun1 c 10 200
-         die("err opening tun fd\n");
-      return fd;
+   if (!existed && (opts->persist || opts->pool) && 
+       (ioctl(fd, TUNSETPERSIST, 1) < 0 || 
+        ioctl(fd, TUNSETOWNER, geteuid()) < 0))
+      die("tun persist");
+
+   /* reuse a pre-configured interface as is */
+   if (existed) {
+      if ((match = rtnl_tun_verify(dev, cfg, !match_only)) < 0)
+         die("tun verify");
+      if (match) {
+         debug_print("%s reused\n", dev);
+         return fd;
+      }
+      if (match_only) {
+         close(fd);
+         return -1;
+      }
    }
 
-   memset(&ifr, 0, sizeof(ifr));
-   ifr.ifr_flags = IFF_TUN | IFF_NO_PI; 
-   if( *dev )
-      strncpy(ifr.ifr_name, dev, IFNAMSIZ);
-   if( (err = ioctl(fd, TUNSETIFF, (void *) &ifr)) < 0 ) 
-      die("ioctl\n");
-   strcpy(dev, ifr.ifr_name);
-
-   /* Create socket */
-   int s;
-   if ( (s = socket(AF_INET6, SOCK_DGRAM, 0)) < 0) 
-      die("socket");
-   /* Get interface flags */
-   if (ioctl(s, SIOCGIFFLAGS, &ifr) < 0) 
-      die("cannot get interface flags");
+   /* link, addresses & private prefix routes in one transaction */
+   if (rtnl_tun_setup(dev, cfg) < 0)
+      die("tun setup");
 
-   // Turn on interface
-   //ifr.ifr_flags |= IFF_UP;
-   //if (ioctl(s, SIOCSIFFLAGS, &ifr) < 0) {
-   //   die("ioctl ifup");
-   //}
-
-   // Set interface address
-   struct sockaddr_in6  tun_addr;
-   memset(&tun_addr, 0, sizeof(tun_addr));
-   tun_addr.sin6_family = AF_INET6;
-   if(inet_pton(AF_INET6, ip6, (void *)&tun_addr.sin6_addr) <= 0) 
-        die("Bad address\n");
-   memcpy((char *) &ifr6.ifr6_addr, (char *) &tun_addr.sin6_addr,
-               sizeof(struct in6_addr));
-
-    if (ioctl(s, SIOGIFINDEX, &ifr) < 0) 
-        die("SIOGIFINDEX");
-    ifr6.ifr6_ifindex   = ifr.ifr_ifindex;
-    ifr6.ifr6_prefixlen = strtol(prefix6, NULL, 10);
-    if (ioctl(s, SIOCSIFADDR, &ifr6) < 0) 
-        die("SIOCSIFADDR");
-
-    ifr.ifr_flags |= IFF_UP | IFF_RUNNING;
-
-    if (ioctl(s, SIOCSIFFLAGS, &ifr) < 0)
-      die("SIOCSIFFLAGS");
-
-   /*char net_prefix_cmd[148]; 
-   sprintf(net_prefix_cmd, "sudo ip -6 addr add %s/64 dev %s", ip, dev);
-   if (system(net_prefix_cmd) < 0) 
-      die("tun prefix");
-    */
-   close(s);
    return fd;
 }
 
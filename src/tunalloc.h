@@ -7,25 +7,53 @@
  */
 #ifndef UDPTUN_TUNALLOC_H
 #define UDPTUN_TUNALLOC_H
- 
+
+#include <stdint.h>
+
+/**
+ * \def TUN_POOL_NAME
+ * \brief Name prefix of pooled interfaces if tun-if is not set.
+ */
+#define TUN_POOL_NAME "cctun"
+
 /**
- * \fn char *create_tun(const char *ip, const char *prefix, int nat, int *tun_fds)
+ * \struct tun_opts
+ * \brief tun interface options.
+ */
+struct tun_opts {
+   uint32_t mtu;     /*!< MTU, 0 for the default */
+   uint32_t txqlen;  /*!< txqueuelen, 0 for the default */
+   uint8_t  persist; /*!< keep the interface (TUNSETPERSIST) after exit */
+   uint8_t  pool;    /*!< size of the pool of persistent interfaces, 
+                          0 for no pool */
+};
+
+/**
+ * \fn char *create_tun4(const char *ip4, const char *prefix4, 
+ *                       const struct tun_opts *opts, char *dev, 
+ *                       int *tun_fds)
  * \brief Allocate and set up a tun interface.
  *
- *    This function is specific to planetlab.
+ *    On Linux, the link, addresses and private prefix routes are
+ *    configured in a single rtnetlink transaction. Existing (persistent)
+ *    interfaces are attached to, verified and only reconfigured if they
+ *    do not match. With a pool, the first free member <dev>0..<dev>N-1 
+ *    that matches is picked, then the first free one.
  *
- * \param ip The address of the interface.
- * \param prefix The prefix of the virtual network.
- * \param dev The wished device name, or NULL
- * \deprecated nat NAT the tun interface or not.
+ * \param ip4 The address of the interface.
+ * \param prefix4 The prefix of the virtual network.
+ * \param opts The interface options.
+ * \param dev The wished device name (pool prefix), or NULL
  * \param tun_fds A pointer to an int to be set to the tun interface fd.
  * \return A pointer (malloc) to the interface name.
  */ 
-char *create_tun4(const char *ip4, const char *prefix4, char *dev, int *tun_fds);
+char *create_tun4(const char *ip4, const char *prefix4, 
+                  const struct tun_opts *opts, char *dev, int *tun_fds);
 char *create_tun46(const char *ip4, const char *prefix4, 
                    const char *ip6, const char *prefix6, 
-                   char *dev, int *tun_fds);
-char *create_tun6(const char *ip6, const char *prefix6, char *dev, int *tun_fds);
+                   const struct tun_opts *opts, char *dev, int *tun_fds);
+char *create_tun6(const char *ip6, const char *prefix6, 
+                  const struct tun_opts *opts, char *dev, int *tun_fds);
 
 #  if defined(LINUX_OS)
 /**
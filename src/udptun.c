@@ -17,11 +17,12 @@
 #include <signal.h>
 
 #include "udptun.h"
+#include "tlog.h"
 
 /* argp variables and structs */
 
 const char *program_version = "copycat 0.1";
-const char*   optstring     = ":abcd:fhi:nNo:pP:qr:sS:tUvV62";
+const char*   optstring     = ":abcd:D:fhi:nNo:pP:qr:sS:tUvVx:62";
 const char* arg_help = "Usage: copycat [OPTION...] -s -o copycat.cfg -d dst.txt\n"
 "  or:  copycat [OPTION...] -c -o copycat.cfg -d dst.txt\n"
 "  or:  copycat [OPTION...] -f -o copycat.cfg -d dst.txt\n\n"
@@ -53,6 +54,8 @@ const char* arg_help = "Usage: copycat [OPTION...] -s -o copycat.cfg -d dst.txt\
 "\n"
 "  -q, --quiet                  Don't produce any output\n"
 "  -i, --run-id ID              Run ID (in pcap name)\n"
+"  -D, --daemon SOCKET          Keep running, take runs from a control socket\n"
+"  -x, --decode FILE            Decode a timeline log to CSV and exit\n"
 "\n"
 "  -v, --verbose                Produce verbose output\n"
 "  -h, --help                   Give this help list\n"
@@ -150,6 +153,10 @@ int parse_arg(int key, char *optarg, int optopt, struct arguments *args) {
          args->config_file = optarg; break;
       case 'i':
          args->run_id = optarg; break;
+      case 'x':
+         args->decode_file = optarg; break;
+      case 'D':
+         args->control_sock = optarg; break;
       case '?':
          printf("Option -%c not supported.\n", optopt);
          return -2;
@@ -180,6 +187,8 @@ void init_args(struct arguments *args) {
    args->config_file = NULL;
    args->dest_file   = NULL;
    args->run_id      = NULL;
+   args->decode_file = NULL;
+   args->control_sock = NULL;
    args->raw_header  = NULL;
 
    args->inactivity_timeout = 0;
@@ -235,6 +244,8 @@ void print_args(struct arguments *args) {
       debug_print("extra header size %d\n", args->raw_header_size);
    }  
    debug_print("extra header:%s\n", args->raw_header);
+   if (args->control_sock)
+      debug_print("daemon mode, control socket:%s\n", args->control_sock);
 }
 
 int validate_args(struct arguments *args) {
@@ -257,6 +268,10 @@ int validate_args(struct arguments *args) {
          } 
          break;
       case SERV_MODE:
+         if (args->control_sock) {
+            errno=EINVAL;
+            die("daemon mode needs a client");
+         }
          break;
       default:
          errno=EINVAL;
@@ -278,6 +293,14 @@ int main(int argc, char *argv[]) {
    /* Process arguments */
    init_args(&args);
    if (parse_args(argc, argv, &args) < 0) return -1;
+
+   /* Offline decoding */
+   if (args.decode_file) {
+      if (tlog_decode(args.decode_file, stdout) < 0)
+         die("decode");
+      return 0;
+   }
+
    validate_args(&args);
    if (args.verbose) print_args(&args);
 
@@ -28,6 +28,12 @@
  */
 #define MIN_PKT_SIZE 32
 
+/**
+ * \def PORT_SPRAY_MAX
+ * \brief The maximal number of tunnel source ports per client.
+ */
+#define PORT_SPRAY_MAX 64
+
 /**
  * \def CLOSE_TIMEOUT
  * \brief The time to wait for delayed finack/ack while closing 
@@ -57,6 +63,12 @@
  */
 #define CLI_NOTUN_FILE6 "cli_notun6.dat"
 
+/**
+ * \def GOODPUT_INTERVAL
+ * \brief Default goodput timeline interval (us).
+ */
+#define GOODPUT_INTERVAL 10000
+
 /**
  * \def TUN_SNAPLEN4
  * \brief libpcap snapshot length in bytes for IPv4 measurements.
@@ -93,6 +105,18 @@
  */
 #define NOTUN_SNAPLEN46 160
 
+/**
+ * \def CAPTURE_BUFFER
+ * \brief Default kernel capture ring size in bytes.
+ */
+#define CAPTURE_BUFFER (32*1024*1024)
+
+/**
+ * \def CAPTURE_TIMEOUT
+ * \brief Capture ring block timeout in ms.
+ */
+#define CAPTURE_TIMEOUT 100
+
 /**
  * \def LOCKED
  * \brief Comment to accept packets from nodes not in dest file.
@@ -125,6 +149,8 @@ struct arguments {
    uint8_t inactivity_timeout; /*!< The inactivity timeout */
 
    char *run_id;               /*!< The run ID */
+   char *decode_file;          /*!< Timeline log to decode */
+   char *control_sock;         /*!< Daemon mode control socket */
 };
 
 #include "debug.h"
@@ -142,5 +168,14 @@ struct arguments {
        __typeof__ (b) _b = (b); \
      _a > _b ? _a : _b; })
 
+/**
+ * \def min(a,b)
+ * \brief min macro with type checking.
+ */
+#define min(a,b) \
+   __extension__({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
 #endif
 
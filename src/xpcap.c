@@ -17,6 +17,8 @@
 #include <string.h>
 #include <pcap.h>
 #include <pthread.h>
+#include <time.h>
+#include <stdarg.h>
 
 #include "debug.h"
 #include "sock.h"
@@ -24,31 +26,178 @@
 #include "state.h"
 #include "thread.h"
 #include "udptun.h"
+#include "pcapw.h"
+#include "flowstat.h"
+#include "encap.h"
+#include "sample.h"
+
+/**
+ * \struct capture_ctx
+ *	\brief A running capture.
+ */
+struct capture_ctx {
+   pcap_t          *handle;   /*!< The capture handle */
+   struct pcapw    *writer;   /*!< The trace writer or NULL */
+   struct flowstat *stats;    /*!< The flow metrics engine or NULL */
+   const char      *filename; /*!< The trace location */
+   uint8_t          silent;   /*!< Do not report drops */
+   int8_t           side;     /*!< ENCAP_TUN/ENCAP_WIRE, -1 if not correlated */
+   uint8_t          nano;     /*!< timestamps are in ns */
+   int              linktype; /*!< The link-layer type */
+   uint8_t          gated;    /*!< drop packets outside of windows */
+   struct sampler   sample;   /*!< The capture sampler */
+};
+
+/**
+ * \struct capture_gate
+ *	\brief The measurement window shared by the client and the captures.
+ */
+struct capture_gate {
+   pthread_mutex_t lock;       /*!< protects the window */
+   pthread_cond_t  applied_cv; /*!< signals applied filters */
+   int             threads;    /*!< gated capture threads */
+   int             applied;    /*!< threads filtering on gen */
+   uint8_t         enabled;    /*!< capture-gating or daemon mode is set */
+   uint8_t         muted;      /*!< windows stay closed (capture off) */
+   uint8_t         open;       /*!< a window is open, atomic */
+   uint32_t        gen;        /*!< window generation, atomic */
+   int             index;      /*!< destination index */
+   char            label[16];  /*!< tun, notun or both */
+   char            host[2][2*INET6_ADDRSTRLEN + 32]; /*!< per-side filter */
+   uint64_t        start;      /*!< window start (ns) */
+   FILE           *fp;         /*!< window log */
+};
+
+/**
+ * \var static struct capture_gate gate
+ * \brief The measurement window.
+ */
+static struct capture_gate gate = { .lock       = PTHREAD_MUTEX_INITIALIZER,
+                                    .applied_cv = PTHREAD_COND_INITIALIZER };
+
+/**
+ * \var static pcap_t *bpf_handle
+ * \brief The dead handle socket filters are compiled with.
+ */
+static pcap_t *bpf_handle;
+
+/**
+ * \var static GHashTable *bpf_cache
+ * \brief Compiled socket filters, by expression.
+ */
+static GHashTable *bpf_cache;
+
+/**
+ * \var static pthread_mutex_t bpf_lock
+ * \brief Protects the filter cache.
+ */
+static pthread_mutex_t bpf_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /**
  * \fn static void *term_capture(void* arg)
- * \brief Flush & properly close pcap dump buffers.
+ * \brief Report kernel drops, flush & properly close pcap dump buffers.
  *
- * \param arg pcap_t handle
+ * \param arg The capture context (struct capture_ctx *)
  */ 
 static void term_capture(void* arg);
 
 /**
- * \fn static void capture(char *dev, const char *addr, int port, char *filename)
+ * \fn static void gate_leave()
+ * \brief Stop waiting on the filters of a gated capture thread.
+ */ 
+static void gate_leave();
+
+/**
+ * \fn static void capture_handler(u_char *user, const struct pcap_pkthdr *h,
+ *                                 const u_char *bytes)
+ * \brief pcap_loop callback, dump and/or account a packet.
+ *
+ * \param user The capture context (struct capture_ctx *)
+ */
+static void capture_handler(u_char *user, const struct pcap_pkthdr *h,
+                            const u_char *bytes);
+
+/**
+ * \fn static void capture(struct tun_state *state, const char *dev, 
+ *                         const char *addr4, const char *addr6, int port,
+ *                         char *filename, int side)
  * \brief pcap sniff & dump process
  *
+ *    Packets are captured from a TPACKET_V3 ring of capture-buffer bytes
+ *    with nanosecond timestamps (if supported) and written 
+ *    asynchronously and/or summarized into per-flow metrics. Flow
+ *    sampling is appended to the capture filter.
+ *
+ * \param state The program state
  * \param dev The network interface to sniff on
- * \param addr The address of this itf
+ * \param addr4 The IPv4 address of this itf
+ * \param addr6 The IPv6 address of this itf
  * \param port 
  * \param filename The location of the trace dump file
+ * \param side The encapsulation correlator side (ENCAP_TUN or ENCAP_WIRE)
  */ 
-static void capture(const char *dev, const char *addr4, const char *addr6,  
-                    int port, int proto, char *filename, unsigned int snaplen);
+static void capture(struct tun_state *state, const char *dev, 
+                    const char *addr4, const char *addr6, int port, 
+                    char *filename, int side);
+
+/**
+ * \fn static void capture_setfilter(pcap_t *handle, const char *base,
+ *                                   const char *gate, bpf_u_int32 net)
+ * \brief Compile & set the conjunction of two filters.
+ *
+ * \param handle The capture handle
+ * \param base The capture filter or an empty string
+ * \param gate The window filter or an empty string
+ * \param net The network of the interface
+ */
+static void capture_setfilter(pcap_t *handle, const char *base,
+                              const char *gate, bpf_u_int32 net);
+
+/**
+ * \fn static void bpf_clause(char *exp, size_t len, const char *fmt, ...)
+ * \brief Append a primitive to a filter expression.
+ */
+static void bpf_clause(char *exp, size_t len, const char *fmt, ...);
+
+/**
+ * \fn static struct sock_fprog *bpf_ports(int sport, int dport)
+ * \brief Build a port filter on transport header offsets.
+ *
+ * \param sport The source port to filter or 0 for no filtering.
+ * \param dport The destination port to filter or 0 for no filtering.
+ * \return The filter
+ */
+static struct sock_fprog *bpf_ports(int sport, int dport);
+
+/**
+ * \fn static void bpf_free(gpointer data)
+ * \brief Free a cached socket filter.
+ */
+static void bpf_free(gpointer data);
+
+/**
+ * \fn static void window_host(char *buf, size_t len, struct tun_rec *rec)
+ * \brief Write a filter matching the addresses of a destination.
+ */
+static void window_host(char *buf, size_t len, struct tun_rec *rec);
 
 void term_capture(void* arg) {
-   pcap_t *handle = (pcap_t *)arg;
-   pcap_breakloop(handle);
-   pcap_close(handle);
+   struct capture_ctx *ctx = (struct capture_ctx *)arg;
+   struct pcap_stat ps;
+
+   pcap_breakloop(ctx->handle);
+   if (!ctx->silent && pcap_stats(ctx->handle, &ps) == 0)
+      fprintf(stderr, "%s: %u packets received, %u dropped by kernel, "
+              "%u dropped by interface\n", ctx->filename, ps.ps_recv, 
+              ps.ps_drop, ps.ps_ifdrop);
+   pcap_close(ctx->handle);
+   sample_write(&ctx->sample, ctx->filename);
+   pcapw_close(ctx->writer);
+   flowstat_close(ctx->stats);
+   if (ctx->side >= 0)
+      encap_detach();
+   if (ctx->gated)
+      gate_leave();
    debug_print("closing pcap dump process...\n");
    return;
 }
@@ -75,8 +224,8 @@ void *capture_tun(void *arg) {
    else
       snaplen = TUN_SNAPLEN4;*/
 
-   capture(state->tun_if, state->private_addr4, state->private_addr6, 0, 
-          state->protocol_num, file_loc, state->snaplen);
+   capture(state, state->tun_if, state->private_addr4, state->private_addr6, 
+           0, file_loc, ENCAP_TUN);
    return 0;
 }
 
@@ -93,22 +242,181 @@ void *capture_notun(void *arg) {
    }
    strncat(file_loc, ".pcap", 512);
 
-   capture(state->default_if, state->public_addr4, state->public_addr6, 
-           state->public_port, state->protocol_num, file_loc, state->snaplen);
+   capture(state, state->default_if, state->public_addr4, 
+           state->public_addr6, state->public_port, file_loc, ENCAP_WIRE);
    return 0;
 }
 
-void capture(const char *dev, const char *addr4, const char *addr6, 
-             int port, int proto, char *filename, unsigned int snaplen) {
+void run_captures(struct tun_state *state) {
+   /* servers do not know the windows of their clients, daemons turn
+      captures on and off per run */
+   gate.enabled = (state->capture_gating || state->args->control_sock) && 
+                  state->args->mode != SERV_MODE;
+   xthread_create(capture_notun, (void *) state, 1);
+   synchronize();
+   if (state->encap_delay && !state->capture_tap) {
+      xthread_create(capture_tun, (void *) state, 1);
+      synchronize();
+   }
+}
+
+void window_host(char *buf, size_t len, struct tun_rec *rec) {
+   char addr[INET6_ADDRSTRLEN];
+   int n = 0;
+
+   buf[0] = '\0';
+   if (rec->sa4 && inet_ntop(AF_INET, 
+         &((struct sockaddr_in *)rec->sa4)->sin_addr, addr, sizeof(addr)))
+      n += snprintf(buf, len, "host %s", addr);
+   if (rec->sa6 && inet_ntop(AF_INET6, 
+         &((struct sockaddr_in6 *)rec->sa6)->sin6_addr, addr, sizeof(addr)))
+      snprintf(buf + n, len - n, "%shost %s", n ? " or " : "", addr);
+}
+
+void capture_window_open(struct tun_state *state, int index, 
+                         const char *label) {
+   struct timespec ts;
+   int cancel;
+
+   if (!gate.enabled || gate.muted)
+      return;
+   pthread_mutex_lock(&gate.lock);
+   if (!gate.fp) {
+      char file_loc[512];
+      snprintf(file_loc, sizeof(file_loc), "%s%s%s%s.csv", state->out_dir,
+               WINDOW_FILE, state->args->run_id ? "." : "",
+               state->args->run_id ? state->args->run_id : "");
+      if (!(gate.fp = fopen(file_loc, "w")))
+         die("fopen");
+      fchmod(fileno(gate.fp), S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+      fprintf(gate.fp, "#window,index,port,label,start,end\n");
+   }
+   gate.index = index;
+   strncpy(gate.label, label, sizeof(gate.label) - 1);
+   /* tunneled packets leave the default interface towards the public
+      address of the destination */
+   window_host(gate.host[ENCAP_TUN], sizeof(gate.host[0]), 
+               state->cli_private[index]);
+   window_host(gate.host[ENCAP_WIRE], sizeof(gate.host[0]), 
+               state->cli_public[index]);
+   clock_gettime(CLOCK_REALTIME, &ts);
+   gate.start = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+   __atomic_store_n(&gate.open, 1, __ATOMIC_RELEASE);
+   __atomic_add_fetch(&gate.gen, 1, __ATOMIC_RELEASE);
+   /* the first packets of the window are the handshakes, wait until
+      every capture filters on the destination (not cancelled with the
+      lock held) */
+   pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel);
+   gate.applied = 0;
+   while (gate.applied < gate.threads)
+      pthread_cond_wait(&gate.applied_cv, &gate.lock);
+   pthread_mutex_unlock(&gate.lock);
+   pthread_setcancelstate(cancel, NULL);
+}
+
+void capture_window_close(struct tun_state *state) {
+   struct timespec ts;
+
+   if (!gate.enabled)
+      return;
+   pthread_mutex_lock(&gate.lock);
+   if (gate.open) {
+      __atomic_store_n(&gate.open, 0, __ATOMIC_RELEASE);
+      __atomic_add_fetch(&gate.gen, 1, __ATOMIC_RELEASE);
+      gate.applied = 0;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      fprintf(gate.fp, "window,%d,%d,%s,%llu,%llu\n", gate.index, 
+              state->port, gate.label, (unsigned long long)gate.start,
+              (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+      fflush(gate.fp);
+   }
+   pthread_mutex_unlock(&gate.lock);
+}
+
+void capture_window_run(int capture) {
+   pthread_mutex_lock(&gate.lock);
+   /* reopened with the run id of the next window */
+   if (gate.fp) {
+      fclose(gate.fp);
+      gate.fp = NULL;
+   }
+   gate.muted = !capture;
+   pthread_mutex_unlock(&gate.lock);
+}
+
+void gate_leave() {
+   pthread_mutex_lock(&gate.lock);
+   gate.threads--;
+   pthread_cond_broadcast(&gate.applied_cv);
+   pthread_mutex_unlock(&gate.lock);
+}
+
+int capture_gate_open() {
+   return !gate.enabled || __atomic_load_n(&gate.open, __ATOMIC_ACQUIRE);
+}
+
+void capture_setfilter(pcap_t *handle, const char *base, const char *gate, 
+                       bpf_u_int32 net) {
+   char filter_exp[2048];
+   struct bpf_program fp;	
+
+   if (*base && *gate)
+      snprintf(filter_exp, sizeof(filter_exp), "(%s) and (%s)", base, gate);
+   else
+      snprintf(filter_exp, sizeof(filter_exp), "%s", *base ? base : gate);
+   if (pcap_compile(handle, &fp, filter_exp, 0, net) == -1) 
+      die("pcap_compile");
+   if (pcap_setfilter(handle, &fp) == -1) 
+      die("pcap_setfilter");
+   pcap_freecode(&fp);
+}
+
+void capture_handler(u_char *user, const struct pcap_pkthdr *h,
+                     const u_char *bytes) {
+   struct capture_ctx *ctx = (struct capture_ctx *)user;
+   /* still in the ring from a closed window */
+   if (ctx->gated && !capture_gate_open())
+      return;
+   if (!sample_keep(&ctx->sample, ctx->linktype, bytes, h->caplen))
+      return;
+   if (ctx->writer)
+      pcapw_write(ctx->writer, h, bytes);
+   if (ctx->stats)
+      flowstat_packet(ctx->stats, h, bytes);
+   if (ctx->side >= 0)
+      encap_packet(ctx->side, (uint64_t)h->ts.tv_sec * 1000000000ULL + 
+                   (uint64_t)h->ts.tv_usec * (ctx->nano ? 1 : 1000),
+                   bytes, h->caplen, ctx->linktype);
+}
+
+void capture(struct tun_state *state, const char *dev, 
+             const char *addr4, const char *addr6, int port, 
+             char *filename, int side) {
 	pcap_t *handle;
    char errbuf[PCAP_ERRBUF_SIZE];
+   int nano = 0;
+   int proto = state->protocol_num;
+   unsigned int snaplen = state->snaplen;
 
-	if ( (handle = pcap_open_live(dev, snaplen, 0, 10000, errbuf)) == NULL) 
-	   die("pcap_open_live");
+	if ( (handle = pcap_create(dev, errbuf)) == NULL) 
+	   die("pcap_create");
+   pcap_set_snaplen(handle, snaplen);
+   pcap_set_promisc(handle, 0);
+   /* ring block retire timeout */
+   pcap_set_timeout(handle, CAPTURE_TIMEOUT);
+   if (state->capture_bufsize)
+      pcap_set_buffer_size(handle, state->capture_bufsize);
+#if defined(PCAP_TSTAMP_PRECISION_NANO)
+   pcap_set_tstamp_precision(handle, PCAP_TSTAMP_PRECISION_NANO);
+#endif
+   if (pcap_activate(handle) < 0)
+      die("pcap_activate");
+#if defined(PCAP_TSTAMP_PRECISION_NANO)
+   nano = (pcap_get_tstamp_precision(handle) == PCAP_TSTAMP_PRECISION_NANO);
+#endif
 
    /* build&set filter */
-   char filter_exp[256];
-   struct bpf_program fp;	
+   char filter_exp[1024] = "", sample_exp[768];
    bpf_u_int32 net = inet_addr(addr4);
 
    if (port) {  
@@ -127,47 +435,196 @@ void capture(const char *dev, const char *addr4, const char *addr6,
                                 "ip proto %d or ip6 proto %d)",
                    addr4, addr6, port, proto, proto);
       }
-      if (pcap_compile(handle, &fp, filter_exp, 0, net) == -1) 
-         die("pcap_compile");
-      if (pcap_setfilter(handle, &fp) == -1) 
-         die("pcap_setfilter");
    }
 
-   /* init pcap trace */
-   pcap_dumper_t * dumper = pcap_dump_open(handle, filename);
-   mode_t m = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
-   if (chmod(filename, m) < 0)
-      die("chmod");
+   /* flow sampling in the kernel filter */
+   struct sampler sample;
+   sample_init(&sample, state->capture_sample_mode, state->capture_sample_rate);
+   if (sample_filter(&sample, sample_exp, sizeof(sample_exp))) {
+      if (*filter_exp) {
+         size_t len = strlen(filter_exp);
+         memmove(filter_exp + 1, filter_exp, len);
+         filter_exp[0] = '(';
+         snprintf(filter_exp + len + 1, sizeof(filter_exp) - len - 1, 
+                  ") and (%s)", sample_exp);
+      } else
+         strcpy(filter_exp, sample_exp);
+   }
+   if (!gate.enabled && *filter_exp)
+      capture_setfilter(handle, filter_exp, "", net);
+
+   /* init pcap trace and/or flow metrics */
+   struct capture_ctx ctx = { handle, NULL, NULL, filename, 
+                              state->args->silent, encap_attach() ? side : -1,
+                              nano, pcap_datalink(handle), gate.enabled, 
+                              sample };
+   if (state->capture_output & CAPTURE_PCAP) {
+      struct pcapw_rotate rot = { state->capture_rotate_size, 
+                                  state->capture_rotate_time, 
+                                  state->capture_retain, state->capture_hook };
+      ctx.writer = pcapw_open(filename, pcap_datalink(handle), snaplen, nano, 
+                              &rot, state->capture_zlevel, state->capture_index);
+   }
+   if (state->capture_output & CAPTURE_METRICS)
+      ctx.stats = flowstat_open(filename, pcap_datalink(handle), nano, 
+                                state->metrics_interval);
 
    /* capture & dump */
-   pthread_cleanup_push(&term_capture, handle);
+   if (gate.enabled) {
+      pthread_mutex_lock(&gate.lock);
+      gate.threads++;
+      pthread_mutex_unlock(&gate.lock);
+   }
+   pthread_cleanup_push(&term_capture, &ctx);
    synchronize();
-	pcap_loop(handle, -1, pcap_dump, (void*) dumper);
+   if (!gate.enabled)
+	   pcap_loop(handle, -1, capture_handler, (u_char *) &ctx);
+   else {
+      /* swap filters between dispatches, the ring block retire timeout
+         bounds the swap delay, windows open once every capture has
+         swapped */
+      uint32_t gen = ~0u, cur;
+      char host[sizeof(gate.host[0])];
+      do {
+         if ((cur = __atomic_load_n(&gate.gen, __ATOMIC_ACQUIRE)) != gen) {
+            pthread_mutex_lock(&gate.lock);
+            cur = gate.gen;
+            strcpy(host, gate.open ? gate.host[side] : "less 0");
+            pthread_mutex_unlock(&gate.lock);
+            capture_setfilter(handle, filter_exp, host, net);
+            gen = cur;
+            pthread_mutex_lock(&gate.lock);
+            if (gate.gen == gen) {
+               gate.applied++;
+               pthread_cond_broadcast(&gate.applied_cv);
+            }
+            pthread_mutex_unlock(&gate.lock);
+         }
+      } while (pcap_dispatch(handle, -1, capture_handler, 
+                             (u_char *) &ctx) >= 0);
+      gate_leave();
+   }
    pthread_cleanup_pop(0);
 }
 
-struct sock_fprog *gen_bpf(const char *dev, const char *addr, int sport, int dport) {
-   pcap_t *handle;		
-   char errbuf[PCAP_ERRBUF_SIZE];	
-   struct bpf_program *fp = xmalloc(sizeof(struct bpf_program));
+void bpf_free(gpointer data) {
+   struct sock_fprog *fprog = (struct sock_fprog *)data;
+   free(fprog->filter);
+   free(fprog);
+}
 
-   /* build filter */
-   char filter_exp[64]; 
-   if (sport && dport)
-      sprintf(filter_exp, "src port %d and dst port %d", sport, dport);
-   else if (sport && !dport)
-      sprintf(filter_exp, "src port %d", sport);
-   else if (!sport && dport)
-      sprintf(filter_exp, "dst port %d", dport);
+void bpf_clause(char *exp, size_t len, const char *fmt, ...) {
+   size_t n = strlen(exp);
+   va_list ap;
+
+   if (n && n < len)
+      n += snprintf(exp + n, len - n, " and ");
+   if (n >= len)
+      return;
+   va_start(ap, fmt);
+   vsnprintf(exp + n, len - n, fmt, ap);
+   va_end(ap);
+}
+
+struct sock_fprog *bpf_ports(int sport, int dport) {
+   struct sock_filter prog[] = {
+      BPF_STMT(BPF_LD  | BPF_H   | BPF_ABS, 0),
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, sport, 0, 3),
+      BPF_STMT(BPF_LD  | BPF_H   | BPF_ABS, 2),
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, dport, 0, 1),
+      BPF_STMT(BPF_RET | BPF_K, 0xffff),
+      BPF_STMT(BPF_RET | BPF_K, 0),
+   };
+   struct sock_filter *insn = prog;
+   unsigned int len = sizeof(prog) / sizeof(prog[0]);
 
-   /* compile filter */
-   bpf_u_int32 net = inet_addr(addr);
-   handle = pcap_open_live(dev, BUFSIZ, 0, 1000, errbuf);
-   if (!handle) 
-      die("Couldn't open device %s: %s");
-   if (pcap_compile(handle, fp, filter_exp, 0, net) == -1) 
-      die("Couldn't parse filter %s: %s\n");
+   /* skip unfiltered ports */
+   if (!sport) {
+      insn += 2;
+      len  -= 2;
+   } else if (!dport) {
+      prog[1].jf = 1;
+      prog[2] = prog[4];
+      prog[3] = prog[5];
+      len -= 2;
+   }
 
-   return (struct sock_fprog *)fp;
+   struct sock_fprog *fprog = xmalloc(sizeof(struct sock_fprog));
+   fprog->len    = len;
+   fprog->filter = xmalloc(len * sizeof(struct sock_filter));
+   memcpy(fprog->filter, insn, len * sizeof(struct sock_filter));
+   return fprog;
 }
 
+const struct sock_fprog *gen_bpf(int family, int proto, const char *saddr, 
+                                 const char *daddr, int sport, int dport) {
+   char filter_exp[256] = "";
+   int ports = !proto || proto == IPPROTO_UDP || proto == IPPROTO_TCP;
+
+   /* build filter */
+   if (family == AF_INET6) {
+      /* IPv6 raw sockets pass the transport header to filters: only
+         ports are matched, the bound address filters the destination */
+      if (!ports || (!sport && !dport))
+         return NULL;
+      snprintf(filter_exp, sizeof(filter_exp), "transport sport %d dport %d",
+               sport, dport);
+   } else {
+      if (family == AF_INET)
+         bpf_clause(filter_exp, sizeof(filter_exp), "ip");
+      if (proto == IPPROTO_TCP)
+         bpf_clause(filter_exp, sizeof(filter_exp), "tcp");
+      else if (proto == IPPROTO_UDP)
+         bpf_clause(filter_exp, sizeof(filter_exp), "udp");
+      else if (proto)
+         bpf_clause(filter_exp, sizeof(filter_exp), "ip proto %d", proto);
+      if (saddr)
+         bpf_clause(filter_exp, sizeof(filter_exp), "src host %s", saddr);
+      if (daddr)
+         bpf_clause(filter_exp, sizeof(filter_exp), "dst host %s", daddr);
+      /* port-less protocols never match port primitives */
+      if (sport && ports)
+         bpf_clause(filter_exp, sizeof(filter_exp), "src port %d", sport);
+      if (dport && ports)
+         bpf_clause(filter_exp, sizeof(filter_exp), "dst port %d", dport);
+   }
+
+   pthread_mutex_lock(&bpf_lock);
+   if (!bpf_handle) {
+      /* raw sockets filter IP packets, no link-layer header */
+      if (!(bpf_handle = pcap_open_dead(DLT_RAW, 65535)))
+         die("pcap_open_dead");
+      bpf_cache = g_hash_table_new_full(g_str_hash, g_str_equal, 
+                                        free, bpf_free);
+   }
+
+   struct sock_fprog *fprog = g_hash_table_lookup(bpf_cache, filter_exp);
+   if (!fprog && family == AF_INET6) {
+      fprog = bpf_ports(sport, dport);
+      g_hash_table_insert(bpf_cache, strdup(filter_exp), fprog);
+   } else if (!fprog) {
+      struct bpf_program fp;
+      if (pcap_compile(bpf_handle, &fp, filter_exp, 1, 
+                       PCAP_NETMASK_UNKNOWN) == -1) {
+         errno=EINVAL;
+         die(pcap_geterr(bpf_handle));
+      }
+
+      /* struct bpf_insn and struct sock_filter share their layout */
+      fprog         = xmalloc(sizeof(struct sock_fprog));
+      fprog->len    = fp.bf_len;
+      fprog->filter = xmalloc(fp.bf_len * sizeof(struct sock_filter));
+      for (unsigned int i = 0; i < fp.bf_len; i++) {
+         fprog->filter[i].code = fp.bf_insns[i].code;
+         fprog->filter[i].jt   = fp.bf_insns[i].jt;
+         fprog->filter[i].jf   = fp.bf_insns[i].jf;
+         fprog->filter[i].k    = fp.bf_insns[i].k;
+      }
+      pcap_freecode(&fp);
+      g_hash_table_insert(bpf_cache, strdup(filter_exp), fprog);
+      debug_print("bpf \"%s\": %u instructions\n", filter_exp, fprog->len);
+   }
+   pthread_mutex_unlock(&bpf_lock);
+
+   return fprog;
+}
@@ -9,6 +9,7 @@
 #define UDPTUN_XPCAP_H
 
 #include "sysconfig.h"
+#include "state.h"
 #if defined(BSD_OS)
 //#   include <net/bpf.h>
 #  include <pcap.h>
@@ -16,6 +17,12 @@
 #  include <linux/filter.h>
 #endif
 
+/**
+ * \def WINDOW_FILE
+ * \brief Measurement window log prefix (in output-dir).
+ */
+#define WINDOW_FILE "windows"
+
 /**
  * \fn void *capture_tun(void *arg)
  * \brief Capture the tunneled flows in a separate thread
@@ -39,18 +46,89 @@ void *capture_tun(void *arg);
 void *capture_notun(void *arg);
 
 /**
- * \fn struct sock_fprog *gen_bpf(const char *dev, const char *addr, int sport, int dport)
- * \brief Create a Berkeley Packet Filter (BPF). Bind it to a socket.
+ * \fn void run_captures(struct tun_state *state)
+ * \brief Start the capture threads and wait until they are ready.
+ *
+ *    The default interface is always captured, the tun interface is
+ *    captured as well when encap-delay is set and capture-tap is not.
+ *
+ *  \param state The program state
+ */
+void run_captures(struct tun_state *state);
+
+/**
+ * \fn void capture_window_open(struct tun_state *state, int index, 
+ *                              const char *label)
+ * \brief Open the capture gate on the flows of a destination.
+ *
+ *    With capture-gating, client captures start closed and only record
+ *    the traffic of the destination of the open window: the filters of
+ *    the capture threads are swapped to the destination addresses, its
+ *    private ones on the tun interface, its public ones on the default
+ *    interface. Returns once every capture thread filters on the
+ *    destination, at most a capture timeout later. Windows are logged
+ *    to windows[.run-id].csv:
+ *
+ *    window,index,port,label,start,end   (ns)
+ *
+ *  \param state The program state
+ *  \param index The destination index
+ *  \param label The flows of the window (tun, notun or both)
+ */
+void capture_window_open(struct tun_state *state, int index, 
+                         const char *label);
+
+/**
+ * \fn void capture_window_close(struct tun_state *state)
+ * \brief Close the capture gate and log the window.
+ *
+ *  \param state The program state
+ */
+void capture_window_close(struct tun_state *state);
+
+/**
+ * \fn void capture_window_run(int capture)
+ * \brief Start a new run of the daemon mode.
+ *
+ *    The window log is closed, the windows of the run are logged under
+ *    its run id. Captures are turned off by keeping windows closed.
+ *
+ *  \param capture 1 to capture the windows of the run, 0 not to
+ */
+void capture_window_run(int capture);
+
+/**
+ * \fn int capture_gate_open()
+ * \brief Tell if packets are to be recorded. Thread-safe.
+ *
+ * \return 1 if a window is open or capture-gating is not set, 0 otherwise
+ */
+int capture_gate_open();
+
+/**
+ * \fn const struct sock_fprog *gen_bpf(int family, int proto, 
+ *                                     const char *saddr, const char *daddr, 
+ *                                     int sport, int dport)
+ * \brief Compile a socket filter for raw sockets.
  * 
- *    The filter is equivalent to $tcpdump -i dev 'src port sport and dst port dport'
+ *    The filter is equivalent to $tcpdump 'family and proto and 
+ *    src host saddr and dst host daddr and src port sport and 
+ *    dst port dport', unset fields are not filtered. It is compiled for
+ *    IP packets without link-layer header through a dead pcap handle
+ *    and cached: the same filter is compiled once and must not be freed.
+ *    Filters of IPv6 raw sockets see the transport header first, so
+ *    AF_INET6 filters only match ports.
  *
- * \param dev The interface of the socket. 
- * \param addr The address of the socket.
+ * \param family AF_INET, AF_INET6 or AF_UNSPEC for both
+ * \param proto The IP protocol or 0 for no filtering.
+ * \param saddr The source address or NULL for no filtering.
+ * \param daddr The destination address or NULL for no filtering.
  * \param sport The source port to filter or 0 for no filtering.
  * \param dport The destination port to filter or 0 for no filtering.
- * \return 
+ * \return The filter, NULL if there is nothing to filter
  */ 
-struct sock_fprog *gen_bpf(const char *dev, const char *addr, int sport, int dport);
+const struct sock_fprog *gen_bpf(int family, int proto, const char *saddr, 
+                                 const char *daddr, int sport, int dport);
 
 #endif
 